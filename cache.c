@@ -0,0 +1,451 @@
+/**
+ * Copyright (c) 2012, Felipe Pena
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *   Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/uio.h>
+#include "common.h"
+#include "cache.h"
+#include "ptrace.h"
+
+/**
+ * Cache slots are linked in a LRU list and in hash chains by index,
+ * PX_CACHE_NIL terminates both
+ */
+#define PX_CACHE_NIL UINT32_MAX
+
+/**
+ * Largest run of missing pages fetched with a single read
+ */
+#define PX_CACHE_FETCH 64
+
+typedef struct _px_cache_slot {
+	uintptr_t page;   /* remote page address */
+	uint32_t epoch;   /* epoch the page was read in */
+	uint32_t prev;    /* LRU list */
+	uint32_t next;
+	uint32_t hnext;   /* hash chain */
+	int unreadable;   /* page faulted when read */
+} px_cache_slot;
+
+typedef struct _px_cache {
+	size_t budget;        /* memory budget in bytes */
+	size_t page_size;
+	uint32_t nslots;      /* number of slots the budget allows */
+	uint32_t used;        /* slots handed out so far */
+	uint32_t nbuckets;    /* power of two */
+	uint32_t epoch;
+	uint32_t head, tail;  /* most and least recently used */
+	uint32_t *buckets;
+	px_cache_slot *slots;
+	char *data;
+	uint64_t hits, misses, evictions, fetches, bypassed;
+} px_cache;
+
+static px_cache g_cache = {
+	PX_CACHE_DEFAULT_BUDGET, 0, 0, 0, 0, 1, PX_CACHE_NIL, PX_CACHE_NIL
+};
+
+#define SLOT(i) g_cache.slots[i]
+#define SLOT_DATA(i) (g_cache.data + (size_t)(i) * g_cache.page_size)
+
+static inline uint32_t _px_cache_hash(uintptr_t page)
+{
+	return (uint32_t)((page / g_cache.page_size) * 0x9e3779b97f4a7c15ULL >> 32)
+		& (g_cache.nbuckets - 1);
+}
+
+/**
+ * Allocates the cache tables on first use
+ */
+static int _px_cache_init(void)
+{
+	uint32_t i;
+
+	if (g_cache.slots) {
+		return 0;
+	}
+
+	g_cache.page_size = sysconf(_SC_PAGESIZE);
+	g_cache.nslots = g_cache.budget / g_cache.page_size;
+
+	if (g_cache.nslots == 0) {
+		return -1;
+	}
+
+	for (g_cache.nbuckets = 1; g_cache.nbuckets < g_cache.nslots;
+		g_cache.nbuckets <<= 1);
+
+	g_cache.buckets = malloc(sizeof(*g_cache.buckets) * g_cache.nbuckets);
+	g_cache.slots = malloc(sizeof(*g_cache.slots) * g_cache.nslots);
+	/* Untouched slot pages are never committed by the kernel */
+	g_cache.data = malloc((size_t)g_cache.nslots * g_cache.page_size);
+
+	if (g_cache.buckets == NULL || g_cache.slots == NULL || g_cache.data == NULL) {
+		px_error("Failed to alloc the page cache!");
+		px_cache_clear();
+		return -1;
+	}
+
+	for (i = 0; i < g_cache.nbuckets; ++i) {
+		g_cache.buckets[i] = PX_CACHE_NIL;
+	}
+	g_cache.used = 0;
+	g_cache.head = g_cache.tail = PX_CACHE_NIL;
+
+	return 0;
+}
+
+static void _px_cache_unlink(uint32_t i)
+{
+	if (SLOT(i).prev != PX_CACHE_NIL) {
+		SLOT(SLOT(i).prev).next = SLOT(i).next;
+	} else {
+		g_cache.head = SLOT(i).next;
+	}
+	if (SLOT(i).next != PX_CACHE_NIL) {
+		SLOT(SLOT(i).next).prev = SLOT(i).prev;
+	} else {
+		g_cache.tail = SLOT(i).prev;
+	}
+}
+
+static void _px_cache_push(uint32_t i)
+{
+	SLOT(i).prev = PX_CACHE_NIL;
+	SLOT(i).next = g_cache.head;
+
+	if (g_cache.head != PX_CACHE_NIL) {
+		SLOT(g_cache.head).prev = i;
+	}
+	g_cache.head = i;
+
+	if (g_cache.tail == PX_CACHE_NIL) {
+		g_cache.tail = i;
+	}
+}
+
+/**
+ * Removes a slot from its hash chain
+ */
+static void _px_cache_unhash(uint32_t i)
+{
+	uint32_t *p = &g_cache.buckets[_px_cache_hash(SLOT(i).page)];
+
+	while (*p != PX_CACHE_NIL) {
+		if (*p == i) {
+			*p = SLOT(i).hnext;
+			return;
+		}
+		p = &SLOT(*p).hnext;
+	}
+}
+
+/**
+ * Finds a page read in the current epoch
+ */
+static uint32_t _px_cache_lookup(uintptr_t page)
+{
+	uint32_t i = g_cache.buckets[_px_cache_hash(page)];
+
+	while (i != PX_CACHE_NIL) {
+		if (SLOT(i).page == page && SLOT(i).epoch == g_cache.epoch) {
+			return i;
+		}
+		i = SLOT(i).hnext;
+	}
+	return PX_CACHE_NIL;
+}
+
+/**
+ * Takes a free slot, evicting the least recently used page when full
+ * The slot is placed at the LRU head but not hashed yet
+ */
+static uint32_t _px_cache_take(void)
+{
+	uint32_t i;
+
+	if (g_cache.used < g_cache.nslots) {
+		i = g_cache.used++;
+	} else {
+		i = g_cache.tail;
+		_px_cache_unlink(i);
+		_px_cache_unhash(i);
+
+		if (SLOT(i).epoch == g_cache.epoch) {
+			++g_cache.evictions;
+		}
+	}
+	SLOT(i).epoch = g_cache.epoch - 1;
+	SLOT(i).hnext = PX_CACHE_NIL;
+	_px_cache_push(i);
+
+	return i;
+}
+
+/**
+ * Hashes a slot under the given page for the current epoch
+ */
+static void _px_cache_insert(uint32_t i, uintptr_t page, int unreadable)
+{
+	uint32_t h = _px_cache_hash(page);
+
+	SLOT(i).page = page;
+	SLOT(i).epoch = g_cache.epoch;
+	SLOT(i).unreadable = unreadable;
+	SLOT(i).hnext = g_cache.buckets[h];
+	g_cache.buckets[h] = i;
+}
+
+/**
+ * Reads a run of missing pages straight into cache slots
+ * Returns how many of them were read completely. The page that stopped
+ * the transfer is remembered as unreadable, so that reads running into
+ * it again cost no syscall.
+ */
+static size_t _px_cache_fetch(uintptr_t page, uint32_t *slots, size_t n)
+{
+	struct iovec iov[PX_CACHE_FETCH];
+	size_t i, done;
+	ssize_t got;
+
+	for (i = 0; i < n; ++i) {
+		iov[i].iov_base = SLOT_DATA(slots[i]);
+		iov[i].iov_len = g_cache.page_size;
+	}
+
+	++g_cache.fetches;
+	errno = 0;
+	got = ptrace_read_iov(page, iov, n);
+	done = got > 0 ? (size_t)got / g_cache.page_size : 0;
+
+	for (i = 0; i < n; ++i) {
+		if (i <= done && (i < done || errno == EFAULT || got >= 0)) {
+			_px_cache_insert(slots[i], page + i * g_cache.page_size, i == done);
+		} else {
+			/* Unreadable page, recycle the slot first */
+			_px_cache_unlink(slots[i]);
+			SLOT(slots[i]).next = PX_CACHE_NIL;
+			SLOT(slots[i]).prev = g_cache.tail;
+
+			if (g_cache.tail != PX_CACHE_NIL) {
+				SLOT(g_cache.tail).next = slots[i];
+			} else {
+				g_cache.head = slots[i];
+			}
+			g_cache.tail = slots[i];
+		}
+	}
+	return done;
+}
+
+/**
+ * Reads target memory through the page cache
+ * Same contract as ptrace_read_direct(): returns the number of bytes read
+ * (short when the range runs into unreadable memory) or -1.
+ */
+ssize_t px_cache_read(uintptr_t addr, void *vptr, size_t len)
+{
+	uint32_t run[PX_CACHE_FETCH];
+	uintptr_t page, end = addr + len, mask;
+	size_t done = 0, off, n, nrun = 0, pos = 0, max;
+	uint32_t i;
+
+	if (len == 0) {
+		return 0;
+	}
+
+	/* Large reads would only flush the cache */
+	if (!px_cache_enabled() || _px_cache_init() == -1
+		|| len > g_cache.budget / 8) {
+		++g_cache.bypassed;
+		return ptrace_read_direct(addr, vptr, len);
+	}
+
+	mask = ~(uintptr_t)(g_cache.page_size - 1);
+	/* A fetch must never evict the slots it is filling */
+	max = g_cache.nslots / 2 < PX_CACHE_FETCH ? g_cache.nslots / 2 : PX_CACHE_FETCH;
+	max = max ? max : 1;
+
+	for (page = addr & mask; page < end; page += g_cache.page_size) {
+		if (pos < nrun) {
+			/* Fetched along with a previous page of this read */
+			i = run[pos++];
+		} else if ((i = _px_cache_lookup(page)) != PX_CACHE_NIL) {
+			++g_cache.hits;
+			_px_cache_unlink(i);
+			_px_cache_push(i);
+
+			if (SLOT(i).unreadable) {
+				break;
+			}
+		} else {
+			/* Collect the run of missing pages starting here */
+			for (nrun = 0; nrun < max && page + nrun * g_cache.page_size < end
+				&& (nrun == 0 || _px_cache_lookup(page
+					+ nrun * g_cache.page_size) == PX_CACHE_NIL); ++nrun) {
+				run[nrun] = _px_cache_take();
+			}
+			g_cache.misses += nrun;
+
+			if ((nrun = _px_cache_fetch(page, run, nrun)) == 0) {
+				break;
+			}
+			i = run[0];
+			pos = 1;
+		}
+
+		off = page < addr ? addr - page : 0;
+		n = g_cache.page_size - off;
+
+		if (n > len - done) {
+			n = len - done;
+		}
+		memcpy((char*)vptr + done, SLOT_DATA(i) + off, n);
+		done += n;
+	}
+
+	return done ? (ssize_t)done : -1;
+}
+
+/**
+ * Copies a range out of the cache only when every page of it is there
+ * Returns len, or -1 without reading anything from the target when a page
+ * is missing, so that callers can batch the misses themselves.
+ */
+ssize_t px_cache_peek(uintptr_t addr, void *vptr, size_t len)
+{
+	uintptr_t page, end = addr + len, mask;
+	size_t done = 0, off, n;
+	uint32_t i;
+
+	if (len == 0 || g_cache.slots == NULL) {
+		return len ? -1 : 0;
+	}
+
+	mask = ~(uintptr_t)(g_cache.page_size - 1);
+
+	for (page = addr & mask; page < end; page += g_cache.page_size) {
+		if ((i = _px_cache_lookup(page)) == PX_CACHE_NIL || SLOT(i).unreadable) {
+			return -1;
+		}
+	}
+
+	for (page = addr & mask; page < end; page += g_cache.page_size) {
+		i = _px_cache_lookup(page);
+		++g_cache.hits;
+		_px_cache_unlink(i);
+		_px_cache_push(i);
+
+		off = page < addr ? addr - page : 0;
+		n = g_cache.page_size - off;
+
+		if (n > len - done) {
+			n = len - done;
+		}
+		memcpy((char*)vptr + done, SLOT_DATA(i) + off, n);
+		done += n;
+	}
+	return (ssize_t)done;
+}
+
+/**
+ * Checks whether reads go through the cache
+ */
+int px_cache_enabled(void)
+{
+	return g_cache.budget != 0;
+}
+
+/**
+ * Invalidates every cached page by starting a new epoch
+ * Called whenever the target may have run (resume, signal, detach)
+ */
+void px_cache_invalidate(void)
+{
+	++g_cache.epoch;
+}
+
+/**
+ * Returns the current epoch, so other per-stop state can tell when the
+ * target may have changed
+ */
+uint32_t px_cache_epoch(void)
+{
+	return g_cache.epoch;
+}
+
+/**
+ * Changes the memory budget, dropping the current contents
+ */
+void px_cache_set_budget(size_t budget)
+{
+	px_cache_clear();
+	g_cache.budget = budget;
+}
+
+/**
+ * Displays the cache statistics
+ */
+void px_cache_show_stats(void)
+{
+	uint64_t total = g_cache.hits + g_cache.misses;
+
+	printf("Budget    : %zu KiB (%u pages)\n", g_cache.budget >> 10,
+		g_cache.nslots ? g_cache.nslots
+			: (uint32_t)(g_cache.budget / sysconf(_SC_PAGESIZE)));
+	printf("Used      : %u pages\n", g_cache.used);
+	printf("Epoch     : %u\n", g_cache.epoch);
+	printf("Hits      : %" PRIu64 " (%.1f%%)\n", g_cache.hits,
+		total ? 100.0 * g_cache.hits / total : 0.0);
+	printf("Misses    : %" PRIu64 " (%.1f%%)\n", g_cache.misses,
+		total ? 100.0 * g_cache.misses / total : 0.0);
+	printf("Reads     : %" PRIu64 "\n", g_cache.fetches);
+	printf("Evictions : %" PRIu64 "\n", g_cache.evictions);
+	printf("Bypassed  : %" PRIu64 "\n", g_cache.bypassed);
+}
+
+/**
+ * Deallocs the cache
+ */
+void px_cache_clear(void)
+{
+	px_safe_free(g_cache.buckets);
+	px_safe_free(g_cache.slots);
+	px_safe_free(g_cache.data);
+
+	g_cache.buckets = NULL;
+	g_cache.slots = NULL;
+	g_cache.data = NULL;
+	g_cache.nslots = g_cache.used = 0;
+	g_cache.head = g_cache.tail = PX_CACHE_NIL;
+	g_cache.hits = g_cache.misses = g_cache.evictions = 0;
+	g_cache.fetches = g_cache.bypassed = 0;
+}
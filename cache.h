@@ -0,0 +1,47 @@
+/**
+ * Copyright (c) 2012, Felipe Pena
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *   Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PX_CACHE
+#define PX_CACHE
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * Default memory budget for cached target pages
+ */
+#define PX_CACHE_DEFAULT_BUDGET (64 << 20)
+
+ssize_t px_cache_read(uintptr_t, void*, size_t);
+ssize_t px_cache_peek(uintptr_t, void*, size_t);
+int px_cache_enabled(void);
+void px_cache_invalidate(void);
+uint32_t px_cache_epoch(void);
+void px_cache_set_budget(size_t);
+void px_cache_show_stats(void);
+void px_cache_clear(void);
+
+#endif /* PX_CACHE */
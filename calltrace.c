@@ -0,0 +1,1323 @@
+/**
+ * Copyright (c) 2012, Felipe Pena
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *   Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <time.h>
+#include <elf.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+#include <sys/user.h>
+#include <sys/time.h>
+#include <sys/syscall.h>
+#include "common.h"
+#include "cmd.h"
+#include "ptrace.h"
+#include "cache.h"
+#include "elf.h"
+#include "sym.h"
+#include "trace.h"
+#include "proc.h"
+#include "calltrace.h"
+
+#if defined(__x86_64__)
+/**
+ * Log-linear latency histogram: each power of two of nanoseconds is split
+ * in 1 << PX_CALLTRACE_SUB_BITS linear buckets
+ */
+#define PX_CALLTRACE_SUB_BITS 2
+#define PX_CALLTRACE_BUCKETS (64 << PX_CALLTRACE_SUB_BITS)
+
+/**
+ * Nested traced calls timed per thread, deeper ones are only counted
+ */
+#define PX_CALLTRACE_DEPTH 64
+
+/**
+ * Threads printed in the report
+ */
+#define PX_CALLTRACE_TOP 20
+
+/**
+ * Rounds to resume the threads stopped right after hitting the
+ * breakpoint, before giving up on restoring them
+ */
+#define PX_CALLTRACE_DRAIN_TRIES 16
+
+/**
+ * How a thread gets past a breakpoint, at the entry or at a return
+ * address, without putting the original instruction back when possible
+ */
+enum {
+	PX_CALLTRACE_STEP,    /* restore, single-step, re-insert */
+	PX_CALLTRACE_SKIP,    /* endbr64: a no-op */
+	PX_CALLTRACE_PUSH,    /* push %reg */
+	PX_CALLTRACE_MOV,     /* mov %reg, %reg (64-bit) */
+	PX_CALLTRACE_SUB_SP,  /* sub $imm, %rsp, its flags are never used */
+	PX_CALLTRACE_STORE_SP /* movq $imm32, disp8(%rsp) */
+};
+
+typedef struct _px_calltrace_insn {
+	int how;              /* PX_CALLTRACE_STEP, ... */
+	size_t len;           /* length of a skipped or emulated instruction */
+	size_t reg;           /* offsets in user_regs_struct of the source */
+	size_t dst;           /* ... and destination registers */
+	long imm;             /* immediate operand */
+	long disp;            /* displacement from %rsp */
+} px_calltrace_insn;
+
+/**
+ * A return address of timed calls, with a breakpoint of its own while any
+ * of them runs. The stack is left alone: an unwinder walking through the
+ * call must see the real return address.
+ */
+typedef struct _px_calltrace_site {
+	uintptr_t addr;       /* 0 for a free slot */
+	long word;            /* original word at addr */
+	px_calltrace_insn insn;
+	size_t refs;          /* timed calls returning here */
+	int planted;
+} px_calltrace_site;
+
+/**
+ * A timed call, returning traps on the breakpoint at its return address
+ */
+typedef struct _px_calltrace_frame {
+	uintptr_t ret;
+	uintptr_t sp;         /* where the return address is */
+	uint64_t start;
+} px_calltrace_frame;
+
+typedef struct _px_calltrace_thread {
+	pid_t tid;            /* 0 for a free slot */
+	uint64_t calls;
+	uint64_t returns;
+	uint64_t *hist;       /* PX_CALLTRACE_BUCKETS, with --latency */
+	size_t depth;
+	px_calltrace_frame frames[PX_CALLTRACE_DEPTH];
+} px_calltrace_thread;
+
+/**
+ * A child of the target. A forked one has its own copy of the breakpoint,
+ * a vfork one shares it until it execs or exits.
+ */
+typedef struct _px_calltrace_child {
+	pid_t pid;
+	int kind;             /* PTRACE_EVENT_[V]FORK, 0 until its parent's event */
+	int stopped;          /* its first stop came before its parent's event */
+} px_calltrace_child;
+
+typedef struct _px_calltrace {
+	const char *name;
+	uintptr_t addr;
+	long word;            /* original word at addr */
+	px_calltrace_insn insn;
+	int latency;
+	int stopping;
+	unsigned interval;
+	unsigned seconds;
+	px_calltrace_thread *threads; /* open addressing by tid */
+	size_t nslots;
+	size_t n;
+	px_calltrace_site *sites; /* open addressing by address */
+	size_t site_slots;
+	size_t nsites;
+	uint64_t start;
+	uint64_t traps;
+	uint64_t trap_ns;     /* time px spent handling the traps */
+	uint64_t max_trap_ns;
+	uint64_t steps;       /* breakpoints passed by single-stepping */
+	uint64_t untimed;     /* calls nested too deep to be timed */
+	uint64_t lost;        /* timed calls whose return was not seen */
+	uint64_t forks;
+	uint64_t vforks;
+	px_calltrace_child *children;
+	size_t nchildren;
+	size_t children_size;
+	int exec;             /* the target exec'd, the breakpoint is gone */
+} px_calltrace_state;
+
+static volatile sig_atomic_t g_calltrace_stop, g_calltrace_tick;
+
+static void _px_calltrace_signal(int signum)
+{
+	if (signum == SIGINT) {
+		g_calltrace_stop = 1;
+	} else {
+		g_calltrace_tick = 1;
+	}
+}
+
+/**
+ * General registers by their encoding number
+ */
+static const size_t g_regs[16] = {
+	offsetof(struct user_regs_struct, rax),
+	offsetof(struct user_regs_struct, rcx),
+	offsetof(struct user_regs_struct, rdx),
+	offsetof(struct user_regs_struct, rbx),
+	offsetof(struct user_regs_struct, rsp),
+	offsetof(struct user_regs_struct, rbp),
+	offsetof(struct user_regs_struct, rsi),
+	offsetof(struct user_regs_struct, rdi),
+	offsetof(struct user_regs_struct, r8),
+	offsetof(struct user_regs_struct, r9),
+	offsetof(struct user_regs_struct, r10),
+	offsetof(struct user_regs_struct, r11),
+	offsetof(struct user_regs_struct, r12),
+	offsetof(struct user_regs_struct, r13),
+	offsetof(struct user_regs_struct, r14),
+	offsetof(struct user_regs_struct, r15)
+};
+
+#define PX_CALLTRACE_REG(regs, off) \
+	(*(unsigned long long *) ((char *) (regs) + (off)))
+
+/**
+ * Chooses how to get past the instruction at addr, its first bytes in
+ * word: the usual prologues and register moves are emulated, others are
+ * single-stepped
+ */
+static void _px_calltrace_decode(pid_t pid, uintptr_t addr, long word,
+	px_calltrace_insn *insn)
+{
+	const unsigned char *code = (const unsigned char *) &word;
+
+	insn->how = PX_CALLTRACE_STEP;
+
+	if (memcmp(code, "\xf3\x0f\x1e\xfa", 4) == 0) {
+		insn->how = PX_CALLTRACE_SKIP;
+		insn->len = 4;
+	} else if (code[0] >= 0x50 && code[0] <= 0x57) {
+		insn->how = PX_CALLTRACE_PUSH;
+		insn->reg = g_regs[code[0] - 0x50];
+		insn->len = 1;
+	} else if (code[0] == 0x41 && code[1] >= 0x50 && code[1] <= 0x57) {
+		insn->how = PX_CALLTRACE_PUSH;
+		insn->reg = g_regs[code[1] - 0x50 + 8];
+		insn->len = 2;
+	} else if ((code[0] & 0xfa) == 0x48 && code[1] == 0x89
+		&& (code[2] & 0xc0) == 0xc0) {
+		/* REX.W [R] [B] 89 /r, register to register */
+		insn->how = PX_CALLTRACE_MOV;
+		insn->reg = g_regs[((code[2] >> 3) & 7) | ((code[0] & 4) << 1)];
+		insn->dst = g_regs[(code[2] & 7) | ((code[0] & 1) << 3)];
+		insn->len = 3;
+	} else if (code[0] == 0x48 && code[1] == 0x83 && code[2] == 0xec) {
+		insn->how = PX_CALLTRACE_SUB_SP;
+		insn->imm = (signed char) code[3];
+		insn->len = 4;
+	} else if (code[0] == 0x48 && code[1] == 0x81 && code[2] == 0xec) {
+		insn->how = PX_CALLTRACE_SUB_SP;
+		insn->imm = *(const int32_t *) (code + 3);
+		insn->len = 7;
+	} else if (code[0] == 0x48 && code[1] == 0xc7 && code[2] == 0x44
+		&& code[3] == 0x24) {
+		/* The imm32 goes past the word read */
+		insn->how = PX_CALLTRACE_STORE_SP;
+		insn->disp = (signed char) code[4];
+		insn->len = 9;
+		errno = 0;
+		insn->imm = (int32_t) ptrace(PTRACE_PEEKTEXT, pid, addr + 5, NULL);
+
+		if (errno) {
+			insn->how = PX_CALLTRACE_STEP;
+		}
+	}
+}
+
+/**
+ * Writes the first byte at addr, keeping the next seven as they are now:
+ * another breakpoint may be in them
+ */
+static int _px_calltrace_poke(pid_t pid, uintptr_t addr, unsigned char byte)
+{
+	long word;
+
+	errno = 0;
+	if ((word = ptrace(PTRACE_PEEKTEXT, pid, addr, NULL)) == -1 && errno) {
+		return -1;
+	}
+	return ptrace(PTRACE_POKETEXT, pid, addr, (word & ~0xffL) | byte);
+}
+
+/**
+ * Puts the original first byte back at addr if a breakpoint is there
+ */
+static void _px_calltrace_unpoke(pid_t pid, uintptr_t addr, long word)
+{
+	long now;
+
+	errno = 0;
+	now = ptrace(PTRACE_PEEKTEXT, pid, addr, NULL);
+
+	/* The target may have exec'd meanwhile */
+	if ((now != -1 || !errno) && (now & 0xff) == 0xcc) {
+		ptrace(PTRACE_POKETEXT, pid, addr, (now & ~0xffL) | (word & 0xff));
+	}
+}
+
+/**
+ * Finds the stats of a thread, adding them when it is new
+ */
+static px_calltrace_thread *_px_calltrace_thread(px_calltrace_state *c,
+	pid_t tid)
+{
+	px_calltrace_thread *slots, *th;
+	size_t i, j, nslots;
+
+	if ((c->n + 1) * 2 > c->nslots) {
+		nslots = c->nslots ? c->nslots * 2 : 64;
+
+		if ((slots = calloc(nslots, sizeof(*slots))) == NULL) {
+			return NULL;
+		}
+		for (i = 0; i < c->nslots; ++i) {
+			if (c->threads[i].tid == 0) {
+				continue;
+			}
+			for (j = (c->threads[i].tid * 2654435761U) & (nslots - 1);
+				slots[j].tid; j = (j + 1) & (nslots - 1));
+			slots[j] = c->threads[i];
+		}
+		px_safe_free(c->threads);
+		c->threads = slots;
+		c->nslots = nslots;
+	}
+
+	for (i = (tid * 2654435761U) & (c->nslots - 1); c->threads[i].tid;
+		i = (i + 1) & (c->nslots - 1)) {
+		if (c->threads[i].tid == tid) {
+			return &c->threads[i];
+		}
+	}
+	th = &c->threads[i];
+
+	if (c->latency
+		&& (th->hist = calloc(PX_CALLTRACE_BUCKETS, sizeof(*th->hist))) == NULL) {
+		return NULL;
+	}
+	th->tid = tid;
+	++c->n;
+
+	return th;
+}
+
+/**
+ * Finds a return address, adding it when asked and new. Returns NULL when
+ * it is not known, or can not take a breakpoint of px's.
+ */
+static px_calltrace_site *_px_calltrace_site(px_calltrace_state *c,
+	pid_t tid, uintptr_t addr, int add)
+{
+	px_calltrace_site *slots, *site;
+	size_t i, j, nslots;
+
+	if (add && (c->nsites + 1) * 2 > c->site_slots) {
+		nslots = c->site_slots ? c->site_slots * 2 : 64;
+
+		if ((slots = calloc(nslots, sizeof(*slots))) == NULL) {
+			return NULL;
+		}
+		for (i = 0; i < c->site_slots; ++i) {
+			if (c->sites[i].addr == 0) {
+				continue;
+			}
+			for (j = (c->sites[i].addr * 2654435761U) & (nslots - 1);
+				slots[j].addr; j = (j + 1) & (nslots - 1));
+			slots[j] = c->sites[i];
+		}
+		px_safe_free(c->sites);
+		c->sites = slots;
+		c->site_slots = nslots;
+	}
+	if (c->site_slots == 0) {
+		return NULL;
+	}
+
+	for (i = (addr * 2654435761U) & (c->site_slots - 1); c->sites[i].addr;
+		i = (i + 1) & (c->site_slots - 1)) {
+		if (c->sites[i].addr == addr) {
+			return &c->sites[i];
+		}
+	}
+	if (!add) {
+		return NULL;
+	}
+	site = &c->sites[i];
+
+	/* The entry itself, or someone else's breakpoint */
+	errno = 0;
+	if (((site->word = ptrace(PTRACE_PEEKTEXT, tid, addr, NULL)) == -1 && errno)
+		|| (site->word & 0xff) == 0xcc) {
+		return NULL;
+	}
+	_px_calltrace_decode(tid, addr, site->word, &site->insn);
+	site->addr = addr;
+	++c->nsites;
+
+	return site;
+}
+
+/**
+ * Takes a reference on the breakpoint at a return address, inserting it
+ * for the first one
+ */
+static int _px_calltrace_site_get(px_calltrace_state *c, pid_t tid,
+	uintptr_t addr)
+{
+	px_calltrace_site *site;
+
+	if ((site = _px_calltrace_site(c, tid, addr, 1)) == NULL) {
+		return -1;
+	}
+	if (!site->planted) {
+		if (_px_calltrace_poke(tid, addr, 0xcc) == -1) {
+			return -1;
+		}
+		site->planted = 1;
+	}
+	++site->refs;
+
+	return 0;
+}
+
+/**
+ * Drops a reference on the breakpoint at a return address, taking it out
+ * with the last one
+ */
+static void _px_calltrace_site_put(px_calltrace_state *c, pid_t tid,
+	uintptr_t addr)
+{
+	px_calltrace_site *site;
+
+	if ((site = _px_calltrace_site(c, tid, addr, 0)) == NULL
+		|| site->refs == 0 || --site->refs) {
+		return;
+	}
+	_px_calltrace_poke(tid, addr, site->word & 0xff);
+	site->planted = 0;
+}
+
+static inline size_t _px_calltrace_bucket(uint64_t ns)
+{
+	const size_t sub = 1 << PX_CALLTRACE_SUB_BITS;
+	size_t e;
+
+	if (ns < sub) {
+		return ns;
+	}
+	e = 63 - __builtin_clzll(ns);
+
+	return ((e - PX_CALLTRACE_SUB_BITS + 1) << PX_CALLTRACE_SUB_BITS)
+		+ ((ns >> (e - PX_CALLTRACE_SUB_BITS)) & (sub - 1));
+}
+
+/**
+ * Lowest value of a bucket
+ */
+static inline uint64_t _px_calltrace_bucket_low(size_t b)
+{
+	const size_t sub = 1 << PX_CALLTRACE_SUB_BITS;
+
+	if (b < sub) {
+		return b;
+	}
+	return (uint64_t) (sub + (b & (sub - 1)))
+		<< ((b >> PX_CALLTRACE_SUB_BITS) - 1);
+}
+
+/**
+ * Runs the original instruction at addr with the breakpoint removed
+ * Other threads passing there meanwhile are not seen.
+ */
+static void _px_calltrace_step(px_calltrace_state *c, pid_t tid,
+	uintptr_t addr, long word, struct user_regs_struct *regs, int *sig)
+{
+	int stat;
+
+	regs->rip = addr;
+
+	if (ptrace(PTRACE_SETREGS, tid, NULL, regs) == -1
+		|| _px_calltrace_poke(tid, addr, word & 0xff) == -1) {
+		return;
+	}
+	++c->steps;
+
+	while (ptrace(PTRACE_SINGLESTEP, tid, NULL, 0) != -1
+		&& waitpid(tid, &stat, __WALL) == tid && WIFSTOPPED(stat)) {
+		/* A signal arriving meanwhile is delivered once past the step */
+		if (WSTOPSIG(stat) == SIGTRAP || stat >> 16) {
+			break;
+		}
+		*sig = WSTOPSIG(stat);
+	}
+	_px_calltrace_poke(tid, addr, 0xcc);
+	ptrace(PTRACE_GETREGS, tid, NULL, regs);
+}
+
+/**
+ * Gets a thread past the breakpoint at addr, emulating the original
+ * instruction when it can
+ */
+static void _px_calltrace_pass(px_calltrace_state *c, pid_t tid,
+	uintptr_t addr, long word, const px_calltrace_insn *insn,
+	struct user_regs_struct *regs, int *sig)
+{
+	switch (insn->how) {
+		case PX_CALLTRACE_SKIP:
+			regs->rip = addr + insn->len;
+			break;
+
+		case PX_CALLTRACE_PUSH:
+			regs->rsp -= 8;
+			ptrace(PTRACE_POKEDATA, tid, regs->rsp,
+				PX_CALLTRACE_REG(regs, insn->reg));
+			regs->rip = addr + insn->len;
+			break;
+
+		case PX_CALLTRACE_MOV:
+			PX_CALLTRACE_REG(regs, insn->dst) = PX_CALLTRACE_REG(regs, insn->reg);
+			regs->rip = addr + insn->len;
+			break;
+
+		case PX_CALLTRACE_SUB_SP:
+			regs->rsp -= insn->imm;
+			regs->rip = addr + insn->len;
+			break;
+
+		case PX_CALLTRACE_STORE_SP:
+			ptrace(PTRACE_POKEDATA, tid, regs->rsp + insn->disp, insn->imm);
+			regs->rip = addr + insn->len;
+			break;
+
+		default:
+			_px_calltrace_step(c, tid, addr, word, regs, sig);
+			break;
+	}
+}
+
+/**
+ * Finds the timed call a thread at a return address returned from: the
+ * one whose return address was just popped. Any frame may be it, calls on
+ * a signal or coroutine stack interleave with others.
+ * Returns its index or -1.
+ */
+static ssize_t _px_calltrace_returned(const px_calltrace_thread *th,
+	uintptr_t addr, uintptr_t sp)
+{
+	size_t i;
+
+	for (i = th->depth; i-- > 0;) {
+		if (th->frames[i].ret == addr && th->frames[i].sp + 8 == sp) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/**
+ * Removes a frame of a thread, keeping the others in order
+ */
+static void _px_calltrace_pop(px_calltrace_thread *th, size_t i)
+{
+	memmove(&th->frames[i], &th->frames[i + 1],
+		(--th->depth - i) * sizeof(*th->frames));
+}
+
+/**
+ * Handles a SIGTRAP stop, returns 0 when it was one of px's breakpoints
+ * The thread is resumed.
+ */
+static int _px_calltrace_trap(px_calltrace_state *c, pid_t tid)
+{
+	const uint64_t t0 = px_clock_ns();
+	struct user_regs_struct regs;
+	px_calltrace_thread *th;
+	px_calltrace_frame *f = NULL;
+	px_calltrace_site *site = NULL;
+	uintptr_t addr;
+	uint64_t now;
+	ssize_t j;
+	size_t i;
+	long ret;
+	int sig = 0;
+
+	if (ptrace(PTRACE_GETREGS, tid, NULL, &regs) == -1) {
+		return -1;
+	}
+	addr = regs.rip - 1;
+
+	if ((addr != c->addr && (site = _px_calltrace_site(c, tid, addr, 0)) == NULL)
+		|| (th = _px_calltrace_thread(c, tid)) == NULL) {
+		return -1;
+	}
+	++c->traps;
+
+	if (site) {
+		/* A timed call returned, or other code runs there */
+		if ((j = _px_calltrace_returned(th, addr, regs.rsp)) != -1) {
+			++th->returns;
+			++th->hist[_px_calltrace_bucket(t0 - th->frames[j].start)];
+			_px_calltrace_pop(th, j);
+			_px_calltrace_site_put(c, tid, addr);
+		}
+		if (site->planted) {
+			_px_calltrace_pass(c, tid, addr, site->word, &site->insn, &regs,
+				&sig);
+		} else {
+			/* Taken out meanwhile, the original instruction is back */
+			regs.rip = addr;
+		}
+	} else {
+		++th->calls;
+
+		if (c->latency) {
+			/* A frame whose slot is reused was left (longjmp...) or
+			 * returned during a step */
+			for (i = 0; i < th->depth; ++i) {
+				if (th->frames[i].sp == regs.rsp) {
+					_px_calltrace_site_put(c, tid, th->frames[i].ret);
+					_px_calltrace_pop(th, i);
+					++c->lost;
+					break;
+				}
+			}
+			errno = 0;
+
+			if (th->depth == PX_CALLTRACE_DEPTH
+				|| ((ret = ptrace(PTRACE_PEEKDATA, tid, regs.rsp, NULL)) == -1
+					&& errno)
+				|| _px_calltrace_site_get(c, tid, ret) == -1) {
+				++c->untimed;
+			} else {
+				f = &th->frames[th->depth++];
+				f->ret = ret;
+				f->sp = regs.rsp;
+			}
+		}
+		_px_calltrace_pass(c, tid, c->addr, c->word, &c->insn, &regs, &sig);
+	}
+	ptrace(PTRACE_SETREGS, tid, NULL, &regs);
+
+	now = px_clock_ns();
+
+	if (f) {
+		f->start = now;
+	}
+	ptrace(PTRACE_CONT, tid, NULL, sig);
+
+	c->trap_ns += now - t0;
+
+	if (now - t0 > c->max_trap_ns) {
+		c->max_trap_ns = now - t0;
+	}
+	return 0;
+}
+
+/**
+ * Takes the breakpoints out of a process: the entry and every return
+ * address that had one, a forked child may still have its copy
+ */
+static void _px_calltrace_restore(px_calltrace_state *c, pid_t pid)
+{
+	size_t i;
+
+	_px_calltrace_unpoke(pid, c->addr, c->word);
+
+	for (i = 0; i < c->site_slots; ++i) {
+		if (c->sites[i].addr) {
+			_px_calltrace_unpoke(pid, c->sites[i].addr, c->sites[i].word);
+		}
+	}
+}
+
+/**
+ * Interrupts again a thread resumed from a trap or an event: any stop
+ * takes a pending PTRACE_INTERRUPT with it
+ */
+static void _px_calltrace_rearm(px_threads *t, pid_t tid)
+{
+	ssize_t i;
+
+	if ((i = px_threads_find(t, tid)) != -1 && t->list[i].interrupted) {
+		ptrace(PTRACE_INTERRUPT, tid, NULL, NULL);
+	}
+}
+
+/**
+ * Finds a child of the target, returns its index or -1
+ */
+static ssize_t _px_calltrace_child_find(const px_calltrace_state *c, pid_t pid)
+{
+	size_t i;
+
+	for (i = 0; i < c->nchildren; ++i) {
+		if (c->children[i].pid == pid) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static px_calltrace_child *_px_calltrace_child_add(px_calltrace_state *c,
+	pid_t pid, int kind)
+{
+	px_calltrace_child *children;
+	size_t size;
+
+	if (c->nchildren == c->children_size) {
+		size = c->children_size ? c->children_size * 2 : 8;
+
+		if ((children = realloc(c->children, size * sizeof(*children))) == NULL) {
+			px_error("Failed to alloc!");
+			return NULL;
+		}
+		c->children = children;
+		c->children_size = size;
+	}
+	children = &c->children[c->nchildren++];
+	children->pid = pid;
+	children->kind = kind;
+	children->stopped = 0;
+
+	return children;
+}
+
+static void _px_calltrace_child_remove(px_calltrace_state *c, size_t i)
+{
+	c->children[i] = c->children[--c->nchildren];
+}
+
+/**
+ * Lets a child go once its kind and first stop are both known: a forked
+ * one gets its copy of the breakpoint undone, a vfork one runs on
+ */
+static void _px_calltrace_child_start(px_calltrace_state *c, size_t i)
+{
+	const pid_t pid = c->children[i].pid;
+
+	if (c->children[i].kind == PTRACE_EVENT_FORK) {
+		_px_calltrace_restore(c, pid);
+		ptrace(PTRACE_DETACH, pid, NULL, NULL);
+		_px_calltrace_child_remove(c, i);
+		++c->forks;
+	} else {
+		c->children[i].stopped = 0;
+		ptrace(PTRACE_CONT, pid, NULL, 0);
+	}
+}
+
+/**
+ * Handles a fork or vfork event of a parent, the child's first stop may
+ * have come before it or be yet to come
+ */
+static void _px_calltrace_child_event(px_calltrace_state *c, pid_t pid,
+	int kind)
+{
+	ssize_t i;
+
+	if (kind == PTRACE_EVENT_VFORK) {
+		++c->vforks;
+	}
+	if ((i = _px_calltrace_child_find(c, pid)) == -1) {
+		_px_calltrace_child_add(c, pid, kind);
+		return;
+	}
+	c->children[i].kind = kind;
+
+	if (c->children[i].stopped) {
+		_px_calltrace_child_start(c, i);
+	}
+}
+
+/**
+ * Handles a stop of a child. A vfork child shares the memory of the
+ * target: it is traced like a thread until it execs or exits, then let go
+ * with nothing undone in it.
+ */
+static void _px_calltrace_child(px_calltrace_state *c, pid_t pid, int stat)
+{
+	px_calltrace_child *child;
+	ssize_t i;
+	int sig;
+
+	if ((i = _px_calltrace_child_find(c, pid)) == -1) {
+		/* Its first stop, before its parent's event */
+		if (WIFSTOPPED(stat)
+			&& (child = _px_calltrace_child_add(c, pid, 0)) != NULL) {
+			child->stopped = 1;
+		}
+		return;
+	}
+	if (!WIFSTOPPED(stat)) {
+		_px_calltrace_child_remove(c, i);
+		return;
+	}
+	if (c->children[i].kind != PTRACE_EVENT_VFORK) {
+		if (c->children[i].kind == PTRACE_EVENT_FORK) {
+			_px_calltrace_child_start(c, i);
+		}
+		return;
+	}
+	sig = WSTOPSIG(stat);
+
+	switch (stat >> 16) {
+		case PTRACE_EVENT_EXEC:
+			ptrace(PTRACE_DETACH, pid, NULL, NULL);
+			_px_calltrace_child_remove(c, i);
+			return;
+
+		case PTRACE_EVENT_STOP:
+			/* Its first stop, or a group stop LISTEN keeps it in */
+			ptrace(sig == SIGSTOP || sig == SIGTSTP || sig == SIGTTIN
+				|| sig == SIGTTOU ? PTRACE_LISTEN : PTRACE_CONT, pid, NULL, NULL);
+			return;
+
+		case 0:
+			/* A signal delivery stop, the signal goes on */
+			break;
+
+		default:
+			sig = 0;
+			break;
+	}
+	ptrace(PTRACE_CONT, pid, NULL, sig);
+}
+
+/**
+ * Handles a stop of a traced thread, or of a child
+ */
+static void _px_calltrace_stop(px_calltrace_state *c, pid_t tid, int stat)
+{
+	px_threads *t = &ENV(threads);
+	unsigned long msg;
+	size_t j;
+	ssize_t i;
+
+	if (WIFSTOPPED(stat) && stat >> 16 == 0 && WSTOPSIG(stat) == SIGTRAP
+		&& _px_calltrace_trap(c, tid) == 0) {
+		_px_calltrace_rearm(t, tid);
+		return;
+	}
+
+	if (WIFSTOPPED(stat) && (stat >> 16 == PTRACE_EVENT_FORK
+		|| stat >> 16 == PTRACE_EVENT_VFORK)) {
+		if (ptrace(PTRACE_GETEVENTMSG, tid, NULL, &msg) != -1) {
+			_px_calltrace_child_event(c, msg, stat >> 16);
+		}
+		ptrace(PTRACE_CONT, tid, NULL, 0);
+		_px_calltrace_rearm(t, tid);
+		return;
+	}
+
+	/* A child, not a thread of the target */
+	if (px_threads_find(t, tid) == -1
+		&& syscall(SYS_tgkill, ENV(pid), tid, 0) == -1) {
+		_px_calltrace_child(c, tid, stat);
+		return;
+	}
+
+	/* The breakpoint and the timed calls went with the old image */
+	if (WIFSTOPPED(stat) && stat >> 16 == PTRACE_EVENT_EXEC) {
+		c->exec = 1;
+
+		for (j = 0; j < c->nslots; ++j) {
+			c->threads[j].depth = 0;
+		}
+	}
+
+	if ((i = px_threads_event(t, tid, stat)) != -1 && !c->stopping) {
+		px_threads_resume(t, i);
+	}
+}
+
+/**
+ * Waits for the children whose first stop is yet to come, and for the
+ * live vfork children to exec or exit: they run the breakpoint too.
+ * Children whose parent's event never came are let go untouched.
+ */
+static void _px_calltrace_drain(px_calltrace_state *c)
+{
+	size_t i, live;
+	pid_t tid;
+	int stat;
+
+	for (;;) {
+		for (i = 0, live = 0; i < c->nchildren; ++i) {
+			live += c->children[i].kind != 0;
+		}
+		if (live == 0) {
+			break;
+		}
+		if ((tid = waitpid(-1, &stat, __WALL)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		_px_calltrace_stop(c, tid, stat);
+	}
+
+	for (i = 0; i < c->nchildren; ++i) {
+		ptrace(PTRACE_DETACH, c->children[i].pid, NULL, NULL);
+	}
+	c->nchildren = 0;
+}
+
+static void _px_calltrace_setoptions(int options)
+{
+	size_t i;
+
+	for (i = 0; i < ENV(threads).n; ++i) {
+		ptrace(PTRACE_SETOPTIONS, ENV(threads).list[i].tid, NULL, options);
+	}
+}
+
+/**
+ * Tells if a thread has a SIGTRAP pending, from its status in procfs
+ */
+static int _px_calltrace_trap_pending(pid_t tid)
+{
+	char fname[64], *buf;
+	const char *p;
+	uint64_t mask = 0;
+	size_t len;
+
+	snprintf(fname, sizeof(fname), "/proc/%d/task/%d/status", ENV(pid), tid);
+
+	if ((buf = px_proc_read(fname, &len)) == NULL) {
+		return 0;
+	}
+	if ((p = strstr(buf, "\nSigPnd:")) != NULL) {
+		p += sizeof("\nSigPnd:") - 1;
+		px_proc_skip_spaces(&p);
+		mask = px_proc_hex(&p);
+	}
+	free(buf);
+
+	return (mask >> (SIGTRAP - 1)) & 1;
+}
+
+/**
+ * Tells if a thread is yet to report the stop it owes, one
+ * PTRACE_INTERRUPT failed on (exiting) owes none
+ */
+static int _px_calltrace_owed(const px_threads *t)
+{
+	size_t i;
+
+	for (i = 0; i < t->n; ++i) {
+		if (!t->list[i].stopped
+			&& (t->list[i].interrupted || t->list[i].starting)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Stops every thread with the breakpoint still in, handling the traps
+ * that come first. A thread stopped right after its trap, its SIGTRAP
+ * still pending, runs again to have it handled.
+ */
+static void _px_calltrace_stop_all(px_calltrace_state *c)
+{
+	px_threads *t = &ENV(threads);
+	size_t i, tries, pending;
+	pid_t tid;
+	int stat;
+
+	c->stopping = 1;
+
+	for (tries = 0; tries < PX_CALLTRACE_DRAIN_TRIES; ++tries) {
+		px_threads_interrupt(t);
+
+		while (_px_calltrace_owed(t)) {
+			if ((tid = waitpid(-1, &stat, __WALL)) == -1) {
+				if (errno == EINTR) {
+					continue;
+				}
+				break;
+			}
+			_px_calltrace_stop(c, tid, stat);
+		}
+
+		/* The pc can not tell: an emulated push leaves it at addr + 1 too */
+		for (i = 0, pending = 0; i < t->n; ++i) {
+			if (!t->list[i].stopped || t->list[i].group_stop
+				|| !_px_calltrace_trap_pending(t->list[i].tid)) {
+				continue;
+			}
+			tid = t->list[i].tid;
+			px_threads_resume(t, i);
+
+			/* The trap, ours or not, leaves it running for the next round */
+			while (waitpid(tid, &stat, __WALL) == tid) {
+				_px_calltrace_stop(c, tid, stat);
+
+				if (!WIFSTOPPED(stat) || stat >> 16 == PTRACE_EVENT_STOP
+					|| (stat >> 16 == 0 && WSTOPSIG(stat) == SIGTRAP)) {
+					break;
+				}
+			}
+			++pending;
+		}
+		if (pending == 0) {
+			return;
+		}
+	}
+	px_error("Threads keep hitting the breakpoint, it may be left behind");
+}
+
+static void _px_calltrace_fmt(uint64_t ns, char *buf, size_t len)
+{
+	if (ns < 1000) {
+		snprintf(buf, len, "%" PRIu64 "ns", ns);
+	} else if (ns < 1000000) {
+		snprintf(buf, len, "%.1fus", ns / 1e3);
+	} else if (ns < 1000000000) {
+		snprintf(buf, len, "%.1fms", ns / 1e6);
+	} else {
+		snprintf(buf, len, "%.2fs", ns / 1e9);
+	}
+}
+
+/**
+ * Upper bound of the bucket holding the given fraction of the calls
+ */
+static uint64_t _px_calltrace_percentile(const uint64_t *hist, uint64_t n,
+	double q)
+{
+	uint64_t seen = 0, rank = (uint64_t) (n * q);
+	size_t b;
+
+	for (b = 0; b < PX_CALLTRACE_BUCKETS; ++b) {
+		if ((seen += hist[b]) > rank) {
+			return _px_calltrace_bucket_low(b + 1);
+		}
+	}
+	return 0;
+}
+
+static int _px_calltrace_calls_cmp(const void *a, const void *b)
+{
+	const px_calltrace_thread *ta = *(px_calltrace_thread * const *) a;
+	const px_calltrace_thread *tb = *(px_calltrace_thread * const *) b;
+
+	return ta->calls < tb->calls ? 1 : ta->calls > tb->calls ? -1 : 0;
+}
+
+static void _px_calltrace_report(px_calltrace_state *c)
+{
+	const double elapsed = (px_clock_ns() - c->start) / 1e9;
+	px_calltrace_thread **order;
+	uint64_t hist[PX_CALLTRACE_BUCKETS], calls = 0, returns = 0, max = 0;
+	char p50[16], p99[16], low[16], high[16];
+	size_t i, b, n = 0, first = PX_CALLTRACE_BUCKETS, last = 0;
+
+	if ((order = malloc(sizeof(*order) * (c->n + 1))) == NULL) {
+		px_error("Failed to alloc!");
+		return;
+	}
+	memset(hist, 0, sizeof(hist));
+
+	for (i = 0; i < c->nslots; ++i) {
+		if (c->threads[i].tid == 0) {
+			continue;
+		}
+		order[n++] = &c->threads[i];
+		calls += c->threads[i].calls;
+		returns += c->threads[i].returns;
+
+		for (b = 0; c->latency && b < PX_CALLTRACE_BUCKETS; ++b) {
+			hist[b] += c->threads[i].hist[b];
+		}
+	}
+	qsort(order, n, sizeof(*order), _px_calltrace_calls_cmp);
+
+	printf("[+] %s: %" PRIu64 " calls in %.1fs (%.0f/s) by %zu threads\n",
+		c->name, calls, elapsed, elapsed > 0 ? calls / elapsed : 0.0, n);
+
+	if (c->latency) {
+		printf("%-8s %12s %12s %10s %10s\n", "tid", "calls", "returns",
+			"p50", "p99");
+	} else {
+		printf("%-8s %12s\n", "tid", "calls");
+	}
+	for (i = 0; i < n && i < PX_CALLTRACE_TOP; ++i) {
+		if (c->latency) {
+			_px_calltrace_fmt(_px_calltrace_percentile(order[i]->hist,
+				order[i]->returns, 0.5), p50, sizeof(p50));
+			_px_calltrace_fmt(_px_calltrace_percentile(order[i]->hist,
+				order[i]->returns, 0.99), p99, sizeof(p99));
+			printf("%-8d %12" PRIu64 " %12" PRIu64 " %10s %10s\n",
+				order[i]->tid, order[i]->calls, order[i]->returns,
+				order[i]->returns ? p50 : "-", order[i]->returns ? p99 : "-");
+		} else {
+			printf("%-8d %12" PRIu64 "\n", order[i]->tid, order[i]->calls);
+		}
+	}
+	if (n > PX_CALLTRACE_TOP) {
+		printf("[+] %zu more threads\n", n - PX_CALLTRACE_TOP);
+	}
+	free(order);
+
+	if (c->latency && returns) {
+		for (b = 0; b < PX_CALLTRACE_BUCKETS; ++b) {
+			if (hist[b]) {
+				first = b < first ? b : first;
+				last = b;
+				max = hist[b] > max ? hist[b] : max;
+			}
+		}
+		printf("[+] Latency of the %" PRIu64 " returns (each includes a trap):\n",
+			returns);
+
+		for (b = first; b <= last; ++b) {
+			_px_calltrace_fmt(_px_calltrace_bucket_low(b), low, sizeof(low));
+			_px_calltrace_fmt(_px_calltrace_bucket_low(b + 1), high,
+				sizeof(high));
+			printf("  %8s - %-8s %10" PRIu64 " |%.*s\n", low, high, hist[b],
+				(int) ((hist[b] * 40 + max - 1) / max),
+				"########################################");
+		}
+	}
+
+	/* The thread waits for px in each trap, a kernel round trip on top */
+	printf("[+] Overhead: %" PRIu64 " traps, %.1fus each in px (%.1fus at "
+		"most), %.2f%% of a CPU; every call stops its thread %s\n",
+		c->traps, c->traps ? c->trap_ns / 1e3 / c->traps : 0.0,
+		c->max_trap_ns / 1e3,
+		elapsed > 0 ? c->trap_ns / 1e7 / elapsed : 0.0,
+		c->latency ? "twice" : "once");
+
+	if (c->steps) {
+		printf("[+] %" PRIu64 " traps single-stepped the original instruction, "
+			"other threads passing there meanwhile were missed\n", c->steps);
+	}
+	if (c->untimed || c->lost || c->forks || c->vforks) {
+		printf("[+] %" PRIu64 " calls nested too deep to be timed, %" PRIu64
+			" returns not seen, %" PRIu64 " forked children cleaned, %" PRIu64
+			" vfork children traced\n", c->untimed, c->lost, c->forks,
+			c->vforks);
+	}
+	fflush(stdout);
+}
+#endif
+
+/**
+ * Counts the calls of a function with a breakpoint at its entry, and
+ * with --latency times them by pointing their return address at the
+ * entry too
+ * trace <symbol | address> [--latency] [--interval N] [--seconds N]
+ * Runs until Ctrl-C or the given seconds, reporting every interval.
+ */
+void px_calltrace(const char *params)
+{
+#if defined(__x86_64__)
+	px_calltrace_state c;
+	struct sigaction sa, old_int, old_alrm;
+	struct itimerval timer, old_timer;
+	char *opts = NULL, *token, *saveptr = NULL, *value;
+	uint64_t next_report = 0, end = 0, now;
+	pid_t tid;
+	size_t i;
+	int stat, type = STT_FUNC;
+
+	memset(&c, 0, sizeof(c));
+
+	if (params == NULL || (opts = strdup(params)) == NULL
+		|| (c.name = strtok_r(opts, " ", &saveptr)) == NULL) {
+		px_error("Missing symbol name");
+		goto out;
+	}
+
+	while ((token = strtok_r(NULL, " ", &saveptr)) != NULL) {
+		if (strcmp(token, "--latency") == 0) {
+			c.latency = 1;
+			continue;
+		}
+		if ((value = strtok_r(NULL, " ", &saveptr)) == NULL) {
+			px_error("Missing value for %s", token);
+			goto out;
+		}
+		if (strcmp(token, "--interval") == 0) {
+			c.interval = strtoul(value, NULL, 10);
+		} else if (strcmp(token, "--seconds") == 0) {
+			c.seconds = strtoul(value, NULL, 10);
+		} else {
+			px_error("Unknown option %s", token);
+			goto out;
+		}
+	}
+
+	if (strncmp(c.name, "0x", 2) == 0) {
+		c.addr = strtoull(c.name, NULL, 16);
+	} else if (ELF(map) == 0) {
+		px_error("No link_map, run maps first");
+		goto out;
+	} else if ((c.addr = px_elf_lookup_symbol(c.name, NULL, &type)) == 0
+		&& (ENV(symbols).tables || px_sym_build() != -1)) {
+		/* Not exported, .symtab may have it, the index only holds functions */
+		c.addr = px_sym_lookup(c.name);
+	}
+	if (c.addr == 0) {
+		px_error("Symbol not found!");
+		goto out;
+	}
+	if (type == STT_GNU_IFUNC) {
+		px_error("%s is an IFUNC, its address is the resolver's: trace the "
+			"implementation it selects by its own name", c.name);
+		goto out;
+	}
+	if (type != STT_FUNC) {
+		px_error("%s is not a function", c.name);
+		goto out;
+	}
+
+	errno = 0;
+	if ((c.word = ptrace(PTRACE_PEEKTEXT, ENV(pid), c.addr, NULL)) == -1
+		&& errno) {
+		px_error("Failed to read %#" PRIxPTR " (%s)", c.addr, strerror(errno));
+		goto out;
+	}
+	if ((c.word & 0xff) == 0xcc) {
+		px_error("There is a breakpoint at %#" PRIxPTR " already", c.addr);
+		goto out;
+	}
+	_px_calltrace_decode(ENV(pid), c.addr, c.word, &c.insn);
+
+	/* Children forked meanwhile get the breakpoint out before running,
+	 * vfork ones are traced until they exec */
+	_px_calltrace_setoptions(PX_PTRACE_OPTIONS | PTRACE_O_TRACEFORK
+		| PTRACE_O_TRACEVFORK | PTRACE_O_TRACEEXEC);
+
+	if (_px_calltrace_poke(ENV(pid), c.addr, 0xcc) == -1) {
+		px_error("Failed to insert the breakpoint (%s)", strerror(errno));
+		_px_calltrace_setoptions(PX_PTRACE_OPTIONS);
+		goto out;
+	}
+	px_cache_invalidate();
+
+	g_calltrace_stop = g_calltrace_tick = 0;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = _px_calltrace_signal;
+	sigemptyset(&sa.sa_mask);
+	/* No SA_RESTART, waitpid() must return on them */
+	sigaction(SIGINT, &sa, &old_int);
+	sigaction(SIGALRM, &sa, &old_alrm);
+
+	c.start = px_clock_ns();
+
+	memset(&timer, 0, sizeof(timer));
+	timer.it_interval.tv_sec = timer.it_value.tv_sec = 1;
+	setitimer(ITIMER_REAL, &timer, &old_timer);
+
+	printf("[+] Tracing %s at %#" PRIxPTR " in %zu threads%s, Ctrl-C to stop\n",
+		c.name, c.addr, ENV(threads).n, c.latency ? " with latency" : "");
+	fflush(stdout);
+
+	if (c.interval) {
+		next_report = c.start + c.interval * 1000000000ULL;
+	}
+	if (c.seconds) {
+		end = c.start + c.seconds * 1000000000ULL;
+	}
+
+	px_threads_resume_all(&ENV(threads));
+
+	while (!g_calltrace_stop && !c.exec && ENV(threads).n) {
+		if ((tid = waitpid(-1, &stat, __WALL)) != -1) {
+			_px_calltrace_stop(&c, tid, stat);
+		} else if (errno != EINTR) {
+			break;
+		}
+		if (g_calltrace_tick) {
+			g_calltrace_tick = 0;
+			now = px_clock_ns();
+
+			if (end && now >= end) {
+				break;
+			}
+			if (next_report && now >= next_report) {
+				_px_calltrace_report(&c);
+				next_report += c.interval * 1000000000ULL;
+			}
+		}
+	}
+
+	setitimer(ITIMER_REAL, &old_timer, NULL);
+
+	if (ENV(threads).n) {
+		_px_calltrace_stop_all(&c);
+	}
+	_px_calltrace_drain(&c);
+
+	if (ENV(threads).n) {
+		if (!c.exec) {
+			_px_calltrace_restore(&c, ENV(pid));
+		}
+		_px_calltrace_setoptions(PX_PTRACE_OPTIONS);
+		px_threads_stop(&ENV(threads));
+	}
+
+	sigaction(SIGINT, &old_int, NULL);
+	sigaction(SIGALRM, &old_alrm, NULL);
+
+	px_cache_invalidate();
+
+	_px_calltrace_report(&c);
+
+	if (c.exec) {
+		printf("[+] pid %d exec'd, the breakpoint went with its old image, "
+			"run maps again\n", ENV(pid));
+	}
+	if (ENV(threads).n == 0) {
+		printf("[+] pid %d is gone\n", ENV(pid));
+		px_threads_clear(&ENV(threads));
+		ptrace_reset();
+		ENV(pid) = 0;
+	}
+out:
+	for (i = 0; i < c.nslots; ++i) {
+		px_safe_free(c.threads[i].hist);
+	}
+	px_safe_free(c.threads);
+	px_safe_free(c.sites);
+	px_safe_free(c.children);
+	px_safe_free(opts);
+#else
+	px_error("trace is only supported on x86_64");
+#endif
+}
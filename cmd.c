@@ -38,23 +38,49 @@
 #include "trace.h"
 #include "maps.h"
 #include "elf.h"
+#include "cache.h"
+#include "search.h"
+#include "refs.h"
+#include "leaks.h"
+#include "strscan.h"
+#include "gcore.h"
+#include "core.h"
+#include "track.h"
+#include "residency.h"
+#include "numa.h"
+#include "profile.h"
+#include "sample.h"
+#include "calltrace.h"
+#include "unwind.h"
 
 px_env g_env;
 
 #define PX_STRL(x) x, sizeof(x)-1
 
 /**
- * Checks for supplied PID
+ * Checks for supplied PID (or an opened core file)
  */
 inline static int _px_check_pid(void)
 {
-	if (ENV(pid) == 0) {
+	if (ENV(pid) == 0 && ENV(source) == NULL) {
 		px_error("Currently there is no pid attached");
 		return 1;
 	}
 	return 0;
 }
 
+/**
+ * Checks for a live process, for the commands a core file cannot serve
+ */
+inline static int _px_check_live(void)
+{
+	if (ENV(source)) {
+		px_error("Not available on core files");
+		return 1;
+	}
+	return _px_check_pid();
+}
+
 /**
  * Finds and call a handler if found
  */
@@ -86,7 +112,14 @@ static void _px_clear_session()
 		px_maps_clear();
 		px_elf_clear();
 	}
+	px_sym_clear();
+	px_refs_clear();
+	px_unwind_clear();
 
+	if (ENV(source)) {
+		ENV(source)->close();
+		ENV(source) = NULL;
+	}
 	if (ENV(pid) != 0) {
 		px_detach_pid();
 	}
@@ -97,7 +130,7 @@ static void _px_clear_session()
  */
 static void _px_quit_handler(CMD_HANDLER_ARGS)
 {
-	if (ENV(pid) != 0) {
+	if (ENV(pid) != 0 || ENV(source)) {
 		_px_clear_session();
 	}
 
@@ -113,7 +146,7 @@ static void _px_attach_handler(CMD_HANDLER_ARGS)
 {
 	pid_t pid = strtol(params, NULL, 10);
 
-	if (ENV(pid) != 0) {
+	if (ENV(pid) != 0 || ENV(source)) {
 		_px_clear_session();
 	}
 
@@ -137,8 +170,7 @@ static void _px_detach_handler(CMD_HANDLER_ARGS)
 		return;
 	}
 
-	px_detach_pid(ENV(pid));
-
+	/* Closes the core file, if that is what is open */
 	_px_clear_session();
 
 	ENV(pid) = 0;
@@ -152,37 +184,73 @@ static void _px_signal_handler(CMD_HANDLER_ARGS)
 {
 	int signum = atoi(params);
 
-	if (_px_check_pid()) {
+	if (_px_check_live()) {
 		return;
 	}
 
 	px_send_signal(signum);
 }
 
+/**
+ * Lists the attached threads
+ * threads
+ */
+static void _px_threads_handler(CMD_HANDLER_ARGS)
+{
+	if (_px_check_live()) {
+		return;
+	}
+
+	px_threads_show();
+}
+
+/**
+ * Shows the registers of a thread, saved when it stopped
+ * regs [tid]
+ */
+static void _px_regs_handler(CMD_HANDLER_ARGS)
+{
+	if (_px_check_live()) {
+		return;
+	}
+
+	px_threads_show_regs(params ? strtol(params, NULL, 10) : 0);
+}
+
 /**
  * Maps the memory using the /proc/<pid>/maps information
+ * maps [refresh]
  */
 static void _px_maps_handler(CMD_HANDLER_ARGS)
 {
-	char fname[PATH_MAX], lname[PATH_MAX], *line = NULL;
-	FILE *fp;
-	size_t size;
+	char fname[PATH_MAX], lname[PATH_MAX];
 
 	if (_px_check_pid()) {
 		return;
 	}
 
-	snprintf(fname, sizeof(fname), "/proc/%d/maps", ENV(pid));
-
-	printf("[+] Starting to read %s...\n", fname);
-
-	if ((fp = fopen(fname, "r")) == NULL) {
-		px_error("Fail to open '%s'", fname);
+	/* Only apply what changed since the last snapshot */
+	if (params && strcmp(params, "refresh") == 0 && ENV(maps) != NULL) {
+		if (ENV(source)) {
+			px_error("A core file does not change");
+			return;
+		}
+		px_unwind_clear();
+		px_maps_refresh();
 		return;
 	}
 
-	while (getline(&line, &size, fp) != -1) {
-		px_maps_region(line);
+	if (ENV(source)) {
+		printf("[+] Starting to read the regions of %s...\n", ENV(source)->name);
+	} else {
+		printf("[+] Starting to read /proc/%d/maps...\n", ENV(pid));
+	}
+
+	/* Unwind objects are keyed by region names */
+	px_unwind_clear();
+
+	if (px_maps_load() == -1) {
+		return;
 	}
 
 	printf("%d mapped regions\n", (int)ENV(nregions));
@@ -191,13 +259,13 @@ static void _px_maps_handler(CMD_HANDLER_ARGS)
 
 	printf("[+] Starting to read ELF...\n");
 
-	if (readlink(fname, lname, sizeof(lname)) == -1) {
+	if (ENV(source)) {
+		px_elf_maps();
+	} else if (readlink(fname, lname, sizeof(lname)) == -1) {
 		px_error("readlink failed! (%s)\n", strerror(errno));
 	} else {
 		px_elf_maps();
 	}
-
-	fclose(fp);
 }
 
 /**
@@ -309,21 +377,382 @@ static void _px_dump_handler(CMD_HANDLER_ARGS)
 }
 
 /**
- * Finds an specified address in the mapped regions
- * find <address>
+ * Finds specified addresses in the mapped regions
+ * find <address> [address ...]
  */
 static void _px_find_handler(CMD_HANDLER_ARGS)
 {
-	uintptr_t addr = 0;
+	uintptr_t *addrs = NULL, *tmp;
+	ssize_t *found;
+	char *token, *saveptr = NULL;
+	size_t i, n = 0;
+
+	if (_px_check_pid()) {
+		return;
+	}
+
+	if (params == NULL) {
+		px_error("Missing address");
+		return;
+	}
+
+	for (token = strtok_r((char*)params, " ", &saveptr); token;
+		token = strtok_r(NULL, " ", &saveptr)) {
+		if ((tmp = realloc(addrs, sizeof(*addrs) * (n + 1))) == NULL) {
+			px_error("Failed to realloc!");
+			px_safe_free(addrs);
+			return;
+		}
+		addrs = tmp;
+		addrs[n++] = strtoull(token, NULL, 16);
+	}
+
+	if ((found = malloc(sizeof(*found) * n)) == NULL) {
+		px_error("Failed to alloc!");
+		px_safe_free(addrs);
+		return;
+	}
+
+	px_maps_lookup_batch(addrs, found, n);
+
+	for (i = 0; i < n; ++i) {
+		if (found[i] == -1) {
+			px_error("Address %#" PRIxPTR " not found!", addrs[i]);
+			continue;
+		}
+		printf("Found... %s (%s)\n", PX_MAPS_NAME(found[i]),
+			ENV(maps)[found[i]].perms);
+	}
+
+	free(found);
+	px_safe_free(addrs);
+}
+
+/**
+ * Finds a symbol by name in the loaded objects
+ * symbol <name>
+ */
+static void _px_symbol_handler(CMD_HANDLER_ARGS)
+{
+	if (_px_check_pid()) {
+		return;
+	}
+
+	if (params == NULL) {
+		px_error("Missing symbol name");
+		return;
+	}
+
+	if (px_elf_find_symbol(params) == 0) {
+		px_error("Symbol not found!");
+	}
+}
+
+/**
+ * Resolves addresses to lib!func+off
+ * symbolize <address [address ...] | ->
+ */
+static void _px_symbolize_handler(CMD_HANDLER_ARGS)
+{
+	if (_px_check_pid()) {
+		return;
+	}
+
+	if (params == NULL) {
+		px_error("Missing address");
+		return;
+	}
+
+	px_sym_symbolize(params);
+}
 
+/**
+ * Searches the readable regions for a byte pattern
+ * search <hex bytes | "string"> [--perms r-x] [--region lib]
+ */
+static void _px_search_handler(CMD_HANDLER_ARGS)
+{
 	if (_px_check_pid()) {
 		return;
 	}
 
-	sscanf(params, "%" PRIxPTR, &addr);
+	if (params == NULL) {
+		px_error("Missing pattern");
+		return;
+	}
+
+	px_search(params);
+}
+
+/**
+ * Finds the pointers to an address or range in writable memory
+ * refs <addr | start-end | --index>
+ */
+static void _px_refs_handler(CMD_HANDLER_ARGS)
+{
+	if (_px_check_pid()) {
+		return;
+	}
+
+	if (params == NULL) {
+		px_error("Missing address");
+		return;
+	}
+
+	px_refs(params);
+}
+
+/**
+ * Reports the heap chunks no pointer reaches
+ * leaks
+ */
+static void _px_leaks_handler(CMD_HANDLER_ARGS)
+{
+	if (_px_check_pid()) {
+		return;
+	}
+
+	px_leaks();
+}
+
+/**
+ * Extracts printable strings from the target memory
+ * strings [--min N] [--region name] [--encoding ascii|utf16le]
+ */
+static void _px_strings_handler(CMD_HANDLER_ARGS)
+{
+	if (_px_check_pid()) {
+		return;
+	}
+
+	px_strings(params);
+}
+
+/**
+ * Writes an ELF core file of the target
+ * gcore <file>
+ */
+static void _px_gcore_handler(CMD_HANDLER_ARGS)
+{
+	if (_px_check_live()) {
+		return;
+	}
+
+	if (params == NULL) {
+		px_error("Missing file name");
+		return;
+	}
+
+	px_gcore(params);
+}
+
+/**
+ * Writes a core file to read back with core, or forks the target and
+ * reads from the child so the target can run again
+ * snapshot <file | --fork>
+ */
+static void _px_snapshot_handler(CMD_HANDLER_ARGS)
+{
+	if (_px_check_live()) {
+		return;
+	}
+
+	if (params == NULL) {
+		px_error("Missing file name");
+		return;
+	}
+
+	if (strcmp(params, "--fork") != 0) {
+		px_gcore(params);
+	} else if (ENV(parent) != 0) {
+		px_error("Already reading from a fork of pid %d", ENV(parent));
+	} else {
+		px_fork_pid();
+	}
+}
+
+/**
+ * Opens a core file (from gcore, snapshot or the kernel) for analysis
+ * core <file>
+ */
+static void _px_core_handler(CMD_HANDLER_ARGS)
+{
+	if (params == NULL) {
+		px_error("Missing file name");
+		return;
+	}
+
+	if (ENV(pid) != 0 || ENV(source)) {
+		_px_clear_session();
+	}
+
+	if ((ENV(source) = px_core_open(params)) != NULL) {
+		printf("[+] Reading memory from %s\n", params);
+	}
+}
+
+/**
+ * Reports how much of each region is resident, swapped or in huge pages
+ * residency [--region name]
+ */
+static void _px_residency_handler(CMD_HANDLER_ARGS)
+{
+	if (_px_check_live()) {
+		return;
+	}
+
+	px_residency(params);
+}
+
+/**
+ * Shows the NUMA node placement of the regions and threads
+ * numa
+ */
+static void _px_numa_handler(CMD_HANDLER_ARGS)
+{
+	if (_px_check_live()) {
+		return;
+	}
+
+	px_numa();
+}
+
+/**
+ * Samples the stacks of the target's threads
+ * profile [--hz N] [--seconds N] [--out file]
+ */
+static void _px_profile_handler(CMD_HANDLER_ARGS)
+{
+	if (_px_check_live()) {
+		return;
+	}
+
+	if (ENV(parent) != 0) {
+		px_error("Not available on snapshots, the child must not run");
+		return;
+	}
+
+	px_profile(params);
+}
+
+/**
+ * Samples the threads' states from procfs, without ptrace
+ * sample --noptrace [--pid N] [--hz N] [--seconds N]
+ */
+static void _px_sample_handler(CMD_HANDLER_ARGS)
+{
+	if (ENV(source)) {
+		px_error("Not available on core files");
+		return;
+	}
+
+	px_sample(params);
+}
+
+/**
+ * Counts and times the calls of a function with breakpoints
+ * trace <symbol | address> [--latency] [--interval N] [--seconds N]
+ */
+static void _px_trace_handler(CMD_HANDLER_ARGS)
+{
+	if (_px_check_live()) {
+		return;
+	}
+
+	if (ENV(parent) != 0) {
+		px_error("Not available on snapshots, the child must not run");
+		return;
+	}
+
+	px_calltrace(params);
+}
+
+/**
+ * track start operation handler
+ * track <start>
+ */
+static void _px_track_start_handler(CMD_HANDLER_ARGS)
+{
+	px_track_start();
+}
+
+/**
+ * track diff operation handler
+ * track diff [--dump file]
+ */
+static void _px_track_diff_handler(CMD_HANDLER_ARGS)
+{
+	px_track_diff(params);
+}
+
+/**
+ * Reports the pages written between two points in time
+ * track <start | diff>
+ */
+static void _px_track_handler(CMD_HANDLER_ARGS)
+{
+	static const px_command _commands[] = {
+		{PX_STRL("start"), _px_track_start_handler},
+		{PX_STRL("diff"),  _px_track_diff_handler },
+		{NULL, 0, NULL}
+	};
 
-	if (px_maps_find_region(addr) == 0) {
-		px_error("Address not found!");
+	if (_px_check_live()) {
+		return;
+	}
+
+	if (_px_find_cmd(_commands, (char*)params, 1) == 0) {
+		px_error("Command not found!");
+	}
+}
+
+/**
+ * cache stats operation handler
+ * cache <stats>
+ */
+static void _px_cache_stats_handler(CMD_HANDLER_ARGS)
+{
+	px_cache_show_stats();
+}
+
+/**
+ * cache flush operation handler
+ * cache <flush>
+ */
+static void _px_cache_flush_handler(CMD_HANDLER_ARGS)
+{
+	px_cache_invalidate();
+}
+
+/**
+ * cache size operation handler
+ * cache size <KiB> (0 disables the cache)
+ */
+static void _px_cache_size_handler(CMD_HANDLER_ARGS)
+{
+	if (params == NULL) {
+		px_error("Missing cache size");
+		return;
+	}
+
+	px_cache_set_budget(strtoul(params, NULL, 10) << 10);
+}
+
+/**
+ * cache operation handler
+ * cache <stats | flush | size>
+ */
+static void _px_cache_handler(CMD_HANDLER_ARGS)
+{
+	static const px_command _commands[] = {
+		{PX_STRL("stats"), _px_cache_stats_handler},
+		{PX_STRL("flush"), _px_cache_flush_handler},
+		{PX_STRL("size"),  _px_cache_size_handler },
+		{NULL, 0, NULL}
+	};
+
+	if (_px_find_cmd(_commands, (char*)params, 1) == 0) {
+		px_error("Command not found!");
 	}
 }
 
@@ -335,10 +764,28 @@ static const px_command commands[] = {
 	{PX_STRL("attach"), _px_attach_handler},
 	{PX_STRL("detach"), _px_detach_handler},
 	{PX_STRL("signal"), _px_signal_handler},
+	{PX_STRL("threads"), _px_threads_handler},
+	{PX_STRL("regs"),   _px_regs_handler  },
 	{PX_STRL("maps"),   _px_maps_handler  },
 	{PX_STRL("show"),   _px_show_handler  },
 	{PX_STRL("find"),   _px_find_handler  },
+	{PX_STRL("symbol"), _px_symbol_handler},
+	{PX_STRL("symbolize"), _px_symbolize_handler},
+	{PX_STRL("search"), _px_search_handler},
+	{PX_STRL("refs"),   _px_refs_handler  },
+	{PX_STRL("leaks"),  _px_leaks_handler },
+	{PX_STRL("strings"), _px_strings_handler},
+	{PX_STRL("gcore"),  _px_gcore_handler },
+	{PX_STRL("snapshot"), _px_snapshot_handler},
+	{PX_STRL("core"),   _px_core_handler  },
+	{PX_STRL("track"),  _px_track_handler },
+	{PX_STRL("residency"), _px_residency_handler},
+	{PX_STRL("numa"),   _px_numa_handler  },
+	{PX_STRL("profile"), _px_profile_handler},
+	{PX_STRL("sample"), _px_sample_handler },
+	{PX_STRL("trace"),  _px_trace_handler  },
 	{PX_STRL("dump"),   _px_dump_handler  },
+	{PX_STRL("cache"),  _px_cache_handler },
 	{NULL, 0, NULL}
 };
 
@@ -31,6 +31,9 @@
 #include <link.h>
 #include "maps.h"
 #include "elf.h"
+#include "sym.h"
+#include "trace.h"
+#include "source.h"
 
 /**
  * Command handler args
@@ -47,9 +50,17 @@
 
 typedef struct _px_env {
 	pid_t pid;            /* target process pid */
+	pid_t parent;         /* pid forked by snapshot --fork, 0 otherwise */
+	px_threads threads;   /* seized threads of the target */
+	const px_source *source; /* file read instead of pid (core), or NULL */
 	px_elf elf;
 	size_t nregions;      /* number of mapped regions */
+	size_t maps_size;     /* allocated entries in the region table */
+	uintptr_t *maps_start;/* sorted region start addresses */
 	px_maps *maps;        /* mapped regions from /proc/pid/maps */
+	px_strpool maps_names;/* region filenames */
+	px_sym_index symbols; /* address to symbol index */
+	unsigned jobs;        /* worker threads (--jobs), 0 for one per CPU */
 } px_env;
 
 typedef void (*px_command_handler)(CMD_HANDLER_ARGS);
@@ -0,0 +1,286 @@
+/**
+ * Copyright (c) 2012, Felipe Pena
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *   Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <elf.h>
+#include <link.h>
+#include "common.h"
+#include "cmd.h"
+#include "elffile.h"
+#include "cache.h"
+#include "core.h"
+
+/**
+ * PT_LOAD segment of the core, its bytes past filesz read as zeros
+ */
+typedef struct _px_core_load {
+	uintptr_t start;
+	uintptr_t end;
+	size_t filesz;
+	const unsigned char *data;
+	uint32_t flags;
+} px_core_load;
+
+static struct {
+	px_elf_file file;
+	px_core_load *loads;   /* sorted by start */
+	size_t nloads;
+	char path[PATH_MAX];
+} g_core;
+
+static int _px_core_load_cmp(const void *a, const void *b)
+{
+	const px_core_load *x = a, *y = b;
+
+	return x->start < y->start ? -1 : x->start > y->start;
+}
+
+/**
+ * Returns the segment containing addr, NULL when none
+ */
+static const px_core_load *_px_core_find(uintptr_t addr)
+{
+	size_t lo = 0, hi = g_core.nloads, half;
+
+	/* Last segment starting at or below addr */
+	while (hi > lo) {
+		half = (hi - lo) / 2;
+
+		if (g_core.loads[lo + half].start <= addr) {
+			lo += half + 1;
+		} else {
+			hi = lo + half;
+		}
+	}
+	return lo && addr < g_core.loads[lo - 1].end ? &g_core.loads[lo - 1] : NULL;
+}
+
+/**
+ * Unmaps the core file
+ */
+static void _px_core_close(void)
+{
+	px_elf_file_close(&g_core.file);
+	px_safe_free(g_core.loads);
+	memset(&g_core, 0, sizeof(g_core));
+
+	px_cache_invalidate();
+}
+
+/**
+ * Returns a pointer to the bytes of addr in the mapping, with the number
+ * of bytes available from there in len; NULL when addr is not in the
+ * file (outside every segment, or past its filesz)
+ */
+static const void *_px_core_ptr(uintptr_t addr, size_t *len)
+{
+	const px_core_load *load = _px_core_find(addr);
+
+	if (load == NULL || addr - load->start >= load->filesz) {
+		return NULL;
+	}
+	*len = load->filesz - (addr - load->start);
+
+	return load->data + (addr - load->start);
+}
+
+/**
+ * Copies target memory out of the core
+ * Same contract as ptrace_read_direct(): the bytes read up to the first
+ * address no segment covers, or -1 when there are none.
+ */
+static ssize_t _px_core_read(uintptr_t addr, void *vptr, size_t len)
+{
+	const px_core_load *load;
+	size_t done = 0, n, avail;
+
+	while (done < len && (load = _px_core_find(addr + done)) != NULL) {
+		n = load->end - (addr + done);
+		n = n < len - done ? n : len - done;
+		avail = addr + done - load->start < load->filesz
+			? load->filesz - (addr + done - load->start) : 0;
+
+		if (avail >= n) {
+			memcpy((char*) vptr + done, load->data + (addr + done - load->start), n);
+		} else {
+			/* Not dumped: holes and unreadable regions read as zeros */
+			memcpy((char*) vptr + done, load->data + (addr + done - load->start), avail);
+			memset((char*) vptr + done + avail, 0, n - avail);
+		}
+		done += n;
+	}
+	return done || len == 0 ? (ssize_t) done : -1;
+}
+
+/**
+ * Finds a note of the core by owner and type
+ */
+static const void *_px_core_note(const char *name, uint32_t type, size_t *len)
+{
+	return px_elf_file_note(&g_core.file, type, name, len);
+}
+
+/**
+ * Builds the region table from the core
+ * px cores carry the original maps text; other cores only have PT_LOAD
+ * segments, named after their NT_FILE entry when there is one.
+ */
+static ssize_t _px_core_maps(void)
+{
+	const uint64_t *files;
+	const char *text, *names, *end = NULL;
+	char *copy, line[PATH_MAX + 128], perms[5];
+	size_t len, i, k, nfiles = 0, page = 0;
+
+	px_maps_clear();
+
+	if ((text = _px_core_note(PX_NOTE_NAME, PX_NOTE_MAPS, &len)) != NULL) {
+		/* The note is not NUL-terminated */
+		if ((copy = malloc(len + 1)) == NULL) {
+			return -1;
+		}
+		memcpy(copy, text, len);
+		copy[len] = '\0';
+
+		for (text = copy; *text; ) {
+			px_maps_region(text);
+			text += strcspn(text, "\n");
+			text += *text == '\n';
+		}
+		free(copy);
+
+		return ENV(nregions);
+	}
+
+	if ((files = _px_core_note("CORE", NT_FILE, &len)) != NULL && len >= 16) {
+		nfiles = files[0];
+		page = files[1];
+
+		/* Bounded before multiplying, a bogus count must not wrap around */
+		if (nfiles > (len / sizeof(uint64_t) - 2) / 3) {
+			nfiles = 0;
+		}
+	}
+	if (files) {
+		names = (const char*) (files + 2 + 3 * nfiles);
+		end = (const char*) files + len;
+	} else {
+		names = NULL;
+	}
+
+	for (i = 0, k = 0; i < g_core.nloads; ++i) {
+		const px_core_load *load = &g_core.loads[i];
+		const char *name = "";
+
+		/* NT_FILE lists the file backed segments in address order */
+		while (k < nfiles && files[2 + 3 * k] < load->start) {
+			names += names < end ? strnlen(names, end - names) + 1 : 0;
+			++k;
+		}
+		perms[0] = load->flags & PF_R ? 'r' : '-';
+		perms[1] = load->flags & PF_W ? 'w' : '-';
+		perms[2] = load->flags & PF_X ? 'x' : '-';
+		perms[3] = 'p';
+		perms[4] = '\0';
+
+		if (k < nfiles && files[2 + 3 * k] == load->start && names < end
+			&& strnlen(names, end - names) < (size_t) (end - names)) {
+			name = names;
+		}
+		snprintf(line, sizeof(line), "%lx-%lx %s %lx 00:00 0 %s",
+			(unsigned long) load->start, (unsigned long) load->end, perms,
+			(unsigned long) (*name ? files[4 + 3 * k] * page : 0), name);
+		px_maps_region(line);
+	}
+	return ENV(nregions);
+}
+
+static const px_source g_core_source = {
+	g_core.path, _px_core_read, _px_core_ptr, _px_core_note, _px_core_maps,
+	_px_core_close
+};
+
+/**
+ * Maps a core file (from gcore, px snapshot or the kernel) and indexes
+ * its PT_LOAD segments
+ * Returns the source to install as ENV(source), NULL on failure.
+ */
+const px_source *px_core_open(const char *path)
+{
+	const px_elf_file *f = &g_core.file;
+	size_t i, nphdrs;
+
+	_px_core_close();
+
+	if (px_elf_file_open(&g_core.file, path) == -1 || f->phdrs == NULL
+		|| f->ehdr->e_type != ET_CORE) {
+		px_error("%s is not a core file", path);
+		_px_core_close();
+		return NULL;
+	}
+
+	/* More than 65534 headers: the count is in section 0 */
+	nphdrs = f->ehdr->e_phnum == PN_XNUM && f->shdrs ? f->shdrs[0].sh_info
+		: f->ehdr->e_phnum;
+
+	if (f->ehdr->e_phoff + nphdrs * sizeof(ElfW(Phdr)) > f->size
+		|| (g_core.loads = calloc(nphdrs, sizeof(*g_core.loads))) == NULL) {
+		px_error("Truncated core file");
+		_px_core_close();
+		return NULL;
+	}
+
+	for (i = 0; i < nphdrs; ++i) {
+		const ElfW(Phdr) *ph = &f->phdrs[i];
+		px_core_load *load = &g_core.loads[g_core.nloads];
+
+		if (ph->p_type != PT_LOAD || ph->p_memsz == 0) {
+			continue;
+		}
+		load->start = ph->p_vaddr;
+		load->end = ph->p_vaddr + ph->p_memsz;
+		load->flags = ph->p_flags;
+
+		/* A truncated core keeps what it has */
+		if (ph->p_offset < f->size) {
+			load->filesz = ph->p_filesz < f->size - ph->p_offset
+				? ph->p_filesz : f->size - ph->p_offset;
+			load->data = f->data + ph->p_offset;
+		}
+		++g_core.nloads;
+	}
+	qsort(g_core.loads, g_core.nloads, sizeof(*g_core.loads), _px_core_load_cmp);
+
+	snprintf(g_core.path, sizeof(g_core.path), "%s", path);
+
+	/* Everything read so far described something else */
+	px_cache_invalidate();
+
+	return &g_core_source;
+}
@@ -0,0 +1,143 @@
+/**
+ * Copyright (c) 2012, Felipe Pena
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *   Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+#include "counts.h"
+
+static inline uint64_t _px_counts_hash(const void *key, size_t len)
+{
+	const unsigned char *p = key;
+	uint64_t h = 14695981039346656037ULL;
+
+	while (len--) {
+		h = (h ^ *p++) * 1099511628211ULL;
+	}
+	return h;
+}
+
+static int _px_counts_grow(px_counts_table *table)
+{
+	size_t i, j, nslots = table->nslots ? table->nslots * 2 : 1024;
+	px_counts_entry *slots = calloc(nslots, sizeof(*slots));
+
+	if (slots == NULL) {
+		return -1;
+	}
+	for (i = 0; i < table->nslots; ++i) {
+		if (table->slots[i].key == NULL) {
+			continue;
+		}
+		for (j = table->slots[i].hash & (nslots - 1); slots[j].key;
+			j = (j + 1) & (nslots - 1));
+		slots[j] = table->slots[i];
+	}
+	px_safe_free(table->slots);
+	table->slots = slots;
+	table->nslots = nslots;
+
+	return 0;
+}
+
+/**
+ * Adds count to the entry of a key, copying the key when it is new
+ */
+int px_counts_add(px_counts_table *table, const void *key, size_t len,
+	uint64_t count)
+{
+	const uint64_t hash = _px_counts_hash(key, len);
+	px_counts_entry *e;
+	size_t i;
+
+	if ((table->n + 1) * 2 > table->nslots && _px_counts_grow(table) == -1) {
+		return -1;
+	}
+
+	for (i = hash & (table->nslots - 1); table->slots[i].key;
+		i = (i + 1) & (table->nslots - 1)) {
+		e = &table->slots[i];
+
+		if (e->hash == hash && e->len == len && memcmp(e->key, key, len) == 0) {
+			e->count += count;
+			return 0;
+		}
+	}
+
+	e = &table->slots[i];
+
+	/* Empty keys still need a non-NULL pointer to mark the slot used */
+	if ((e->key = malloc(len ? len : 1)) == NULL) {
+		return -1;
+	}
+	memcpy(e->key, key, len);
+	e->hash = hash;
+	e->len = len;
+	e->count = count;
+	++table->n;
+
+	return 0;
+}
+
+static int _px_counts_cmp(const void *a, const void *b)
+{
+	const px_counts_entry *ea = *(px_counts_entry * const *) a;
+	const px_counts_entry *eb = *(px_counts_entry * const *) b;
+
+	return ea->count < eb->count ? 1 : ea->count > eb->count ? -1 : 0;
+}
+
+/**
+ * Returns the table->n entries, highest count first, in a malloc'd array
+ */
+px_counts_entry **px_counts_sorted(const px_counts_table *table)
+{
+	px_counts_entry **order;
+	size_t i, n = 0;
+
+	if ((order = malloc(sizeof(*order) * (table->n + 1))) == NULL) {
+		return NULL;
+	}
+	for (i = 0; i < table->nslots; ++i) {
+		if (table->slots[i].key) {
+			order[n++] = &table->slots[i];
+		}
+	}
+	qsort(order, n, sizeof(*order), _px_counts_cmp);
+
+	return order;
+}
+
+void px_counts_free(px_counts_table *table)
+{
+	size_t i;
+
+	for (i = 0; i < table->nslots; ++i) {
+		px_safe_free(table->slots[i].key);
+	}
+	px_safe_free(table->slots);
+	memset(table, 0, sizeof(*table));
+}
@@ -35,181 +35,634 @@
 #include "common.h"
 #include "cmd.h"
 #include "elf.h"
+#include "elffile.h"
 #include "ptrace.h"
+#include "proc.h"
+
+#define ELF_ST_TYPE _ElfW(ELF, __ELF_NATIVE_CLASS, ST_TYPE)
 
 /**
- * Resolves the link_map tables
+ * Number of dynamic entries fetched per remote read
+ */
+#define PX_DYN_BLOCK 32
+
+/**
+ * Reads a whole dynamic section up to (not including) DT_NULL
+ * Returns a malloc'd table and stores the number of entries in n
  */
-static int _px_elf_resolv_tables(struct link_map *map)
+static ElfW(Dyn) *_px_elf_read_dynamic(uintptr_t addr, size_t *n)
 {
-	ElfW(Dyn) dyn;
-	uintptr_t addr = (uintptr_t) map->l_ld;
-	ElfW(Word) nchains;
+	ElfW(Dyn) *dyn = NULL, *tmp;
+	size_t i, size = 0;
+
+	*n = 0;
 
 	do {
-		ptrace_read(addr, &dyn, sizeof(dyn));
+		if ((tmp = realloc(dyn, sizeof(*dyn) * (size + PX_DYN_BLOCK))) == NULL) {
+			px_error("Failed to realloc!");
+			break;
+		}
+		dyn = tmp;
 
-		if (dyn.d_tag == 0) {
+		if (ptrace_read(addr + size * sizeof(*dyn), dyn + size,
+				sizeof(*dyn) * PX_DYN_BLOCK) <= 0) {
 			break;
 		}
+		for (i = size; i < size + PX_DYN_BLOCK && dyn[i].d_tag != DT_NULL; ++i);
+
+		*n = i;
+		size += PX_DYN_BLOCK;
+	} while (i == size);
+
+	return dyn;
+}
 
-		switch (dyn.d_tag) {
+/**
+ * Relocates a d_ptr value
+ * The dynamic linker relocates most entries in place, but not all of
+ * them (e.g. the vDSO), so anything below the load address is relative.
+ */
+static inline uintptr_t _px_elf_reloc(const px_elf_object *obj, uintptr_t ptr)
+{
+	return ptr < obj->base ? ptr + obj->base : ptr;
+}
+
+/**
+ * Resolves the link_map tables
+ */
+static void _px_elf_resolv_tables(px_elf_object *obj)
+{
+	ElfW(Dyn) *dyn;
+	size_t i, n;
+
+	dyn = _px_elf_read_dynamic(obj->dynamic, &n);
+
+	for (i = 0; i < n; ++i) {
+		switch (dyn[i].d_tag) {
 			case DT_HASH:
-				ptrace_read(dyn.d_un.d_ptr + map->l_addr,
-					&nchains, sizeof(nchains));
+				obj->hash = _px_elf_reloc(obj, dyn[i].d_un.d_ptr);
+				break;
+			case DT_GNU_HASH:
+				obj->gnu_hash = _px_elf_reloc(obj, dyn[i].d_un.d_ptr);
 				break;
 			case DT_STRTAB:
-				ELF(strtab) = dyn.d_un.d_ptr;
-				printf("Strtab found at %#" PRIxPTR "\n", ELF(strtab));
+				obj->strtab = _px_elf_reloc(obj, dyn[i].d_un.d_ptr);
+				break;
+			case DT_STRSZ:
+				obj->strsz = dyn[i].d_un.d_val;
 				break;
 			case DT_SYMTAB:
-				ELF(symtab) = dyn.d_un.d_ptr;
-				printf("Symtab found at %#" PRIxPTR "\n", ELF(symtab));
+				obj->symtab = _px_elf_reloc(obj, dyn[i].d_un.d_ptr);
 				break;
 		}
+	}
+
+	px_safe_free(dyn);
+}
+
+/**
+ * Loads the description of the object at a link_map entry
+ */
+static int _px_elf_load_object(uintptr_t addr, px_elf_object *obj)
+{
+	struct link_map map;
+
+	memset(obj, 0, sizeof(*obj));
+
+	if (ptrace_read(addr, &map, sizeof(map)) != sizeof(map)) {
+		return -1;
+	}
+
+	obj->map = addr;
+	obj->next = (uintptr_t) map.l_next;
+	obj->base = map.l_addr;
+	obj->dynamic = (uintptr_t) map.l_ld;
 
-		addr += sizeof(dyn);
-	} while (1);
+	ptrace_read((uintptr_t) map.l_name, obj->name, sizeof(obj->name));
 
-	return nchains;
+	if (obj->dynamic) {
+		_px_elf_resolv_tables(obj);
+	}
+	return 0;
 }
 
-#define ELF_ST_TYPE _ElfW(ELF, __ELF_NATIVE_CLASS, ST_TYPE)
+/**
+ * Walks the link_map chain, calling fn for every loaded object
+ * The walk stops early when fn returns non-zero, that value is returned
+ */
+int px_elf_foreach_object(px_elf_object_fn fn, void *arg)
+{
+	px_elf_object obj;
+	uintptr_t addr;
+	int ret;
+
+	for (addr = ELF(map); addr; addr = obj.next) {
+		if (_px_elf_load_object(addr, &obj) == -1) {
+			break;
+		}
+		if ((ret = fn(&obj, arg)) != 0) {
+			return ret;
+		}
+	}
+	return 0;
+}
 
 /**
- * Finds a symbol in the tables
+ * Hash functions used by DT_HASH and DT_GNU_HASH
  */
-int px_elf_find_symbol(const char *name)
+static uint32_t _px_elf_sysv_hash(const char *name)
 {
-	struct link_map map;
-	ElfW(Sym) sym;
-	char str[128], libname[PATH_MAX];
-	int i = 0, nchains;
+	const unsigned char *s = (const unsigned char*) name;
+	uint32_t h = 0, g;
+
+	while (*s) {
+		h = (h << 4) + *s++;
+		g = h & 0xf0000000;
+		h ^= g >> 24;
+		h &= ~g;
+	}
+	return h;
+}
 
-	ptrace_read(ELF(map), &map, sizeof(map));
+static uint32_t _px_elf_gnu_hash(const char *name)
+{
+	const unsigned char *s = (const unsigned char*) name;
+	uint32_t h = 5381;
 
-	do {
-		ptrace_read((uintptr_t)map.l_next, &map, sizeof(map));
-		ptrace_read((uintptr_t)map.l_name, libname, sizeof(libname));
+	while (*s) {
+		h = h * 33 + *s++;
+	}
+	return h;
+}
+
+/**
+ * Checks a symbol against the name we are looking for
+ * Only defined symbols match, and only by their exact name.
+ */
+static int _px_elf_sym_match(const px_elf_object *obj, const ElfW(Sym) *sym,
+	const char *name, size_t len)
+{
+	char str[PX_SYM_NAME_LEN];
+
+	if (sym->st_shndx == SHN_UNDEF || sym->st_name == 0
+		|| len + 1 > sizeof(str)) {
+		return 0;
+	}
+
+	if (ptrace_read(obj->strtab + sym->st_name, str, len + 1) <= 0) {
+		return 0;
+	}
+	return memcmp(str, name, len + 1) == 0;
+}
 
-		nchains = _px_elf_resolv_tables(&map);
+/**
+ * Symbols whose chain entries are fetched per read when walking a bucket
+ */
+#define PX_CHAIN_BLOCK 8
 
-		printf("Library %s (chains=%d)\n", libname, nchains);
-		i = 0;
+/**
+ * Looks up a symbol through DT_GNU_HASH
+ * The bloom filter rejects most misses with a single read. The chain walk
+ * ends at its terminator, bounded by the symbol table: the linker puts
+ * .dynstr right after .dynsym, otherwise only the end of the mapping is.
+ */
+static int _px_elf_gnu_lookup(const px_elf_object *obj, const char *name,
+	ElfW(Sym) *found)
+{
+	const uint32_t h = _px_elf_gnu_hash(name);
+	const size_t bits = sizeof(ElfW(Addr)) * 8, len = strlen(name);
+	uint32_t header[4], bucket, chain[PX_CHAIN_BLOCK];
+	uintptr_t buckets, chains;
+	ElfW(Addr) bloom;
+	ElfW(Sym) syms[PX_CHAIN_BLOCK];
+	px_read_req reqs[2];
+	size_t i, nsyms;
+
+	/* nbuckets, symoffset, bloom_size, bloom_shift */
+	if (ptrace_read(obj->gnu_hash, header, sizeof(header)) != sizeof(header)
+		|| header[0] == 0 || header[2] == 0) {
+		return 0;
+	}
 
-		while (i < nchains) {
-			ptrace_read(ELF(symtab) + (i * sizeof(ElfW(Sym))), &sym, sizeof(sym));
+	ptrace_read(obj->gnu_hash + sizeof(header)
+		+ ((h / bits) & (header[2] - 1)) * sizeof(bloom), &bloom, sizeof(bloom));
 
-			++i;
+	if (!((bloom >> (h % bits)) & (bloom >> ((h >> header[3]) % bits)) & 1)) {
+		return 0;
+	}
 
-			if (ELF_ST_TYPE(sym.st_info) != STT_FUNC) {
-				continue;
-			}
+	buckets = obj->gnu_hash + sizeof(header) + header[2] * sizeof(bloom);
+	chains = buckets + header[0] * sizeof(bucket);
 
-			ptrace_read(ELF(strtab) + sym.st_name, str, sizeof(str));
+	ptrace_read(buckets + (h % header[0]) * sizeof(bucket), &bucket, sizeof(bucket));
 
-			printf("%d [%s]\n", ELF_ST_TYPE(sym.st_info), str);
+	nsyms = obj->strtab > obj->symtab
+		? (obj->strtab - obj->symtab) / sizeof(*syms) : SIZE_MAX;
 
-			if (memcmp(str, name, strlen(name)) == 0) {
+	if (bucket < header[1] || bucket >= nsyms) {
+		return 0;
+	}
+
+	/* Walk the chain a block at a time, it ends at an odd hash value */
+	for (; bucket < nsyms; bucket += PX_CHAIN_BLOCK) {
+		reqs[0].addr = chains + (bucket - header[1]) * sizeof(*chain);
+		reqs[0].len = sizeof(chain);
+		reqs[0].buf = chain;
+		reqs[1].addr = obj->symtab + bucket * sizeof(*syms);
+		reqs[1].len = sizeof(syms);
+		reqs[1].buf = syms;
+
+		if (ptrace_readv(reqs, 2) == -1) {
+			return 0;
+		}
+
+		/* A corrupt table must not walk past the last symbol */
+		for (i = 0; i < PX_CHAIN_BLOCK && bucket + i < nsyms; ++i) {
+			if ((chain[i] | 1) == (h | 1)
+				&& _px_elf_sym_match(obj, &syms[i], name, len)) {
+				*found = syms[i];
 				return 1;
 			}
+			if (chain[i] & 1) {
+				return 0;
+			}
+		}
+	}
+	return 0;
+}
+
+/**
+ * Looks up a symbol through DT_HASH
+ */
+static int _px_elf_sysv_lookup(const px_elf_object *obj, const char *name,
+	ElfW(Sym) *found)
+{
+	const size_t len = strlen(name);
+	ElfW(Word) header[2], i, n, next;
+	uintptr_t chains;
+	px_read_req reqs[2];
+	ElfW(Sym) sym;
+
+	/* nbucket, nchain */
+	if (ptrace_read(obj->hash, header, sizeof(header)) != sizeof(header)
+		|| header[0] == 0) {
+		return 0;
+	}
+
+	chains = obj->hash + sizeof(header) + header[0] * sizeof(i);
+
+	ptrace_read(obj->hash + sizeof(header)
+		+ (_px_elf_sysv_hash(name) % header[0]) * sizeof(i), &i, sizeof(i));
+
+	/* A cyclic chain is cut after as many steps as there are symbols */
+	for (n = 0; i != STN_UNDEF && i < header[1] && n < header[1];
+			i = next, ++n) {
+		reqs[0].addr = obj->symtab + i * sizeof(sym);
+		reqs[0].len = sizeof(sym);
+		reqs[0].buf = &sym;
+		reqs[1].addr = chains + i * sizeof(next);
+		reqs[1].len = sizeof(next);
+		reqs[1].buf = &next;
+
+		if (ptrace_readv(reqs, 2) == -1) {
+			return 0;
 		}
-	} while (map.l_next);
 
+		if (_px_elf_sym_match(obj, &sym, name, len)) {
+			*found = sym;
+			return 1;
+		}
+	}
 	return 0;
 }
 
+/**
+ * Looks up a symbol in a single object
+ * Returns the symbol address or 0, its type (STT_*) is stored in type if
+ * given
+ */
+uintptr_t px_elf_object_lookup(const px_elf_object *obj, const char *name,
+	int *type)
+{
+	ElfW(Sym) sym;
+	int found = 0;
+
+	if (obj->symtab == 0 || obj->strtab == 0) {
+		return 0;
+	}
+
+	if (obj->gnu_hash) {
+		found = _px_elf_gnu_lookup(obj, name, &sym);
+	} else if (obj->hash) {
+		found = _px_elf_sysv_lookup(obj, name, &sym);
+	}
+
+	if (!found) {
+		return 0;
+	}
+	if (type) {
+		*type = ELF_ST_TYPE(sym.st_info);
+	}
+	return obj->base + sym.st_value;
+}
+
+/**
+ * Counts the symbols of an object
+ * DT_HASH has it in nchain, with DT_GNU_HASH the end of the table is the
+ * end of the last chain of the highest bucket.
+ */
+size_t px_elf_object_nsyms(const px_elf_object *obj)
+{
+	uint32_t header[4], *buckets, chain[PX_CHAIN_BLOCK], last = 0;
+	uintptr_t chains;
+	size_t i;
+
+	if (obj->hash) {
+		return ptrace_read(obj->hash, header, 2 * sizeof(*header)) > 0
+			? header[1] : 0;
+	}
+
+	if (obj->gnu_hash == 0
+		|| ptrace_read(obj->gnu_hash, header, sizeof(header)) != sizeof(header)
+		|| header[0] == 0) {
+		return 0;
+	}
+
+	if ((buckets = malloc(sizeof(*buckets) * header[0])) == NULL) {
+		px_error("Failed to alloc!");
+		return 0;
+	}
+
+	ptrace_read(obj->gnu_hash + sizeof(header)
+		+ header[2] * sizeof(ElfW(Addr)), buckets, sizeof(*buckets) * header[0]);
+
+	chains = obj->gnu_hash + sizeof(header) + header[2] * sizeof(ElfW(Addr))
+		+ header[0] * sizeof(*buckets);
+
+	for (i = 0; i < header[0]; ++i) {
+		last = buckets[i] > last ? buckets[i] : last;
+	}
+	free(buckets);
+
+	if (last < header[1]) {
+		return header[1];
+	}
+
+	for (;; last += PX_CHAIN_BLOCK) {
+		if (ptrace_read(chains + (last - header[1]) * sizeof(*chain),
+				chain, sizeof(chain)) <= 0) {
+			return last;
+		}
+		for (i = 0; i < PX_CHAIN_BLOCK; ++i) {
+			if (chain[i] & 1) {
+				return last + i + 1;
+			}
+		}
+	}
+}
+
+/**
+ * px_elf_foreach_object() callback for px_elf_lookup_symbol()
+ */
+static int _px_elf_lookup_cb(px_elf_object *obj, void *arg)
+{
+	struct { const char *name; uintptr_t addr; px_elf_object *obj; int *type; } *ctx = arg;
+
+	if ((ctx->addr = px_elf_object_lookup(obj, ctx->name, ctx->type)) == 0) {
+		return 0;
+	}
+	if (ctx->obj) {
+		*ctx->obj = *obj;
+	}
+	return 1;
+}
+
+/**
+ * Looks up a symbol by name in every loaded object
+ * Returns its address or 0, the owning object is stored in obj and the
+ * symbol type (STT_*) in type if given
+ */
+uintptr_t px_elf_lookup_symbol(const char *name, px_elf_object *obj,
+	int *type)
+{
+	struct { const char *name; uintptr_t addr; px_elf_object *obj; int *type; } ctx;
+
+	ctx.name = name;
+	ctx.addr = 0;
+	ctx.obj = obj;
+	ctx.type = type;
+
+	px_elf_foreach_object(_px_elf_lookup_cb, &ctx);
+
+	return ctx.addr;
+}
+
+/**
+ * Finds a symbol in the tables
+ */
+int px_elf_find_symbol(const char *name)
+{
+	px_elf_object obj;
+	uintptr_t addr;
+
+	if (ELF(map) == 0) {
+		px_error("No link_map, run maps first");
+		return 0;
+	}
+
+	if ((addr = px_elf_lookup_symbol(name, &obj, NULL)) == 0) {
+		return 0;
+	}
+
+	printf("%s found at %#" PRIxPTR " (%s)\n", name, addr,
+		obj.name[0] ? obj.name : "main program");
+
+	return 1;
+}
+
+/**
+ * Reads the whole program header table of the target
+ * Returns a malloc'd table, the number of entries is header->e_phnum
+ */
+static ElfW(Phdr) *_px_elf_read_phdrs(ElfW(Ehdr) *header)
+{
+	ElfW(Phdr) *phdrs;
+
+	ptrace_read(ELF(header), header, sizeof(*header));
+
+	if ((phdrs = malloc(sizeof(*phdrs) * header->e_phnum)) == NULL) {
+		px_error("Failed to alloc!");
+		return NULL;
+	}
+
+	ptrace_read(ELF(header) + header->e_phoff, phdrs,
+		sizeof(*phdrs) * header->e_phnum);
+
+	return phdrs;
+}
+
+/**
+ * Reads the whole section header table of the target
+ * Returns a malloc'd table, the number of entries is header->e_shnum
+ */
+static ElfW(Shdr) *_px_elf_read_shdrs(ElfW(Ehdr) *header)
+{
+	ElfW(Shdr) *shdrs;
+
+	ptrace_read(ELF(header), header, sizeof(*header));
+
+	if ((shdrs = malloc(sizeof(*shdrs) * header->e_shnum)) == NULL) {
+		px_error("Failed to alloc!");
+		return NULL;
+	}
+
+	ptrace_read(ELF(header) + header->e_shoff, shdrs,
+		sizeof(*shdrs) * header->e_shnum);
+
+	return shdrs;
+}
+
 /**
  * Reads the ELF data from the target process
  */
 void px_elf_maps(void)
 {
 	ElfW(Ehdr) header;
-	ElfW(Phdr) phdr;
-	ElfW(Dyn) dyn;
-	uintptr_t addr;
-	int i = 0;
+	ElfW(Phdr) *phdrs;
+	ElfW(Dyn) *dyn;
+	struct r_debug debug;
+	uintptr_t addr = 0, dynamic = 0;
+	size_t i, n;
 
-	ptrace_read(ELF(header), &header, sizeof(header));
+	if ((phdrs = _px_elf_read_phdrs(&header)) == NULL) {
+		return;
+	}
 
 	printf("Program header at %#" PRIxPTR "\n", ELF(header) + header.e_phoff);
 
-	/* Locate the PT_DYNAMIC program header */
-	do {
-		ptrace_read(ELF(header) + header.e_phoff + i, &phdr, sizeof(phdr));
-		i += sizeof(phdr);
-	} while (phdr.p_type != PT_DYNAMIC);
+	/* Position independent executables are loaded at a bias */
+	ELF(bias) = header.e_type == ET_DYN ? ELF(header) : 0;
+
+	for (i = 0; i < header.e_phnum; ++i) {
+		switch (phdrs[i].p_type) {
+			case PT_PHDR:
+				ELF(bias) = ELF(header) + header.e_phoff - phdrs[i].p_vaddr;
+				break;
+			case PT_DYNAMIC:
+				dynamic = phdrs[i].p_vaddr;
+				break;
+		}
+	}
+	free(phdrs);
 
-	addr = phdr.p_vaddr;
+	if (dynamic == 0) {
+		px_error("No PT_DYNAMIC segment (static binary?)");
+		return;
+	}
 
-	/* Locate the GOT address */
-	do {
-		ptrace_read(addr += sizeof(dyn), &dyn, sizeof(dyn));
+	dyn = _px_elf_read_dynamic(ELF(bias) + dynamic, &n);
 
-		if (dyn.d_tag == DT_PLTGOT) {
-			ELF(got) = dyn.d_un.d_ptr;
-			break;
+	/* Locate the GOT and the r_debug addresses */
+	for (i = 0; i < n; ++i) {
+		switch (dyn[i].d_tag) {
+			case DT_PLTGOT:
+				ELF(got) = dyn[i].d_un.d_ptr;
+				if (ELF(got) < ELF(bias)) {
+					ELF(got) += ELF(bias);
+				}
+				break;
+			case DT_DEBUG:
+				addr = dyn[i].d_un.d_ptr;
+				break;
 		}
-	} while (1);
+	}
+	px_safe_free(dyn);
 
 	printf("GOT address at %#" PRIxPTR "\n", ELF(got));
 
-	/* Read the link_map address from the second GOT entry */
-	ptrace_read(ELF(got) + sizeof(void*), &addr, sizeof(void*));
+	if (addr && ptrace_read(addr, &debug, sizeof(debug)) == sizeof(debug)
+		&& debug.r_map) {
+		/* The dynamic linker publishes the link_map chain in r_debug */
+		addr = (uintptr_t) debug.r_map;
+	} else if (ELF(got)) {
+		/* Read the link_map address from the second GOT entry */
+		ptrace_read(ELF(got) + sizeof(void*), &addr, sizeof(void*));
+	}
 
 	/* Sets the link_map address */
 	ELF(map) = addr;
 
-	px_elf_find_symbol("foo");
+	if (ELF(map) == 0) {
+		px_error("link_map not found");
+		return;
+	}
 }
 
 /**
  * Displays the ELF sections
+ * Section headers are rarely mapped at runtime, so they are read from
+ * the file backing the program, and from the target only as a fallback.
  */
 void px_elf_show_sections(void)
 {
 	ElfW(Ehdr) header;
-	ElfW(Shdr) section;
+	ElfW(Shdr) *remote = NULL;
+	const ElfW(Shdr) *sections, *section;
+	px_elf_file file;
 	const char *name;
-	uintptr_t sections;
-	int i;
+	size_t i, n;
+
+	if (px_elf_file_open_addr(&file, ELF(header)) == 0 && file.shdrs) {
+		sections = file.shdrs;
+		n = file.shnum;
+	} else {
+		if ((remote = _px_elf_read_shdrs(&header)) == NULL) {
+			px_elf_file_close(&file);
+			return;
+		}
+		sections = remote;
+		n = header.e_shnum;
+	}
 
-	ptrace_read(ELF(header), &header, sizeof(header));
-
-	/* Section table offset */
-	sections = ELF(header) + header.e_shoff;
-
-	printf("Nr  | Type     | Flags | VAddr\n");
-
-	for (i = 0; i < header.e_shnum; ++i) {
-		ptrace_read(sections + (i * sizeof(section)), &section, sizeof(section));
-
-		switch (section.sh_type) {
-			case SHT_SYMTAB:   name = "SYMTAB";   break;
-			case SHT_STRTAB:   name = "STRTAB";   break;
-			case SHT_HASH:     name = "HASH";     break;
-			case SHT_DYNAMIC:  name = "DYNAMIC";  break;
-			case SHT_NOTE:     name = "NOTE";     break;
-			case SHT_NULL:     name = "NULL";     break;
-			case SHT_PROGBITS: name = "PROGBITS"; break;
-			case SHT_NOBITS:   name = "NOBITS";   break;
-			case SHT_REL:      name = "REL";      break;
-			case SHT_SHLIB:    name = "SHLIB";    break;
-			case SHT_DYNSYM:   name = "DYNSYM";   break;
-			case SHT_LOPROC:   name = "LOPROC";   break;
-			case SHT_HIPROC:   name = "HIPROC";   break;
-			case SHT_LOUSER:   name = "LOUSER";   break;
-			case SHT_HIUSER:   name = "HIUSER";   break;
-			default:           name = "UNKNOWN";  break;
+	printf("Nr  | Name                 | Type     | Flags | VAddr\n");
+
+	for (i = 0; i < n; ++i) {
+		section = &sections[i];
+
+		switch (section->sh_type) {
+			case SHT_SYMTAB:     name = "SYMTAB";   break;
+			case SHT_STRTAB:     name = "STRTAB";   break;
+			case SHT_HASH:       name = "HASH";     break;
+			case SHT_GNU_HASH:   name = "GNU_HASH"; break;
+			case SHT_DYNAMIC:    name = "DYNAMIC";  break;
+			case SHT_NOTE:       name = "NOTE";     break;
+			case SHT_NULL:       name = "NULL";     break;
+			case SHT_PROGBITS:   name = "PROGBITS"; break;
+			case SHT_NOBITS:     name = "NOBITS";   break;
+			case SHT_REL:        name = "REL";      break;
+			case SHT_RELA:       name = "RELA";     break;
+			case SHT_SHLIB:      name = "SHLIB";    break;
+			case SHT_DYNSYM:     name = "DYNSYM";   break;
+			case SHT_INIT_ARRAY: name = "INIT_ARR"; break;
+			case SHT_FINI_ARRAY: name = "FINI_ARR"; break;
+			case SHT_LOPROC:     name = "LOPROC";   break;
+			case SHT_HIPROC:     name = "HIPROC";   break;
+			case SHT_LOUSER:     name = "LOUSER";   break;
+			case SHT_HIUSER:     name = "HIUSER";   break;
+			default:             name = "UNKNOWN";  break;
 		}
-		printf(" %-2d | %-8s | %c%c%c   | %#" PRIxPTR "\n", i, name,
-			section.sh_flags & SHF_ALLOC     ? 'A' : '-',
-			section.sh_flags & SHF_WRITE     ? 'W' : '-',
-			section.sh_flags & SHF_EXECINSTR ? 'X' : '-',
-			section.sh_addr);
+		printf(" %-2zu | %-20.20s | %-8s | %c%c%c   | %#" PRIxPTR "\n", i,
+			px_elf_file_section_name(&file, section), name,
+			section->sh_flags & SHF_ALLOC     ? 'A' : '-',
+			section->sh_flags & SHF_WRITE     ? 'W' : '-',
+			section->sh_flags & SHF_EXECINSTR ? 'X' : '-',
+			section->sh_addr);
 	}
 
-	printf("Number of sections: %d\n", header.e_shnum);
+	printf("Number of sections: %zu\n", n);
+
+	px_elf_file_close(&file);
+	px_safe_free(remote);
 }
 
 /**
@@ -218,20 +671,18 @@ void px_elf_show_sections(void)
 void px_elf_show_segments(void)
 {
 	ElfW(Ehdr) header;
-	ElfW(Phdr) pheader;
-	uintptr_t pheaders;
+	ElfW(Phdr) *pheaders, pheader;
 	const char *name;
 	int i;
 
-	ptrace_read(ELF(header), &header, sizeof(header));
-
-	/* Program header table offset */
-	pheaders = ELF(header) + header.e_phoff;
+	if ((pheaders = _px_elf_read_phdrs(&header)) == NULL) {
+		return;
+	}
 
 	printf("Type     | Size     | Flags | Vaddr\n");
 
 	for (i = 0; i < header.e_phnum; ++i) {
-		ptrace_read(pheaders + (i * sizeof(pheader)), &pheader, sizeof(pheader));
+		pheader = pheaders[i];
 
 		switch (pheader.p_type) {
 			case PT_NULL:    name = "NULL";    break;
@@ -246,12 +697,15 @@ void px_elf_show_segments(void)
 			default:         name = "UNKNOWN"; break;
 		}
 
-		printf("%-8s | %-8u | %c%c%c   | %#" PRIxPTR "\n", name, pheader.p_filesz,
+		printf("%-8s | %-8lu | %c%c%c   | %#" PRIxPTR "\n", name,
+			(unsigned long) pheader.p_filesz,
 			pheader.p_flags & PF_X ? 'X' : '-',
 			pheader.p_flags & PF_W ? 'W' : '-',
 			pheader.p_flags & PF_R ? 'R' : '-',
 			pheader.p_vaddr);
 	}
+
+	free(pheaders);
 }
 
 /**
@@ -260,34 +714,44 @@ void px_elf_show_segments(void)
 void px_elf_dump_segment(px_elf_dump type)
 {
 	ElfW(Ehdr) header;
-	ElfW(Shdr) section;
-	uintptr_t sections, offset = 0;
+	ElfW(Shdr) *sections, section;
+	const ElfW(Shdr) *shdr;
+	px_elf_file file;
+	uintptr_t offset = 0;
 	int i, j, data;
-	size_t size = 0;
-
-	ptrace_read(ELF(header), &header, sizeof(header));
-
-	/* Section header table offset */
-	sections = ELF(header) + header.e_shoff;
-
-	for (i = 0; i < header.e_shnum; ++i) {
-		ptrace_read(sections + (i * sizeof(section)), &section, sizeof(section));
-
-		switch (type) {
-			case PX_DUMP_TEXT:
-				if (section.sh_addr == header.e_entry) {
-					offset = header.e_entry;
-					size = section.sh_size;
-				}
-				break;
-			case PX_DUMP_DATA:
-			default:
+	size_t size = 0, chunk;
+	char buf[65536];
+
+	/* Find the section in the file, the addresses are relative to the bias */
+	if (px_elf_file_open_addr(&file, ELF(header)) == 0
+		&& (shdr = px_elf_file_section(&file,
+			type == PX_DUMP_TEXT ? ".text" : ".data")) != NULL) {
+		offset = ELF(bias) + shdr->sh_addr;
+		size = shdr->sh_size;
+	}
+	px_elf_file_close(&file);
+
+	if (offset == 0 && (sections = _px_elf_read_shdrs(&header)) != NULL) {
+		for (i = 0; i < header.e_shnum; ++i) {
+			section = sections[i];
+
+			switch (type) {
+				case PX_DUMP_TEXT:
+					if (section.sh_addr == header.e_entry) {
+						offset = header.e_entry;
+						size = section.sh_size;
+					}
+					break;
+				case PX_DUMP_DATA:
+				default:
+					break;
+			}
+			/* Stop looping if we found what are looking for */
+			if (offset) {
 				break;
+			}
 		}
-		/* Stop looping if we found what are looking for */
-		if (offset) {
-			break;
-		}
+		free(sections);
 	}
 
 	if (offset == 0) {
@@ -297,33 +761,64 @@ void px_elf_dump_segment(px_elf_dump type)
 
 	/* Dumping the bytes in 4 columns (objdump-like) without hexdump */
 	for (i = j = 0; i < size; i += sizeof(data)) {
-		ptrace_read(offset + i, &data, sizeof(data));
+		if (i % sizeof(buf) == 0) {
+			chunk = size - i < sizeof(buf) ? size - i : sizeof(buf);
+
+			if (ptrace_read(offset + i, buf, chunk) < (ssize_t)chunk) {
+				px_error("Failed to read %zu bytes at %#" PRIxPTR " (%m)",
+					chunk, offset + i);
+				break;
+			}
+		}
+		memcpy(&data, buf + (i % sizeof(buf)), sizeof(data));
 		printf("%08x%s", data, ++j % 4 ? " " : "\n");
 	}
 
 	printf("\n");
 }
 
+/**
+ * Returns the target's auxiliary vector, to be freed by the caller
+ */
+void *px_elf_auxv(size_t *len)
+{
+	char filename[PATH_MAX];
+	const void *note;
+	void *copy;
+
+	if (ENV(source)) {
+		if ((note = ENV(source)->note("CORE", NT_AUXV, len)) == NULL
+			|| (copy = malloc(*len)) == NULL) {
+			return NULL;
+		}
+		return memcpy(copy, note, *len);
+	}
+
+	snprintf(filename, PATH_MAX, "/proc/%d/auxv", ENV(pid));
+
+	return px_proc_read(filename, len);
+}
+
 /**
  * Displays the ELF auxiliar vector
  */
 void px_elf_show_auxv(void)
 {
 	enum {AUXV_HEX, AUXV_INT, AUXV_STR} type;
-	ElfW(auxv_t) auxv;
+	ElfW(auxv_t) auxv, *vec;
 	const char *name;
-	char filename[PATH_MAX];
-	int fd;
+	size_t i, len;
 
-	snprintf(filename, PATH_MAX, "/proc/%d/auxv", ENV(pid));
-
-	if ((fd = open(filename, O_RDONLY)) == -1) {
-		px_error("open fail (%m)");
+	if ((vec = px_elf_auxv(&len)) == NULL) {
+		px_error("Failed to read the auxiliary vector");
+		return;
 	}
 
 #define CASE(_name, _type) case _name: name = #_name; type = _type; break
 
-	while (read(fd, &auxv, sizeof(auxv)) > 0) {
+	for (i = 0; i < len / sizeof(auxv); ++i) {
+		auxv = vec[i];
+
 		switch (auxv.a_type) {
 			CASE(AT_HWCAP,  AUXV_HEX);
 			CASE(AT_PAGESZ, AUXV_INT);
@@ -365,6 +860,7 @@ void px_elf_show_auxv(void)
 				break;
 		}
 	}
+	free(vec);
 }
 
 /**
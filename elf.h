@@ -27,17 +27,42 @@
 #ifndef PX_ELF
 #define PX_ELF
 
+#include <stdint.h>
+#include <limits.h>
+
 /**
  * ELF information
  */
 typedef struct _px_elf {
 	uintptr_t header; /* base address */
+	uintptr_t bias;   /* load bias (PIE) */
 	uintptr_t got;    /* GOT address */
-	uintptr_t strtab; /* strtab address */
-	uintptr_t symtab; /* symtab address */
 	uintptr_t map;    /* link_map address */
 } px_elf;
 
+/**
+ * Length of the symbol names read from the target
+ */
+#define PX_SYM_NAME_LEN 128
+
+/**
+ * A loaded object (link_map entry) and its dynamic symbol tables
+ */
+typedef struct _px_elf_object {
+	uintptr_t map;      /* link_map entry */
+	uintptr_t next;     /* next link_map entry */
+	uintptr_t base;     /* load address (l_addr) */
+	uintptr_t dynamic;  /* dynamic section (l_ld) */
+	uintptr_t strtab;   /* DT_STRTAB */
+	size_t strsz;       /* DT_STRSZ */
+	uintptr_t symtab;   /* DT_SYMTAB */
+	uintptr_t hash;     /* DT_HASH */
+	uintptr_t gnu_hash; /* DT_GNU_HASH */
+	char name[PATH_MAX];
+} px_elf_object;
+
+typedef int (*px_elf_object_fn)(px_elf_object*, void*);
+
 /**
  * Helper macro to access ELF information in the g_env global var
  */
@@ -53,10 +78,15 @@ typedef enum {
 
 void px_elf_maps(void);
 int px_elf_find_symbol(const char*);
+uintptr_t px_elf_lookup_symbol(const char*, px_elf_object*, int*);
+int px_elf_foreach_object(px_elf_object_fn, void*);
+uintptr_t px_elf_object_lookup(const px_elf_object*, const char*, int*);
+size_t px_elf_object_nsyms(const px_elf_object*);
 void px_elf_clear(void);
 void px_elf_show_sections(void);
 void px_elf_show_segments(void);
 void px_elf_dump_segment(px_elf_dump);
+void *px_elf_auxv(size_t*);
 void px_elf_show_auxv(void);
 
 #endif /* PX_ELF */
@@ -0,0 +1,288 @@
+/**
+ * Copyright (c) 2012, Felipe Pena
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *   Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <elf.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "common.h"
+#include "cmd.h"
+#include "elffile.h"
+
+/**
+ * Checks that [off, off + len) lies within the mapping
+ */
+static inline int _px_elf_file_bounds(const px_elf_file *f, size_t off, size_t len)
+{
+	return off <= f->size && len <= f->size - off;
+}
+
+/**
+ * Maps an opened ELF file and validates its headers
+ */
+static int _px_elf_file_map(px_elf_file *f, int fd)
+{
+	const ElfW(Ehdr) *ehdr;
+	struct stat st;
+	void *data;
+
+	memset(f, 0, sizeof(*f));
+
+	if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(*ehdr)) {
+		return -1;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	if (data == MAP_FAILED) {
+		return -1;
+	}
+
+	f->data = data;
+	f->size = st.st_size;
+	f->ehdr = ehdr = data;
+
+	if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0
+		|| ehdr->e_ident[EI_CLASS] != PX_ELFCLASS) {
+		px_elf_file_close(f);
+		return -1;
+	}
+
+	if (ehdr->e_phnum && _px_elf_file_bounds(f, ehdr->e_phoff,
+			(size_t)ehdr->e_phnum * sizeof(ElfW(Phdr)))) {
+		f->phdrs = (const ElfW(Phdr)*) (f->data + ehdr->e_phoff);
+	}
+
+	if (ehdr->e_shnum && _px_elf_file_bounds(f, ehdr->e_shoff,
+			(size_t)ehdr->e_shnum * sizeof(ElfW(Shdr)))) {
+		f->shdrs = (const ElfW(Shdr)*) (f->data + ehdr->e_shoff);
+		f->shnum = ehdr->e_shnum;
+
+		if (ehdr->e_shstrndx < f->shnum && f->shdrs[ehdr->e_shstrndx].sh_type
+			!= SHT_NOBITS && _px_elf_file_bounds(f,
+				f->shdrs[ehdr->e_shstrndx].sh_offset,
+				f->shdrs[ehdr->e_shstrndx].sh_size)) {
+			f->shstrtab = (const char*) (f->data
+				+ f->shdrs[ehdr->e_shstrndx].sh_offset);
+			f->shstrsz = f->shdrs[ehdr->e_shstrndx].sh_size;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Maps an ELF file by path
+ */
+int px_elf_file_open(px_elf_file *f, const char *path)
+{
+	int fd, ret;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+		memset(f, 0, sizeof(*f));
+		return -1;
+	}
+
+	ret = _px_elf_file_map(f, fd);
+	close(fd);
+
+	return ret;
+}
+
+/**
+ * Maps the file backing the region that contains addr
+ * The path recorded in the region is tried first, then the region's entry
+ * in /proc/<pid>/map_files, which also works for deleted files.
+ */
+int px_elf_file_open_addr(px_elf_file *f, uintptr_t addr)
+{
+	char fname[PATH_MAX];
+	const char *name;
+	ssize_t i;
+
+	memset(f, 0, sizeof(*f));
+
+	if ((i = px_maps_lookup(addr)) == -1) {
+		return -1;
+	}
+
+	name = PX_MAPS_NAME(i);
+
+	if (name[0] != '/') {
+		/* Anonymous or special ([vdso], [heap]...) */
+		return -1;
+	}
+
+	if (strstr(name, " (deleted)") == NULL && px_elf_file_open(f, name) == 0) {
+		return 0;
+	}
+
+	/* A core's pid is not a live process here */
+	if (ENV(source)) {
+		return -1;
+	}
+
+	snprintf(fname, sizeof(fname), "/proc/%d/map_files/%" PRIxPTR "-%" PRIxPTR,
+		ENV(pid), PX_MAPS_START(i), ENV(maps)[i].end);
+
+	return px_elf_file_open(f, fname);
+}
+
+/**
+ * Unmaps an ELF file
+ */
+void px_elf_file_close(px_elf_file *f)
+{
+	if (f->data) {
+		munmap((void*) f->data, f->size);
+	}
+	memset(f, 0, sizeof(*f));
+}
+
+/**
+ * Returns the name of a section
+ */
+const char *px_elf_file_section_name(const px_elf_file *f, const ElfW(Shdr) *shdr)
+{
+	if (f->shstrtab == NULL || shdr->sh_name >= f->shstrsz) {
+		return "";
+	}
+	return f->shstrtab + shdr->sh_name;
+}
+
+/**
+ * Finds a section by name
+ */
+const ElfW(Shdr) *px_elf_file_section(const px_elf_file *f, const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < f->shnum; ++i) {
+		if (strcmp(px_elf_file_section_name(f, &f->shdrs[i]), name) == 0) {
+			return &f->shdrs[i];
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Finds the first section of a type
+ */
+const ElfW(Shdr) *px_elf_file_section_type(const px_elf_file *f, uint32_t type)
+{
+	size_t i;
+
+	for (i = 0; i < f->shnum; ++i) {
+		if (f->shdrs[i].sh_type == type) {
+			return &f->shdrs[i];
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Returns the contents of a section, NULL if it has none in the file
+ */
+const void *px_elf_file_section_data(const px_elf_file *f, const ElfW(Shdr) *shdr)
+{
+	if (shdr == NULL || shdr->sh_type == SHT_NOBITS
+		|| !_px_elf_file_bounds(f, shdr->sh_offset, shdr->sh_size)) {
+		return NULL;
+	}
+	return f->data + shdr->sh_offset;
+}
+
+/**
+ * Walks a note area looking for a note by type and owner name
+ */
+static const void *_px_elf_file_find_note(const unsigned char *p, size_t len,
+	size_t align, uint32_t type, const char *name, size_t *desc_len)
+{
+	const size_t name_len = strlen(name) + 1;
+	const ElfW(Nhdr) *nhdr;
+	size_t off = 0, namesz, descsz;
+
+	align = align < 4 ? 4 : align;
+
+	while (off + sizeof(*nhdr) <= len) {
+		nhdr = (const ElfW(Nhdr)*) (p + off);
+		off += sizeof(*nhdr);
+
+		namesz = (nhdr->n_namesz + align - 1) & ~(align - 1);
+		descsz = (nhdr->n_descsz + align - 1) & ~(align - 1);
+
+		if (namesz > len - off || nhdr->n_descsz > len - off - namesz) {
+			break;
+		}
+		if (nhdr->n_type == type && nhdr->n_namesz == name_len
+			&& memcmp(p + off, name, name_len) == 0) {
+			*desc_len = nhdr->n_descsz;
+			return p + off + namesz;
+		}
+		off += namesz + descsz;
+	}
+	return NULL;
+}
+
+/**
+ * Finds a note by type and owner name in the PT_NOTE segments (or the
+ * SHT_NOTE sections when there are no program headers)
+ * Returns a pointer to its descriptor and stores its length in len
+ */
+const void *px_elf_file_note(const px_elf_file *f, uint32_t type,
+	const char *name, size_t *len)
+{
+	const void *desc;
+	size_t i;
+
+	for (i = 0; f->phdrs && i < f->ehdr->e_phnum; ++i) {
+		if (f->phdrs[i].p_type != PT_NOTE
+			|| !_px_elf_file_bounds(f, f->phdrs[i].p_offset, f->phdrs[i].p_filesz)) {
+			continue;
+		}
+		if ((desc = _px_elf_file_find_note(f->data + f->phdrs[i].p_offset,
+				f->phdrs[i].p_filesz, f->phdrs[i].p_align, type, name, len))) {
+			return desc;
+		}
+	}
+
+	for (i = 0; f->phdrs == NULL && i < f->shnum; ++i) {
+		if (f->shdrs[i].sh_type != SHT_NOTE
+			|| px_elf_file_section_data(f, &f->shdrs[i]) == NULL) {
+			continue;
+		}
+		if ((desc = _px_elf_file_find_note(f->data + f->shdrs[i].sh_offset,
+				f->shdrs[i].sh_size, f->shdrs[i].sh_addralign, type, name, len))) {
+			return desc;
+		}
+	}
+	return NULL;
+}
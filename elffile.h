@@ -0,0 +1,79 @@
+/**
+ * Copyright (c) 2012, Felipe Pena
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *   Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PX_ELFFILE
+#define PX_ELFFILE
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <link.h>
+
+/**
+ * ELF class and machine px itself (and so its targets) is built for
+ */
+#if __ELF_NATIVE_CLASS == 64
+# define PX_ELFCLASS ELFCLASS64
+#else
+# define PX_ELFCLASS ELFCLASS32
+#endif
+
+#if defined(__x86_64__)
+# define PX_ELF_MACHINE EM_X86_64
+#elif defined(__i386__)
+# define PX_ELF_MACHINE EM_386
+#elif defined(__aarch64__)
+# define PX_ELF_MACHINE EM_AARCH64
+#elif defined(__arm__)
+# define PX_ELF_MACHINE EM_ARM
+#else
+# define PX_ELF_MACHINE EM_NONE
+#endif
+
+/**
+ * An ELF file mapped read-only from disk
+ * Every pointer points into the mapping, nothing is copied.
+ */
+typedef struct _px_elf_file {
+	const unsigned char *data;
+	size_t size;
+	const ElfW(Ehdr) *ehdr;
+	const ElfW(Phdr) *phdrs;   /* NULL if out of bounds */
+	const ElfW(Shdr) *shdrs;   /* NULL if stripped of section headers */
+	size_t shnum;
+	const char *shstrtab;
+	size_t shstrsz;
+} px_elf_file;
+
+int px_elf_file_open(px_elf_file*, const char*);
+int px_elf_file_open_addr(px_elf_file*, uintptr_t);
+void px_elf_file_close(px_elf_file*);
+const ElfW(Shdr) *px_elf_file_section(const px_elf_file*, const char*);
+const ElfW(Shdr) *px_elf_file_section_type(const px_elf_file*, uint32_t);
+const char *px_elf_file_section_name(const px_elf_file*, const ElfW(Shdr)*);
+const void *px_elf_file_section_data(const px_elf_file*, const ElfW(Shdr)*);
+const void *px_elf_file_note(const px_elf_file*, uint32_t, const char*, size_t*);
+
+#endif /* PX_ELFFILE */
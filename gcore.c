@@ -0,0 +1,540 @@
+/**
+ * Copyright (c) 2012, Felipe Pena
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *   Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <time.h>
+#include <elf.h>
+#include <link.h>
+#include <sys/ptrace.h>
+#include <sys/procfs.h>
+#include <sys/uio.h>
+#include "common.h"
+#include "cmd.h"
+#include "elf.h"
+#include "elffile.h"
+#include "ptrace.h"
+#include "pagemap.h"
+#include "pool.h"
+#include "proc.h"
+#include "core.h"
+#include "gcore.h"
+
+/**
+ * Segments are copied in windows of this size, one buffer per worker
+ */
+#define PX_GCORE_WINDOW (4 << 20)
+
+/**
+ * Growable buffer the notes are assembled in
+ */
+typedef struct _px_gcore_notes {
+	unsigned char *data;
+	size_t len;
+	size_t size;
+} px_gcore_notes;
+
+typedef struct _px_gcore_run {
+	int fd;
+	const px_pagemap_item *items; /* windows of the dumped regions */
+	const ElfW(Phdr) *phdrs; /* where each region goes in the file */
+	unsigned char **bufs;    /* one window per worker */
+	size_t page;
+	size_t written;          /* counters, updated atomically */
+	size_t skipped;
+	size_t unreadable;
+	int failed;
+} px_gcore_run;
+
+static int _px_gcore_note(px_gcore_notes *notes, const char *name,
+	uint32_t type, const void *desc, size_t len)
+{
+	const size_t namesz = strlen(name) + 1, name_len = (namesz + 3) & ~3UL;
+	const size_t need = sizeof(ElfW(Nhdr)) + name_len + ((len + 3) & ~3UL);
+	ElfW(Nhdr) nhdr;
+	unsigned char *data;
+
+	if (notes->len + need > notes->size) {
+		notes->size = (notes->len + need) * 2;
+
+		if ((data = realloc(notes->data, notes->size)) == NULL) {
+			return -1;
+		}
+		notes->data = data;
+	}
+
+	nhdr.n_namesz = namesz;
+	nhdr.n_descsz = len;
+	nhdr.n_type = type;
+
+	memset(notes->data + notes->len, 0, need);
+	memcpy(notes->data + notes->len, &nhdr, sizeof(nhdr));
+	memcpy(notes->data + notes->len + sizeof(nhdr), name, namesz);
+	memcpy(notes->data + notes->len + sizeof(nhdr) + name_len, desc, len);
+	notes->len += need;
+
+	return 0;
+}
+
+/**
+ * Checks whether a region's contents go in the core
+ * Unreadable regions and the kernel's [vvar]/[vsyscall] pages only get
+ * a zero-sized PT_LOAD.
+ */
+static inline int _px_gcore_dumped(size_t i)
+{
+	const char *name = PX_MAPS_NAME(i);
+
+	return ENV(maps)[i].perms[0] == 'r' && strncmp(name, "[vvar", 5) != 0
+		&& strcmp(name, "[vsyscall]") != 0;
+}
+
+/**
+ * px_pagemap_items() filter for the regions with bytes in the file
+ */
+static int _px_gcore_wanted(size_t i, void *arg)
+{
+	return _px_gcore_dumped(i);
+}
+
+/**
+ * Checks whether a region is anonymous memory, whose pages that were never
+ * touched read as zeros
+ */
+static inline int _px_gcore_anonymous(size_t i)
+{
+	const char *name = PX_MAPS_NAME(i);
+
+	return *name == '\0' || strcmp(name, "[heap]") == 0
+		|| strncmp(name, "[stack", 6) == 0;
+}
+
+/**
+ * Adds the NT_PRSTATUS and NT_PRFPREG notes of a thread
+ * Returns 1 when its registers could be read, which needs a ptrace-stop.
+ */
+static int _px_gcore_thread(px_gcore_notes *notes, pid_t tid,
+	const struct elf_prpsinfo *psinfo, int *ret)
+{
+	struct elf_prstatus status;
+	elf_fpregset_t fpregs;
+	struct iovec iov;
+
+	memset(&status, 0, sizeof(status));
+	status.pr_pid = tid;
+	status.pr_ppid = psinfo->pr_ppid;
+	status.pr_pgrp = psinfo->pr_pgrp;
+	status.pr_sid = psinfo->pr_sid;
+
+	iov.iov_base = &status.pr_reg;
+	iov.iov_len = sizeof(status.pr_reg);
+
+	if (ptrace(PTRACE_GETREGSET, tid, NT_PRSTATUS, &iov) == -1) {
+		return 0;
+	}
+	*ret |= _px_gcore_note(notes, "CORE", NT_PRSTATUS, &status, sizeof(status));
+
+	iov.iov_base = &fpregs;
+	iov.iov_len = sizeof(fpregs);
+
+	if (ptrace(PTRACE_GETREGSET, tid, NT_PRFPREG, &iov) == 0) {
+		*ret |= _px_gcore_note(notes, "CORE", NT_PRFPREG, &fpregs, iov.iov_len);
+	}
+	return 1;
+}
+
+/**
+ * Fills the notes: NT_PRPSINFO, the thread notes, NT_AUXV, NT_FILE and
+ * the px maps note
+ */
+static int _px_gcore_build_notes(px_gcore_notes *notes, size_t page)
+{
+	struct elf_prpsinfo psinfo;
+	char fname[PATH_MAX], *buf, *p;
+	const char *s;
+	DIR *dir;
+	struct dirent *ent;
+	pid_t tid, ppid = 0;
+	size_t len, i, nfiles = 0, nthreads, nregs, names = 0;
+	uint64_t *files;
+	void *auxv;
+	int ret = 0;
+
+	/* /proc/<pid>/stat: pid (comm) state ppid pgrp session */
+	memset(&psinfo, 0, sizeof(psinfo));
+	snprintf(fname, sizeof(fname), "/proc/%d/stat", ENV(pid));
+
+	if ((buf = px_proc_read(fname, &len)) != NULL) {
+		if ((p = strrchr(buf, ')')) != NULL && p[1] == ' ') {
+			s = p + 2;
+			psinfo.pr_sname = *s;
+			s += 2;
+			ppid = px_proc_dec(&s);
+		}
+		free(buf);
+	}
+	psinfo.pr_state = psinfo.pr_sname == 'R' ? 0 : 1;
+	psinfo.pr_pid = ENV(pid);
+	psinfo.pr_ppid = ppid;
+	psinfo.pr_pgrp = getpgid(ENV(pid));
+	psinfo.pr_sid = getsid(ENV(pid));
+
+	snprintf(fname, sizeof(fname), "/proc/%d/comm", ENV(pid));
+
+	if ((buf = px_proc_read(fname, &len)) != NULL) {
+		strncpy(psinfo.pr_fname, buf, sizeof(psinfo.pr_fname) - 1);
+		psinfo.pr_fname[strcspn(psinfo.pr_fname, "\n")] = '\0';
+		free(buf);
+	}
+
+	snprintf(fname, sizeof(fname), "/proc/%d/cmdline", ENV(pid));
+
+	if ((buf = px_proc_read(fname, &len)) != NULL) {
+		len = len < sizeof(psinfo.pr_psargs) - 1 ? len : sizeof(psinfo.pr_psargs) - 1;
+
+		for (i = 0; i < len; ++i) {
+			psinfo.pr_psargs[i] = buf[i] ? buf[i] : ' ';
+		}
+		while (i && psinfo.pr_psargs[i - 1] == ' ') {
+			psinfo.pr_psargs[--i] = '\0';
+		}
+		free(buf);
+	}
+	ret |= _px_gcore_note(notes, "CORE", NT_PRPSINFO, &psinfo, sizeof(psinfo));
+
+	/* The attached thread first, debuggers take it as the current one */
+	nregs = _px_gcore_thread(notes, ENV(pid), &psinfo, &ret);
+	nthreads = 1;
+
+	snprintf(fname, sizeof(fname), "/proc/%d/task", ENV(pid));
+
+	if ((dir = opendir(fname)) != NULL) {
+		while ((ent = readdir(dir)) != NULL) {
+			if (ent->d_name[0] == '.' || (tid = atoi(ent->d_name)) == ENV(pid)) {
+				continue;
+			}
+			nregs += _px_gcore_thread(notes, tid, &psinfo, &ret);
+			++nthreads;
+		}
+		closedir(dir);
+	}
+
+	if (nregs < nthreads) {
+		printf("[!] Registers of %zu of %zu threads saved, only stopped threads "
+			"can be read\n", nregs, nthreads);
+	}
+
+	if ((auxv = px_elf_auxv(&len)) != NULL) {
+		ret |= _px_gcore_note(notes, "CORE", NT_AUXV, auxv, len);
+		free(auxv);
+	}
+
+	/* NT_FILE: count, page size, (start, end, offset in pages)[], names */
+	for (i = 0; i < ENV(nregions); ++i) {
+		if (PX_MAPS_NAME(i)[0] == '/') {
+			++nfiles;
+			names += strlen(PX_MAPS_NAME(i)) + 1;
+		}
+	}
+	len = (2 + 3 * nfiles) * sizeof(uint64_t) + names;
+
+	if ((files = malloc(len)) == NULL) {
+		return -1;
+	}
+	files[0] = nfiles;
+	files[1] = page;
+	p = (char*) (files + 2 + 3 * nfiles);
+
+	for (i = 0, nfiles = 0; i < ENV(nregions); ++i) {
+		if (PX_MAPS_NAME(i)[0] != '/') {
+			continue;
+		}
+		files[2 + 3 * nfiles] = PX_MAPS_START(i);
+		files[3 + 3 * nfiles] = ENV(maps)[i].end;
+		files[4 + 3 * nfiles] = ENV(maps)[i].offset / page;
+		p = stpcpy(p, PX_MAPS_NAME(i)) + 1;
+		++nfiles;
+	}
+	ret |= _px_gcore_note(notes, "CORE", NT_FILE, files, len);
+	free(files);
+
+	/* Lets px load the regions back with their names */
+	snprintf(fname, sizeof(fname), "/proc/%d/maps", ENV(pid));
+
+	if ((buf = px_proc_read(fname, &len)) != NULL) {
+		ret |= _px_gcore_note(notes, PX_NOTE_NAME, PX_NOTE_MAPS, buf, len);
+		free(buf);
+	}
+
+	return ret;
+}
+
+static inline int _px_gcore_zero_page(const unsigned char *p, size_t page)
+{
+	const uint64_t *w = (const uint64_t*) p;
+	uint64_t acc = 0;
+	size_t i;
+
+	for (i = 0; i < page / sizeof(uint64_t); ++i) {
+		acc |= w[i];
+	}
+	return acc == 0;
+}
+
+/**
+ * Copies the populated pages of a window to the file
+ * Pages never touched in anonymous memory are not read at all, pages that
+ * read as zeros are not written, both stay holes in the file.
+ */
+static void _px_gcore_window(size_t n, unsigned worker, const uint64_t *pm,
+	ssize_t have, void *arg)
+{
+	px_gcore_run *run = arg;
+	const px_pagemap_item *item = &run->items[n];
+	const ElfW(Phdr) *ph = &run->phdrs[item->region + 1];
+	const off_t offset = ph->p_offset + (item->addr - ph->p_vaddr);
+	const size_t page = run->page, npages = item->npages;
+	unsigned char *buf = run->bufs[worker];
+	size_t i, j, k, skipped = 0, written = 0, unreadable = 0;
+	ssize_t got;
+
+	/* File pages not in memory still read back as the file */
+	if (!_px_gcore_anonymous(item->region)) {
+		have = -1;
+	}
+
+	for (i = 0; i < npages; i = j) {
+		/* Run of pages to read */
+		if (have > (ssize_t) i && !(pm[i] & (PX_PM_PRESENT | PX_PM_SWAPPED))) {
+			++skipped;
+			j = i + 1;
+			continue;
+		}
+		for (j = i + 1; j < npages && !(have > (ssize_t) j
+			&& !(pm[j] & (PX_PM_PRESENT | PX_PM_SWAPPED))); ++j);
+
+		got = ptrace_read_direct(item->addr + i * page, buf, (j - i) * page);
+
+		if (got < (ssize_t) ((j - i) * page)) {
+			unreadable += (j - i) * page - (got > 0 ? got : 0);
+			got = got > 0 ? got - got % page : 0;
+		}
+
+		/* Write the non-zero pages, run by run */
+		for (k = 0; k < (size_t) got / page; ) {
+			size_t first = k;
+
+			while (k < (size_t) got / page && !_px_gcore_zero_page(buf + k * page, page)) {
+				++k;
+			}
+			if (k > first) {
+				if (pwrite(run->fd, buf + first * page, (k - first) * page,
+						offset + (i + first) * page) != (ssize_t) ((k - first) * page)) {
+					run->failed = errno ? errno : EIO;
+				}
+				written += k - first;
+			}
+			for (; k < (size_t) got / page && _px_gcore_zero_page(buf + k * page, page); ++k) {
+				++skipped;
+			}
+		}
+	}
+
+	__atomic_fetch_add(&run->written, written * page, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&run->skipped, skipped * page, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&run->unreadable, unreadable, __ATOMIC_RELAXED);
+}
+
+/**
+ * Writes an ELF core file of the attached process
+ * gcore <file>
+ * The file is laid out up front (headers, notes, then one page aligned
+ * PT_LOAD per region), so the windows of the segments are copied by the
+ * worker threads straight to their final offsets with pwrite(). Memory use
+ * is one window per worker whatever the size of the target.
+ */
+void px_gcore(const char *file)
+{
+	const size_t page = getpagesize();
+	const unsigned jobs = ptrace_read_shared() ? px_pool_jobs() : 1;
+	px_gcore_notes notes = { NULL, 0, 0 };
+	px_gcore_run run;
+	px_pagemap_item *items = NULL;
+	ElfW(Ehdr) ehdr;
+	ElfW(Phdr) *phdrs = NULL;
+	ElfW(Shdr) shdr;
+	struct timespec t0, t1;
+	size_t i, nphdrs = ENV(nregions) + 1;
+	ssize_t n;
+	off_t offset;
+	unsigned w;
+	int pagemap;
+
+	if (ENV(nregions) == 0) {
+		px_error("No regions, run maps first");
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	memset(&run, 0, sizeof(run));
+	run.page = page;
+
+	if (_px_gcore_build_notes(&notes, page) == -1
+		|| (phdrs = calloc(nphdrs, sizeof(*phdrs))) == NULL) {
+		px_error("Failed to alloc!");
+		goto out;
+	}
+
+	memset(&ehdr, 0, sizeof(ehdr));
+	memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+	ehdr.e_ident[EI_CLASS] = PX_ELFCLASS;
+	ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+	ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+	ehdr.e_ident[EI_OSABI] = ELFOSABI_NONE;
+	ehdr.e_type = ET_CORE;
+	ehdr.e_machine = PX_ELF_MACHINE;
+	ehdr.e_version = EV_CURRENT;
+	ehdr.e_phoff = sizeof(ehdr);
+	ehdr.e_ehsize = sizeof(ehdr);
+	ehdr.e_phentsize = sizeof(ElfW(Phdr));
+	ehdr.e_phnum = nphdrs < PN_XNUM ? nphdrs : PN_XNUM;
+
+	offset = sizeof(ehdr) + nphdrs * sizeof(ElfW(Phdr));
+
+	/* Past 65534 headers the real count goes in section 0's sh_info */
+	memset(&shdr, 0, sizeof(shdr));
+
+	if (nphdrs >= PN_XNUM) {
+		shdr.sh_info = nphdrs;
+		ehdr.e_shoff = offset;
+		ehdr.e_shentsize = sizeof(shdr);
+		ehdr.e_shnum = 1;
+		offset += sizeof(shdr);
+	}
+
+	phdrs[0].p_type = PT_NOTE;
+	phdrs[0].p_offset = offset;
+	phdrs[0].p_filesz = notes.len;
+	phdrs[0].p_align = 4;
+
+	offset = (offset + notes.len + page - 1) & ~(off_t) (page - 1);
+
+	for (i = 0; i < ENV(nregions); ++i) {
+		ElfW(Phdr) *ph = &phdrs[i + 1];
+		const px_maps *region = &ENV(maps)[i];
+
+		ph->p_type = PT_LOAD;
+		ph->p_vaddr = PX_MAPS_START(i);
+		ph->p_memsz = region->end - PX_MAPS_START(i);
+		ph->p_flags = (region->perms[0] == 'r' ? PF_R : 0)
+			| (region->perms[1] == 'w' ? PF_W : 0)
+			| (region->perms[2] == 'x' ? PF_X : 0);
+		ph->p_align = page;
+		ph->p_offset = offset;
+		ph->p_filesz = _px_gcore_dumped(i) ? ph->p_memsz : 0;
+
+		offset += ph->p_filesz;
+	}
+
+	if ((n = px_pagemap_items(PX_GCORE_WINDOW / page, _px_gcore_wanted, NULL,
+			&items)) == -1) {
+		goto out;
+	}
+
+	if ((run.fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) == -1) {
+		px_error("Failed to open %s (%s)", file, strerror(errno));
+		goto out;
+	}
+
+	if (pwrite(run.fd, &ehdr, sizeof(ehdr), 0) != sizeof(ehdr)
+		|| pwrite(run.fd, phdrs, nphdrs * sizeof(*phdrs), sizeof(ehdr))
+			!= (ssize_t) (nphdrs * sizeof(*phdrs))
+		|| pwrite(run.fd, notes.data, notes.len, phdrs[0].p_offset)
+			!= (ssize_t) notes.len
+		|| (ehdr.e_shnum && pwrite(run.fd, &shdr, sizeof(shdr), ehdr.e_shoff)
+			!= sizeof(shdr))) {
+		run.failed = errno;
+	}
+
+	run.items = items;
+	run.phdrs = phdrs;
+	/* Without it every page is read */
+	pagemap = px_pagemap_open();
+
+	if ((run.bufs = calloc(jobs, sizeof(*run.bufs))) == NULL) {
+		px_error("Failed to alloc!");
+		goto close;
+	}
+	for (w = 0; w < jobs; ++w) {
+		if ((run.bufs[w] = malloc(PX_GCORE_WINDOW)) == NULL) {
+			px_error("Failed to alloc!");
+			goto close;
+		}
+	}
+
+	if (px_pagemap_scan(pagemap, items, n, PX_GCORE_WINDOW / page, jobs,
+			_px_gcore_window, &run) == -1) {
+		goto close;
+	}
+
+	/* Trailing holes still count in the file size */
+	if (ftruncate(run.fd, offset) == -1 && !run.failed) {
+		run.failed = errno;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	if (run.failed) {
+		px_error("Failed to write %s (%s)", file, strerror(run.failed));
+	} else {
+		printf("[+] %zu segments, %zu KiB written, %zu KiB left as holes, "
+			"%zu KiB unreadable in %.3fs\n", ENV(nregions), run.written >> 10,
+			run.skipped >> 10, run.unreadable >> 10,
+			(t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+	}
+close:
+	if (pagemap != -1) {
+		close(pagemap);
+	}
+	close(run.fd);
+out:
+	if (run.bufs) {
+		for (w = 0; w < jobs; ++w) {
+			px_safe_free(run.bufs[w]);
+		}
+	}
+	px_safe_free(run.bufs);
+	px_safe_free(items);
+	px_safe_free(phdrs);
+	px_safe_free(notes.data);
+}
@@ -0,0 +1,471 @@
+/**
+ * Copyright (c) 2012, Felipe Pena
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *   Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <elf.h>
+#include <sys/ptrace.h>
+#include <sys/uio.h>
+#include <sys/procfs.h>
+#include "common.h"
+#include "cmd.h"
+#include "ptrace.h"
+#include "scan.h"
+#include "leaks.h"
+
+/**
+ * glibc chunks are aligned to 16 bytes and start with prev_size and size
+ * words; the low bits of size are flags, PREV_INUSE telling whether the
+ * previous chunk is allocated.
+ */
+#define PX_LEAKS_GRANULE 16
+#define PX_LEAKS_HEADER  (2 * sizeof(uint64_t))
+#define PX_LEAKS_MIN     32
+#define PX_LEAKS_PREV_INUSE 1
+#define PX_LEAKS_FLAGS   7
+
+/**
+ * Heap walk and chunk reads go in pieces of this size
+ */
+#define PX_LEAKS_WINDOW (4 << 20)
+
+/**
+ * Size classes reported: 32, 64, ... up to 2^PX_LEAKS_CLASSES + 4 bytes
+ */
+#define PX_LEAKS_CLASSES 28
+#define PX_LEAKS_SAMPLES 4
+
+#define PX_BIT_TEST(map, i) ((map)[(i) >> 6] & (1ULL << ((i) & 63)))
+#define PX_BIT_SET(map, i)  ((map)[(i) >> 6] |= 1ULL << ((i) & 63))
+
+/**
+ * A growable stack of granule numbers
+ */
+typedef struct _px_leaks_stack {
+	size_t *items;
+	size_t n;
+	size_t size;
+} px_leaks_stack;
+
+/**
+ * Mark state, one bit per 16-byte granule of the heap in each bitmap
+ * (3 bits per 16 bytes, about 2.3% of the heap size)
+ */
+typedef struct _px_leaks_state {
+	uintptr_t lo;           /* heap start */
+	size_t span;            /* bytes of heap covered by the walk */
+	size_t ngranules;
+	uint64_t *starts;       /* chunk starts */
+	uint64_t *inuse;        /* allocated chunks */
+	uint64_t *marked;       /* reached chunks */
+	px_leaks_stack *stacks; /* worklist of each root scan worker */
+	size_t nchunks;
+	size_t roots;           /* words seen while scanning the roots */
+	int failed;             /* a worklist could not grow */
+} px_leaks_state;
+
+/**
+ * Pushes a granule, returns -1 when the stack cannot grow
+ */
+static int _px_leaks_push(px_leaks_stack *stack, size_t g)
+{
+	const size_t size = stack->size ? stack->size * 2 : 4096;
+	size_t *items;
+
+	if (stack->n == stack->size) {
+		if ((items = realloc(stack->items, sizeof(*items) * size)) == NULL) {
+			return -1;
+		}
+		stack->items = items;
+		stack->size = size;
+	}
+	stack->items[stack->n++] = g;
+
+	return 0;
+}
+
+/**
+ * Returns the granule of the chunk containing granule g, -1 when none
+ */
+static ssize_t _px_leaks_chunk_of(const px_leaks_state *l, size_t g)
+{
+	size_t w = g >> 6;
+	uint64_t bits = l->starts[w] & (~0ULL >> (63 - (g & 63)));
+
+	while (bits == 0) {
+		if (w == 0) {
+			return -1;
+		}
+		bits = l->starts[--w];
+	}
+	return (w << 6) + 63 - __builtin_clzll(bits);
+}
+
+/**
+ * Returns the granule following the chunk starting at g
+ */
+static size_t _px_leaks_chunk_end(const px_leaks_state *l, size_t g)
+{
+	size_t w = ++g >> 6;
+	uint64_t bits;
+
+	if (g >= l->ngranules) {
+		return l->ngranules;
+	}
+	bits = l->starts[w] & (~0ULL << (g & 63));
+
+	while (bits == 0) {
+		if (++w >= (l->ngranules + 63) >> 6) {
+			return l->ngranules;
+		}
+		bits = l->starts[w];
+	}
+	return (w << 6) + __builtin_ctzll(bits);
+}
+
+/**
+ * Marks the allocated chunk a word points into, queueing it for scanning
+ * The mark bit is set atomically since the roots are scanned in parallel.
+ * Returns -1 when the chunk could not be queued: it is marked but its
+ * contents would never be scanned.
+ */
+static inline int _px_leaks_mark(px_leaks_state *l, px_leaks_stack *stack,
+	uint64_t word)
+{
+	ssize_t g;
+
+	if (word - l->lo >= l->span
+		|| (g = _px_leaks_chunk_of(l, (word - l->lo) / PX_LEAKS_GRANULE)) == -1
+		|| !PX_BIT_TEST(l->inuse, g)) {
+		return 0;
+	}
+	if (__atomic_fetch_or(&l->marked[g >> 6], 1ULL << (g & 63),
+			__ATOMIC_RELAXED) & (1ULL << (g & 63))) {
+		return 0;
+	}
+	return _px_leaks_push(stack, g);
+}
+
+/**
+ * Walks the chunk headers of the heap, filling the start and in-use maps
+ * A chunk is allocated when the next one has PREV_INUSE set; the last
+ * chunk is the top chunk and is never reported. Returns the number of
+ * bytes walked.
+ */
+static size_t _px_leaks_walk(px_leaks_state *l, uintptr_t end)
+{
+	unsigned char *buf;
+	uintptr_t pos = l->lo, base = 0;
+	uint64_t size;
+	ssize_t got = 0, prev = -1;
+
+	if ((buf = malloc(PX_LEAKS_WINDOW)) == NULL) {
+		return 0;
+	}
+
+	while (pos + PX_LEAKS_HEADER <= end) {
+		if (pos < base || pos + PX_LEAKS_HEADER > base + got) {
+			base = pos;
+			got = ptrace_read_direct(base, buf,
+				end - base < PX_LEAKS_WINDOW ? end - base : PX_LEAKS_WINDOW);
+
+			if (got < (ssize_t) PX_LEAKS_HEADER) {
+				break;
+			}
+		}
+		memcpy(&size, buf + (pos - base) + sizeof(uint64_t), sizeof(size));
+
+		if (prev != -1 && (size & PX_LEAKS_PREV_INUSE)) {
+			PX_BIT_SET(l->inuse, prev);
+			l->nchunks++;
+		}
+		size &= ~(uint64_t) PX_LEAKS_FLAGS;
+
+		if (size < PX_LEAKS_MIN || size % PX_LEAKS_GRANULE || size > end - pos) {
+			if (pos + size != end) {
+				px_error("Corrupt chunk header at %#" PRIxPTR ", stopping there", pos);
+			}
+			break;
+		}
+		prev = (pos - l->lo) / PX_LEAKS_GRANULE;
+		PX_BIT_SET(l->starts, prev);
+		pos += size;
+	}
+	free(buf);
+
+	return pos - l->lo;
+}
+
+/**
+ * px_scan_regions() callback, marks what the root words point to
+ */
+static void _px_leaks_roots(const px_scan_chunk *chunk, void *arg)
+{
+	px_leaks_state *l = arg;
+	px_leaks_stack *stack = &l->stacks[chunk->worker];
+	const size_t nwords = chunk->limit / sizeof(uint64_t);
+	uint64_t word;
+	size_t i;
+
+	for (i = 0; i < nwords; ++i) {
+		memcpy(&word, chunk->data + i * sizeof(uint64_t), sizeof(word));
+
+		if (_px_leaks_mark(l, stack, word) == -1) {
+			__atomic_store_n(&l->failed, 1, __ATOMIC_RELAXED);
+			break;
+		}
+	}
+	__atomic_fetch_add(&l->roots, nwords, __ATOMIC_RELAXED);
+}
+
+/**
+ * Uses the registers of every attached thread (or the core's first
+ * thread) as roots
+ */
+static void _px_leaks_registers(px_leaks_state *l, px_leaks_stack *stack)
+{
+	const struct elf_prstatus *status;
+	const uint64_t *regs;
+	size_t i, j, len, n = 0;
+
+	if (ENV(source)) {
+		/* The first NT_PRSTATUS is the thread px was attached to */
+		if ((status = ENV(source)->note("CORE", NT_PRSTATUS, &len)) == NULL
+			|| len < sizeof(*status)) {
+			px_error("No NT_PRSTATUS note, the registers are not used as roots");
+			return;
+		}
+		regs = (const uint64_t *) &status->pr_reg;
+
+		for (j = 0; j < sizeof(status->pr_reg) / sizeof(uint64_t); ++j) {
+			if (_px_leaks_mark(l, stack, regs[j]) == -1) {
+				l->failed = 1;
+				return;
+			}
+		}
+		return;
+	}
+
+	for (i = 0; i < ENV(threads).n; ++i) {
+		if (!ENV(threads).list[i].have_regs) {
+			continue;
+		}
+		regs = (const uint64_t *) &ENV(threads).list[i].regs;
+
+		for (j = 0; j < sizeof(ENV(threads).list[i].regs) / sizeof(uint64_t); ++j) {
+			if (_px_leaks_mark(l, stack, regs[j]) == -1) {
+				l->failed = 1;
+				return;
+			}
+		}
+		++n;
+	}
+	if (n == 0) {
+		px_error("Failed to read the registers, they are not used as roots");
+	}
+}
+
+/**
+ * Scans the reached chunks until the worklist is empty
+ * Chunk contents go through the page cache, the traversal jumps around.
+ * Returns -1 when out of memory
+ */
+static int _px_leaks_trace(px_leaks_state *l, px_leaks_stack *stack)
+{
+	unsigned char *buf;
+	uintptr_t addr, end;
+	uint64_t word;
+	size_t g, i, len;
+
+	if ((buf = malloc(PX_LEAKS_WINDOW)) == NULL) {
+		return -1;
+	}
+
+	while (stack->n) {
+		g = stack->items[--stack->n];
+		addr = l->lo + g * PX_LEAKS_GRANULE + PX_LEAKS_HEADER;
+		/* The usable size ends with the next chunk's prev_size */
+		end = l->lo + _px_leaks_chunk_end(l, g) * PX_LEAKS_GRANULE + sizeof(uint64_t);
+
+		if (end > l->lo + l->span) {
+			end = l->lo + l->span;
+		}
+
+		for (; addr < end; addr += len) {
+			len = end - addr < PX_LEAKS_WINDOW ? end - addr : PX_LEAKS_WINDOW;
+
+			ptrace_read(addr, buf, len);
+
+			for (i = 0; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+				memcpy(&word, buf + i, sizeof(word));
+
+				if (_px_leaks_mark(l, stack, word) == -1) {
+					free(buf);
+					return -1;
+				}
+			}
+		}
+	}
+	free(buf);
+
+	return 0;
+}
+
+/**
+ * Prints the unreached allocated chunks grouped by power of two size class
+ */
+static void _px_leaks_report(const px_leaks_state *l)
+{
+	size_t count[PX_LEAKS_CLASSES] = {0}, bytes[PX_LEAKS_CLASSES] = {0};
+	uintptr_t samples[PX_LEAKS_CLASSES][PX_LEAKS_SAMPLES];
+	size_t w, g, size, c, k, total = 0, total_bytes = 0;
+	uint64_t bits;
+
+	for (w = 0; w < (l->ngranules + 63) >> 6; ++w) {
+		/* Allocated and not reached */
+		for (bits = l->inuse[w] & ~l->marked[w]; bits; bits &= bits - 1) {
+			g = (w << 6) + __builtin_ctzll(bits);
+			size = (_px_leaks_chunk_end(l, g) - g) * PX_LEAKS_GRANULE;
+
+			for (c = 0; c < PX_LEAKS_CLASSES - 1
+				&& size > ((size_t) PX_LEAKS_MIN << c); ++c);
+
+			if (count[c] < PX_LEAKS_SAMPLES) {
+				samples[c][count[c]] = l->lo + g * PX_LEAKS_GRANULE + PX_LEAKS_HEADER;
+			}
+			count[c]++;
+			bytes[c] += size;
+			total++;
+			total_bytes += size;
+		}
+	}
+
+	for (c = 0; c < PX_LEAKS_CLASSES; ++c) {
+		if (count[c] == 0) {
+			continue;
+		}
+		printf("<= %10zu bytes: %zu chunks, %zu bytes (", (size_t) PX_LEAKS_MIN << c,
+			count[c], bytes[c]);
+
+		for (k = 0; k < count[c] && k < PX_LEAKS_SAMPLES; ++k) {
+			printf(k ? " %#" PRIxPTR : "%#" PRIxPTR, samples[c][k]);
+		}
+		printf(count[c] > PX_LEAKS_SAMPLES ? " ...)\n" : ")\n");
+	}
+	printf("[+] %zu of %zu allocated chunks unreachable (%zu bytes), %zu root words\n",
+		total, l->nchunks, total_bytes, l->roots);
+}
+
+/**
+ * Reports the [heap] chunks that no pointer reaches
+ * Conservative mark: every aligned word in the writable regions other
+ * than the heap (stacks, .data/.bss, TLS) and in the registers of the
+ * attached thread is a root, any word pointing inside an allocated chunk
+ * marks it. Chunks freed into tcache or fastbins still look allocated to
+ * the walk, and their safe-linked next pointers cannot be followed, so
+ * they may be reported too. Only the main arena is walked; other arenas
+ * and mmap()ed chunks count as roots.
+ */
+void px_leaks(void)
+{
+	const px_scan_filter filter = { "?w", NULL, "[heap]" };
+	px_leaks_state l;
+	px_leaks_stack all;
+	size_t i, words;
+	ssize_t heap = -1;
+	unsigned jobs = px_scan_jobs(), w;
+
+	for (i = 0; i < ENV(nregions); ++i) {
+		if (strcmp(PX_MAPS_NAME(i), "[heap]") == 0) {
+			heap = i;
+			break;
+		}
+	}
+	if (heap == -1) {
+		px_error("No [heap] region, run maps first");
+		return;
+	}
+
+	memset(&l, 0, sizeof(l));
+	memset(&all, 0, sizeof(all));
+
+	l.lo = PX_MAPS_START(heap);
+	l.ngranules = (ENV(maps)[heap].end - l.lo) / PX_LEAKS_GRANULE;
+	words = (l.ngranules + 63) >> 6;
+
+	if ((l.starts = calloc(words, sizeof(uint64_t))) == NULL
+		|| (l.inuse = calloc(words, sizeof(uint64_t))) == NULL
+		|| (l.marked = calloc(words, sizeof(uint64_t))) == NULL
+		|| (l.stacks = calloc(jobs, sizeof(*l.stacks))) == NULL) {
+		px_error("Failed to alloc!");
+		goto out;
+	}
+
+	if ((l.span = _px_leaks_walk(&l, ENV(maps)[heap].end)) == 0) {
+		px_error("Failed to walk the heap");
+		goto out;
+	}
+	l.ngranules = l.span / PX_LEAKS_GRANULE;
+
+	_px_leaks_registers(&l, &l.stacks[0]);
+
+	if (px_scan_regions(&filter, 0, _px_leaks_roots, &l) == -1) {
+		goto out;
+	}
+
+	/* The heap itself is traced from one worklist */
+	for (w = 0; w < jobs && !l.failed; ++w) {
+		for (i = 0; i < l.stacks[w].n; ++i) {
+			if (_px_leaks_push(&all, l.stacks[w].items[i]) == -1) {
+				l.failed = 1;
+				break;
+			}
+		}
+		px_safe_free(l.stacks[w].items);
+		memset(&l.stacks[w], 0, sizeof(l.stacks[w]));
+	}
+
+	/* A chunk left out of the worklist would report what it points to */
+	if (l.failed || _px_leaks_trace(&l, &all) == -1) {
+		px_error("Failed to alloc!");
+		goto out;
+	}
+
+	_px_leaks_report(&l);
+out:
+	if (l.stacks) {
+		for (w = 0; w < jobs; ++w) {
+			px_safe_free(l.stacks[w].items);
+		}
+	}
+	px_safe_free(all.items);
+	px_safe_free(l.stacks);
+	px_safe_free(l.marked);
+	px_safe_free(l.inuse);
+	px_safe_free(l.starts);
+}
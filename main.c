@@ -39,6 +39,7 @@ static void usage()
 	printf("Usage: px [options]\n\n"
 			"Options:\n"
 			"	-h, --help	Displays this information\n"
+			"	-j, --jobs N	Uses at most N worker threads\n"
 			"	-v, --version	Displays the version\n");
 }
 
@@ -48,15 +49,22 @@ int main(int argc, char **argv)
 	int opt_index = 0;
 	static struct option long_opts[] = {
 		{"help",    no_argument, 0, 'h'},
+		{"jobs",    required_argument, 0, 'j'},
 		{"version", no_argument, 0, 'v'},
 		{0, 0, 0, 0}
 	};
 
-	while ((c = getopt_long(argc, argv, "hv", long_opts, &opt_index)) != -1) {
+	while ((c = getopt_long(argc, argv, "hj:v", long_opts, &opt_index)) != -1) {
 		switch (c) {
 			case 'h':
 				usage();
 				exit(0);
+			case 'j':
+				if ((g_env.jobs = strtoul(optarg, NULL, 10)) == 0) {
+					fprintf(stderr, "px: --jobs expects a positive number\n");
+					exit(1);
+				}
+				break;
 			case 'v':
 				printf("px-" PX_VERSION "\n");
 				exit(0);
@@ -33,43 +33,509 @@
 #include "maps.h"
 #include "cmd.h"
 #include "ptrace.h"
+#include "proc.h"
 
 /**
- * Parses an line from /proc/<pid>/maps
+ * Initial number of entries of the region table, it doubles when full
  */
-void px_maps_region(const char *line)
+#define PX_MAPS_INITIAL_SIZE 64
+
+static inline uint32_t _px_strpool_hash(const char *str, size_t len)
 {
-	uintptr_t start, end;
-	char perms[5], filename[PATH_MAX];
-	int offset, dmajor, dminor, inode;
-	const size_t n = ENV(nregions);
+	uint32_t h = 2166136261u;
 
-	if (sscanf(line, "%" PRIxPTR "-%" PRIxPTR " %s %x %x:%x %u %s",
-		&start, &end, perms, &offset, &dmajor, &dminor, &inode, filename) < 6 ||
-		(end - start) == 0) {
-		return;
+	while (len--) {
+		h = (h ^ (unsigned char) *str++) * 16777619u;
 	}
+	return h;
+}
 
-	if (ENV(maps) == NULL || n % 5 == 0) {
-		ENV(maps) = (px_maps*) realloc(ENV(maps), sizeof(px_maps) * (n + 5));
+/**
+ * Grows the hash of a string pool, rehashing the current strings
+ */
+static int _px_strpool_rehash(px_strpool *pool)
+{
+	size_t i, j, nslots = pool->nslots ? pool->nslots * 2 : 256;
+	uint32_t *slots = calloc(nslots, sizeof(*slots));
+	const char *str;
 
-		if (ENV(maps) == NULL) {
-			px_error("Failed to realloc!\n");
-			return;
+	if (slots == NULL) {
+		return -1;
+	}
+
+	for (i = 0; i < pool->nslots; ++i) {
+		if (pool->slots[i] == 0) {
+			continue;
+		}
+		str = pool->data + pool->slots[i];
+		j = _px_strpool_hash(str, strlen(str)) & (nslots - 1);
+
+		while (slots[j]) {
+			j = (j + 1) & (nslots - 1);
 		}
+		slots[j] = pool->slots[i];
 	}
 
-	ENV(maps)[n].start = start;
-	ENV(maps)[n].end = end;
-	memcpy(ENV(maps)[n].filename, filename, sizeof(filename));
-	memcpy(ENV(maps)[n].perms, perms, sizeof(perms));
+	px_safe_free(pool->slots);
+	pool->slots = slots;
+	pool->nslots = nslots;
 
-	/* Sets the base address where we will read ELF data */
-	if (n == 0) {
-		ELF(header) = ENV(maps)[0].start;
+	return 0;
+}
+
+/**
+ * Interns a string in the pool
+ * Returns the offset of the (single) copy of the string in the pool
+ */
+uint32_t px_strpool_intern(px_strpool *pool, const char *str, size_t len)
+{
+	size_t i, size;
+	char *data;
+
+	if (len == 0) {
+		return 0;
+	}
+
+	if ((pool->count + 1) * 2 > pool->nslots && _px_strpool_rehash(pool) == -1) {
+		px_error("Failed to alloc!");
+		return 0;
+	}
+
+	i = _px_strpool_hash(str, len) & (pool->nslots - 1);
+
+	while (pool->slots[i]) {
+		data = pool->data + pool->slots[i];
+
+		if (memcmp(data, str, len) == 0 && data[len] == '\0') {
+			return pool->slots[i];
+		}
+		i = (i + 1) & (pool->nslots - 1);
+	}
+
+	if (pool->len + len + 1 > pool->size || pool->data == NULL) {
+		for (size = pool->size ? pool->size : 4096;
+			size < pool->len + len + 2; size *= 2);
+
+		if ((data = realloc(pool->data, size)) == NULL) {
+			px_error("Failed to realloc!");
+			return 0;
+		}
+		if (pool->data == NULL) {
+			/* Offset 0 is the empty string */
+			data[0] = '\0';
+			pool->len = 1;
+		}
+		pool->data = data;
+		pool->size = size;
+	}
+
+	memcpy(pool->data + pool->len, str, len);
+	pool->data[pool->len + len] = '\0';
+
+	pool->slots[i] = pool->len;
+	pool->len += len + 1;
+	++pool->count;
+
+	return pool->slots[i];
+}
+
+/**
+ * Deallocs a string pool
+ */
+void px_strpool_clear(px_strpool *pool)
+{
+	px_safe_free(pool->data);
+	px_safe_free(pool->slots);
+	memset(pool, 0, sizeof(*pool));
+}
+
+/**
+ * Finds the index of the first region starting above addr
+ */
+static inline size_t _px_maps_upper_bound(uintptr_t addr, size_t lo, size_t hi)
+{
+	const uintptr_t *start = ENV(maps_start);
+	size_t half;
+
+	while (hi > lo) {
+		half = (hi - lo) / 2;
+
+		if (start[lo + half] <= addr) {
+			lo += half + 1;
+		} else {
+			hi = lo + half;
+		}
+	}
+	return lo;
+}
+
+/**
+ * Inserts a region in the table, keeping it sorted by start address
+ * Returns the index of the new region or -1
+ */
+static ssize_t _px_maps_insert(uintptr_t start, const px_maps *region)
+{
+	const size_t n = ENV(nregions);
+	size_t i, size;
+	uintptr_t *starts;
+	px_maps *maps;
+
+	if (n == ENV(maps_size)) {
+		size = n ? n * 2 : PX_MAPS_INITIAL_SIZE;
+
+		starts = realloc(ENV(maps_start), sizeof(*starts) * size);
+
+		if (starts == NULL) {
+			px_error("Failed to realloc!");
+			return -1;
+		}
+		ENV(maps_start) = starts;
+
+		maps = realloc(ENV(maps), sizeof(*maps) * size);
+
+		if (maps == NULL) {
+			px_error("Failed to realloc!");
+			return -1;
+		}
+		ENV(maps) = maps;
+		ENV(maps_size) = size;
 	}
 
+	/* /proc/<pid>/maps is sorted, so this is usually an append */
+	i = n && start < ENV(maps_start)[n - 1] ? _px_maps_upper_bound(start, 0, n) : n;
+
+	if (i < n) {
+		memmove(ENV(maps_start) + i + 1, ENV(maps_start) + i,
+			sizeof(*ENV(maps_start)) * (n - i));
+		memmove(ENV(maps) + i + 1, ENV(maps) + i, sizeof(*ENV(maps)) * (n - i));
+	}
+
+	ENV(maps_start)[i] = start;
+	ENV(maps)[i] = *region;
+
 	++ENV(nregions);
+
+	return i;
+}
+
+/**
+ * A parsed /proc/<pid>/maps line, the name points into the read buffer
+ */
+typedef struct _px_maps_line {
+	uintptr_t start;
+	uintptr_t end;
+	uintptr_t offset;
+	char perms[5];
+	const char *name;
+	size_t name_len;
+} px_maps_line;
+
+/**
+ * Scans one line of /proc/<pid>/maps in place
+ * start-end perms offset dev inode [pathname]
+ * The input may come from a core file, a malformed line is skipped whole
+ * Returns a pointer past the end of the line, or NULL at the end of input
+ */
+static const char *_px_maps_scan(const char *p, px_maps_line *line, int *valid)
+{
+	const char *name;
+	size_t n;
+
+	if (*p == '\0') {
+		return NULL;
+	}
+
+	*valid = 0;
+
+	line->start = px_proc_hex(&p);
+	if (*p != '-') {
+		goto out;
+	}
+	++p;
+	line->end = px_proc_hex(&p);
+	px_proc_skip_spaces(&p);
+
+	for (n = 0; n < 4 && p[n] != '\0' && p[n] != '\n'; ++n);
+	if (n < 4) {
+		goto out;
+	}
+	memcpy(line->perms, p, 4);
+	line->perms[4] = '\0';
+	p += 4;
+	px_proc_skip_spaces(&p);
+
+	line->offset = px_proc_hex(&p);
+	px_proc_skip_spaces(&p);
+	px_proc_skip_field(&p); /* dev */
+	px_proc_skip_field(&p); /* inode */
+
+	/* The pathname is the rest of the line and may have spaces */
+	for (name = p; *p != '\n' && *p != '\0'; ++p);
+
+	line->name = name;
+	line->name_len = p - name;
+
+	*valid = line->end > line->start;
+
+out:
+	for (; *p != '\n' && *p != '\0'; ++p);
+
+	return *p == '\n' ? p + 1 : p;
+}
+
+/**
+ * Adds a parsed line to the region table
+ */
+static ssize_t _px_maps_add(const px_maps_line *line)
+{
+	px_maps region;
+	ssize_t i;
+
+	region.end = line->end;
+	region.offset = line->offset;
+	region.filename = px_strpool_intern(&ENV(maps_names), line->name,
+		line->name_len);
+	memcpy(region.perms, line->perms, sizeof(region.perms));
+
+	if ((i = _px_maps_insert(line->start, &region)) == -1) {
+		return -1;
+	}
+
+	/* Sets the base address where we will read ELF data */
+	if (ENV(nregions) == 1) {
+		ELF(header) = line->start;
+	}
+	return i;
+}
+
+/**
+ * Parses an line from /proc/<pid>/maps
+ */
+void px_maps_region(const char *str)
+{
+	px_maps_line line;
+	int valid;
+
+	if (_px_maps_scan(str, &line, &valid) && valid) {
+		_px_maps_add(&line);
+	}
+}
+
+/**
+ * Reads /proc/<pid>/maps into one buffer
+ */
+static char *_px_maps_read(size_t *len)
+{
+	char fname[PATH_MAX], *buf;
+
+	snprintf(fname, sizeof(fname), "/proc/%d/maps", ENV(pid));
+
+	if ((buf = px_proc_read(fname, len)) == NULL) {
+		px_error("Fail to read '%s' (%s)", fname, strerror(errno));
+	}
+	return buf;
+}
+
+/**
+ * Builds the region table from /proc/<pid>/maps
+ * Returns the number of regions or -1
+ */
+ssize_t px_maps_load(void)
+{
+	px_maps_line line;
+	const char *p;
+	size_t len;
+	char *buf;
+	int valid;
+
+	if (ENV(source)) {
+		return ENV(source)->maps();
+	}
+
+	if ((buf = _px_maps_read(&len)) == NULL) {
+		return -1;
+	}
+
+	px_maps_clear();
+
+	for (p = buf; (p = _px_maps_scan(p, &line, &valid)) != NULL;) {
+		if (valid) {
+			_px_maps_add(&line);
+		}
+	}
+
+	free(buf);
+
+	return ENV(nregions);
+}
+
+/**
+ * Checks whether a region is the same as a freshly parsed line
+ */
+static int _px_maps_same(size_t i, const px_maps_line *line)
+{
+	const px_maps *region = &ENV(maps)[i];
+	const char *name = PX_MAPS_NAME(i);
+
+	return ENV(maps_start)[i] == line->start
+		&& region->end == line->end
+		&& region->offset == line->offset
+		&& memcmp(region->perms, line->perms, sizeof(region->perms)) == 0
+		&& strncmp(name, line->name, line->name_len) == 0
+		&& name[line->name_len] == '\0';
+}
+
+static void _px_maps_show_change(char op, uintptr_t start, uintptr_t end,
+	const char *perms, const char *name, int name_len)
+{
+	printf("%c %#" PRIxPTR "-%#" PRIxPTR " %s %.*s\n",
+		op, start, end, perms, name_len, name);
+}
+
+/**
+ * Updates the region table from a new /proc/<pid>/maps snapshot
+ * Both lists are sorted by start address, so a single merge pass finds
+ * the regions that went away and the new ones; unchanged regions are
+ * kept as they are, names included.
+ */
+ssize_t px_maps_refresh(void)
+{
+	px_maps_line line;
+	uintptr_t *starts;
+	px_maps *maps, *old_maps = ENV(maps);
+	uintptr_t *old_starts = ENV(maps_start);
+	const size_t old_n = ENV(nregions);
+	size_t i = 0, n = 0, size, added = 0, removed = 0, kept = 0;
+	const char *p;
+	size_t len;
+	char *buf;
+	int valid;
+
+	if ((buf = _px_maps_read(&len)) == NULL) {
+		return -1;
+	}
+
+	/* One entry per line is enough */
+	for (size = 0, p = buf; *p; ++p) {
+		size += *p == '\n';
+	}
+	size = size ? size : 1;
+
+	starts = malloc(sizeof(*starts) * size);
+	maps = malloc(sizeof(*maps) * size);
+
+	if (starts == NULL || maps == NULL) {
+		px_error("Failed to alloc!");
+		px_safe_free(starts);
+		px_safe_free(maps);
+		free(buf);
+		return -1;
+	}
+
+	for (p = buf; (p = _px_maps_scan(p, &line, &valid)) != NULL;) {
+		if (!valid) {
+			continue;
+		}
+		/* Regions that start before this one, or differ from it, are gone */
+		while (i < old_n && (old_starts[i] < line.start
+			|| (old_starts[i] == line.start && !_px_maps_same(i, &line)))) {
+			_px_maps_show_change('-', old_starts[i], old_maps[i].end,
+				old_maps[i].perms, PX_MAPS_NAME(i), INT_MAX);
+			++removed;
+			++i;
+		}
+
+		if (i < old_n && _px_maps_same(i, &line)) {
+			maps[n] = old_maps[i++];
+			++kept;
+		} else {
+			maps[n].end = line.end;
+			maps[n].offset = line.offset;
+			maps[n].filename = px_strpool_intern(&ENV(maps_names), line.name,
+				line.name_len);
+			memcpy(maps[n].perms, line.perms, sizeof(maps[n].perms));
+
+			_px_maps_show_change('+', line.start, line.end, line.perms,
+				line.name, line.name_len);
+			++added;
+		}
+		starts[n++] = line.start;
+	}
+
+	for (; i < old_n; ++i, ++removed) {
+		_px_maps_show_change('-', old_starts[i], old_maps[i].end,
+			old_maps[i].perms, PX_MAPS_NAME(i), INT_MAX);
+	}
+
+	free(buf);
+	free(old_starts);
+	free(old_maps);
+
+	ENV(maps_start) = starts;
+	ENV(maps) = maps;
+	ENV(maps_size) = size;
+	ENV(nregions) = n;
+
+	printf("%zu added, %zu removed, %zu unchanged\n", added, removed, kept);
+
+	return n;
+}
+
+/**
+ * Looks up the region containing an address
+ * Returns the region index or -1
+ */
+ssize_t px_maps_lookup(uintptr_t addr)
+{
+	size_t i = _px_maps_upper_bound(addr, 0, ENV(nregions));
+
+	return i && addr < ENV(maps)[i - 1].end ? (ssize_t)(i - 1) : -1;
+}
+
+/**
+ * Looks up the regions of many addresses at once
+ * Ascending runs of addresses are resolved by galloping forward from the
+ * previous answer, so sorted input costs O(1) amortized per address.
+ */
+void px_maps_lookup_batch(const uintptr_t *addrs, ssize_t *out, size_t n)
+{
+	const size_t nregions = ENV(nregions);
+	size_t i, pos = 0, step;
+
+	for (i = 0; i < n; ++i) {
+		if (i && addrs[i] >= addrs[i - 1]) {
+			/* pos is the upper bound of the previous address */
+			for (step = 1; pos + step <= nregions
+				&& ENV(maps_start)[pos + step - 1] <= addrs[i]; step *= 2);
+
+			pos = _px_maps_upper_bound(addrs[i], pos,
+				pos + step <= nregions ? pos + step : nregions);
+		} else {
+			pos = _px_maps_upper_bound(addrs[i], 0, nregions);
+		}
+
+		out[i] = pos && addrs[i] < ENV(maps)[pos - 1].end ? (ssize_t)(pos - 1) : -1;
+	}
+}
+
+/**
+ * Checks a region against a permission mask and a name filter
+ * Each mask character other than '?' must equal the region's permission
+ * at the same position ("r-x", "rw"); the name matches when it contains
+ * the filter. NULL accepts anything.
+ */
+int px_maps_match(size_t i, const char *perms, const char *name)
+{
+	const char *p = ENV(maps)[i].perms;
+
+	if (perms) {
+		for (; *perms && *p; ++perms, ++p) {
+			if (*perms != '?' && *perms != *p) {
+				return 0;
+			}
+		}
+	}
+	return name == NULL || strstr(PX_MAPS_NAME(i), name) != NULL;
 }
 
 /**
@@ -77,17 +543,15 @@ void px_maps_region(const char *line)
  */
 int px_maps_find_region(uintptr_t addr)
 {
-	int i = 0;
+	ssize_t i = px_maps_lookup(addr);
 
-	while (i < ENV(nregions)) {
-		if (ENV(maps)[i].start <= addr && ENV(maps)[i].end >= addr) {
-			printf("Found... %s (%s)\n",
-				ENV(maps)[i].filename, ENV(maps)[i].perms);
-			return 1;
-		}
-		++i;
+	if (i == -1) {
+		return 0;
 	}
-	return 0;
+
+	printf("Found... %s (%s)\n", PX_MAPS_NAME(i), ENV(maps)[i].perms);
+
+	return 1;
 }
 
 /**
@@ -95,9 +559,13 @@ int px_maps_find_region(uintptr_t addr)
  */
 void px_maps_clear(void)
 {
-	if (ENV(maps) != NULL) {
-		free(ENV(maps));
-		ENV(maps) = NULL;
-	}
+	px_safe_free(ENV(maps));
+	px_safe_free(ENV(maps_start));
+
+	ENV(maps) = NULL;
+	ENV(maps_start) = NULL;
+	ENV(maps_size) = 0;
 	ENV(nregions) = 0;
+
+	px_strpool_clear(&ENV(maps_names));
 }
@@ -30,16 +30,50 @@
 #include <link.h>
 #include <stdint.h>
 #include <limits.h>
+#include <sys/types.h>
 
+/**
+ * Interned strings, referenced by their offset in the pool
+ */
+typedef struct _px_strpool {
+	char *data;       /* NUL-terminated strings, offset 0 is "" */
+	size_t len;
+	size_t size;
+	uint32_t *slots;  /* open addressing hash of offsets (0 = empty) */
+	size_t nslots;    /* power of two */
+	size_t count;
+} px_strpool;
+
+/**
+ * Mapped region
+ * The start addresses are kept apart in ENV(maps_start), sorted, so that
+ * lookups binary search a dense array.
+ */
 typedef struct _px_maps {
-	uintptr_t start;
 	uintptr_t end;
+	uintptr_t offset;  /* file offset */
+	uint32_t filename; /* offset into ENV(maps_names) */
 	char perms[5];
-	char filename[PATH_MAX];
 } px_maps;
 
+/**
+ * Helper macros to access the region table
+ */
+#define PX_MAPS_START(i) ENV(maps_start)[i]
+#define PX_MAPS_NAME(i)  px_strpool_get(&ENV(maps_names), ENV(maps)[i].filename)
+
+#define px_strpool_get(pool, off) ((pool)->data ? (pool)->data + (off) : "")
+
+uint32_t px_strpool_intern(px_strpool*, const char*, size_t);
+void px_strpool_clear(px_strpool*);
+
 void px_maps_region(const char *);
+ssize_t px_maps_load(void);
+ssize_t px_maps_refresh(void);
+ssize_t px_maps_lookup(uintptr_t);
+void px_maps_lookup_batch(const uintptr_t*, ssize_t*, size_t);
 int px_maps_find_region(uintptr_t);
+int px_maps_match(size_t, const char*, const char*);
 void px_maps_elf(const char*);
 int px_maps_find_symbol(const char*);
 void px_maps_clear(void);
@@ -0,0 +1,373 @@
+/**
+ * Copyright (c) 2012, Felipe Pena
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *   Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sched.h>
+#include <errno.h>
+#include <limits.h>
+#include <inttypes.h>
+#include "common.h"
+#include "cmd.h"
+#include "proc.h"
+#include "numa.h"
+
+/**
+ * Nodes px keeps page counts for, pages on higher nodes are not counted
+ */
+#define PX_NUMA_MAX_NODES 64
+
+/**
+ * Field of /proc/<pid>/task/<tid>/stat with the CPU the thread last ran on
+ */
+#define PX_NUMA_STAT_CPU 39
+
+/**
+ * A parsed /proc/<pid>/numa_maps line, the policy points into the read
+ * buffer
+ */
+typedef struct _px_numa_line {
+	uintptr_t start;
+	const char *policy;
+	size_t policy_len;
+	uint64_t pages[PX_NUMA_MAX_NODES];
+	uint64_t page_kib;
+} px_numa_line;
+
+/**
+ * Pages of a region per node
+ */
+typedef struct _px_numa_region {
+	uint64_t kib[PX_NUMA_MAX_NODES];
+	const char *policy;
+	int policy_len;
+} px_numa_region;
+
+/**
+ * Scans one line of /proc/<pid>/numa_maps in place
+ * start policy [key=value ...] with N<node>=<pages> per node
+ * Returns a pointer past the end of the line, or NULL at the end of input
+ */
+static const char *_px_numa_scan(const char *p, px_numa_line *line, int *nodes)
+{
+	const char *key;
+	uint64_t node;
+
+	if (*p == '\0') {
+		return NULL;
+	}
+
+	memset(line->pages, 0, sizeof(line->pages));
+	line->page_kib = 4;
+
+	line->start = px_proc_hex(&p);
+	px_proc_skip_spaces(&p);
+
+	for (line->policy = p; *p != ' ' && *p != '\n' && *p != '\0'; ++p);
+	line->policy_len = p - line->policy;
+	px_proc_skip_spaces(&p);
+
+	while (*p != '\n' && *p != '\0') {
+		key = p;
+
+		if (*p == 'N' && p[1] >= '0' && p[1] <= '9') {
+			++p;
+			node = px_proc_dec(&p);
+
+			if (*p == '=' && node < PX_NUMA_MAX_NODES) {
+				++p;
+				line->pages[node] = px_proc_dec(&p);
+
+				if ((int) node >= *nodes) {
+					*nodes = node + 1;
+				}
+			}
+		} else if (strncmp(key, "kernelpagesize_kB=", 18) == 0) {
+			p += 18;
+			line->page_kib = px_proc_dec(&p);
+		}
+		px_proc_skip_field(&p);
+	}
+	return *p == '\n' ? p + 1 : p;
+}
+
+/**
+ * Fills the node of each CPU from /sys/devices/system/node/node<N>/cpulist
+ */
+static void _px_numa_cpu_nodes(int *cpu_node)
+{
+	char fname[PATH_MAX], *buf;
+	const char *p;
+	struct dirent *ent;
+	uint64_t first, last;
+	size_t len;
+	int node;
+	DIR *dir;
+
+	if ((dir = opendir("/sys/devices/system/node")) == NULL) {
+		return;
+	}
+
+	while ((ent = readdir(dir)) != NULL) {
+		if (strncmp(ent->d_name, "node", 4) != 0
+			|| (node = atoi(ent->d_name + 4)) >= PX_NUMA_MAX_NODES) {
+			continue;
+		}
+		snprintf(fname, sizeof(fname), "/sys/devices/system/node/%s/cpulist",
+			ent->d_name);
+
+		if ((buf = px_proc_read(fname, &len)) == NULL) {
+			continue;
+		}
+
+		/* 0-3,8-11 */
+		for (p = buf; *p >= '0' && *p <= '9';) {
+			first = last = px_proc_dec(&p);
+
+			if (*p == '-') {
+				++p;
+				last = px_proc_dec(&p);
+			}
+			for (; first <= last && first < CPU_SETSIZE; ++first) {
+				cpu_node[first] = node;
+			}
+			if (*p == ',') {
+				++p;
+			}
+		}
+		free(buf);
+	}
+	closedir(dir);
+}
+
+/**
+ * Formats a CPU set as a list (0-3,8)
+ */
+static void _px_numa_cpu_list(const cpu_set_t *set, char *out, size_t size)
+{
+	size_t len = 0;
+	int cpu, last;
+
+	out[0] = '\0';
+
+	for (cpu = 0; cpu < CPU_SETSIZE && len < size; ++cpu) {
+		if (!CPU_ISSET(cpu, set)) {
+			continue;
+		}
+		for (last = cpu; last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set);
+			++last);
+
+		len += snprintf(out + len, size - len, last > cpu ? "%s%d-%d" : "%s%d",
+			len ? "," : "", cpu, last);
+		cpu = last;
+	}
+}
+
+/**
+ * Returns the CPU a thread last ran on, from its stat file, or -1
+ */
+static int _px_numa_last_cpu(pid_t tid)
+{
+	char fname[PATH_MAX], *buf;
+	const char *p;
+	size_t len;
+	int i, cpu = -1;
+
+	snprintf(fname, sizeof(fname), "/proc/%d/task/%d/stat", ENV(pid), tid);
+
+	if ((buf = px_proc_read(fname, &len)) == NULL) {
+		return -1;
+	}
+
+	/* The command name may have spaces and parentheses */
+	if ((p = strrchr(buf, ')')) != NULL) {
+		++p;
+		px_proc_skip_spaces(&p);
+
+		for (i = 3; i < PX_NUMA_STAT_CPU && *p; ++i) {
+			px_proc_skip_field(&p);
+		}
+		if (*p >= '0' && *p <= '9') {
+			cpu = px_proc_dec(&p);
+		}
+	}
+	free(buf);
+
+	return cpu;
+}
+
+/**
+ * Lists the threads with their affinity and last CPU, marking the nodes
+ * they run on as local
+ */
+static void _px_numa_threads(const int *cpu_node, int *local)
+{
+	char fname[PATH_MAX], cpus[256];
+	struct dirent *ent;
+	cpu_set_t set;
+	pid_t tid;
+	int cpu;
+	DIR *dir;
+
+	snprintf(fname, sizeof(fname), "/proc/%d/task", ENV(pid));
+
+	if ((dir = opendir(fname)) == NULL) {
+		px_error("Failed to read %s (%s)", fname, strerror(errno));
+		return;
+	}
+
+	printf("%8s %8s %5s %s\n", "tid", "last cpu", "node", "affinity");
+
+	while ((ent = readdir(dir)) != NULL) {
+		if (ent->d_name[0] == '.') {
+			continue;
+		}
+		tid = atoi(ent->d_name);
+		cpu = _px_numa_last_cpu(tid);
+
+		if (sched_getaffinity(tid, sizeof(set), &set) == -1) {
+			snprintf(cpus, sizeof(cpus), "? (%s)", strerror(errno));
+		} else {
+			_px_numa_cpu_list(&set, cpus, sizeof(cpus));
+		}
+
+		if (cpu >= 0 && cpu < CPU_SETSIZE && cpu_node[cpu] >= 0) {
+			local[cpu_node[cpu]] = 1;
+			printf("%8d %8d %5d %s\n", tid, cpu, cpu_node[cpu], cpus);
+		} else {
+			printf("%8d %8d %5s %s\n", tid, cpu, "?", cpus);
+		}
+	}
+	closedir(dir);
+}
+
+/**
+ * Shows the pages of each region per NUMA node, from
+ * /proc/<pid>/numa_maps joined with the region table, and the CPUs the
+ * threads run on. Regions with most pages on nodes where no thread last
+ * ran are flagged as remote.
+ * numa
+ */
+void px_numa(void)
+{
+	static int cpu_node[CPU_SETSIZE];
+	int local[PX_NUMA_MAX_NODES] = { 0 };
+	px_numa_region *regions;
+	px_numa_line line;
+	char fname[PATH_MAX], *buf, head[16];
+	const char *p;
+	uint64_t node_kib[PX_NUMA_MAX_NODES] = { 0 }, kib, remote;
+	size_t i, len, unknown = 0, nremote = 0;
+	ssize_t r;
+	int n, nodes = 1, placed = 0;
+
+	if (ENV(maps) == NULL) {
+		px_error("No regions, run maps first");
+		return;
+	}
+
+	snprintf(fname, sizeof(fname), "/proc/%d/numa_maps", ENV(pid));
+
+	if ((buf = px_proc_read(fname, &len)) == NULL) {
+		px_error("Fail to read '%s' (%s)", fname, strerror(errno));
+		return;
+	}
+	if ((regions = calloc(ENV(nregions), sizeof(*regions))) == NULL) {
+		px_error("Failed to alloc!");
+		free(buf);
+		return;
+	}
+
+	for (p = buf; (p = _px_numa_scan(p, &line, &nodes)) != NULL;) {
+		if ((r = px_maps_lookup(line.start)) == -1) {
+			++unknown;
+			continue;
+		}
+		regions[r].policy = line.policy;
+		regions[r].policy_len = line.policy_len;
+
+		for (n = 0; n < nodes; ++n) {
+			regions[r].kib[n] += line.pages[n] * line.page_kib;
+		}
+	}
+
+	memset(cpu_node, -1, sizeof(cpu_node));
+	_px_numa_cpu_nodes(cpu_node);
+	_px_numa_threads(cpu_node, local);
+
+	/* Without the CPU to node map nothing can be called remote */
+	for (n = 0; n < PX_NUMA_MAX_NODES; ++n) {
+		placed |= local[n];
+	}
+
+	printf("\n%-33s %-4s ", "region (KiB)", "perm");
+	for (n = 0; n < nodes; ++n) {
+		snprintf(head, sizeof(head), "N%d", n);
+		printf("%10s ", head);
+	}
+	printf("%-16s %s\n", "policy", "name");
+
+	for (i = 0; i < ENV(nregions); ++i) {
+		for (n = 0, kib = 0, remote = 0; n < nodes; ++n) {
+			kib += regions[i].kib[n];
+			remote += local[n] ? 0 : regions[i].kib[n];
+			node_kib[n] += regions[i].kib[n];
+		}
+		if (kib == 0) {
+			continue;
+		}
+
+		snprintf(fname, sizeof(fname), "%" PRIxPTR "-%" PRIxPTR,
+			PX_MAPS_START(i), ENV(maps)[i].end);
+		printf("%-33s %-4s ", fname, ENV(maps)[i].perms);
+
+		for (n = 0; n < nodes; ++n) {
+			printf("%10" PRIu64 " ", regions[i].kib[n]);
+		}
+		printf("%-16.*s %s%s\n", regions[i].policy_len, regions[i].policy,
+			PX_MAPS_NAME(i), placed && remote * 2 > kib ? " [remote]" : "");
+
+		nremote += placed && remote * 2 > kib;
+	}
+
+	printf("[+]");
+	for (n = 0; n < nodes; ++n) {
+		printf(" %" PRIu64 " KiB on node %d%s", node_kib[n], n,
+			n + 1 < nodes ? "," : "");
+	}
+	printf("; %zu regions mostly on nodes no thread last ran on\n", nremote);
+
+	if (unknown) {
+		printf("[!] %zu mappings are not in the region table, run maps refresh\n",
+			unknown);
+	}
+
+	free(regions);
+	free(buf);
+}
@@ -0,0 +1,181 @@
+/**
+ * Copyright (c) 2012, Felipe Pena
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *   Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include "common.h"
+#include "cmd.h"
+#include "pool.h"
+#include "pagemap.h"
+
+/**
+ * State shared by the workers of px_pagemap_scan()
+ */
+typedef struct _px_pagemap_run {
+	int fd;
+	const px_pagemap_item *items;
+	uint64_t **entries;   /* one batch per worker */
+	px_pagemap_fn fn;
+	void *arg;
+} px_pagemap_run;
+
+/**
+ * Opens /proc/<pid>/pagemap, returns the descriptor or -1
+ * Several readers may share the descriptor, reads use pread().
+ */
+int px_pagemap_open(void)
+{
+	char fname[PATH_MAX];
+
+	snprintf(fname, sizeof(fname), "/proc/%d/pagemap", ENV(pid));
+
+	return open(fname, O_RDONLY | O_CLOEXEC);
+}
+
+/**
+ * Reads the entries of npages pages starting at addr into out
+ * Returns the number of entries read or -1
+ */
+ssize_t px_pagemap_read(int fd, uintptr_t addr, size_t npages, uint64_t *out)
+{
+	const off_t offset = (off_t) (addr / getpagesize()) * sizeof(uint64_t);
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < npages * sizeof(uint64_t)) {
+		if ((n = pread(fd, (char*) out + done, npages * sizeof(uint64_t) - done,
+				offset + done)) <= 0) {
+			if (n == -1 && errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		done += n;
+	}
+	return done ? (ssize_t) (done / sizeof(uint64_t)) : -1;
+}
+
+/**
+ * Splits the regions the filter accepts (all of them when NULL) into
+ * items of at most batch pages, in region order; [vsyscall] is never
+ * in the pagemap. Returns the number of items or -1.
+ */
+ssize_t px_pagemap_items(size_t batch, px_pagemap_filter filter, void *arg,
+	px_pagemap_item **out)
+{
+	const size_t page = getpagesize();
+	px_pagemap_item *items = NULL, *tmp;
+	size_t i, n = 0, size = 0;
+	uintptr_t addr;
+
+	for (i = 0; i < ENV(nregions); ++i) {
+		if (strcmp(PX_MAPS_NAME(i), "[vsyscall]") == 0
+			|| (filter && !filter(i, arg))) {
+			continue;
+		}
+		for (addr = PX_MAPS_START(i); addr < ENV(maps)[i].end;
+			addr += batch * page) {
+			if (n == size) {
+				size = size ? size * 2 : 256;
+
+				if ((tmp = realloc(items, sizeof(*items) * size)) == NULL) {
+					px_error("Failed to realloc!");
+					px_safe_free(items);
+					return -1;
+				}
+				items = tmp;
+			}
+			items[n].region = i;
+			items[n].addr = addr;
+			items[n].npages = (ENV(maps)[i].end - addr) / page < batch
+				? (ENV(maps)[i].end - addr) / page : batch;
+			++n;
+		}
+	}
+	*out = items;
+
+	return n;
+}
+
+/**
+ * px_parallel_for() worker reading the entries of one item
+ */
+static void _px_pagemap_batch(size_t i, unsigned worker, void *arg)
+{
+	px_pagemap_run *run = arg;
+	const px_pagemap_item *item = &run->items[i];
+	ssize_t n = -1;
+
+	if (run->fd != -1) {
+		n = px_pagemap_read(run->fd, item->addr, item->npages,
+			run->entries[worker]);
+	}
+	run->fn(i, worker, run->entries[worker], n, run->arg);
+}
+
+/**
+ * Reads the entries of every item on the worker threads and hands them to
+ * fn; each worker reuses one buffer of batch entries. fd may be -1, fn
+ * then gets no entries. Returns -1 when the buffers cannot be allocated.
+ */
+int px_pagemap_scan(int fd, const px_pagemap_item *items, size_t n,
+	size_t batch, unsigned jobs, px_pagemap_fn fn, void *arg)
+{
+	px_pagemap_run run;
+	unsigned w;
+	int ret = 0;
+
+	run.fd = fd;
+	run.items = items;
+	run.fn = fn;
+	run.arg = arg;
+
+	if ((run.entries = calloc(jobs, sizeof(*run.entries))) == NULL) {
+		px_error("Failed to alloc!");
+		return -1;
+	}
+	for (w = 0; w < jobs; ++w) {
+		if ((run.entries[w] = malloc(batch * sizeof(uint64_t))) == NULL) {
+			px_error("Failed to alloc!");
+			ret = -1;
+			goto out;
+		}
+	}
+
+	px_parallel_for(n, jobs, _px_pagemap_batch, &run);
+out:
+	for (w = 0; w < jobs; ++w) {
+		px_safe_free(run.entries[w]);
+	}
+	free(run.entries);
+
+	return ret;
+}
@@ -0,0 +1,69 @@
+/**
+ * Copyright (c) 2012, Felipe Pena
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *   Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PX_PAGEMAP
+#define PX_PAGEMAP
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * /proc/<pid>/pagemap entry bits (see Documentation/admin-guide/mm/pagemap.rst)
+ */
+#define PX_PM_PRESENT    (1ULL << 63)
+#define PX_PM_SWAPPED    (1ULL << 62)
+#define PX_PM_FILE       (1ULL << 61) /* file page or shared anon */
+#define PX_PM_EXCLUSIVE  (1ULL << 56) /* mapped exactly once */
+#define PX_PM_SOFT_DIRTY (1ULL << 55)
+#define PX_PM_PFN_MASK   ((1ULL << 55) - 1)
+
+/**
+ * Pages of one region whose entries are read with a single pread()
+ */
+typedef struct _px_pagemap_item {
+	size_t region;
+	uintptr_t addr;
+	size_t npages;
+} px_pagemap_item;
+
+/**
+ * Selects the regions px_pagemap_items() splits into batches
+ */
+typedef int (*px_pagemap_filter)(size_t, void*);
+
+/**
+ * Called on a worker thread with the item index, the worker, the entries
+ * read and their number (-1 when the pagemap could not be read)
+ */
+typedef void (*px_pagemap_fn)(size_t, unsigned, const uint64_t*, ssize_t, void*);
+
+int px_pagemap_open(void);
+ssize_t px_pagemap_read(int, uintptr_t, size_t, uint64_t*);
+ssize_t px_pagemap_items(size_t, px_pagemap_filter, void*, px_pagemap_item**);
+int px_pagemap_scan(int, const px_pagemap_item*, size_t, size_t, unsigned,
+	px_pagemap_fn, void*);
+
+#endif /* PX_PAGEMAP */
@@ -0,0 +1,121 @@
+/**
+ * Copyright (c) 2012, Felipe Pena
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *   Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "common.h"
+#include "cmd.h"
+#include "pool.h"
+
+/**
+ * Shared state of one px_parallel_for() run
+ */
+typedef struct _px_pool_run {
+	size_t next;   /* next index to hand out */
+	size_t n;
+	px_pool_fn fn;
+	void *arg;
+} px_pool_run;
+
+typedef struct _px_pool_worker {
+	px_pool_run *run;
+	unsigned id;
+} px_pool_worker;
+
+/**
+ * Returns the number of workers to use (--jobs, or one per online CPU)
+ */
+unsigned px_pool_jobs(void)
+{
+	long ncpu;
+
+	if (ENV(jobs)) {
+		return ENV(jobs);
+	}
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return ncpu > 0 ? (unsigned) ncpu : 1;
+}
+
+/**
+ * Worker loop, items are handed out one at a time so uneven work balances
+ */
+static void *_px_pool_worker(void *arg)
+{
+	const px_pool_worker *worker = arg;
+	px_pool_run *run = worker->run;
+	size_t i;
+
+	while ((i = __atomic_fetch_add(&run->next, 1, __ATOMIC_RELAXED)) < run->n) {
+		run->fn(i, worker->id, run->arg);
+	}
+	return NULL;
+}
+
+/**
+ * Calls fn(i, worker, arg) for every i in [0, n) on up to jobs threads
+ * The calling thread is worker 0; the call returns once every item is
+ * done. A thread that cannot be created just leaves its share to the
+ * others.
+ */
+void px_parallel_for(size_t n, unsigned jobs, px_pool_fn fn, void *arg)
+{
+	px_pool_run run = { 0, n, fn, arg };
+	px_pool_worker single = { &run, 0 }, *workers = NULL;
+	pthread_t *threads = NULL;
+	unsigned i, started = 0;
+
+	if (jobs > n) {
+		jobs = n;
+	}
+
+	if (jobs <= 1 || (workers = malloc(sizeof(*workers) * jobs)) == NULL
+		|| (threads = malloc(sizeof(*threads) * jobs)) == NULL) {
+		px_safe_free(workers);
+		_px_pool_worker(&single);
+		return;
+	}
+
+	for (i = 0; i < jobs; ++i) {
+		workers[i].run = &run;
+		workers[i].id = i;
+	}
+	for (i = 1; i < jobs; ++i) {
+		if (pthread_create(&threads[started], NULL, _px_pool_worker,
+				&workers[i]) == 0) {
+			++started;
+		}
+	}
+	_px_pool_worker(&workers[0]);
+
+	for (i = 0; i < started; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+	free(workers);
+}
@@ -0,0 +1,87 @@
+/**
+ * Copyright (c) 2012, Felipe Pena
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *   Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "common.h"
+#include "proc.h"
+
+/**
+ * Size of the first read, the buffer doubles whenever it fills up
+ */
+#define PX_PROC_READ_SIZE (256 << 10)
+
+/**
+ * Reads a whole procfs file with a few large read(2) calls
+ * Returns a malloc'd NUL-terminated buffer and stores its length in len,
+ * or NULL on failure.
+ */
+char *px_proc_read(const char *fname, size_t *len)
+{
+	size_t size = PX_PROC_READ_SIZE, used = 0;
+	char *buf = NULL, *tmp;
+	ssize_t n;
+	int fd;
+
+	if ((fd = open(fname, O_RDONLY | O_CLOEXEC)) == -1) {
+		return NULL;
+	}
+
+	do {
+		if (buf == NULL || used + 1 == size) {
+			if (buf) {
+				size *= 2;
+			}
+			if ((tmp = realloc(buf, size)) == NULL) {
+				px_error("Failed to realloc!");
+				px_safe_free(buf);
+				close(fd);
+				return NULL;
+			}
+			buf = tmp;
+		}
+
+		if ((n = read(fd, buf + used, size - used - 1)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			px_safe_free(buf);
+			close(fd);
+			return NULL;
+		}
+		used += n;
+	} while (n > 0);
+
+	close(fd);
+
+	buf[used] = '\0';
+	*len = used;
+
+	return buf;
+}
@@ -0,0 +1,89 @@
+/**
+ * Copyright (c) 2012, Felipe Pena
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *   Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PX_PROC
+#define PX_PROC
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * In-place scanners for procfs text, they advance *p past what they read
+ */
+static inline uint64_t px_proc_hex(const char **p)
+{
+	const char *s = *p;
+	uint64_t value = 0;
+	unsigned int c;
+
+	for (;; ++s) {
+		if ((c = *s - '0') < 10) {
+			value = (value << 4) | c;
+		} else if ((c = (*s | 0x20) - 'a') < 6) {
+			value = (value << 4) | (c + 10);
+		} else {
+			break;
+		}
+	}
+	*p = s;
+	return value;
+}
+
+static inline uint64_t px_proc_dec(const char **p)
+{
+	const char *s = *p;
+	uint64_t value = 0;
+	unsigned int c;
+
+	while ((c = *s - '0') < 10) {
+		value = value * 10 + c;
+		++s;
+	}
+	*p = s;
+	return value;
+}
+
+static inline void px_proc_skip_spaces(const char **p)
+{
+	while (**p == ' ' || **p == '\t') {
+		++*p;
+	}
+}
+
+/**
+ * Skips the current field and the blanks after it
+ */
+static inline void px_proc_skip_field(const char **p)
+{
+	while (**p != ' ' && **p != '\t' && **p != '\n' && **p != '\0') {
+		++*p;
+	}
+	px_proc_skip_spaces(p);
+}
+
+char *px_proc_read(const char*, size_t*);
+
+#endif /* PX_PROC */
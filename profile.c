@@ -0,0 +1,403 @@
+/**
+ * Copyright (c) 2012, Felipe Pena
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *   Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <time.h>
+#include <elf.h>
+#include <sys/ptrace.h>
+#include <sys/user.h>
+#include <sys/uio.h>
+#include "common.h"
+#include "cmd.h"
+#include "ptrace.h"
+#include "sym.h"
+#include "trace.h"
+#include "unwind.h"
+#include "counts.h"
+#include "profile.h"
+
+#define PX_PROFILE_DEFAULT_HZ      99
+#define PX_PROFILE_MAX_HZ          10000
+#define PX_PROFILE_DEFAULT_SECONDS 30
+
+/**
+ * Frames kept per sample
+ */
+#define PX_PROFILE_DEPTH 128
+
+/**
+ * How far above the stack pointer the unwinder may read
+ */
+#define PX_PROFILE_STACK (256 << 10)
+
+/**
+ * Hottest stacks printed when no --out file is given
+ */
+#define PX_PROFILE_TOP 20
+
+/**
+ * Without register names for the architecture (see trace.h) the file
+ * still builds, and profile only reports that it is not supported
+ */
+#ifndef PX_REG_PC
+# define PX_PROFILE_UNSUPPORTED
+# define PX_REG_PC(r) 0
+# define PX_REG_SP(r) 0
+# define PX_REG_FP(r) 0
+# define PX_REG_LR(r) 0
+#endif
+
+typedef struct _px_profile {
+	unsigned hz;
+	unsigned seconds;
+	const char *out;
+	px_counts_table stacks;   /* raw PC stacks */
+	unsigned char *stack;     /* stack window of the sampled thread */
+	uint64_t samples;
+	uint64_t failed;          /* stops whose registers could not be read */
+	uint64_t ticks;
+	uint64_t missed;          /* ticks skipped because sampling ran late */
+	uint64_t paused_ns;       /* sum of interrupt to resume times */
+	uint64_t max_pause_ns;
+	uint64_t sample_ns;       /* sum of stop to resume times */
+	uint64_t frames;
+	size_t max_threads;
+} px_profile_state;
+
+/**
+ * Unwinds a stopped thread from its registers
+ * Returns the number of PCs stored, leaf first.
+ */
+static size_t _px_profile_unwind(px_profile_state *p, pid_t tid, uintptr_t *pcs)
+{
+	struct user_regs_struct regs;
+	struct iovec iov = { &regs, sizeof(regs) };
+	px_unwind_regs uregs;
+	px_unwind_stack stack;
+
+	if (ptrace(PTRACE_GETREGSET, tid, NT_PRSTATUS, &iov) == -1) {
+		return 0;
+	}
+
+	uregs.pc = PX_REG_PC(regs);
+	uregs.sp = PX_REG_SP(regs);
+	uregs.fp = PX_REG_FP(regs);
+	uregs.lr = PX_REG_LR(regs);
+
+	stack.buf = p->stack;
+	stack.size = PX_PROFILE_STACK;
+	stack.base = uregs.sp;
+	stack.len = 0;
+
+	return px_unwind(&uregs, &stack, pcs, PX_PROFILE_DEPTH);
+}
+
+/**
+ * Takes a sample of a thread stopped by PTRACE_INTERRUPT
+ */
+static void _px_profile_sample(px_profile_state *p, pid_t tid)
+{
+	uintptr_t pcs[PX_PROFILE_DEPTH];
+	size_t n;
+
+	if ((n = _px_profile_unwind(p, tid, pcs)) == 0) {
+		++p->failed;
+		return;
+	}
+	if (px_counts_add(&p->stacks, pcs, n * sizeof(*pcs), 1) == -1) {
+		++p->failed;
+		return;
+	}
+	++p->samples;
+	p->frames += n;
+}
+
+/**
+ * Appends the name of a frame to a folded stack; return addresses are
+ * looked up one byte back, in the call instruction
+ */
+static size_t _px_profile_frame(char *buf, size_t len, uintptr_t pc, int caller)
+{
+	px_sym_info info;
+	int n;
+
+	if (px_sym_resolve(caller ? pc - 1 : pc, &info) == 0) {
+		n = snprintf(buf, len, "[unknown]");
+	} else if (info.name) {
+		n = snprintf(buf, len, "%s", info.name);
+	} else {
+		n = snprintf(buf, len, "[%s]", info.object[0] ? info.object : "anon");
+	}
+	return n < 0 ? 0 : (size_t) n < len ? (size_t) n : len - 1;
+}
+
+/**
+ * Folds the PC stacks into root;...;leaf strings, merging the stacks
+ * that only differ in offsets, and writes them out hottest first
+ */
+static int _px_profile_report(px_profile_state *p)
+{
+	px_counts_table folded = { NULL, 0, 0 };
+	px_counts_entry **order;
+	const uintptr_t *pcs;
+	char line[PX_PROFILE_DEPTH * 64];
+	size_t i, k, n, len, limit;
+	FILE *fp = stdout;
+	int ret = -1;
+
+	for (i = 0; i < p->stacks.nslots; ++i) {
+		if (p->stacks.slots[i].key == NULL) {
+			continue;
+		}
+		pcs = p->stacks.slots[i].key;
+		n = p->stacks.slots[i].len / sizeof(*pcs);
+
+		for (k = n, len = 0; k-- > 0 && len + 1 < sizeof(line);) {
+			len += _px_profile_frame(line + len, sizeof(line) - len, pcs[k],
+				k != 0);
+
+			if (k && len + 1 < sizeof(line)) {
+				line[len++] = ';';
+			}
+		}
+		if (px_counts_add(&folded, line, len, p->stacks.slots[i].count) == -1) {
+			px_error("Failed to alloc!");
+			goto out;
+		}
+	}
+
+	if ((order = px_counts_sorted(&folded)) == NULL) {
+		px_error("Failed to alloc!");
+		goto out;
+	}
+	n = folded.n;
+
+	if (p->out && (fp = fopen(p->out, "w")) == NULL) {
+		px_error("Failed to open %s (%s)", p->out, strerror(errno));
+		free(order);
+		goto out;
+	}
+
+	limit = p->out ? n : n < PX_PROFILE_TOP ? n : PX_PROFILE_TOP;
+
+	for (i = 0; i < limit; ++i) {
+		fprintf(fp, "%.*s %" PRIu64 "\n", (int) order[i]->len,
+			(const char*) order[i]->key, order[i]->count);
+	}
+
+	if (p->out) {
+		if (fclose(fp) == EOF) {
+			px_error("Failed to write %s (%s)", p->out, strerror(errno));
+		} else {
+			printf("[+] %zu folded stacks written to %s\n", n, p->out);
+		}
+	} else if (n > limit) {
+		printf("[+] %zu more stacks, use --out to get them all\n", n - limit);
+	}
+	free(order);
+	ret = 0;
+out:
+	px_counts_free(&folded);
+
+	return ret;
+}
+
+/**
+ * Samples the threads at every tick until the time is up or the target
+ * exits. Each thread only stops for its own sample: all are interrupted
+ * at once and each one is resumed as soon as its stack was read.
+ */
+static void _px_profile_run(px_profile_state *p, px_threads *threads)
+{
+	const uint64_t period = 1000000000ULL / p->hz;
+	const uint64_t end = px_clock_ns() + (uint64_t) p->seconds * 1000000000ULL;
+	struct timespec ts;
+	uint64_t next = px_clock_ns(), now, stopped, pause;
+	ssize_t i;
+
+	while (threads->n && next < end) {
+		if (threads->n > p->max_threads) {
+			p->max_threads = threads->n;
+		}
+		px_threads_interrupt(threads);
+		++p->ticks;
+
+		while (threads->interrupted && (i = px_threads_wait(threads)) != -1) {
+			if (threads->list[i].interrupted) {
+				stopped = px_clock_ns();
+				_px_profile_sample(p, threads->list[i].tid);
+
+				now = px_clock_ns();
+				pause = now - threads->list[i].since;
+				p->paused_ns += pause;
+				p->sample_ns += now - stopped;
+
+				if (pause > p->max_pause_ns) {
+					p->max_pause_ns = pause;
+				}
+			}
+			px_threads_resume(threads, i);
+		}
+
+		/* Ticks that already passed are dropped, not bunched up */
+		next += period;
+
+		if ((now = px_clock_ns()) > next) {
+			p->missed += (now - next) / period + 1;
+			next += ((now - next) / period + 1) * period;
+		}
+		ts.tv_sec = next / 1000000000ULL;
+		ts.tv_nsec = next % 1000000000ULL;
+
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+	}
+}
+
+/**
+ * Profiles the target by sampling the stacks of its threads
+ * profile [--hz N] [--seconds N] [--out file]
+ * The output is in the folded format of flamegraph.pl, one line per
+ * distinct stack with its sample count.
+ */
+void px_profile(const char *params)
+{
+	px_profile_state p;
+	px_threads *threads = &ENV(threads);
+	px_unwind_stats before, after;
+	char *opts = NULL, *token, *saveptr = NULL, *value;
+	uint64_t t0, elapsed;
+	double thread_ns;
+
+	memset(&p, 0, sizeof(p));
+	p.hz = PX_PROFILE_DEFAULT_HZ;
+	p.seconds = PX_PROFILE_DEFAULT_SECONDS;
+
+#ifdef PX_PROFILE_UNSUPPORTED
+	px_error("profile is not supported on this architecture");
+	return;
+#endif
+
+	if (params && (opts = strdup(params)) == NULL) {
+		px_error("Failed to alloc!");
+		return;
+	}
+
+	for (token = opts ? strtok_r(opts, " ", &saveptr) : NULL; token;
+		token = strtok_r(NULL, " ", &saveptr)) {
+		if ((value = strtok_r(NULL, " ", &saveptr)) == NULL) {
+			px_error("Missing value for %s", token);
+			goto out;
+		}
+		if (strcmp(token, "--hz") == 0) {
+			p.hz = strtoul(value, NULL, 10);
+
+			if (p.hz == 0 || p.hz > PX_PROFILE_MAX_HZ) {
+				px_error("--hz must be between 1 and %d", PX_PROFILE_MAX_HZ);
+				goto out;
+			}
+		} else if (strcmp(token, "--seconds") == 0) {
+			if ((p.seconds = strtoul(value, NULL, 10)) == 0) {
+				px_error("--seconds expects a positive number");
+				goto out;
+			}
+		} else if (strcmp(token, "--out") == 0) {
+			p.out = value;
+		} else {
+			px_error("Unknown option %s", token);
+			goto out;
+		}
+	}
+
+	if (ENV(maps) == NULL) {
+		px_error("No regions, run maps first");
+		goto out;
+	}
+	if (ENV(symbols).tables == NULL && px_sym_build() == -1) {
+		goto out;
+	}
+	if ((p.stack = malloc(PX_PROFILE_STACK)) == NULL) {
+		px_error("Failed to alloc!");
+		goto out;
+	}
+
+	/* The session's threads run between samples */
+	px_threads_resume_all(threads);
+
+	printf("[+] Sampling %zu threads at %u Hz for %us\n", threads->n, p.hz,
+		p.seconds);
+	fflush(stdout);
+
+	px_unwind_stats_get(&before);
+	t0 = px_clock_ns();
+	_px_profile_run(&p, threads);
+	elapsed = px_clock_ns() - t0;
+
+	px_unwind_stats_get(&after);
+	px_threads_stop(threads);
+
+	if (threads->n == 0) {
+		printf("[+] pid %d is gone\n", ENV(pid));
+		px_threads_clear(threads);
+		ptrace_reset();
+		ENV(pid) = 0;
+	}
+
+	if (p.samples == 0) {
+		px_error("No samples taken");
+		goto out;
+	}
+
+	_px_profile_report(&p);
+
+	/* Thread time is approximated by the samples each tick took */
+	thread_ns = (double) elapsed * (p.samples + p.failed) / p.ticks;
+
+	printf("[+] %" PRIu64 " samples (%" PRIu64 " failed) of up to %zu threads "
+		"in %.1fs, %" PRIu64 " ticks missed, %zu distinct stacks, "
+		"%.1f frames per sample\n", p.samples, p.failed, p.max_threads,
+		elapsed / 1e9, p.missed, p.stacks.n, (double) p.frames / p.samples);
+	printf("[+] %" PRIu64 " frames unwound through .eh_frame, %" PRIu64
+		" through frame pointers, %.1f%% of the rules from the cache\n",
+		after.cfi - before.cfi, after.fp - before.fp,
+		100.0 * (after.hits - before.hits) / ((after.hits - before.hits)
+			+ (after.misses - before.misses) + !(after.hits + after.misses)));
+
+	/* Interrupt to resume bounds the pause, the thread stops somewhere in it */
+	printf("[+] Threads paused at most %.1fus per sample (max %.1fus, %.1fus "
+		"of it reading the stack), running at least %.3f%% of the time\n",
+		p.paused_ns / 1e3 / (p.samples + p.failed), p.max_pause_ns / 1e3,
+		p.sample_ns / 1e3 / (p.samples + p.failed),
+		100.0 - 100.0 * p.paused_ns / thread_ns);
+out:
+	px_counts_free(&p.stacks);
+	px_safe_free(p.stack);
+	px_safe_free(opts);
+}
@@ -24,28 +24,478 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE
 #include <sys/ptrace.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include "common.h"
 #include "ptrace.h"
+#include "cache.h"
 #include "cmd.h"
 
 /**
- * Reads memory from the child process
+ * Ranges passed to one process_vm_readv(2) call
+ */
+#ifndef IOV_MAX
+# define IOV_MAX 1024
+#endif
+
+/**
+ * Read strategies, tried in order until one of them works
+ */
+typedef enum {
+	PX_READ_VM,    /* process_vm_readv(2) */
+	PX_READ_MEM,   /* pread(2) on /proc/<pid>/mem */
+	PX_READ_PEEK   /* PTRACE_PEEKTEXT, word by word */
+} px_read_method;
+
+static px_read_method g_method = PX_READ_VM;
+static int g_memfd = -1;
+static pid_t g_mempid = 0;
+
+/**
+ * Returns a descriptor for /proc/<pid>/mem, opening it on demand
+ */
+static int _px_ptrace_memfd(void)
+{
+	char fname[PATH_MAX];
+
+	if (g_memfd != -1 && g_mempid == ENV(pid)) {
+		return g_memfd;
+	}
+
+	if (g_memfd != -1) {
+		close(g_memfd);
+	}
+
+	snprintf(fname, sizeof(fname), "/proc/%d/mem", ENV(pid));
+
+	if ((g_memfd = open(fname, O_RDONLY | O_CLOEXEC)) != -1) {
+		g_mempid = ENV(pid);
+	}
+	return g_memfd;
+}
+
+/**
+ * Reads through process_vm_readv(2), resuming after partial transfers
+ */
+static ssize_t _px_ptrace_read_vm(uintptr_t addr, void *vptr, size_t len)
+{
+	struct iovec local, remote;
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len) {
+		local.iov_base = (char*)vptr + done;
+		local.iov_len = len - done;
+		remote.iov_base = (void*)(addr + done);
+		remote.iov_len = len - done;
+
+		if ((n = process_vm_readv(ENV(pid), &local, 1, &remote, 1, 0)) <= 0) {
+			break;
+		}
+		done += n;
+	}
+	return done || len == 0 ? (ssize_t)done : -1;
+}
+
+/**
+ * Reads through pread(2) on /proc/<pid>/mem
  */
-void ptrace_read(uintptr_t addr, void *vptr, size_t len)
+static ssize_t _px_ptrace_read_mem(uintptr_t addr, void *vptr, size_t len)
+{
+	size_t done = 0;
+	ssize_t n;
+	int fd;
+
+	if ((fd = _px_ptrace_memfd()) == -1) {
+		return -1;
+	}
+
+	while (done < len) {
+		if ((n = pread(fd, (char*)vptr + done, len - done,
+				(off_t)(addr + done))) <= 0) {
+			if (n == -1 && errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		done += n;
+	}
+	return done || len == 0 ? (ssize_t)done : -1;
+}
+
+/**
+ * Reads through PTRACE_PEEKTEXT, one word per syscall
+ */
+static ssize_t _px_ptrace_read_peek(uintptr_t addr, void *vptr, size_t len)
 {
 	const size_t long_size = sizeof(long);
-	int i = 0, j = len / long_size, is_exact = len % long_size;
+	size_t done = 0, n;
 	long word;
-	void *saddr = vptr;
 
-	while (i <= j) {
-		if (i == j && is_exact == 0) {
+	while (done < len) {
+		errno = 0;
+		word = ptrace(PTRACE_PEEKTEXT, ENV(pid), addr + done, NULL);
+
+		if (word == -1 && errno != 0) {
 			break;
 		}
-		word = ptrace(PTRACE_PEEKTEXT, ENV(pid), addr + i * long_size, NULL);
-		memcpy(saddr, &word, i == j ? (len % long_size) : long_size);
-		saddr += long_size;
-		++i;
+
+		n = len - done < long_size ? len - done : long_size;
+		memcpy((char*)vptr + done, &word, n);
+		done += n;
+	}
+	return done || len == 0 ? (ssize_t)done : -1;
+}
+
+/**
+ * Reads memory from the child process without the page cache
+ * Returns the number of bytes read, which may be short when the range
+ * runs into unmapped memory, or -1 when nothing could be read at all.
+ */
+ssize_t ptrace_read_direct(uintptr_t addr, void *vptr, size_t len)
+{
+	ssize_t n = -1;
+
+	if (ENV(source)) {
+		return ENV(source)->read(addr, vptr, len);
+	}
+
+	switch (g_method) {
+		case PX_READ_VM:
+			if ((n = _px_ptrace_read_vm(addr, vptr, len)) != -1
+				|| (errno != ENOSYS && errno != EPERM)) {
+				break;
+			}
+			g_method = PX_READ_MEM;
+			/* fall through */
+		case PX_READ_MEM:
+			if ((n = _px_ptrace_read_mem(addr, vptr, len)) != -1
+				|| (errno != ENOENT && errno != EACCES && errno != EPERM)) {
+				break;
+			}
+			g_method = PX_READ_PEEK;
+			/* fall through */
+		case PX_READ_PEEK:
+			n = _px_ptrace_read_peek(addr, vptr, len);
+			break;
+	}
+
+	return n;
+}
+
+/**
+ * Reads a contiguous remote range into scattered local buffers
+ * Returns the number of bytes read or -1, like ptrace_read_direct()
+ */
+ssize_t ptrace_read_iov(uintptr_t addr, const struct iovec *local, size_t n)
+{
+	struct iovec remote;
+	size_t i, total = 0;
+	ssize_t got;
+
+	for (i = 0; i < n; ++i) {
+		total += local[i].iov_len;
+	}
+
+	if (g_method == PX_READ_VM && n <= IOV_MAX && ENV(source) == NULL) {
+		remote.iov_base = (void*)addr;
+		remote.iov_len = total;
+
+		if ((got = process_vm_readv(ENV(pid), local, n, &remote, 1, 0)) != -1
+			|| (errno != ENOSYS && errno != EPERM)) {
+			return got;
+		}
+	}
+
+	for (i = 0, total = 0; i < n; ++i) {
+		got = ptrace_read_direct(addr + total, local[i].iov_base,
+			local[i].iov_len);
+
+		if (got > 0) {
+			total += got;
+		}
+		if (got < (ssize_t)local[i].iov_len) {
+			break;
+		}
+	}
+	return total ? (ssize_t)total : -1;
+}
+
+/**
+ * Reads memory from the child process
+ * The part of the buffer that could not be read is zero-filled, so callers
+ * reading fixed-size strings always get them terminated.
+ */
+ssize_t ptrace_read(uintptr_t addr, void *vptr, size_t len)
+{
+	/* Files are mapped already, caching them would only copy more */
+	ssize_t n = ENV(source) ? ENV(source)->read(addr, vptr, len)
+		: px_cache_read(addr, vptr, len);
+
+	if (n < (ssize_t)len) {
+		memset((char*)vptr + (n > 0 ? n : 0), 0, len - (n > 0 ? n : 0));
+	}
+	return n;
+}
+
+/**
+ * Requests closer than this are merged into a single remote range,
+ * reading the gap between them into a bounce buffer
+ */
+#define PX_READV_GAP 256
+
+/**
+ * A merged remote range covering one or more requests
+ */
+typedef struct _px_read_run {
+	uintptr_t addr;
+	size_t len;
+	size_t first;   /* first request (index into the sorted order) */
+	size_t count;   /* number of requests in the run */
+	char *bounce;   /* NULL when requests are exactly adjacent */
+} px_read_run;
+
+static int _px_read_req_cmp(const void *a, const void *b)
+{
+	const px_read_req *x = *(const px_read_req**)a, *y = *(const px_read_req**)b;
+
+	return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+/**
+ * Copies a bounce buffer out to the requests of its run
+ */
+static void _px_readv_scatter(const px_read_run *run, const px_read_req **order)
+{
+	size_t i;
+
+	for (i = run->first; i < run->first + run->count; ++i) {
+		memcpy(order[i]->buf, run->bounce + (order[i]->addr - run->addr),
+			order[i]->len);
+	}
+}
+
+/**
+ * Reads a run on its own, used when the batched transfer came up short
+ */
+static void _px_readv_single(const px_read_run *run, const px_read_req **order)
+{
+	size_t i;
+
+	if (run->bounce) {
+		ptrace_read(run->addr, run->bounce, run->len);
+		_px_readv_scatter(run, order);
+		return;
+	}
+	for (i = run->first; i < run->first + run->count; ++i) {
+		ptrace_read(order[i]->addr, order[i]->buf, order[i]->len);
+	}
+}
+
+/**
+ * Serves a run from the page cache when all of its pages are there
+ */
+static int _px_readv_cached(const px_read_run *run, const px_read_req **order)
+{
+	size_t i;
+
+	if (run->bounce) {
+		if (px_cache_peek(run->addr, run->bounce, run->len) == -1) {
+			return 0;
+		}
+		_px_readv_scatter(run, order);
+		return 1;
+	}
+	for (i = run->first; i < run->first + run->count; ++i) {
+		if (px_cache_peek(order[i]->addr, order[i]->buf, order[i]->len) == -1) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/**
+ * Reads a list of (remote address, length, local buffer) requests
+ * Requests are sorted, neighbouring ones merged, and the resulting ranges
+ * are served from the page cache when it holds them; the misses are moved
+ * with as few process_vm_readv(2) calls as IOV_MAX allows.
+ * Unreadable bytes are zero-filled as in ptrace_read(). Returns the total
+ * number of bytes requested, or -1 on allocation failure.
+ */
+ssize_t ptrace_readv(const px_read_req *reqs, size_t n)
+{
+	const px_read_req **order;
+	px_read_run *runs;
+	struct iovec *local, remote[IOV_MAX];
+	size_t i, j, nruns = 0, nlocal, nremote, bounce_len = 0, total = 0;
+	size_t batch;
+	char *bounce = NULL;
+	ssize_t got;
+
+	if (n == 0) {
+		return 0;
+	}
+
+	order = malloc(n * sizeof(*order));
+	runs = malloc(n * sizeof(*runs));
+	local = malloc((n < IOV_MAX ? n : IOV_MAX) * sizeof(*local));
+
+	if (order == NULL || runs == NULL || local == NULL) {
+		px_safe_free(order);
+		px_safe_free(runs);
+		px_safe_free(local);
+		return -1;
+	}
+
+	for (i = 0; i < n; ++i) {
+		order[i] = &reqs[i];
+		total += reqs[i].len;
+	}
+	qsort(order, n, sizeof(*order), _px_read_req_cmp);
+
+	/* Merge neighbouring requests into runs */
+	for (i = 0; i < n; ++i) {
+		px_read_run *run = nruns ? &runs[nruns - 1] : NULL;
+		uintptr_t end = order[i]->addr + order[i]->len;
+
+		if (order[i]->len == 0) {
+			continue;
+		}
+		if (run && order[i]->addr <= run->addr + run->len + PX_READV_GAP) {
+			if (order[i]->addr != run->addr + run->len) {
+				run->bounce = (char*)1;
+			}
+			if (end > run->addr + run->len) {
+				run->len = end - run->addr;
+			}
+			run->count = i - run->first + 1;
+			continue;
+		}
+		run = &runs[nruns++];
+		run->addr = order[i]->addr;
+		run->len = order[i]->len;
+		run->first = i;
+		run->count = 1;
+		run->bounce = NULL;
+	}
+
+	/* Runs with gaps or overlaps are read through a shared bounce buffer */
+	for (i = 0; i < nruns; ++i) {
+		if (runs[i].bounce) {
+			bounce_len += runs[i].len;
+		}
+	}
+	if (bounce_len && (bounce = malloc(bounce_len)) == NULL) {
+		free(order);
+		free(runs);
+		free(local);
+		return -1;
+	}
+	for (i = 0, bounce_len = 0; i < nruns; ++i) {
+		if (runs[i].bounce) {
+			runs[i].bounce = bounce + bounce_len;
+			bounce_len += runs[i].len;
+		}
+	}
+
+	/* Runs already in the page cache are served from it, the rest batched */
+	if (px_cache_enabled() && ENV(source) == NULL) {
+		for (i = 0, j = 0; i < nruns; ++i) {
+			if (!_px_readv_cached(&runs[i], order)) {
+				runs[j++] = runs[i];
+			}
+		}
+		nruns = j;
+	}
+
+	for (i = 0; i < nruns; i += batch) {
+		nlocal = nremote = 0;
+
+		/* Fill one batch without exceeding IOV_MAX on either side */
+		for (batch = 0; i + batch < nruns && nremote < IOV_MAX; ++batch) {
+			const px_read_run *run = &runs[i + batch];
+			size_t nl = run->bounce ? 1 : run->count;
+
+			if (nlocal + nl > IOV_MAX) {
+				break;
+			}
+			if (run->bounce) {
+				local[nlocal].iov_base = run->bounce;
+				local[nlocal++].iov_len = run->len;
+			} else {
+				for (j = run->first; j < run->first + run->count; ++j) {
+					local[nlocal].iov_base = order[j]->buf;
+					local[nlocal++].iov_len = order[j]->len;
+				}
+			}
+			remote[nremote].iov_base = (void*)run->addr;
+			remote[nremote++].iov_len = run->len;
+		}
+		if (batch == 0) {
+			/* A single run has more than IOV_MAX requests */
+			_px_readv_single(&runs[i], order);
+			batch = 1;
+			continue;
+		}
+
+		got = g_method == PX_READ_VM && ENV(source) == NULL
+			? process_vm_readv(ENV(pid), local, nlocal, remote, nremote, 0) : -1;
+
+		for (j = 0; j < batch; ++j) {
+			const px_read_run *run = &runs[i + j];
+
+			if (got >= (ssize_t)run->len) {
+				got -= run->len;
+				if (run->bounce) {
+					_px_readv_scatter(run, order);
+				}
+			} else {
+				got = 0;
+				_px_readv_single(run, order);
+			}
+		}
+	}
+
+	px_safe_free(bounce);
+	free(order);
+	free(runs);
+	free(local);
+
+	return total;
+}
+
+/**
+ * Tells whether ptrace_read_direct() may be called from worker threads
+ * PTRACE_PEEKTEXT only works from the tracing thread. The other methods
+ * work from any thread once /proc/<pid>/mem is open, so it is opened here.
+ */
+int ptrace_read_shared(void)
+{
+	if (ENV(source)) {
+		return 1;
+	}
+	if (g_method == PX_READ_MEM && _px_ptrace_memfd() == -1) {
+		return 0;
+	}
+	return g_method != PX_READ_PEEK;
+}
+
+/**
+ * Drops the per-process read state (called on detach)
+ */
+void ptrace_reset(void)
+{
+	if (g_memfd != -1) {
+		close(g_memfd);
+		g_memfd = -1;
 	}
+	g_mempid = 0;
+	g_method = PX_READ_VM;
 }
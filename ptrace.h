@@ -29,7 +29,23 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
-void ptrace_read(uintptr_t, void*, size_t);
+/**
+ * Scatter-gather read request (see ptrace_readv)
+ */
+typedef struct _px_read_req {
+	uintptr_t addr; /* remote address */
+	size_t len;     /* number of bytes */
+	void *buf;      /* local buffer */
+} px_read_req;
+
+ssize_t ptrace_read(uintptr_t, void*, size_t);
+ssize_t ptrace_readv(const px_read_req*, size_t);
+ssize_t ptrace_read_direct(uintptr_t, void*, size_t);
+ssize_t ptrace_read_iov(uintptr_t, const struct iovec*, size_t);
+int ptrace_read_shared(void);
+void ptrace_reset(void);
 
 #endif /* PX_PTRACE */
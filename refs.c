@@ -0,0 +1,353 @@
+/**
+ * Copyright (c) 2012, Felipe Pena
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *   Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "common.h"
+#include "cmd.h"
+#include "cache.h"
+#include "scan.h"
+#include "sym.h"
+#include "refs.h"
+
+/**
+ * Four words compared at once; GCC lowers it to SSE2/AVX2 as available
+ */
+typedef uint64_t px_refs_vec __attribute__((vector_size(32)));
+
+#define PX_REFS_LANES (sizeof(px_refs_vec) / sizeof(uint64_t))
+
+/**
+ * A pointer found in the target: the word at source holds target
+ */
+typedef struct _px_ref {
+	uintptr_t target;
+	uintptr_t source;
+} px_ref;
+
+typedef struct _px_ref_list {
+	px_ref *refs;
+	size_t n;
+	size_t size;
+	int failed;             /* an allocation failed, the list is short */
+} px_ref_list;
+
+typedef struct _px_refs_scan {
+	uintptr_t lo;           /* range the words are checked against */
+	uintptr_t span;
+	int index;              /* keep only words pointing into a region */
+	px_ref_list *lists;     /* one per worker */
+} px_refs_scan;
+
+/**
+ * Reverse pointer index, sorted by target; valid for one stop of one pid
+ */
+static struct {
+	px_ref_list list;
+	pid_t pid;
+	uint32_t epoch;
+} g_refs;
+
+static int _px_ref_add(px_ref_list *list, uintptr_t target, uintptr_t source)
+{
+	px_ref *refs;
+	size_t size;
+
+	if (list->n == list->size) {
+		size = list->size ? list->size * 2 : 1024;
+
+		if ((refs = realloc(list->refs, sizeof(*refs) * size)) == NULL) {
+			list->failed = 1;
+			return -1;
+		}
+		list->refs = refs;
+		list->size = size;
+	}
+	list->refs[list->n].target = target;
+	list->refs[list->n].source = source;
+	list->n++;
+
+	return 0;
+}
+
+/**
+ * px_scan_regions() callback, checks every aligned word of the chunk
+ * A word is a hit when (word - lo) < span, one unsigned compare covering
+ * both bounds, done PX_REFS_LANES words at a time.
+ */
+static void _px_refs_chunk(const px_scan_chunk *chunk, void *arg)
+{
+	const px_refs_scan *scan = arg;
+	px_ref_list *list = &scan->lists[chunk->worker];
+	const size_t nwords = chunk->limit / sizeof(uint64_t);
+	const px_refs_vec lo = { scan->lo, scan->lo, scan->lo, scan->lo };
+	const px_refs_vec span = { scan->span, scan->span, scan->span, scan->span };
+	px_refs_vec words, hit;
+	uint64_t word;
+	size_t i, k;
+
+	if (list->failed) {
+		return;
+	}
+
+	for (i = 0; i + PX_REFS_LANES <= nwords; i += PX_REFS_LANES) {
+		memcpy(&words, chunk->data + i * sizeof(uint64_t), sizeof(words));
+		hit = (px_refs_vec) ((words - lo) < span);
+
+		if ((hit[0] | hit[1] | hit[2] | hit[3]) == 0) {
+			continue;
+		}
+		for (k = 0; k < PX_REFS_LANES; ++k) {
+			if (hit[k] && (!scan->index || px_maps_lookup(words[k]) != -1)
+				&& _px_ref_add(list, words[k],
+					chunk->addr + (i + k) * sizeof(uint64_t)) == -1) {
+				return;
+			}
+		}
+	}
+
+	for (; i < nwords; ++i) {
+		memcpy(&word, chunk->data + i * sizeof(uint64_t), sizeof(word));
+
+		if (word - scan->lo < scan->span
+			&& (!scan->index || px_maps_lookup(word) != -1)
+			&& _px_ref_add(list, word, chunk->addr + i * sizeof(uint64_t)) == -1) {
+			return;
+		}
+	}
+}
+
+/**
+ * Scans the writable regions for words in [lo, lo + span)
+ * The per-worker results are concatenated into out.
+ */
+static int _px_refs_scan(uintptr_t lo, uintptr_t span, int index,
+	px_ref_list *out)
+{
+	const px_scan_filter filter = { "?w", NULL, NULL };
+	const unsigned jobs = px_scan_jobs();
+	px_refs_scan scan;
+	size_t total = 0;
+	unsigned w;
+	int ret = 0;
+
+	scan.lo = lo;
+	scan.span = span;
+	scan.index = index;
+
+	if ((scan.lists = calloc(jobs, sizeof(*scan.lists))) == NULL) {
+		px_error("Failed to alloc!");
+		return -1;
+	}
+
+	if (px_scan_regions(&filter, 0, _px_refs_chunk, &scan) == -1) {
+		ret = -1;
+	}
+
+	for (w = 0; w < jobs; ++w) {
+		total += scan.lists[w].n;
+
+		if (ret == 0 && scan.lists[w].failed) {
+			px_error("Failed to alloc!");
+			ret = -1;
+		}
+	}
+
+	memset(out, 0, sizeof(*out));
+
+	if (ret == 0 && total && (out->refs = malloc(sizeof(px_ref) * total)) == NULL) {
+		px_error("Failed to alloc!");
+		ret = -1;
+	}
+
+	for (w = 0; w < jobs; ++w) {
+		if (ret == 0 && scan.lists[w].n) {
+			memcpy(out->refs + out->n, scan.lists[w].refs,
+				sizeof(px_ref) * scan.lists[w].n);
+			out->n += scan.lists[w].n;
+		}
+		px_safe_free(scan.lists[w].refs);
+	}
+	out->size = out->n;
+	free(scan.lists);
+
+	return ret;
+}
+
+static int _px_ref_target_cmp(const void *a, const void *b)
+{
+	const px_ref *x = a, *y = b;
+
+	if (x->target != y->target) {
+		return x->target < y->target ? -1 : 1;
+	}
+	return x->source < y->source ? -1 : x->source > y->source;
+}
+
+static int _px_ref_source_cmp(const void *a, const void *b)
+{
+	const px_ref *x = a, *y = b;
+
+	return x->source < y->source ? -1 : x->source > y->source;
+}
+
+/**
+ * Checks whether the reverse index still describes the target
+ */
+static inline int _px_refs_index_valid(void)
+{
+	return g_refs.list.refs != NULL && g_refs.pid == ENV(pid)
+		&& g_refs.epoch == px_cache_epoch();
+}
+
+/**
+ * Builds the reverse index of every word pointing into a mapped region
+ */
+static void _px_refs_build_index(void)
+{
+	uintptr_t lo, hi;
+
+	px_refs_clear();
+
+	if (ENV(nregions) == 0) {
+		px_error("No regions, run maps first");
+		return;
+	}
+	lo = PX_MAPS_START(0);
+	hi = ENV(maps)[ENV(nregions) - 1].end;
+
+	if (_px_refs_scan(lo, hi - lo, 1, &g_refs.list) == -1) {
+		px_refs_clear();
+		return;
+	}
+	qsort(g_refs.list.refs, g_refs.list.n, sizeof(px_ref), _px_ref_target_cmp);
+
+	g_refs.pid = ENV(pid);
+	g_refs.epoch = px_cache_epoch();
+
+	printf("[+] %zu pointers indexed\n", g_refs.list.n);
+}
+
+/**
+ * Copies the indexed references to [lo, lo + span) into out
+ */
+static int _px_refs_from_index(uintptr_t lo, uintptr_t span, px_ref_list *out)
+{
+	const px_ref *refs = g_refs.list.refs;
+	size_t first = 0, hi = g_refs.list.n, half, last;
+
+	/* First entry with target >= lo */
+	while (hi > first) {
+		half = (hi - first) / 2;
+
+		if (refs[first + half].target < lo) {
+			first += half + 1;
+		} else {
+			hi = first + half;
+		}
+	}
+	for (last = first; last < g_refs.list.n
+		&& refs[last].target - lo < span; ++last);
+
+	memset(out, 0, sizeof(*out));
+
+	if (last == first) {
+		return 0;
+	}
+	if ((out->refs = malloc(sizeof(px_ref) * (last - first))) == NULL) {
+		px_error("Failed to alloc!");
+		return -1;
+	}
+	memcpy(out->refs, refs + first, sizeof(px_ref) * (last - first));
+	out->n = out->size = last - first;
+
+	return 0;
+}
+
+/**
+ * Finds the words in writable memory pointing at an address or range
+ * refs <addr | start-end | --index>
+ * Queries are answered from the reverse index while it is valid (same
+ * pid, target not resumed since it was built), by scanning otherwise.
+ */
+void px_refs(const char *params)
+{
+	px_ref_list found;
+	uintptr_t lo, hi;
+	char *end, source[PATH_MAX];
+	size_t i;
+	ssize_t region;
+	int ret;
+
+	if (strcmp(params, "--index") == 0) {
+		_px_refs_build_index();
+		return;
+	}
+
+	lo = strtoull(params, &end, 16);
+	hi = *end == '-' ? strtoull(end + 1, &end, 16) : lo + 1;
+
+	if (*end != '\0' || hi <= lo) {
+		px_error("Invalid address or range");
+		return;
+	}
+
+	if (ENV(symbols).tables == NULL && ELF(map)) {
+		px_sym_build();
+	}
+
+	ret = _px_refs_index_valid() ? _px_refs_from_index(lo, hi - lo, &found)
+		: _px_refs_scan(lo, hi - lo, 0, &found);
+
+	if (ret == -1) {
+		return;
+	}
+
+	qsort(found.refs, found.n, sizeof(px_ref), _px_ref_source_cmp);
+
+	for (i = 0; i < found.n; ++i) {
+		px_sym_format(found.refs[i].source, source, sizeof(source));
+		region = px_maps_lookup(found.refs[i].source);
+
+		printf("%#" PRIxPTR " -> %#" PRIxPTR " %s (%s)\n",
+			found.refs[i].source, found.refs[i].target, source,
+			region == -1 ? "----" : ENV(maps)[region].perms);
+	}
+	printf("[+] %zu references\n", found.n);
+
+	px_safe_free(found.refs);
+}
+
+/**
+ * Drops the reverse index
+ */
+void px_refs_clear(void)
+{
+	px_safe_free(g_refs.list.refs);
+	memset(&g_refs, 0, sizeof(g_refs));
+}
@@ -0,0 +1,288 @@
+/**
+ * Copyright (c) 2012, Felipe Pena
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *   Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <time.h>
+#include "common.h"
+#include "cmd.h"
+#include "pagemap.h"
+#include "pool.h"
+#include "residency.h"
+
+/**
+ * Pagemap entries read at once, one buffer per worker
+ */
+#define PX_RESIDENCY_BATCH 65536
+
+/**
+ * /proc/kpageflags bits (see Documentation/admin-guide/mm/pagemap.rst)
+ */
+#define PX_KPF_THP (1ULL << 22)
+
+/**
+ * Page counts of a region (or of a batch of its pages)
+ */
+typedef struct _px_residency_counts {
+	size_t pages;
+	size_t present;
+	size_t swapped;
+	size_t file;
+	size_t thp;
+	size_t shared;
+} px_residency_counts;
+
+typedef struct _px_residency_run {
+	int kpageflags;       /* -1 when the page flags cannot be read */
+	const px_pagemap_item *items;
+	px_residency_counts *counts; /* one per item */
+	uint64_t **flags;     /* one batch per worker */
+	size_t pfns;          /* present pages with a PFN, updated atomically */
+} px_residency_run;
+
+/**
+ * Counts the THP pages of a batch from /proc/kpageflags, reading each run
+ * of consecutive PFNs with a single pread()
+ */
+static size_t _px_residency_thp(px_residency_run *run, const uint64_t *pm,
+	size_t n, uint64_t *flags)
+{
+	size_t i = 0, k, len, thp = 0;
+	uint64_t pfn;
+	ssize_t got;
+
+	while (i < n) {
+		if (!(pm[i] & PX_PM_PRESENT) || (pfn = pm[i] & PX_PM_PFN_MASK) == 0) {
+			++i;
+			continue;
+		}
+		for (len = 1; i + len < n && (pm[i + len] & PX_PM_PRESENT)
+			&& (pm[i + len] & PX_PM_PFN_MASK) == pfn + len; ++len);
+
+		got = pread(run->kpageflags, flags, len * sizeof(uint64_t),
+			pfn * sizeof(uint64_t));
+
+		for (k = 0; got > 0 && k < (size_t) got / sizeof(uint64_t); ++k) {
+			thp += (flags[k] & PX_KPF_THP) != 0;
+		}
+		__atomic_add_fetch(&run->pfns, len, __ATOMIC_RELAXED);
+		i += len;
+	}
+	return thp;
+}
+
+/**
+ * Classifies the pages of a batch (run on the worker threads)
+ */
+static void _px_residency_batch(size_t i, unsigned worker, const uint64_t *pm,
+	ssize_t n, void *arg)
+{
+	px_residency_run *run = arg;
+	px_residency_counts *counts = &run->counts[i];
+	ssize_t k;
+
+	counts->pages = run->items[i].npages;
+
+	if (n <= 0) {
+		return;
+	}
+
+	for (k = 0; k < n; ++k) {
+		if (pm[k] & PX_PM_PRESENT) {
+			++counts->present;
+			counts->file += (pm[k] & PX_PM_FILE) != 0;
+			counts->shared += (pm[k] & PX_PM_EXCLUSIVE) == 0;
+		} else if (pm[k] & PX_PM_SWAPPED) {
+			++counts->swapped;
+		}
+	}
+
+	if (run->kpageflags != -1 && counts->present) {
+		counts->thp = _px_residency_thp(run, pm, n, run->flags[worker]);
+	}
+}
+
+/**
+ * px_pagemap_items() filter for --region
+ */
+static int _px_residency_wanted(size_t i, void *arg)
+{
+	return px_maps_match(i, NULL, arg);
+}
+
+static void _px_residency_add(px_residency_counts *to,
+	const px_residency_counts *from)
+{
+	to->pages += from->pages;
+	to->present += from->present;
+	to->swapped += from->swapped;
+	to->file += from->file;
+	to->thp += from->thp;
+	to->shared += from->shared;
+}
+
+static void _px_residency_print(const char *range, const char *perms,
+	const char *name, const px_residency_counts *c, size_t kib, int thp)
+{
+	printf("%-33s %-4s %10zu %10zu %8zu %10zu ", range, perms,
+		c->pages * kib, c->present * kib, c->swapped * kib, c->file * kib);
+
+	if (thp) {
+		printf("%8zu ", c->thp * kib);
+	} else {
+		printf("%8s ", "-");
+	}
+	printf("%8zu %s\n", c->shared * kib, name);
+}
+
+/**
+ * Reports how much of each region is resident, swapped, file backed, in
+ * transparent huge pages and shared, from /proc/<pid>/pagemap and
+ * /proc/kpageflags read in batches by the worker threads
+ * residency [--region name]
+ */
+void px_residency(const char *params)
+{
+	const size_t page = getpagesize(), kib = page >> 10;
+	const unsigned jobs = px_pool_jobs();
+	px_residency_run run;
+	px_pagemap_item *items = NULL;
+	px_residency_counts region, total;
+	const char *filter = NULL;
+	char range[64];
+	struct timespec t0, t1;
+	ssize_t n;
+	size_t i;
+	unsigned w;
+	int pagemap;
+
+	if (params && strncmp(params, "--region ", 9) == 0) {
+		filter = params + 9;
+	} else if (params && *params) {
+		px_error("Unknown option %s", params);
+		return;
+	}
+
+	if (ENV(maps) == NULL) {
+		px_error("No regions, run maps first");
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	memset(&run, 0, sizeof(run));
+
+	if ((pagemap = px_pagemap_open()) == -1) {
+		px_error("Failed to open the pagemap (%s)", strerror(errno));
+		return;
+	}
+	/* Needs CAP_SYS_ADMIN, as do the PFNs in the pagemap */
+	run.kpageflags = open("/proc/kpageflags", O_RDONLY | O_CLOEXEC);
+
+	if ((n = px_pagemap_items(PX_RESIDENCY_BATCH, _px_residency_wanted,
+			(void*) filter, &items)) == -1) {
+		goto out;
+	}
+
+	if ((run.counts = calloc(n ? n : 1, sizeof(*run.counts))) == NULL
+		|| (run.flags = calloc(jobs, sizeof(*run.flags))) == NULL) {
+		px_error("Failed to alloc!");
+		goto out;
+	}
+	for (w = 0; w < jobs; ++w) {
+		if ((run.flags[w] = malloc(PX_RESIDENCY_BATCH * sizeof(uint64_t))) == NULL) {
+			px_error("Failed to alloc!");
+			goto out;
+		}
+	}
+
+	run.items = items;
+
+	if (px_pagemap_scan(pagemap, items, n, PX_RESIDENCY_BATCH, jobs,
+			_px_residency_batch, &run) == -1) {
+		goto out;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	/* Without PFNs (no CAP_SYS_ADMIN) the page flags say nothing */
+	if (run.pfns == 0 && run.kpageflags != -1) {
+		close(run.kpageflags);
+		run.kpageflags = -1;
+	}
+
+	printf("%-33s %-4s %10s %10s %8s %10s %8s %8s\n", "region (KiB)", "perm",
+		"size", "resident", "swapped", "file", "thp", "shared");
+
+	memset(&total, 0, sizeof(total));
+
+	/* Items are in region order */
+	for (i = 0; i < (size_t) n; ) {
+		const size_t r = items[i].region;
+
+		memset(&region, 0, sizeof(region));
+
+		for (; i < (size_t) n && items[i].region == r; ++i) {
+			_px_residency_add(&region, &run.counts[i]);
+		}
+		_px_residency_add(&total, &region);
+
+		if (region.present == 0 && region.swapped == 0) {
+			continue;
+		}
+		snprintf(range, sizeof(range), "%" PRIxPTR "-%" PRIxPTR,
+			PX_MAPS_START(r), ENV(maps)[r].end);
+
+		_px_residency_print(range, ENV(maps)[r].perms, PX_MAPS_NAME(r), &region,
+			kib, run.kpageflags != -1);
+	}
+	_px_residency_print("total", "", "", &total, kib, run.kpageflags != -1);
+
+	if (run.kpageflags == -1) {
+		printf("[!] /proc/kpageflags is not readable, THP pages are not "
+			"counted\n");
+	}
+	printf("[+] %zu pages classified in %.3fs\n", total.pages,
+		(t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+out:
+	if (run.flags) {
+		for (w = 0; w < jobs; ++w) {
+			px_safe_free(run.flags[w]);
+		}
+		free(run.flags);
+	}
+	px_safe_free(run.counts);
+	px_safe_free(items);
+	close(pagemap);
+
+	if (run.kpageflags != -1) {
+		close(run.kpageflags);
+	}
+}
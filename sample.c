@@ -0,0 +1,745 @@
+/**
+ * Copyright (c) 2012, Felipe Pena
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *   Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "common.h"
+#include "cmd.h"
+#include "proc.h"
+#include "trace.h"
+#include "counts.h"
+#include "sample.h"
+
+#define PX_SAMPLE_DEFAULT_HZ 99
+#define PX_SAMPLE_MAX_HZ 1000
+#define PX_SAMPLE_DEFAULT_SECONDS 30
+
+/**
+ * Threads, syscalls, wait channels and stacks printed in the report
+ */
+#define PX_SAMPLE_TOP 20
+
+/**
+ * Fields of /proc/<pid>/task/<tid>/stat with the user and system time
+ */
+#define PX_SAMPLE_STAT_UTIME 14
+#define PX_SAMPLE_STAT_STIME 15
+
+/**
+ * fds value of a file opened on each read, when px ran out of fds
+ */
+#define PX_SAMPLE_REOPEN -2
+
+/**
+ * fds left for the reopened files and the rest of px
+ */
+#define PX_SAMPLE_SPARE_FDS 64
+
+/**
+ * The files polled per thread, opened once and read with pread()
+ */
+enum {
+	PX_SAMPLE_STAT,
+	PX_SAMPLE_WCHAN,
+	PX_SAMPLE_SYSCALL,
+	PX_SAMPLE_STACK,
+	PX_SAMPLE_FILES
+};
+
+static const char *const g_sample_files[PX_SAMPLE_FILES] = {
+	"stat", "wchan", "syscall", "stack"
+};
+
+/**
+ * Kinds of the counted keys, each key is a px_sample_key and a string
+ */
+enum {
+	PX_SAMPLE_KEY_SYSCALL = 's',
+	PX_SAMPLE_KEY_WCHAN = 'w',
+	PX_SAMPLE_KEY_STACK = 'k'
+};
+
+typedef struct _px_sample_key {
+	pid_t tid;                /* 0 in the per-process totals */
+	char kind;
+} px_sample_key;
+
+typedef struct _px_sample_thread {
+	pid_t tid;
+	int fds[PX_SAMPLE_FILES]; /* -1 when the file can not be read */
+	int gone;
+	char comm[16];
+	uint64_t running;         /* samples in R, on a CPU or waiting for one */
+	uint64_t sleeping;        /* samples in S */
+	uint64_t disk;            /* samples in D */
+	uint64_t other;           /* stopped, traced, zombie... */
+	uint64_t cpu_first;       /* utime + stime in clock ticks */
+	uint64_t cpu_last;
+	const px_counts_entry *top[2]; /* most seen syscall and wait channel */
+} px_sample_thread;
+
+typedef struct _px_sample {
+	pid_t pid;
+	int task;                 /* /proc/<pid>/task */
+	DIR *dir;                 /* rescans of task, on a dup of its fd */
+	unsigned hz;
+	unsigned seconds;
+	px_sample_thread *threads;
+	size_t n;
+	size_t size;
+	px_counts_table counts;
+	uint64_t ticks;
+	uint64_t missed;
+	size_t nfds;              /* files kept open */
+	size_t max_fds;
+	uint64_t reads;
+	uint64_t reopens;
+	uint64_t tick_ns;         /* sum of the time spent reading per tick */
+	uint64_t max_tick_ns;
+	px_threads *traced;       /* the attached threads, NULL when not ours */
+	uint64_t stops;           /* ptrace stops of the traced threads */
+	int readable[PX_SAMPLE_FILES];
+} px_sample_state;
+
+/**
+ * Opens a file of a thread, relative to the task directory
+ */
+static int _px_sample_open(px_sample_state *s, pid_t tid, int file)
+{
+	char name[64];
+
+	snprintf(name, sizeof(name), "%d/%s", tid, g_sample_files[file]);
+
+	return openat(s->task, name, O_RDONLY | O_CLOEXEC);
+}
+
+/**
+ * Reads a polled file of a thread into buf, NUL-terminated
+ * Returns the length, 0 when the file can not be read and -1 when the
+ * thread is gone.
+ */
+static ssize_t _px_sample_read(px_sample_state *s, px_sample_thread *t,
+	int file, char *buf, size_t size)
+{
+	ssize_t len;
+	int fd = t->fds[file];
+
+	if (fd == -1) {
+		return 0;
+	}
+	if (fd == PX_SAMPLE_REOPEN) {
+		if ((fd = _px_sample_open(s, t->tid, file)) == -1) {
+			return errno == ENOENT ? -1 : 0;
+		}
+		++s->reopens;
+	}
+
+	len = pread(fd, buf, size - 1, 0);
+	++s->reads;
+
+	if (t->fds[file] == PX_SAMPLE_REOPEN) {
+		close(fd);
+	}
+	if (len <= 0) {
+		/* procfs returns ESRCH, or nothing, once the thread exited */
+		return len == 0 || errno == ESRCH ? -1 : 0;
+	}
+	buf[len] = '\0';
+
+	return len;
+}
+
+static void _px_sample_close(px_sample_state *s, px_sample_thread *t)
+{
+	size_t i;
+
+	for (i = 0; i < PX_SAMPLE_FILES; ++i) {
+		if (t->fds[i] >= 0) {
+			close(t->fds[i]);
+			--s->nfds;
+		}
+		t->fds[i] = -1;
+	}
+	t->gone = 1;
+}
+
+/**
+ * Starts polling a thread: its files are opened once, and when px is out
+ * of fds they are opened on each read instead
+ */
+static int _px_sample_add(px_sample_state *s, pid_t tid)
+{
+	px_sample_thread *t;
+	size_t i;
+
+	if (s->n == s->size) {
+		s->size = s->size ? s->size * 2 : 64;
+
+		if ((t = realloc(s->threads, sizeof(*t) * s->size)) == NULL) {
+			px_error("Failed to realloc!");
+			return -1;
+		}
+		s->threads = t;
+	}
+	t = &s->threads[s->n];
+	memset(t, 0, sizeof(*t));
+	t->tid = tid;
+
+	for (i = 0; i < PX_SAMPLE_FILES; ++i) {
+		if ((t->fds[i] = _px_sample_open(s, tid, i)) != -1) {
+			s->readable[i] = 1;
+
+			if (s->nfds++ >= s->max_fds) {
+				close(t->fds[i]);
+				t->fds[i] = PX_SAMPLE_REOPEN;
+				--s->nfds;
+			}
+		} else if (errno == EMFILE || errno == ENFILE) {
+			t->fds[i] = PX_SAMPLE_REOPEN;
+		} else if (errno == ENOENT) {
+			_px_sample_close(s, t);
+			return 0;
+		}
+	}
+	++s->n;
+
+	return 0;
+}
+
+/**
+ * Adds the threads created since the last scan
+ */
+static void _px_sample_scan(px_sample_state *s)
+{
+	struct dirent *ent;
+	pid_t tid;
+	size_t i;
+
+	rewinddir(s->dir);
+
+	while ((ent = readdir(s->dir)) != NULL) {
+		if (ent->d_name[0] == '.') {
+			continue;
+		}
+		tid = atoi(ent->d_name);
+
+		for (i = 0; i < s->n && (s->threads[i].tid != tid
+			|| s->threads[i].gone); ++i);
+
+		if (i == s->n && _px_sample_add(s, tid) == -1) {
+			break;
+		}
+	}
+}
+
+/**
+ * Counts a key of the process, and of a thread unless tid is 0
+ */
+static void _px_sample_count(px_sample_state *s, pid_t tid, char kind,
+	const char *str, size_t len)
+{
+	char key[sizeof(px_sample_key) + 4096];
+	px_sample_key *k = (px_sample_key *) key;
+
+	if (len > sizeof(key) - sizeof(*k)) {
+		len = sizeof(key) - sizeof(*k);
+	}
+	memset(k, 0, sizeof(*k));
+	k->kind = kind;
+	memcpy(key + sizeof(*k), str, len);
+
+	px_counts_add(&s->counts, key, sizeof(*k) + len, 1);
+
+	if (tid) {
+		k->tid = tid;
+		px_counts_add(&s->counts, key, sizeof(*k) + len, 1);
+	}
+}
+
+/**
+ * Folds /proc/<pid>/task/<tid>/stack, leaf first "[<0>] func+0x1/0x2"
+ * lines, into root;...;leaf
+ */
+static size_t _px_sample_fold(const char *stack, char *out, size_t size)
+{
+	const char *lines[64], *p, *name;
+	size_t n = 0, len = 0, k;
+
+	for (p = stack; *p && n < sizeof(lines) / sizeof(*lines); ++p) {
+		lines[n++] = p;
+
+		if ((p = strchr(p, '\n')) == NULL) {
+			break;
+		}
+	}
+	while (n-- > 0 && len + 1 < size) {
+		if ((name = strchr(lines[n], ' ')) == NULL) {
+			continue;
+		}
+		for (++name, k = 0; name[k] && name[k] != '+' && name[k] != '\n'; ++k);
+
+		if (k >= size - len - 1) {
+			k = size - len - 1;
+		}
+		if (len) {
+			out[len++] = ';';
+		}
+		memcpy(out + len, name, k);
+		len += k;
+	}
+	return len < size ? len : size - 1;
+}
+
+/**
+ * Takes a sample of a thread
+ * The syscall, wait channel and stack are only read for blocked threads.
+ */
+static void _px_sample_thread_poll(px_sample_state *s, px_sample_thread *t)
+{
+	char buf[4096], folded[4096];
+	const char *p, *end;
+	uint64_t cpu;
+	ssize_t len;
+	char state;
+	int i;
+
+	if ((len = _px_sample_read(s, t, PX_SAMPLE_STAT, buf, sizeof(buf))) <= 0) {
+		if (len == -1) {
+			_px_sample_close(s, t);
+		}
+		return;
+	}
+
+	/* pid (comm) state ..., comm may hold spaces and parentheses */
+	if ((p = strchr(buf, '(')) == NULL || (end = strrchr(buf, ')')) == NULL) {
+		return;
+	}
+	if (t->comm[0] == '\0') {
+		snprintf(t->comm, sizeof(t->comm), "%.*s", (int) (end - p - 1), p + 1);
+	}
+	p = end + 2;
+	state = *p;
+
+	for (i = 3; i < PX_SAMPLE_STAT_UTIME; ++i) {
+		px_proc_skip_field(&p);
+	}
+	cpu = px_proc_dec(&p);
+	px_proc_skip_spaces(&p);
+	cpu += px_proc_dec(&p);
+
+	if (t->running + t->sleeping + t->disk + t->other == 0) {
+		t->cpu_first = cpu;
+	}
+	t->cpu_last = cpu;
+
+	switch (state) {
+		case 'R':
+			++t->running;
+			return;
+		case 'S':
+			++t->sleeping;
+			break;
+		case 'D':
+			++t->disk;
+			break;
+		default:
+			++t->other;
+			return;
+	}
+
+	/* "nr args... sp pc", "-1 sp pc" out of a syscall, or "running" once
+	 * it woke up */
+	if (_px_sample_read(s, t, PX_SAMPLE_SYSCALL, buf, sizeof(buf)) > 0
+		&& (buf[0] == '-' || (buf[0] >= '0' && buf[0] <= '9'))) {
+		_px_sample_count(s, t->tid, PX_SAMPLE_KEY_SYSCALL, buf,
+			strcspn(buf, " \n"));
+	}
+
+	if ((len = _px_sample_read(s, t, PX_SAMPLE_WCHAN, buf, sizeof(buf))) > 0
+		&& strcmp(buf, "0") != 0) {
+		_px_sample_count(s, t->tid, PX_SAMPLE_KEY_WCHAN, buf, len);
+	}
+
+	if (_px_sample_read(s, t, PX_SAMPLE_STACK, buf, sizeof(buf)) > 0
+		&& (len = _px_sample_fold(buf, folded, sizeof(folded))) > 0) {
+		_px_sample_count(s, 0, PX_SAMPLE_KEY_STACK, folded, len);
+	}
+}
+
+/**
+ * Resumes the attached threads that stopped since the last tick: signals
+ * are passed on and new threads let go, so the target keeps running
+ */
+static void _px_sample_events(px_sample_state *s)
+{
+	ssize_t i;
+	pid_t tid;
+	int stat;
+
+	while ((tid = waitpid(-1, &stat, __WALL | WNOHANG)) > 0) {
+		++s->stops;
+
+		if ((i = px_threads_event(s->traced, tid, stat)) != -1) {
+			px_threads_resume(s->traced, i);
+		}
+	}
+}
+
+/**
+ * Polls every thread at each tick until the time is up or the target
+ * exits
+ */
+static void _px_sample_run(px_sample_state *s)
+{
+	const uint64_t period = 1000000000ULL / s->hz;
+	const uint64_t end = px_clock_ns() + (uint64_t) s->seconds * 1000000000ULL;
+	struct timespec ts;
+	uint64_t next = px_clock_ns(), now, took;
+	size_t i, live;
+
+	while (next < end) {
+		/* New threads are looked for once a second */
+		if (s->ticks % s->hz == 0) {
+			_px_sample_scan(s);
+		}
+		now = px_clock_ns();
+
+		for (i = 0, live = 0; i < s->n; ++i) {
+			if (!s->threads[i].gone) {
+				_px_sample_thread_poll(s, &s->threads[i]);
+				live += !s->threads[i].gone;
+			}
+		}
+		++s->ticks;
+
+		if (s->traced) {
+			_px_sample_events(s);
+		}
+		took = px_clock_ns() - now;
+		s->tick_ns += took;
+
+		if (took > s->max_tick_ns) {
+			s->max_tick_ns = took;
+		}
+		if (live == 0) {
+			printf("[+] pid %d is gone\n", s->pid);
+			break;
+		}
+
+		/* Ticks that already passed are dropped, not bunched up */
+		next += period;
+
+		if ((now = px_clock_ns()) > next) {
+			s->missed += (now - next) / period + 1;
+			next += ((now - next) / period + 1) * period;
+		}
+		ts.tv_sec = next / 1000000000ULL;
+		ts.tv_nsec = next % 1000000000ULL;
+
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+	}
+}
+
+static int _px_sample_tid_cmp(const void *a, const void *b)
+{
+	const px_sample_thread *ta = a, *tb = b;
+
+	return ta->tid < tb->tid ? -1 : ta->tid > tb->tid;
+}
+
+static int _px_sample_running_cmp(const void *a, const void *b)
+{
+	const px_sample_thread *ta = a, *tb = b;
+	const uint64_t ca = ta->cpu_last - ta->cpu_first;
+	const uint64_t cb = tb->cpu_last - tb->cpu_first;
+
+	if (ta->running != tb->running) {
+		return ta->running < tb->running ? 1 : -1;
+	}
+	return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
+
+/**
+ * Prints the most seen process-wide keys of a kind
+ */
+static void _px_sample_show_top(px_counts_entry **order, size_t n, char kind,
+	uint64_t total, const char *title)
+{
+	const px_sample_key *k;
+	size_t i, shown = 0;
+
+	for (i = 0; i < n && shown < PX_SAMPLE_TOP; ++i) {
+		k = order[i]->key;
+
+		if (k->tid != 0 || k->kind != kind) {
+			continue;
+		}
+		if (shown++ == 0) {
+			printf("%s\n", title);
+		}
+		printf("  %8" PRIu64 " %5.1f%%  %.*s\n", order[i]->count,
+			total ? order[i]->count * 100.0 / total : 0.0,
+			(int) (order[i]->len - sizeof(*k)), (const char*) (k + 1));
+	}
+}
+
+static void _px_sample_report(px_sample_state *s)
+{
+	const long hz = sysconf(_SC_CLK_TCK);
+	char top[2][40];
+	px_counts_entry **order;
+	const px_sample_key *k;
+	px_sample_thread key, *t;
+	uint64_t samples, blocked = 0;
+	size_t i, j;
+
+	if ((order = px_counts_sorted(&s->counts)) == NULL) {
+		px_error("Failed to alloc!");
+		return;
+	}
+
+	/* Each thread gets its most seen syscall and wait channel */
+	qsort(s->threads, s->n, sizeof(*s->threads), _px_sample_tid_cmp);
+
+	for (i = 0; i < s->counts.n; ++i) {
+		k = order[i]->key;
+
+		if (k->tid == 0 || k->kind == PX_SAMPLE_KEY_STACK) {
+			continue;
+		}
+		key.tid = k->tid;
+
+		if ((t = bsearch(&key, s->threads, s->n, sizeof(*s->threads),
+			_px_sample_tid_cmp)) != NULL) {
+			j = k->kind == PX_SAMPLE_KEY_WCHAN;
+
+			if (t->top[j] == NULL) {
+				t->top[j] = order[i];
+			}
+		}
+	}
+	qsort(s->threads, s->n, sizeof(*s->threads), _px_sample_running_cmp);
+
+	printf("%-8s %-16s %7s %7s %7s %7s %9s  %-10s %s\n", "tid", "comm",
+		"R%", "S%", "D%", "other%", "cpu(s)", "syscall", "wchan");
+
+	for (i = 0; i < s->n; ++i) {
+		t = &s->threads[i];
+		samples = t->running + t->sleeping + t->disk + t->other;
+		blocked += t->sleeping + t->disk;
+
+		if (i >= PX_SAMPLE_TOP || samples == 0) {
+			continue;
+		}
+		for (j = 0; j < 2; ++j) {
+			snprintf(top[j], sizeof(top[j]), "%.*s", t->top[j]
+				? (int) (t->top[j]->len - sizeof(px_sample_key)) : 1,
+				t->top[j] ? (const char*) t->top[j]->key
+					+ sizeof(px_sample_key) : "-");
+		}
+		printf("%-8d %-16s %6.1f%% %6.1f%% %6.1f%% %6.1f%% %9.2f  %-10s %s\n",
+			t->tid, t->comm, t->running * 100.0 / samples,
+			t->sleeping * 100.0 / samples, t->disk * 100.0 / samples,
+			t->other * 100.0 / samples,
+			(double) (t->cpu_last - t->cpu_first) / hz, top[0], top[1]);
+	}
+	if (s->n > PX_SAMPLE_TOP) {
+		printf("[+] %zu more threads\n", s->n - PX_SAMPLE_TOP);
+	}
+
+	_px_sample_show_top(order, s->counts.n, PX_SAMPLE_KEY_SYSCALL, blocked,
+		"[+] Syscalls of the blocked threads (by number):");
+	_px_sample_show_top(order, s->counts.n, PX_SAMPLE_KEY_WCHAN, blocked,
+		"[+] Wait channels of the blocked threads:");
+
+	if (s->readable[PX_SAMPLE_STACK]) {
+		_px_sample_show_top(order, s->counts.n, PX_SAMPLE_KEY_STACK, blocked,
+			"[+] Kernel stacks of the blocked threads:");
+	} else {
+		printf("[+] Kernel stacks are not readable (needs CAP_SYS_ADMIN)\n");
+	}
+	if (!s->readable[PX_SAMPLE_SYSCALL] || !s->readable[PX_SAMPLE_WCHAN]) {
+		printf("[+] syscall or wchan is not readable, sampled states only\n");
+	}
+
+	free(order);
+}
+
+/**
+ * Samples the threads of a process from procfs, without stopping them
+ * sample --noptrace [--pid N] [--hz N] [--seconds N]
+ * A thread's state, syscall, wait channel and kernel stack are read from
+ * /proc/<pid>/task/<tid>, with the files opened once and read with
+ * pread() at each tick.
+ */
+void px_sample(const char *params)
+{
+	px_sample_state s;
+	char *opts = NULL, *token, *saveptr = NULL, *value;
+	char fname[PATH_MAX];
+	struct rlimit fds, saved;
+	int noptrace = 0, resume = 0, fd;
+	uint64_t t0;
+	size_t i;
+
+	memset(&s, 0, sizeof(s));
+	s.task = -1;
+	s.pid = ENV(pid);
+	s.hz = PX_SAMPLE_DEFAULT_HZ;
+	s.seconds = PX_SAMPLE_DEFAULT_SECONDS;
+
+	if (params && (opts = strdup(params)) == NULL) {
+		px_error("Failed to alloc!");
+		return;
+	}
+
+	for (token = opts ? strtok_r(opts, " ", &saveptr) : NULL; token;
+		token = strtok_r(NULL, " ", &saveptr)) {
+		if (strcmp(token, "--noptrace") == 0) {
+			noptrace = 1;
+			continue;
+		}
+		if ((value = strtok_r(NULL, " ", &saveptr)) == NULL) {
+			px_error("Missing value for %s", token);
+			goto out;
+		}
+		if (strcmp(token, "--pid") == 0) {
+			s.pid = strtol(value, NULL, 10);
+		} else if (strcmp(token, "--hz") == 0) {
+			s.hz = strtoul(value, NULL, 10);
+
+			if (s.hz == 0 || s.hz > PX_SAMPLE_MAX_HZ) {
+				px_error("--hz must be between 1 and %d", PX_SAMPLE_MAX_HZ);
+				goto out;
+			}
+		} else if (strcmp(token, "--seconds") == 0) {
+			if ((s.seconds = strtoul(value, NULL, 10)) == 0) {
+				px_error("--seconds expects a positive number");
+				goto out;
+			}
+		} else {
+			px_error("Unknown option %s", token);
+			goto out;
+		}
+	}
+
+	if (!noptrace) {
+		px_error("sample only has the --noptrace mode, profile samples "
+			"stacks through ptrace");
+		goto out;
+	}
+	if (s.pid <= 0) {
+		px_error("No pid, attach or use --pid");
+		goto out;
+	}
+	if (s.pid == ENV(pid) && ENV(parent) != 0) {
+		px_error("Not available on snapshots, the child must not run");
+		goto out;
+	}
+
+	snprintf(fname, sizeof(fname), "/proc/%d/task", s.pid);
+
+	if ((s.task = open(fname, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1
+		|| (fd = dup(s.task)) == -1) {
+		px_error("Failed to open %s (%s)", fname, strerror(errno));
+		goto out;
+	}
+	if ((s.dir = fdopendir(fd)) == NULL) {
+		px_error("Failed to open %s (%s)", fname, strerror(errno));
+		close(fd);
+		goto out;
+	}
+
+	/* Up to four fds per thread are kept open */
+	getrlimit(RLIMIT_NOFILE, &saved);
+	fds = saved;
+	fds.rlim_cur = fds.rlim_max;
+
+	if (setrlimit(RLIMIT_NOFILE, &fds) == -1) {
+		fds = saved;
+	}
+	s.max_fds = fds.rlim_cur > PX_SAMPLE_SPARE_FDS * 2
+		? fds.rlim_cur - PX_SAMPLE_SPARE_FDS : fds.rlim_cur / 2;
+
+	/* The attached threads must run to be worth sampling */
+	if (s.pid == ENV(pid) && ENV(threads).stopped) {
+		px_threads_resume_all(&ENV(threads));
+		s.traced = &ENV(threads);
+		resume = 1;
+	}
+
+	printf("[+] Sampling pid %d from procfs at %u Hz for %us\n", s.pid, s.hz,
+		s.seconds);
+	fflush(stdout);
+
+	t0 = px_clock_ns();
+	_px_sample_run(&s);
+
+	if (resume) {
+		px_threads_stop(&ENV(threads));
+	}
+
+	printf("[+] %" PRIu64 " ticks of up to %zu threads in %.1fs, %" PRIu64
+		" ticks missed\n", s.ticks, s.n, (px_clock_ns() - t0) / 1e9,
+		s.missed);
+	printf("[+] %" PRIu64 " preads (%" PRIu64 " with an open), %.1fus per "
+		"tick on average, %.1fus at most\n", s.reads, s.reopens,
+		s.ticks ? s.tick_ns / 1e3 / s.ticks : 0.0, s.max_tick_ns / 1e3);
+
+	if (s.stops) {
+		printf("[+] The target stopped %" PRIu64 " times for ptrace (signals "
+			"and new threads), each resumed at the next tick\n", s.stops);
+	} else {
+		printf("[+] The target never stopped\n");
+	}
+
+	_px_sample_report(&s);
+
+	for (i = 0; i < s.n; ++i) {
+		_px_sample_close(&s, &s.threads[i]);
+	}
+	setrlimit(RLIMIT_NOFILE, &saved);
+out:
+	if (s.dir) {
+		closedir(s.dir);
+	}
+	if (s.task != -1) {
+		close(s.task);
+	}
+	px_counts_free(&s.counts);
+	px_safe_free(s.threads);
+	px_safe_free(opts);
+}
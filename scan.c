@@ -0,0 +1,190 @@
+/**
+ * Copyright (c) 2012, Felipe Pena
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *   Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+#include "cmd.h"
+#include "ptrace.h"
+#include "pool.h"
+#include "scan.h"
+
+/**
+ * Chunk of a selected region
+ */
+typedef struct _px_scan_item {
+	size_t region;
+	uintptr_t addr;
+	size_t limit;
+} px_scan_item;
+
+typedef struct _px_scan_run {
+	const px_scan_item *items;
+	unsigned char **bufs;      /* one read buffer per worker */
+	size_t overlap;
+	px_scan_fn fn;
+	void *arg;
+	size_t scanned;            /* bytes read, updated atomically */
+} px_scan_run;
+
+/**
+ * Returns the number of workers a scan runs on
+ * Reads can only leave the tracing thread when ptrace_read_shared() says
+ * so; callers size their per-worker state with this.
+ */
+unsigned px_scan_jobs(void)
+{
+	return ptrace_read_shared() ? px_pool_jobs() : 1;
+}
+
+/**
+ * Reads one chunk plus the overlap and hands it to the callback
+ */
+static void _px_scan_one(size_t i, unsigned worker, void *arg)
+{
+	px_scan_run *run = arg;
+	const px_scan_item *item = &run->items[i];
+	const uintptr_t end = ENV(maps)[item->region].end;
+	px_scan_chunk chunk;
+	size_t want = item->limit + run->overlap, avail;
+	const void *data;
+	ssize_t got;
+
+	if (want > end - item->addr) {
+		want = end - item->addr;
+	}
+
+	if ((data = ENV(source) && ENV(source)->ptr
+			? ENV(source)->ptr(item->addr, &avail) : NULL)
+		&& avail >= want) {
+		/* Straight from the mapped core file */
+		got = want;
+	} else if ((got = ptrace_read_direct(item->addr, run->bufs[worker], want)) > 0) {
+		data = run->bufs[worker];
+	} else {
+		/* Guard pages, [vvar] and friends */
+		return;
+	}
+
+	chunk.region = item->region;
+	chunk.addr = item->addr;
+	chunk.data = data;
+	chunk.len = got;
+	chunk.limit = (size_t)got < item->limit ? (size_t)got : item->limit;
+	chunk.worker = worker;
+
+	run->fn(&chunk, run->arg);
+
+	__atomic_fetch_add(&run->scanned, chunk.limit, __ATOMIC_RELAXED);
+}
+
+/**
+ * Splits the selected regions in chunks and scans them on the worker pool
+ * Each chunk is read in one bulk read of PX_SCAN_CHUNK + overlap bytes.
+ * The callback runs concurrently on up to px_scan_jobs() threads, in no
+ * particular order. Returns the number of bytes scanned or -1.
+ */
+ssize_t px_scan_regions(const px_scan_filter *filter, size_t overlap,
+	px_scan_fn fn, void *arg)
+{
+	px_scan_run run;
+	px_scan_item *items = NULL, *tmp;
+	size_t i, n = 0, size = 0;
+	uintptr_t addr;
+	unsigned jobs = px_scan_jobs(), w;
+
+	if (ENV(maps) == NULL) {
+		px_error("No regions, run maps first");
+		return -1;
+	}
+
+	for (i = 0; i < ENV(nregions); ++i) {
+		if (filter->perms ? !px_maps_match(i, filter->perms, filter->region)
+			: (ENV(maps)[i].perms[0] != 'r'
+				|| !px_maps_match(i, NULL, filter->region))) {
+			continue;
+		}
+		if (filter->skip && strcmp(PX_MAPS_NAME(i), filter->skip) == 0) {
+			continue;
+		}
+
+		for (addr = PX_MAPS_START(i); addr < ENV(maps)[i].end;
+			addr += PX_SCAN_CHUNK) {
+			if (n == size) {
+				size = size ? size * 2 : 256;
+
+				if ((tmp = realloc(items, sizeof(*items) * size)) == NULL) {
+					px_error("Failed to realloc!");
+					px_safe_free(items);
+					return -1;
+				}
+				items = tmp;
+			}
+			items[n].region = i;
+			items[n].addr = addr;
+			items[n].limit = ENV(maps)[i].end - addr < PX_SCAN_CHUNK
+				? ENV(maps)[i].end - addr : PX_SCAN_CHUNK;
+			++n;
+		}
+	}
+
+	if (jobs > n) {
+		jobs = n ? n : 1;
+	}
+
+	memset(&run, 0, sizeof(run));
+	run.items = items;
+	run.overlap = overlap;
+	run.fn = fn;
+	run.arg = arg;
+
+	if ((run.bufs = calloc(jobs, sizeof(*run.bufs))) == NULL) {
+		px_error("Failed to alloc!");
+		px_safe_free(items);
+		return -1;
+	}
+	for (w = 0; w < jobs; ++w) {
+		if ((run.bufs[w] = malloc(PX_SCAN_CHUNK + overlap)) == NULL) {
+			jobs = w;
+			break;
+		}
+	}
+
+	if (jobs) {
+		px_parallel_for(n, jobs, _px_scan_one, &run);
+	} else {
+		px_error("Failed to alloc!");
+	}
+
+	for (w = 0; w < jobs; ++w) {
+		free(run.bufs[w]);
+	}
+	free(run.bufs);
+	px_safe_free(items);
+
+	return jobs ? (ssize_t)run.scanned : -1;
+}
@@ -0,0 +1,67 @@
+/**
+ * Copyright (c) 2012, Felipe Pena
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *   Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PX_SCAN
+#define PX_SCAN
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * Regions are read in chunks of this size
+ */
+#define PX_SCAN_CHUNK (4 << 20)
+
+/**
+ * Region selection (see px_maps_match)
+ */
+typedef struct _px_scan_filter {
+	const char *perms;  /* permission mask, NULL for readable regions */
+	const char *region; /* name substring, NULL for any */
+	const char *skip;   /* exact name of regions to leave out, or NULL */
+} px_scan_filter;
+
+/**
+ * One chunk of target memory handed to a scan callback
+ * The chunk owns the bytes [0, limit); data goes on up to len (at most
+ * the requested overlap past limit) so that matches starting before limit
+ * can be verified across the chunk edge.
+ */
+typedef struct _px_scan_chunk {
+	size_t region;             /* index in ENV(maps) */
+	uintptr_t addr;            /* remote address of data[0] */
+	const unsigned char *data;
+	size_t len;
+	size_t limit;
+	unsigned worker;           /* index of the worker thread */
+} px_scan_chunk;
+
+typedef void (*px_scan_fn)(const px_scan_chunk*, void*);
+
+unsigned px_scan_jobs(void);
+ssize_t px_scan_regions(const px_scan_filter*, size_t, px_scan_fn, void*);
+
+#endif /* PX_SCAN */
@@ -0,0 +1,325 @@
+/**
+ * Copyright (c) 2012, Felipe Pena
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *   Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "common.h"
+#include "cmd.h"
+#include "scan.h"
+#include "search.h"
+
+#define PX_SEARCH_MAX_PATTERN 256
+
+/**
+ * Matches are buffered per chunk and flushed in one go
+ */
+#define PX_SEARCH_BATCH 64
+
+typedef struct _px_search_ctx {
+	unsigned char pattern[PX_SEARCH_MAX_PATTERN];
+	size_t len;
+	pthread_mutex_t lock;   /* serializes the output */
+	size_t matches;
+} px_search_ctx;
+
+/**
+ * Parses a hex digit, -1 when c is not one
+ */
+static inline int _px_search_xdigit(char c)
+{
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	}
+	if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+		return (c | 0x20) - 'a' + 10;
+	}
+	return -1;
+}
+
+/**
+ * Parses a quoted string pattern, supporting \\ \" \n \t \0 and \xHH
+ * Returns the position after the closing quote or NULL
+ */
+static const char *_px_search_parse_string(const char *p, px_search_ctx *s)
+{
+	int hi, lo;
+
+	for (++p; *p && *p != '"'; ++p) {
+		if (s->len == sizeof(s->pattern)) {
+			return NULL;
+		}
+		if (*p != '\\') {
+			s->pattern[s->len++] = *p;
+			continue;
+		}
+		switch (*++p) {
+			case 'n': s->pattern[s->len++] = '\n'; break;
+			case 't': s->pattern[s->len++] = '\t'; break;
+			case '0': s->pattern[s->len++] = '\0'; break;
+			case 'x':
+				if ((hi = _px_search_xdigit(p[1])) == -1
+					|| (lo = _px_search_xdigit(p[2])) == -1) {
+					return NULL;
+				}
+				s->pattern[s->len++] = hi << 4 | lo;
+				p += 2;
+				break;
+			case '\0':
+				return NULL;
+			default:
+				s->pattern[s->len++] = *p;
+		}
+	}
+	return *p == '"' ? p + 1 : NULL;
+}
+
+/**
+ * Parses hex bytes ("de ad be ef", "deadbeef", "0xdeadbeef") up to the
+ * first option. Returns the position after the bytes or NULL
+ */
+static const char *_px_search_parse_hex(const char *p, px_search_ctx *s)
+{
+	int hi, lo;
+
+	while (*p && !(p[0] == '-' && p[1] == '-')) {
+		if (*p == ' ') {
+			++p;
+			continue;
+		}
+		if (p[0] == '0' && (p[1] | 0x20) == 'x') {
+			p += 2;
+		}
+		while ((hi = _px_search_xdigit(*p)) != -1) {
+			if ((lo = _px_search_xdigit(p[1])) == -1
+				|| s->len == sizeof(s->pattern)) {
+				return NULL;
+			}
+			s->pattern[s->len++] = hi << 4 | lo;
+			p += 2;
+		}
+		if (*p && *p != ' ') {
+			return NULL;
+		}
+	}
+	return p;
+}
+
+/**
+ * Returns the bit mask of the positions in buf[0..16) where the first
+ * two pattern bytes start (buf must have 17 readable bytes)
+ */
+#ifdef __SSE2__
+static inline unsigned _px_search_candidates(const unsigned char *buf,
+	__m128i first, __m128i second)
+{
+	__m128i a = _mm_loadu_si128((const __m128i*) buf);
+	__m128i b = _mm_loadu_si128((const __m128i*) (buf + 1));
+
+	return _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+		_mm_cmpeq_epi8(b, second)));
+}
+#endif
+
+/**
+ * Calls report for every pattern occurrence starting in [0, limit)
+ * Candidates are found 16 positions at a time by comparing the first two
+ * pattern bytes, then verified with memcmp.
+ */
+static void _px_search_scan(const px_search_ctx *s, const unsigned char *buf,
+	size_t len, size_t limit, void (*report)(size_t, void*), void *arg)
+{
+	const unsigned char *p = s->pattern;
+	const size_t n = s->len;
+	size_t i = 0, last;
+
+	if (len < n) {
+		return;
+	}
+	/* Last position where the pattern fits */
+	last = len - n < limit ? len - n + 1 : limit;
+
+	if (n == 1) {
+		const unsigned char *hit;
+
+		while (i < last && (hit = memchr(buf + i, p[0], last - i)) != NULL) {
+			report(hit - buf, arg);
+			i = hit - buf + 1;
+		}
+		return;
+	}
+
+#ifdef __SSE2__
+	{
+		const __m128i first = _mm_set1_epi8(p[0]), second = _mm_set1_epi8(p[1]);
+		unsigned mask;
+
+		/* The second load reads buf[i + 16] */
+		for (; i + 17 <= len && i + 16 <= last; i += 16) {
+			for (mask = _px_search_candidates(buf + i, first, second); mask;
+				mask &= mask - 1) {
+				size_t pos = i + __builtin_ctz(mask);
+
+				if (memcmp(buf + pos + 2, p + 2, n - 2) == 0) {
+					report(pos, arg);
+				}
+			}
+		}
+	}
+#endif
+
+	for (; i < last; ++i) {
+		if (buf[i] == p[0] && buf[i + 1] == p[1]
+			&& memcmp(buf + i + 2, p + 2, n - 2) == 0) {
+			report(i, arg);
+		}
+	}
+}
+
+typedef struct _px_search_batch {
+	px_search_ctx *search;
+	const px_scan_chunk *chunk;
+	uintptr_t addrs[PX_SEARCH_BATCH];
+	size_t n;
+} px_search_batch;
+
+/**
+ * Prints the buffered matches of a chunk
+ */
+static void _px_search_flush(px_search_batch *batch)
+{
+	const px_scan_chunk *chunk = batch->chunk;
+	const size_t i = chunk->region;
+	const char *name = PX_MAPS_NAME(i);
+	size_t k;
+
+	if (batch->n == 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&batch->search->lock);
+
+	for (k = 0; k < batch->n; ++k) {
+		printf("%#" PRIxPTR " %s+%#" PRIxPTR " (%s)\n", batch->addrs[k],
+			*name ? name : "[anon]", batch->addrs[k] - PX_MAPS_START(i),
+			ENV(maps)[i].perms);
+	}
+	fflush(stdout);
+	batch->search->matches += batch->n;
+
+	pthread_mutex_unlock(&batch->search->lock);
+
+	batch->n = 0;
+}
+
+static void _px_search_report(size_t pos, void *arg)
+{
+	px_search_batch *batch = arg;
+
+	batch->addrs[batch->n++] = batch->chunk->addr + pos;
+
+	if (batch->n == PX_SEARCH_BATCH) {
+		_px_search_flush(batch);
+	}
+}
+
+/**
+ * px_scan_regions() callback
+ */
+static void _px_search_chunk(const px_scan_chunk *chunk, void *arg)
+{
+	px_search_batch batch;
+
+	batch.search = arg;
+	batch.chunk = chunk;
+	batch.n = 0;
+
+	_px_search_scan(batch.search, chunk->data, chunk->len, chunk->limit,
+		_px_search_report, &batch);
+	_px_search_flush(&batch);
+}
+
+/**
+ * Searches the mapped regions for a byte pattern
+ * search <hex bytes | "string"> [--perms <mask>] [--region <name>]
+ */
+void px_search(const char *params)
+{
+	px_search_ctx search;
+	px_scan_filter filter = { NULL, NULL, NULL };
+	char *opts, *token, *saveptr = NULL;
+	const char *p;
+	ssize_t scanned;
+
+	memset(&search, 0, sizeof(search));
+
+	while (*params == ' ') {
+		++params;
+	}
+	p = *params == '"' ? _px_search_parse_string(params, &search)
+		: _px_search_parse_hex(params, &search);
+
+	if (p == NULL || search.len == 0) {
+		px_error("Invalid pattern (hex bytes or a quoted string of up to %d bytes)",
+			PX_SEARCH_MAX_PATTERN);
+		return;
+	}
+
+	if ((opts = strdup(p)) == NULL) {
+		px_error("Failed to alloc!");
+		return;
+	}
+
+	for (token = strtok_r(opts, " ", &saveptr); token;
+		token = strtok_r(NULL, " ", &saveptr)) {
+		if (strcmp(token, "--perms") == 0) {
+			filter.perms = strtok_r(NULL, " ", &saveptr);
+		} else if (strcmp(token, "--region") == 0) {
+			filter.region = strtok_r(NULL, " ", &saveptr);
+		} else {
+			px_error("Unknown option %s", token);
+			free(opts);
+			return;
+		}
+	}
+
+	pthread_mutex_init(&search.lock, NULL);
+
+	/* Chunks overlap by len - 1 bytes so edge matches are seen once */
+	if ((scanned = px_scan_regions(&filter, search.len - 1,
+			_px_search_chunk, &search)) != -1) {
+		printf("[+] %zu matches, %zd KiB scanned\n", search.matches,
+			scanned >> 10);
+	}
+
+	pthread_mutex_destroy(&search.lock);
+	free(opts);
+}
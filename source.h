@@ -0,0 +1,48 @@
+/**
+ * Copyright (c) 2012, Felipe Pena
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *   Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PX_SOURCE
+#define PX_SOURCE
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * Target state served from a file instead of the attached process
+ * ptrace.c, maps.c and the other readers go through ENV(source) when it
+ * is set, so a new kind of file only has to fill one of these in. Every
+ * callback may be called from worker threads.
+ */
+typedef struct _px_source {
+	const char *name;                                    /* file being read */
+	ssize_t (*read)(uintptr_t, void*, size_t);          /* ptrace_read_direct() contract */
+	const void *(*ptr)(uintptr_t, size_t*);              /* zero-copy view, NULL if none */
+	const void *(*note)(const char*, uint32_t, size_t*); /* ELF note by owner and type */
+	ssize_t (*maps)(void);                               /* fills the region table */
+	void (*close)(void);
+} px_source;
+
+#endif /* PX_SOURCE */
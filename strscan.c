@@ -0,0 +1,407 @@
+/**
+ * Copyright (c) 2012, Felipe Pena
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *   Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "common.h"
+#include "cmd.h"
+#include "ptrace.h"
+#include "scan.h"
+#include "strscan.h"
+
+#define PX_STRINGS_DEFAULT_MIN 4
+#define PX_STRINGS_MAX_MIN     1024
+
+/**
+ * Size of each worker's output buffer, it grows for longer lines
+ */
+#define PX_STRINGS_OUT (1 << 20)
+
+/**
+ * Runs going past a chunk are followed with reads of this size
+ */
+#define PX_STRINGS_TAIL (16 << 10)
+
+typedef enum _px_strings_encoding {
+	PX_STRINGS_ASCII,
+	PX_STRINGS_UTF16LE
+} px_strings_encoding;
+
+/**
+ * Buffered output of one worker
+ * Only whole lines are written out, the buffer holds the current line
+ * from offset line on.
+ */
+typedef struct _px_strings_out {
+	char *buf;
+	size_t len;
+	size_t size;
+	size_t line;
+} px_strings_out;
+
+/**
+ * Run of printable characters being extracted
+ */
+typedef struct _px_strings_run {
+	uintptr_t start;
+	size_t chars;
+	int active;
+	char pending[PX_STRINGS_MAX_MIN]; /* characters until min is reached */
+} px_strings_run;
+
+typedef struct _px_strings_ctx {
+	size_t min;
+	px_strings_encoding encoding;
+	unsigned unit;           /* bytes per character */
+	px_strings_out *outs;    /* one per worker */
+	pthread_mutex_t lock;    /* serializes writes to stdout */
+	size_t found;            /* updated atomically */
+} px_strings_ctx;
+
+/**
+ * Writes the complete lines of a worker's buffer
+ */
+static void _px_strings_flush(px_strings_ctx *ctx, px_strings_out *out)
+{
+	if (out->line == 0) {
+		return;
+	}
+	pthread_mutex_lock(&ctx->lock);
+	fwrite(out->buf, 1, out->line, stdout);
+	pthread_mutex_unlock(&ctx->lock);
+
+	memmove(out->buf, out->buf + out->line, out->len - out->line);
+	out->len -= out->line;
+	out->line = 0;
+}
+
+static void _px_strings_write(px_strings_ctx *ctx, px_strings_out *out,
+	const char *data, size_t n)
+{
+	char *buf;
+
+	if (out->len + n > out->size) {
+		_px_strings_flush(ctx, out);
+	}
+	while (out->len + n > out->size) {
+		/* A line longer than the buffer */
+		if ((buf = realloc(out->buf, out->size * 2)) == NULL) {
+			return;
+		}
+		out->buf = buf;
+		out->size *= 2;
+	}
+	memcpy(out->buf + out->len, data, n);
+	out->len += n;
+}
+
+/**
+ * Returns the bit mask of the printable characters in p[0..64)
+ * Printable is 0x20-0x7e and tab. For UTF-16LE both bits of a character
+ * (at an even offset) are set when its low byte is printable and its high
+ * byte is zero.
+ */
+static inline uint64_t _px_strings_mask(const unsigned char *p,
+	px_strings_encoding encoding)
+{
+	uint64_t print = 0, zero = 0, units;
+	unsigned i;
+
+#ifdef __SSE2__
+	const __m128i lo = _mm_set1_epi8(0x1f), hi = _mm_set1_epi8(0x7f);
+	const __m128i tab = _mm_set1_epi8('\t'), nul = _mm_setzero_si128();
+	__m128i v;
+
+	/* Signed compares: bytes >= 0x80 are negative and never printable */
+	for (i = 0; i < 64; i += 16) {
+		v = _mm_loadu_si128((const __m128i*) (p + i));
+		print |= (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_or_si128(
+			_mm_and_si128(_mm_cmpgt_epi8(v, lo), _mm_cmplt_epi8(v, hi)),
+			_mm_cmpeq_epi8(v, tab))) << i;
+		zero |= (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, nul)) << i;
+	}
+#else
+	for (i = 0; i < 64; ++i) {
+		print |= (uint64_t) ((p[i] >= 0x20 && p[i] < 0x7f) || p[i] == '\t') << i;
+		zero |= (uint64_t) (p[i] == 0) << i;
+	}
+#endif
+
+	if (encoding == PX_STRINGS_ASCII) {
+		return print;
+	}
+	units = print & (zero >> 1) & 0x5555555555555555ULL;
+
+	return units | units << 1;
+}
+
+/**
+ * Ends the current run, terminating its line when it was long enough
+ */
+static void _px_strings_end(px_strings_ctx *ctx, px_strings_out *out,
+	px_strings_run *run)
+{
+	if (run->active && run->chars >= ctx->min) {
+		_px_strings_write(ctx, out, "\n", 1);
+		out->line = out->len;
+		__atomic_fetch_add(&ctx->found, 1, __ATOMIC_RELAXED);
+	}
+	run->active = 0;
+	run->chars = 0;
+}
+
+/**
+ * Appends the characters in p[0..n) to the current run
+ * The line (address and text so far) is started when the run reaches the
+ * minimum length, shorter runs never reach the output buffer.
+ */
+static void _px_strings_append(px_strings_ctx *ctx, px_strings_out *out,
+	px_strings_run *run, const unsigned char *p, size_t n)
+{
+	char head[32], text[256];
+	size_t i, k, len;
+
+	for (i = 0; i < n; i += len * ctx->unit) {
+		len = (n - i) / ctx->unit < sizeof(text) ? (n - i) / ctx->unit : sizeof(text);
+
+		for (k = 0; k < len; ++k) {
+			text[k] = p[i + k * ctx->unit];
+		}
+
+		if (run->chars >= ctx->min) {
+			_px_strings_write(ctx, out, text, len);
+		} else if (run->chars + len < ctx->min) {
+			memcpy(run->pending + run->chars, text, len);
+		} else {
+			_px_strings_write(ctx, out, head, snprintf(head, sizeof(head),
+				"%#" PRIxPTR " ", run->start));
+			_px_strings_write(ctx, out, run->pending, run->chars);
+			_px_strings_write(ctx, out, text, len);
+		}
+		run->chars += len;
+	}
+}
+
+/**
+ * Extracts the runs of buf[0..len), read from addr
+ * A run still going at the end is left active for the next buffer.
+ */
+static void _px_strings_feed(px_strings_ctx *ctx, px_strings_out *out,
+	px_strings_run *run, const unsigned char *buf, size_t len, uintptr_t addr)
+{
+	unsigned char tail[64];
+	uint64_t mask;
+	size_t pos, block, start, n;
+
+	for (block = 0; block < len; block += 64) {
+		if (len - block >= 64) {
+			mask = _px_strings_mask(buf + block, ctx->encoding);
+		} else {
+			memset(tail, 0, sizeof(tail));
+			memcpy(tail, buf + block, len - block);
+			mask = _px_strings_mask(tail, ctx->encoding);
+		}
+		n = len - block < 64 ? len - block : 64;
+
+		for (pos = 0; pos < n; ) {
+			if (!run->active) {
+				/* Skip to the next printable byte */
+				if ((mask >> pos) == 0) {
+					break;
+				}
+				pos += __builtin_ctzll(mask >> pos);
+
+				if (pos >= n) {
+					break;
+				}
+				run->active = 1;
+				run->start = addr + block + pos;
+				run->chars = 0;
+			}
+			/* Printable up to the next clear bit */
+			start = pos;
+			pos = (~mask >> pos) ? pos + __builtin_ctzll(~mask >> pos) : 64;
+
+			if (pos > n) {
+				pos = n;
+			}
+			_px_strings_append(ctx, out, run, buf + block + start, pos - start);
+
+			if (pos < n) {
+				_px_strings_end(ctx, out, run);
+			}
+		}
+	}
+}
+
+/**
+ * px_scan_regions() callback
+ * A run is reported by the chunk it starts in: a chunk skips the run it
+ * opens with when the character before the chunk is printable, and reads
+ * past its end for as long as its last run goes on.
+ */
+static void _px_strings_chunk(const px_scan_chunk *chunk, void *arg)
+{
+	px_strings_ctx *ctx = arg;
+	px_strings_out *out = &ctx->outs[chunk->worker];
+	px_strings_run run;
+	unsigned char buf[PX_STRINGS_TAIL], prev[64];
+	const uintptr_t start = PX_MAPS_START(chunk->region);
+	const uintptr_t end = ENV(maps)[chunk->region].end;
+	size_t skip = 0;
+	uintptr_t addr;
+	ssize_t got;
+
+	memset(&run, 0, sizeof(run));
+
+	memset(prev, 0, sizeof(prev));
+
+	if (chunk->addr > start && ptrace_read_direct(chunk->addr - ctx->unit,
+			prev, ctx->unit) == (ssize_t) ctx->unit) {
+		if (_px_strings_mask(prev, ctx->encoding) & 1) {
+			/* Belongs to the previous chunk */
+			for (skip = 0; skip < chunk->limit; skip += 64) {
+				uint64_t mask = chunk->limit - skip >= 64
+					? _px_strings_mask(chunk->data + skip, ctx->encoding) : 0;
+
+				if (~mask) {
+					skip += __builtin_ctzll(~mask);
+					break;
+				}
+			}
+		}
+	}
+	if (skip >= chunk->limit) {
+		return;
+	}
+
+	_px_strings_feed(ctx, out, &run, chunk->data + skip, chunk->limit - skip,
+		chunk->addr + skip);
+
+	for (addr = chunk->addr + chunk->limit; run.active && addr < end; addr += got) {
+		got = ptrace_read_direct(addr, buf,
+			end - addr < sizeof(buf) ? end - addr : sizeof(buf));
+
+		if (got <= 0) {
+			break;
+		}
+		_px_strings_feed(ctx, out, &run, buf, got, addr);
+	}
+	_px_strings_end(ctx, out, &run);
+}
+
+/**
+ * Extracts printable strings from the readable regions
+ * strings [--min N] [--region name] [--encoding ascii|utf16le]
+ */
+void px_strings(const char *params)
+{
+	px_strings_ctx ctx;
+	px_scan_filter filter = { NULL, NULL, NULL };
+	char *opts = NULL, *token, *saveptr = NULL, *value;
+	unsigned jobs = px_scan_jobs(), w;
+	ssize_t scanned;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.min = PX_STRINGS_DEFAULT_MIN;
+	ctx.encoding = PX_STRINGS_ASCII;
+
+	if (params && (opts = strdup(params)) == NULL) {
+		px_error("Failed to alloc!");
+		return;
+	}
+
+	for (token = opts ? strtok_r(opts, " ", &saveptr) : NULL; token;
+		token = strtok_r(NULL, " ", &saveptr)) {
+		if ((value = strtok_r(NULL, " ", &saveptr)) == NULL) {
+			px_error("Missing value for %s", token);
+			goto out;
+		}
+		if (strcmp(token, "--min") == 0) {
+			ctx.min = strtoul(value, NULL, 10);
+
+			if (ctx.min == 0 || ctx.min > PX_STRINGS_MAX_MIN) {
+				px_error("--min must be between 1 and %d", PX_STRINGS_MAX_MIN);
+				goto out;
+			}
+		} else if (strcmp(token, "--region") == 0) {
+			filter.region = value;
+		} else if (strcmp(token, "--encoding") == 0) {
+			if (strcmp(value, "ascii") == 0) {
+				ctx.encoding = PX_STRINGS_ASCII;
+			} else if (strcmp(value, "utf16le") == 0) {
+				ctx.encoding = PX_STRINGS_UTF16LE;
+			} else {
+				px_error("Unknown encoding %s (ascii or utf16le)", value);
+				goto out;
+			}
+		} else {
+			px_error("Unknown option %s", token);
+			goto out;
+		}
+	}
+	ctx.unit = ctx.encoding == PX_STRINGS_UTF16LE ? 2 : 1;
+
+	if ((ctx.outs = calloc(jobs, sizeof(*ctx.outs))) == NULL) {
+		px_error("Failed to alloc!");
+		goto out;
+	}
+	for (w = 0; w < jobs; ++w) {
+		if ((ctx.outs[w].buf = malloc(PX_STRINGS_OUT)) == NULL) {
+			px_error("Failed to alloc!");
+			goto out;
+		}
+		ctx.outs[w].size = PX_STRINGS_OUT;
+	}
+
+	pthread_mutex_init(&ctx.lock, NULL);
+	fflush(stdout);
+
+	scanned = px_scan_regions(&filter, 0, _px_strings_chunk, &ctx);
+
+	for (w = 0; w < jobs; ++w) {
+		_px_strings_flush(&ctx, &ctx.outs[w]);
+	}
+	pthread_mutex_destroy(&ctx.lock);
+
+	if (scanned != -1) {
+		printf("[+] %zu strings, %zd KiB scanned\n", ctx.found, scanned >> 10);
+	}
+out:
+	if (ctx.outs) {
+		for (w = 0; w < jobs; ++w) {
+			px_safe_free(ctx.outs[w].buf);
+		}
+		free(ctx.outs);
+	}
+	px_safe_free(opts);
+}
@@ -0,0 +1,618 @@
+/**
+ * Copyright (c) 2012, Felipe Pena
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *   Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <elf.h>
+#include <link.h>
+#include "common.h"
+#include "cmd.h"
+#include "elf.h"
+#include "elffile.h"
+#include "sym.h"
+#include "symcache.h"
+#include "ptrace.h"
+#include "pool.h"
+
+#define ELF_ST_TYPE _ElfW(ELF, __ELF_NATIVE_CLASS, ST_TYPE)
+
+/**
+ * Symbol collected while building a table
+ */
+typedef struct _px_sym_entry {
+	uint64_t addr;
+	uint32_t size;
+	uint32_t name;
+} px_sym_entry;
+
+/**
+ * Growable list of symbols and their names
+ */
+typedef struct _px_sym_builder {
+	px_sym_entry *syms;
+	size_t nsyms, size;
+	char *strs;
+	size_t len, strs_size;
+} px_sym_builder;
+
+/**
+ * Adds a symbol to the builder
+ */
+static int _px_sym_add(px_sym_builder *b, uint64_t addr, uint32_t size,
+	const char *name, size_t len)
+{
+	px_sym_entry *syms;
+	char *strs;
+	size_t n;
+
+	if (b->nsyms == b->size) {
+		n = b->size ? b->size * 2 : 1024;
+
+		if ((syms = realloc(b->syms, sizeof(*syms) * n)) == NULL) {
+			return -1;
+		}
+		b->syms = syms;
+		b->size = n;
+	}
+	if (b->len + len + 1 > b->strs_size) {
+		for (n = b->strs_size ? b->strs_size : 16384; n < b->len + len + 1; n *= 2);
+
+		if ((strs = realloc(b->strs, n)) == NULL) {
+			return -1;
+		}
+		b->strs = strs;
+		b->strs_size = n;
+	}
+
+	memcpy(b->strs + b->len, name, len);
+	b->strs[b->len + len] = '\0';
+
+	b->syms[b->nsyms].addr = addr;
+	b->syms[b->nsyms].size = size;
+	b->syms[b->nsyms].name = b->len;
+	++b->nsyms;
+
+	b->len += len + 1;
+
+	return 0;
+}
+
+static int _px_sym_entry_cmp(const void *a, const void *b)
+{
+	const px_sym_entry *x = a, *y = b;
+
+	if (x->addr != y->addr) {
+		return x->addr < y->addr ? -1 : 1;
+	}
+	/* Prefer the symbol with a size among aliases */
+	return x->size > y->size ? -1 : x->size < y->size;
+}
+
+/**
+ * Sets the absolute range covered by a table
+ */
+static void _px_sym_bounds(px_sym_table *t)
+{
+	const size_t n = t->nsyms;
+
+	t->lo = t->base + t->addr[0];
+	t->hi = t->base + t->addr[n - 1] + (t->size[n - 1] ? t->size[n - 1] : 1);
+}
+
+/**
+ * Releases the storage of a table
+ */
+static void _px_sym_table_free(px_sym_table *t)
+{
+	px_safe_free(t->object);
+
+	if (t->mapped) {
+		munmap(t->mem, t->mem_len);
+	} else {
+		px_safe_free(t->mem);
+	}
+}
+
+/**
+ * Sorts the collected symbols and packs them into a table
+ * Aliases (symbols at the same address) are dropped.
+ */
+static int _px_sym_finish(px_sym_builder *b, px_sym_table *t)
+{
+	uint64_t *addr;
+	uint32_t *size, *name;
+	size_t i, n = 0;
+	char *mem;
+
+	qsort(b->syms, b->nsyms, sizeof(*b->syms), _px_sym_entry_cmp);
+
+	for (i = 0; i < b->nsyms; ++i) {
+		if (n == 0 || b->syms[i].addr != b->syms[n - 1].addr) {
+			b->syms[n++] = b->syms[i];
+		}
+	}
+
+	t->mem_len = n * (sizeof(*addr) + sizeof(*size) + sizeof(*name)) + b->len;
+
+	if (n == 0 || (mem = malloc(t->mem_len)) == NULL) {
+		return -1;
+	}
+
+	addr = (uint64_t*) mem;
+	size = (uint32_t*) (addr + n);
+	name = size + n;
+
+	for (i = 0; i < n; ++i) {
+		addr[i] = b->syms[i].addr;
+		size[i] = b->syms[i].size;
+		name[i] = b->syms[i].name;
+	}
+	memcpy(name + n, b->strs, b->len);
+
+	t->mem = mem;
+	t->mapped = 0;
+	t->nsyms = n;
+	t->addr = addr;
+	t->size = size;
+	t->name = name;
+	t->strs = (const char*) (name + n);
+
+	_px_sym_bounds(t);
+
+	return 0;
+}
+
+static void _px_sym_builder_free(px_sym_builder *b)
+{
+	px_safe_free(b->syms);
+	px_safe_free(b->strs);
+}
+
+/**
+ * Checks whether a symbol is a defined function worth indexing
+ * An IFUNC's value is its resolver, not the code callers run.
+ */
+static inline int _px_sym_wanted(const ElfW(Sym) *sym)
+{
+	return ELF_ST_TYPE(sym->st_info) == STT_FUNC
+		&& sym->st_shndx != SHN_UNDEF && sym->st_value != 0;
+}
+
+/**
+ * Collects the function symbols of an object's dynamic symbol table
+ * The whole symbol table and string table are read with one read each.
+ */
+static int _px_sym_load_dynsym(const px_elf_object *obj, size_t n,
+	px_sym_builder *b)
+{
+	ElfW(Sym) *syms;
+	char *strs;
+	size_t i, len;
+
+	if (n == 0 || obj->symtab == 0 || obj->strtab == 0 || obj->strsz == 0) {
+		return -1;
+	}
+
+	syms = malloc(sizeof(*syms) * n);
+	strs = malloc(obj->strsz + 1);
+
+	if (syms == NULL || strs == NULL) {
+		px_safe_free(syms);
+		px_safe_free(strs);
+		return -1;
+	}
+
+	/* A short read would leave garbage entries, skip the object instead */
+	if (ptrace_read_direct(obj->symtab, syms, sizeof(*syms) * n)
+			!= (ssize_t)(sizeof(*syms) * n)
+		|| ptrace_read_direct(obj->strtab, strs, obj->strsz)
+			!= (ssize_t)obj->strsz) {
+		free(syms);
+		free(strs);
+		return -1;
+	}
+	strs[obj->strsz] = '\0';
+
+	for (i = 0; i < n; ++i) {
+		if (!_px_sym_wanted(&syms[i]) || syms[i].st_name >= obj->strsz) {
+			continue;
+		}
+		len = strlen(strs + syms[i].st_name);
+
+		if (_px_sym_add(b, syms[i].st_value, syms[i].st_size,
+				strs + syms[i].st_name, len) == -1) {
+			break;
+		}
+	}
+
+	free(syms);
+	free(strs);
+
+	return 0;
+}
+
+/**
+ * Collects the function symbols from the file backing an object
+ * .symtab is used when the file has one (it also has the local
+ * functions), .dynsym otherwise. Everything is read from the mapping.
+ */
+static int _px_sym_load_file(const px_elf_file *file, px_sym_builder *b)
+{
+	const ElfW(Shdr) *shdr, *strhdr;
+	const ElfW(Sym) *syms;
+	const char *strs;
+	size_t i, n;
+
+	if ((shdr = px_elf_file_section_type(file, SHT_SYMTAB)) == NULL) {
+		shdr = px_elf_file_section_type(file, SHT_DYNSYM);
+	}
+
+	if (shdr == NULL || shdr->sh_link >= file->shnum
+		|| (syms = px_elf_file_section_data(file, shdr)) == NULL
+		|| (strs = px_elf_file_section_data(file,
+			strhdr = &file->shdrs[shdr->sh_link])) == NULL) {
+		return -1;
+	}
+
+	n = shdr->sh_size / sizeof(*syms);
+
+	for (i = 0; i < n; ++i) {
+		if (!_px_sym_wanted(&syms[i]) || syms[i].st_name >= strhdr->sh_size) {
+			continue;
+		}
+		if (_px_sym_add(b, syms[i].st_value, syms[i].st_size,
+				strs + syms[i].st_name, strnlen(strs + syms[i].st_name,
+					strhdr->sh_size - syms[i].st_name)) == -1) {
+			break;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * One object of the link_map chain and the table built for it
+ */
+typedef struct _px_sym_job {
+	px_elf_object obj;
+	size_t nsyms;           /* dynamic symbol count, read by the main thread */
+	px_sym_table table;
+	int state;              /* PX_SYM_NONE, PX_SYM_PARSED or PX_SYM_CACHED */
+} px_sym_job;
+
+enum { PX_SYM_NONE, PX_SYM_PARSED, PX_SYM_CACHED };
+
+typedef struct _px_sym_jobs {
+	px_sym_job *jobs;
+	size_t n;
+	size_t size;
+} px_sym_jobs;
+
+/**
+ * px_elf_foreach_object() callback collecting the objects to index
+ */
+static int _px_sym_collect_cb(px_elf_object *obj, void *arg)
+{
+	px_sym_jobs *list = arg;
+	px_sym_job *jobs;
+
+	if (list->n == list->size) {
+		list->size = list->size ? list->size * 2 : 32;
+
+		if ((jobs = realloc(list->jobs, sizeof(*jobs) * list->size)) == NULL) {
+			return -1;
+		}
+		list->jobs = jobs;
+	}
+	memset(&list->jobs[list->n], 0, sizeof(*list->jobs));
+	list->jobs[list->n].obj = *obj;
+	/* Goes through the page cache, which the workers must not touch */
+	list->jobs[list->n++].nsyms = px_elf_object_nsyms(obj);
+
+	return 0;
+}
+
+/**
+ * px_parallel_for() worker building the table of one object
+ * Only touches its own job: the region table is read-only here and remote
+ * memory is read with ptrace_read_direct(), bypassing the page cache.
+ */
+static void _px_sym_build_one(size_t i, unsigned worker, void *arg)
+{
+	px_sym_job *job = &((px_sym_job*) arg)[i];
+	px_elf_object *obj = &job->obj;
+	px_sym_table *t = &job->table;
+	px_sym_builder b;
+	px_elf_file file;
+	const unsigned char *id = NULL;
+	size_t id_len = 0;
+	ssize_t region;
+	int have_file;
+
+	memset(&b, 0, sizeof(b));
+
+	t->base = obj->base;
+
+	if ((have_file = px_elf_file_open_addr(&file, obj->dynamic) == 0)) {
+		id = px_elf_file_note(&file, NT_GNU_BUILD_ID, "GNU", &id_len);
+	}
+
+	if (id && px_symcache_load(id, id_len, t) == 0) {
+		/* Same build seen before, nothing to parse */
+		_px_sym_bounds(t);
+		job->state = PX_SYM_CACHED;
+	} else if (((have_file && _px_sym_load_file(&file, &b) == 0)
+			|| _px_sym_load_dynsym(obj, job->nsyms, &b) == 0) && _px_sym_finish(&b, t) == 0) {
+		/* The file has more symbols and costs no remote reads */
+		job->state = PX_SYM_PARSED;
+
+		if (id) {
+			px_symcache_store(id, id_len, t);
+		}
+	}
+
+	px_elf_file_close(&file);
+	_px_sym_builder_free(&b);
+
+	if (job->state == PX_SYM_NONE) {
+		return;
+	}
+
+	/* The main program has no name in the link_map, its region has */
+	if (obj->name[0] == '\0' && (region = px_maps_lookup(obj->dynamic)) != -1) {
+		snprintf(obj->name, sizeof(obj->name), "%s", PX_MAPS_NAME(region));
+	}
+	t->object = strdup(obj->name);
+}
+
+static int _px_sym_table_cmp(const void *a, const void *b)
+{
+	const px_sym_table *x = a, *y = b;
+
+	return x->lo < y->lo ? -1 : x->lo > y->lo;
+}
+
+/**
+ * Builds the address to symbol index from the link_map chain
+ * Returns the number of symbols indexed or -1
+ */
+int px_sym_build(void)
+{
+	px_sym_index *index = &ENV(symbols);
+	px_sym_jobs list = { NULL, 0, 0 };
+	size_t i;
+
+	if (ELF(map) == 0) {
+		px_error("No link_map, run maps first");
+		return -1;
+	}
+
+	px_sym_clear();
+
+	/* The chain is walked first, each object is then indexed on its own */
+	px_elf_foreach_object(_px_sym_collect_cb, &list);
+
+	px_parallel_for(list.n, ptrace_read_shared() ? px_pool_jobs() : 1,
+		_px_sym_build_one, list.jobs);
+
+	if (list.n) {
+		index->tables = malloc(sizeof(*index->tables) * list.n);
+	}
+
+	for (i = 0; i < list.n; ++i) {
+		if (list.jobs[i].state == PX_SYM_NONE) {
+			continue;
+		}
+		if (index->tables == NULL) {
+			_px_sym_table_free(&list.jobs[i].table);
+			continue;
+		}
+		index->tables[index->ntables++] = list.jobs[i].table;
+		index->nsyms += list.jobs[i].table.nsyms;
+		index->cached += list.jobs[i].state == PX_SYM_CACHED;
+	}
+	free(list.jobs);
+
+	qsort(ENV(symbols).tables, ENV(symbols).ntables,
+		sizeof(*ENV(symbols).tables), _px_sym_table_cmp);
+
+	return ENV(symbols).nsyms;
+}
+
+/**
+ * Returns the last component of a path
+ */
+static inline const char *_px_sym_basename(const char *path)
+{
+	const char *p = strrchr(path, '/');
+
+	return p ? p + 1 : path;
+}
+
+/**
+ * Resolves an address to object, symbol and offset
+ * Addresses outside every symbol table are resolved to their mapped
+ * region when possible. Returns 1 when anything was found, 0 otherwise.
+ */
+int px_sym_resolve(uintptr_t addr, px_sym_info *info)
+{
+	const px_sym_index *index = &ENV(symbols);
+	const px_sym_table *t;
+	size_t lo = 0, hi = index->ntables, half;
+	uint64_t rel;
+	ssize_t region;
+
+	/* Last table starting at or below addr */
+	while (hi > lo) {
+		half = (hi - lo) / 2;
+
+		if (index->tables[lo + half].lo <= addr) {
+			lo += half + 1;
+		} else {
+			hi = lo + half;
+		}
+	}
+
+	if (lo && addr < index->tables[lo - 1].hi) {
+		t = &index->tables[lo - 1];
+		rel = addr - t->base;
+
+		/* Last symbol starting at or below rel */
+		for (lo = 0, hi = t->nsyms; hi > lo;) {
+			half = (hi - lo) / 2;
+
+			if (t->addr[lo + half] <= rel) {
+				lo += half + 1;
+			} else {
+				hi = lo + half;
+			}
+		}
+
+		info->object = _px_sym_basename(t->object);
+		info->name = t->strs + t->name[lo - 1];
+		info->offset = rel - t->addr[lo - 1];
+
+		return 1;
+	}
+
+	if ((region = px_maps_lookup(addr)) != -1) {
+		info->object = _px_sym_basename(PX_MAPS_NAME(region));
+		info->name = NULL;
+		info->offset = addr - PX_MAPS_START(region) + ENV(maps)[region].offset;
+
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * Looks up a symbol by name in the index, the first object having it
+ * wins. Returns its address or 0.
+ */
+uintptr_t px_sym_lookup(const char *name)
+{
+	const px_sym_index *index = &ENV(symbols);
+	const px_sym_table *t;
+	size_t i, j;
+
+	for (i = 0; i < index->ntables; ++i) {
+		t = &index->tables[i];
+
+		for (j = 0; j < t->nsyms; ++j) {
+			if (strcmp(t->strs + t->name[j], name) == 0) {
+				return t->base + t->addr[j];
+			}
+		}
+	}
+	return 0;
+}
+
+/**
+ * Formats an address as lib!func+off
+ */
+size_t px_sym_format(uintptr_t addr, char *buf, size_t len)
+{
+	px_sym_info info;
+	int n;
+
+	if (px_sym_resolve(addr, &info) == 0) {
+		n = snprintf(buf, len, "??");
+	} else if (info.name) {
+		n = snprintf(buf, len, info.offset ? "%s!%s+%#" PRIxPTR : "%s!%s",
+			info.object, info.name, info.offset);
+	} else {
+		n = snprintf(buf, len, "%s+%#" PRIxPTR,
+			info.object[0] ? info.object : "[anon]", info.offset);
+	}
+	return n < 0 ? 0 : (size_t)n < len ? (size_t)n : len - 1;
+}
+
+/**
+ * Prints the symbol of a single address
+ */
+static void _px_sym_show(uintptr_t addr)
+{
+	char buf[PATH_MAX];
+
+	px_sym_format(addr, buf, sizeof(buf));
+	printf("%#" PRIxPTR ": %s\n", addr, buf);
+}
+
+/**
+ * Symbolizes a list of addresses, or the addresses read from stdin when
+ * the list is "-" (one per line, until EOF or a line with a single dot)
+ */
+void px_sym_symbolize(const char *params)
+{
+	char line[128], *token, *saveptr = NULL, *list;
+
+	if (ENV(symbols).tables == NULL) {
+		if (px_sym_build() == -1) {
+			return;
+		}
+		printf("[+] %zu symbols in %zu objects (%zu from the index cache)\n",
+			ENV(symbols).nsyms, ENV(symbols).ntables, ENV(symbols).cached);
+	}
+
+	if (strcmp(params, "-") == 0) {
+		while (fgets(line, sizeof(line), stdin) != NULL
+			&& strcmp(line, ".\n") != 0) {
+			_px_sym_show(strtoull(line, NULL, 16));
+		}
+		fflush(stdout);
+		return;
+	}
+
+	if ((list = strdup(params)) == NULL) {
+		return;
+	}
+	for (token = strtok_r(list, " ", &saveptr); token;
+		token = strtok_r(NULL, " ", &saveptr)) {
+		_px_sym_show(strtoull(token, NULL, 16));
+	}
+	free(list);
+}
+
+/**
+ * Deallocs the symbol index
+ */
+void px_sym_clear(void)
+{
+	px_sym_index *index = &ENV(symbols);
+	size_t i;
+
+	for (i = 0; i < index->ntables; ++i) {
+		_px_sym_table_free(&index->tables[i]);
+	}
+	px_safe_free(index->tables);
+
+	memset(index, 0, sizeof(*index));
+}
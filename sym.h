@@ -0,0 +1,78 @@
+/**
+ * Copyright (c) 2012, Felipe Pena
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *   Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PX_SYM
+#define PX_SYM
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * Function symbols of one loaded object
+ * Arrays are parallel and sorted by address, addresses are relative to
+ * base. The storage is either malloc'd or mapped from an index file.
+ */
+typedef struct _px_sym_table {
+	char *object;           /* object path */
+	uintptr_t base;         /* load bias */
+	uintptr_t lo, hi;       /* absolute range covered by the symbols */
+	size_t nsyms;
+	const uint64_t *addr;
+	const uint32_t *size;
+	const uint32_t *name;   /* offsets into strs */
+	const char *strs;
+	void *mem;              /* backing storage */
+	size_t mem_len;
+	int mapped;             /* mem is mmap'd */
+} px_sym_table;
+
+/**
+ * Address to symbol index over all loaded objects, sorted by lo
+ */
+typedef struct _px_sym_index {
+	px_sym_table *tables;
+	size_t ntables;
+	size_t nsyms;
+	size_t cached;          /* tables mapped from the index cache */
+} px_sym_index;
+
+/**
+ * Result of a symbol lookup
+ */
+typedef struct _px_sym_info {
+	const char *object;     /* object basename */
+	const char *name;       /* NULL when only the object is known */
+	uintptr_t offset;       /* from the symbol, or from the object base */
+} px_sym_info;
+
+int px_sym_build(void);
+int px_sym_resolve(uintptr_t, px_sym_info*);
+uintptr_t px_sym_lookup(const char*);
+size_t px_sym_format(uintptr_t, char*, size_t);
+void px_sym_symbolize(const char*);
+void px_sym_clear(void);
+
+#endif /* PX_SYM */
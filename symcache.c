@@ -0,0 +1,223 @@
+/**
+ * Copyright (c) 2012, Felipe Pena
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *   Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "common.h"
+#include "symcache.h"
+
+/**
+ * Builds the cache directory path
+ * $PX_CACHE_DIR, $XDG_CACHE_HOME/px or $HOME/.cache/px
+ */
+static int _px_symcache_dir(char *dir, size_t len)
+{
+	const char *env;
+	int n;
+
+	if ((env = getenv("PX_CACHE_DIR")) != NULL && env[0]) {
+		n = snprintf(dir, len, "%s", env);
+	} else if ((env = getenv("XDG_CACHE_HOME")) != NULL && env[0]) {
+		n = snprintf(dir, len, "%s/px", env);
+	} else if ((env = getenv("HOME")) != NULL && env[0]) {
+		n = snprintf(dir, len, "%s/.cache/px", env);
+	} else {
+		return -1;
+	}
+	return n > 0 && (size_t)n < len ? 0 : -1;
+}
+
+/**
+ * Builds the path of the index of a build-id
+ */
+static int _px_symcache_path(const unsigned char *id, size_t id_len,
+	char *path, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	char dir[PATH_MAX], name[128];
+	size_t i;
+	int n;
+
+	if (id_len == 0 || id_len * 2 >= sizeof(name)
+		|| _px_symcache_dir(dir, sizeof(dir)) == -1) {
+		return -1;
+	}
+
+	for (i = 0; i < id_len; ++i) {
+		name[i * 2] = hex[id[i] >> 4];
+		name[i * 2 + 1] = hex[id[i] & 0xf];
+	}
+	name[id_len * 2] = '\0';
+
+	n = snprintf(path, len, "%s/%s.sym", dir, name);
+
+	return n > 0 && (size_t)n < len ? 0 : -1;
+}
+
+/**
+ * Checks a mapped index before any of its offsets is trusted
+ * Files may be truncated, corrupt or written by another px: the sizes must
+ * add up, addresses must be sorted for the binary search, and every name
+ * must start inside a NUL-terminated string block.
+ */
+static int _px_symcache_valid(const px_symcache_header *header, size_t len)
+{
+	const size_t n = header->nsyms;
+	const uint64_t *addr = (const uint64_t*) (header + 1);
+	const uint32_t *name = (const uint32_t*) (addr + n) + n;
+	const char *strs = (const char*) (name + n);
+	size_t i;
+
+	if (memcmp(header->magic, PX_SYMCACHE_MAGIC, sizeof(header->magic)) != 0
+		|| header->version != PX_SYMCACHE_VERSION || n == 0
+		|| header->strs_len == 0 || header->strs_len > len
+		|| len != sizeof(*header) + n * (sizeof(uint64_t)
+			+ 2 * sizeof(uint32_t)) + header->strs_len
+		|| strs[header->strs_len - 1] != '\0') {
+		return 0;
+	}
+
+	for (i = 0; i < n; ++i) {
+		if (name[i] >= header->strs_len || (i && addr[i] < addr[i - 1])) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/**
+ * Maps the cached index of a build-id into a table
+ * The table arrays point into the mapping (t->mapped is set).
+ */
+int px_symcache_load(const unsigned char *id, size_t id_len, px_sym_table *t)
+{
+	const px_symcache_header *header;
+	char path[PATH_MAX];
+	struct stat st;
+	void *mem;
+	size_t n;
+	int fd;
+
+	if (_px_symcache_path(id, id_len, path, sizeof(path)) == -1
+		|| (fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+		return -1;
+	}
+
+	if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(*header)) {
+		close(fd);
+		return -1;
+	}
+
+	mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (mem == MAP_FAILED) {
+		return -1;
+	}
+
+	header = mem;
+	n = header->nsyms;
+
+	if (!_px_symcache_valid(header, st.st_size)) {
+		munmap(mem, st.st_size);
+		return -1;
+	}
+
+	t->mem = mem;
+	t->mem_len = st.st_size;
+	t->mapped = 1;
+	t->nsyms = n;
+	t->addr = (const uint64_t*) (header + 1);
+	t->size = (const uint32_t*) (t->addr + n);
+	t->name = t->size + n;
+	t->strs = (const char*) (t->name + n);
+
+	return 0;
+}
+
+static unsigned g_seq;
+
+/**
+ * Stores a table as the cached index of a build-id
+ * The file is written under a temporary name and renamed into place, so
+ * concurrent px instances never see a partial index.
+ */
+int px_symcache_store(const unsigned char *id, size_t id_len,
+	const px_sym_table *t)
+{
+	px_symcache_header header;
+	char dir[PATH_MAX], path[PATH_MAX], tmp[PATH_MAX + 32], *p;
+	const size_t arrays = t->nsyms * (sizeof(uint64_t) + 2 * sizeof(uint32_t));
+	int fd, ok;
+
+	if (t->mapped || _px_symcache_path(id, id_len, path, sizeof(path)) == -1) {
+		return -1;
+	}
+
+	/* mkdir -p */
+	_px_symcache_dir(dir, sizeof(dir));
+
+	for (p = dir + 1; *p; ++p) {
+		if (*p == '/') {
+			*p = '\0';
+			mkdir(dir, 0700);
+			*p = '/';
+		}
+	}
+	if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+		return -1;
+	}
+
+	/* Unique per process and per store, stores may run on worker threads */
+	snprintf(tmp, sizeof(tmp), "%s.%d.%u", path, (int) getpid(),
+		__atomic_fetch_add(&g_seq, 1, __ATOMIC_RELAXED));
+
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) == -1) {
+		return -1;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, PX_SYMCACHE_MAGIC, sizeof(header.magic));
+	header.version = PX_SYMCACHE_VERSION;
+	header.nsyms = t->nsyms;
+	header.strs_len = t->mem_len - arrays;
+
+	ok = write(fd, &header, sizeof(header)) == sizeof(header)
+		&& write(fd, t->mem, t->mem_len) == (ssize_t)t->mem_len;
+
+	if (close(fd) == -1 || !ok || rename(tmp, path) == -1) {
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
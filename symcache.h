@@ -0,0 +1,51 @@
+/**
+ * Copyright (c) 2012, Felipe Pena
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *   Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PX_SYMCACHE
+#define PX_SYMCACHE
+
+#include <stddef.h>
+#include "sym.h"
+
+/**
+ * On-disk symbol index, stored as <build-id>.sym in the cache directory
+ * header, uint64_t addr[n], uint32_t size[n], uint32_t name[n], strings
+ * It is the in-memory layout of px_sym_table, so loading is a mmap.
+ */
+#define PX_SYMCACHE_MAGIC   "PXSYMIDX"
+#define PX_SYMCACHE_VERSION 2
+
+typedef struct _px_symcache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t nsyms;
+	uint64_t strs_len;
+} px_symcache_header;
+
+int px_symcache_load(const unsigned char*, size_t, px_sym_table*);
+int px_symcache_store(const unsigned char*, size_t, const px_sym_table*);
+
+#endif /* PX_SYMCACHE */
@@ -25,66 +25,734 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <dirent.h>
+#include <elf.h>
 #include <sys/ptrace.h>
 #include <sys/wait.h>
+#include <sys/uio.h>
+#include <sys/user.h>
+#include <sys/syscall.h>
+#include <signal.h>
+#include <time.h>
 #include <errno.h>
 #include <string.h>
 #include "common.h"
 #include "trace.h"
 #include "cmd.h"
+#include "ptrace.h"
+#include "cache.h"
+#include "proc.h"
+#include "sym.h"
+
+/**
+ * When the target was last stopped by px_attach_pid()
+ */
+static struct timespec g_stopped;
+
+/**
+ * Thread table helpers px_fork_pid() needs, defined with the others below
+ */
+static int _px_threads_add(px_threads*, pid_t);
+static void _px_threads_remove(px_threads*, size_t);
+static void _px_threads_capture(px_threads*, size_t);
 
 /**
  * Attaches to an specified pid
+ * Every thread is seized, then all are interrupted at once and their
+ * registers saved as they stop.
  */
 void px_attach_pid(void) {
-	int stat;
+	uint64_t t0, seized;
 
 	printf("[+] Attaching to pid %d\n", ENV(pid));
 
-	if (ptrace(PTRACE_ATTACH, ENV(pid), NULL, NULL) == -1) {
-		px_error("Failed to attach to pid (%s)", strerror(errno));
+	px_cache_invalidate();
+
+	t0 = px_clock_ns();
+
+	if (px_threads_seize(&ENV(threads)) == -1) {
 		return;
 	}
 
-	if (waitpid(ENV(pid), &stat, WNOHANG) != ENV(pid) || !WIFSTOPPED(stat)) {
-		px_error("Unexpected wait result (%s)", strerror(errno));
-	}
+	seized = px_clock_ns();
+
+	px_threads_stop(&ENV(threads));
+
+	clock_gettime(CLOCK_MONOTONIC, &g_stopped);
+
+	printf("[+] %zu threads seized in %.0fus\n", ENV(threads).n,
+		(seized - t0) / 1e3);
+	px_threads_show_latency();
 }
 
 /**
  * Detaches from an previously attached pid
  */
 void px_detach_pid(void) {
-	printf("[+] Detaching from pid %d\n", ENV(pid));
+	int stat;
+
+	/* A snapshot child is only a copy, it must not run */
+	if (ENV(parent) != 0) {
+		printf("[+] Killing pid %d (snapshot of pid %d)\n", ENV(pid),
+			ENV(parent));
+
+		if (kill(ENV(pid), SIGKILL) == -1) {
+			px_error("Failed to kill pid (%s)", strerror(errno));
+		} else {
+			waitpid(ENV(pid), &stat, __WALL);
+		}
+		px_threads_clear(&ENV(threads));
+		ENV(parent) = 0;
+	} else {
+		printf("[+] Detaching from pid %d\n", ENV(pid));
+
+		px_threads_detach(&ENV(threads));
+	}
+
+	ptrace_reset();
+	px_cache_invalidate();
+
+	ENV(pid) = 0;
+}
+
+#if defined(__x86_64__)
+/**
+ * Makes the stopped target call fork() by running "syscall; int3" at its
+ * pc, then puts its code and registers back. Returns the pid of the child
+ * (stopped and traced through PTRACE_O_TRACEFORK) or -1. Signals arriving
+ * meanwhile are kept in pending, to be delivered on detach.
+ */
+static pid_t _px_inject_fork(pid_t pid, int *pending)
+{
+	static const unsigned char code[] = {0x0f, 0x05, 0xcc};
+	struct user_regs_struct saved, regs;
+	unsigned long child = 0;
+	long word, patched;
+	int stat, trapped = 0;
+
+	/* Another thread running into the patched bytes would fork too */
+	if (ENV(threads).stopped != ENV(threads).n) {
+		px_error("Not every thread is stopped, refusing to patch the code");
+		return -1;
+	}
+
+	errno = 0;
+	if (ptrace(PTRACE_GETREGS, pid, NULL, &saved) == -1
+		|| ((word = ptrace(PTRACE_PEEKTEXT, pid, saved.rip, NULL)) == -1
+			&& errno)) {
+		px_error("Failed to read the target state (%s)", strerror(errno));
+		return -1;
+	}
+
+	patched = word;
+	memcpy(&patched, code, sizeof(code));
+
+	regs = saved;
+	regs.rax = SYS_fork;
+	/* Otherwise an interrupted syscall would be restarted first */
+	regs.orig_rax = -1;
+
+	if (ptrace(PTRACE_SETOPTIONS, pid, NULL, PX_PTRACE_OPTIONS | PTRACE_O_TRACEFORK) == -1
+		|| ptrace(PTRACE_POKETEXT, pid, saved.rip, patched) == -1) {
+		px_error("Failed to inject fork() (%s)", strerror(errno));
+		return -1;
+	}
+
+	if (ptrace(PTRACE_SETREGS, pid, NULL, &regs) == -1) {
+		px_error("Failed to inject fork() (%s)", strerror(errno));
+		goto restore;
+	}
+
+	/* The fork event stops on the way to the int3 */
+	while (!trapped && ptrace(PTRACE_CONT, pid, NULL, NULL) != -1) {
+		if (waitpid(pid, &stat, __WALL) != pid || !WIFSTOPPED(stat)) {
+			px_error("The target did not stop after fork()");
+			goto restore;
+		}
+		if (stat >> 8 == (SIGTRAP | (PTRACE_EVENT_FORK << 8))) {
+			ptrace(PTRACE_GETEVENTMSG, pid, NULL, &child);
+		} else if (stat >> 16) {
+			/* Not a signal (a group stop, say) */
+		} else if (WSTOPSIG(stat) == SIGTRAP) {
+			trapped = 1;
+		} else {
+			*pending = WSTOPSIG(stat);
+		}
+	}
+
+	if (!trapped || ptrace(PTRACE_GETREGS, pid, NULL, &regs) == -1) {
+		px_error("Failed to run fork() (%s)", strerror(errno));
+	} else if ((long) regs.rax < 0) {
+		px_error("fork() failed in the target (%s)", strerror(-regs.rax));
+	}
+
+restore:
+	if (ptrace(PTRACE_POKETEXT, pid, saved.rip, word) == -1
+		|| ptrace(PTRACE_SETREGS, pid, NULL, &saved) == -1) {
+		px_error("Failed to restore the target (%s)", strerror(errno));
+	}
+	ptrace(PTRACE_SETOPTIONS, pid, NULL, PX_PTRACE_OPTIONS);
+
+	if (child == 0) {
+		return -1;
+	}
+
+	/* The child starts stopped, with the injected code in its copy */
+	if (waitpid(child, &stat, __WALL) != (pid_t) child
+		|| ptrace(PTRACE_POKETEXT, child, saved.rip, word) == -1
+		|| ptrace(PTRACE_SETREGS, child, NULL, &saved) == -1) {
+		px_error("Failed to prepare the child %lu (%s)", child,
+			strerror(errno));
+	}
+	return child;
+}
+#endif
+
+/**
+ * Forks the attached target and moves the session to the copy-on-write
+ * child, detaching from the target right away. The child is killed on
+ * detach.
+ */
+void px_fork_pid(void)
+{
+#if defined(__x86_64__)
+	struct timespec t0, t1;
+	int pending = 0;
+	pid_t child;
+	ssize_t i;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
 
-	if (ptrace(PTRACE_DETACH, ENV(pid), NULL, NULL) == -1) {
+	if ((child = _px_inject_fork(ENV(pid), &pending)) == -1) {
+		return;
+	}
+
+	/* The thread that forked is in a signal stop, the others in stops of
+	 * their own */
+	if (ptrace(PTRACE_DETACH, ENV(pid), NULL, pending) == -1) {
 		px_error("Failed to detach from pid (%s)", strerror(errno));
+	}
+	if ((i = px_threads_find(&ENV(threads), ENV(pid))) != -1) {
+		_px_threads_remove(&ENV(threads), i);
+	}
+	px_threads_detach(&ENV(threads));
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	printf("[+] Reading from pid %d, a fork of pid %d\n", child, ENV(pid));
+	printf("[+] fork() took %.0fus, pid %d was stopped for %.3fs since "
+		"attach\n",
+		(t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_nsec - t0.tv_nsec) / 1e3,
+		ENV(pid), (t1.tv_sec - g_stopped.tv_sec)
+			+ (t1.tv_nsec - g_stopped.tv_nsec) / 1e9);
+
+	ENV(parent) = ENV(pid);
+	ENV(pid) = child;
+
+	/* The child inherited the seize, it is the session's only thread */
+	if (_px_threads_add(&ENV(threads), child) == 0) {
+		ENV(threads).list[0].stopped = 1;
+		ENV(threads).stopped = 1;
+		_px_threads_capture(&ENV(threads), 0);
+	}
+
+	ptrace_reset();
+	px_cache_invalidate();
+#else
+	px_error("snapshot --fork is only supported on x86_64");
+#endif
+}
+
+/**
+ * Returns CLOCK_MONOTONIC in nanoseconds
+ */
+uint64_t px_clock_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Finds a thread by tid
+ */
+ssize_t px_threads_find(const px_threads *t, pid_t tid)
+{
+	size_t i;
+
+	for (i = 0; i < t->n; ++i) {
+		if (t->list[i].tid == tid) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static int _px_threads_add(px_threads *t, pid_t tid)
+{
+	px_thread *list;
+
+	if (t->n == t->size) {
+		t->size = t->size ? t->size * 2 : 16;
+
+		if ((list = realloc(t->list, sizeof(*list) * t->size)) == NULL) {
+			px_error("Failed to realloc!");
+			return -1;
+		}
+		t->list = list;
+	}
+	memset(&t->list[t->n], 0, sizeof(*t->list));
+	t->list[t->n++].tid = tid;
+
+	return 0;
+}
+
+static void _px_threads_remove(px_threads *t, size_t i)
+{
+	if (t->list[i].interrupted) {
+		--t->interrupted;
+	}
+	if (t->list[i].stopped) {
+		--t->stopped;
+	}
+	t->list[i] = t->list[--t->n];
+}
+
+/**
+ * Saves the registers of a stopped thread in the table
+ */
+static void _px_threads_capture(px_threads *t, size_t i)
+{
+	struct iovec iov = { &t->list[i].regs, sizeof(t->list[i].regs) };
+
+	t->list[i].have_regs =
+		ptrace(PTRACE_GETREGSET, t->list[i].tid, NT_PRSTATUS, &iov) != -1;
+}
+
+/**
+ * Seizes every thread of the target with PTRACE_SEIZE: they keep running
+ * until px_threads_interrupt(). Threads created meanwhile are followed
+ * with PTRACE_O_TRACECLONE. Returns 0 or -1.
+ */
+int px_threads_seize(px_threads *t)
+{
+	char fname[PATH_MAX];
+	struct dirent *ent;
+	size_t found;
+	pid_t tid;
+	DIR *dir;
+
+	memset(t, 0, sizeof(*t));
+
+	snprintf(fname, sizeof(fname), "/proc/%d/task", ENV(pid));
+
+	/* Threads not seized yet may create more, list until nothing is new */
+	do {
+		if ((dir = opendir(fname)) == NULL) {
+			px_error("Failed to read %s (%s)", fname, strerror(errno));
+			break;
+		}
+		found = 0;
+
+		while ((ent = readdir(dir)) != NULL) {
+			if (ent->d_name[0] == '.'
+				|| px_threads_find(t, tid = atoi(ent->d_name)) != -1) {
+				continue;
+			}
+			if (ptrace(PTRACE_SEIZE, tid, NULL, PX_PTRACE_OPTIONS) == -1) {
+				/* It may have exited meanwhile */
+				continue;
+			}
+			if (_px_threads_add(t, tid) == -1) {
+				ptrace(PTRACE_DETACH, tid, NULL, NULL);
+				break;
+			}
+			++found;
+		}
+		closedir(dir);
+	} while (found);
+
+	if (px_threads_find(t, ENV(pid)) == -1) {
+		px_error("Failed to attach to pid (%s)", strerror(errno));
+		px_threads_detach(t);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Sends PTRACE_INTERRUPT to every running thread
+ */
+void px_threads_interrupt(px_threads *t)
+{
+	const uint64_t now = px_clock_ns();
+	size_t i;
+
+	for (i = 0; i < t->n; ++i) {
+		if (t->list[i].interrupted || t->list[i].stopped
+			|| ptrace(PTRACE_INTERRUPT, t->list[i].tid, NULL, NULL) == -1) {
+			continue;
+		}
+		t->list[i].interrupted = 1;
+		t->list[i].since = now;
+		++t->interrupted;
+	}
+}
+
+/**
+ * Handles a wait status of a thread: signals are passed on, new threads
+ * are added and threads that exit are removed. Returns the index of the
+ * thread when it is stopped in PTRACE_EVENT_STOP (interrupted, new or
+ * group-stopped), -1 otherwise.
+ */
+ssize_t px_threads_event(px_threads *t, pid_t tid, int stat)
+{
+	unsigned long msg;
+	ssize_t i;
+	int sig;
+
+	if ((i = px_threads_find(t, tid)) == -1) {
+		/* A new thread may stop before its parent's clone event */
+		if (!WIFSTOPPED(stat) || _px_threads_add(t, tid) == -1) {
+			return -1;
+		}
+		i = t->n - 1;
+		t->list[i].starting = 1;
+	}
+	if (WIFEXITED(stat) || WIFSIGNALED(stat)) {
+		_px_threads_remove(t, i);
+		return -1;
+	}
+	if (!WIFSTOPPED(stat)) {
+		return -1;
+	}
+	sig = WSTOPSIG(stat);
+
+	switch (stat >> 16) {
+		case PTRACE_EVENT_STOP:
+			t->list[i].group_stop = sig == SIGSTOP || sig == SIGTSTP
+				|| sig == SIGTTIN || sig == SIGTTOU;
+
+			if (!t->list[i].stopped) {
+				t->list[i].stopped = 1;
+				++t->stopped;
+			}
+			t->list[i].starting = 0;
+			return i;
+
+		case PTRACE_EVENT_CLONE:
+			if (ptrace(PTRACE_GETEVENTMSG, tid, NULL, &msg) != -1
+				&& px_threads_find(t, msg) == -1
+				&& _px_threads_add(t, msg) == 0) {
+				t->list[t->n - 1].starting = 1;
+			}
+			sig = 0;
+			break;
+
+		default:
+			/* Other events, not asked for */
+			if (stat >> 16) {
+				sig = 0;
+			}
+			break;
+	}
+	/* A signal delivery stop, the signal goes on to the thread */
+	ptrace(PTRACE_CONT, tid, NULL, sig);
+
+	/* Any stop takes a pending PTRACE_INTERRUPT with it, send another */
+	if (t->list[i].interrupted) {
+		ptrace(PTRACE_INTERRUPT, tid, NULL, NULL);
+	}
+	return -1;
+}
+
+/**
+ * Waits for the next thread to stop in PTRACE_EVENT_STOP and returns its
+ * index, or -1 when no thread is left
+ */
+ssize_t px_threads_wait(px_threads *t)
+{
+	ssize_t i;
+	pid_t tid;
+	int stat;
+
+	while (t->n && (tid = waitpid(-1, &stat, __WALL)) != -1) {
+		if ((i = px_threads_event(t, tid, stat)) != -1) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/**
+ * Resumes a thread stopped in PTRACE_EVENT_STOP, the pages cached from the
+ * target are stale from then on
+ */
+void px_threads_resume(px_threads *t, size_t i)
+{
+	px_thread *thread = &t->list[i];
+
+	px_cache_invalidate();
+
+	if (thread->interrupted) {
+		thread->interrupted = 0;
+		--t->interrupted;
+	}
+	if (thread->stopped) {
+		thread->stopped = 0;
+		--t->stopped;
+	}
+	thread->have_regs = 0;
+
+	/* PTRACE_CONT would end a group stop, LISTEN keeps the thread in it */
+	ptrace(thread->group_stop ? PTRACE_LISTEN : PTRACE_CONT, thread->tid,
+		NULL, NULL);
+}
+
+/**
+ * Resumes every stopped thread
+ */
+void px_threads_resume_all(px_threads *t)
+{
+	size_t i;
+
+	for (i = 0; i < t->n; ++i) {
+		if (t->list[i].stopped) {
+			px_threads_resume(t, i);
+		}
+	}
+}
+
+/**
+ * Stops every thread, then saves the registers of all in one pass. All
+ * the interrupts are sent before the first wait so the threads stop
+ * concurrently, and nothing but waitpid() runs until the last one did.
+ * Each thread is waited for by tid: waitpid(-1) walks every tracee on
+ * each call, which is quadratic with thousands of threads.
+ * The timings are kept in stop_ns, interrupt_ns and regs_ns.
+ * Pages cached while the threads ran are dropped.
+ * Returns stop_ns: the time from the first interrupt to the last stop.
+ */
+uint64_t px_threads_stop(px_threads *t)
+{
+	const uint64_t start = px_clock_ns();
+	uint64_t now;
+	size_t i = 0;
+	pid_t tid;
+	int stat;
+
+	px_cache_invalidate();
+	px_threads_interrupt(t);
+	t->interrupt_ns = px_clock_ns() - start;
+
+	/* New threads are appended and stop on their own, the walk sees them.
+	 * A thread PTRACE_INTERRUPT failed on (exiting) owes no stop. */
+	while (i < t->n) {
+		if (t->list[i].stopped
+			|| !(t->list[i].interrupted || t->list[i].starting)) {
+			++i;
+		} else if ((tid = waitpid(t->list[i].tid, &stat, __WALL)) == -1) {
+			/* Gone and reaped with its thread group */
+			_px_threads_remove(t, i);
+		} else {
+			px_threads_event(t, tid, stat);
+		}
+	}
+
+	now = px_clock_ns();
+	t->stop_ns = now - start;
+
+	for (i = 0; i < t->n; ++i) {
+		if (!t->list[i].have_regs) {
+			_px_threads_capture(t, i);
+		}
+	}
+	t->regs_ns = px_clock_ns() - now;
+
+	return t->stop_ns;
+}
+
+/**
+ * Detaches from every thread, stopping the running ones first (a thread
+ * must be stopped to be detached)
+ */
+void px_threads_detach(px_threads *t)
+{
+	size_t i;
+
+	px_threads_stop(t);
+
+	for (i = 0; i < t->n; ++i) {
+		ptrace(PTRACE_DETACH, t->list[i].tid, NULL, NULL);
+	}
+	px_safe_free(t->list);
+	memset(t, 0, sizeof(*t));
+}
+
+/**
+ * Forgets the threads of a process that is gone
+ */
+void px_threads_clear(px_threads *t)
+{
+	px_safe_free(t->list);
+	memset(t, 0, sizeof(*t));
+}
+
+#if defined(__x86_64__)
+static const char *const g_reg_names[] = {
+	"r15", "r14", "r13", "r12", "rbp", "rbx", "r11", "r10", "r9", "r8",
+	"rax", "rcx", "rdx", "rsi", "rdi", "orig_rax", "rip", "cs", "eflags",
+	"rsp", "ss", "fs_base", "gs_base", "ds", "es", "fs", "gs"
+};
+#elif defined(__aarch64__)
+static const char *const g_reg_names[] = {
+	"x0", "x1", "x2", "x3", "x4", "x5", "x6", "x7", "x8", "x9", "x10",
+	"x11", "x12", "x13", "x14", "x15", "x16", "x17", "x18", "x19", "x20",
+	"x21", "x22", "x23", "x24", "x25", "x26", "x27", "x28", "x29", "x30",
+	"sp", "pc", "pstate"
+};
+#endif
+
+/**
+ * Lists the attached threads with the pc and sp of their last stop
+ */
+void px_threads_show(void)
+{
+	const px_threads *t = &ENV(threads);
+	char fname[PATH_MAX], where[PATH_MAX], pc[20], sp[20], *comm;
+	const char *state;
+	size_t i, len;
+
+	printf("%-8s %-10s %-16s %-18s %-18s %s\n", "tid", "state", "comm", "pc",
+		"sp", "symbol");
+
+	for (i = 0; i < t->n; ++i) {
+		snprintf(fname, sizeof(fname), "/proc/%d/task/%d/comm", ENV(pid),
+			t->list[i].tid);
+
+		if ((comm = px_proc_read(fname, &len)) != NULL && len) {
+			comm[len - 1] = '\0';
+		}
+		state = t->list[i].group_stop ? "group-stop"
+			: t->list[i].stopped ? "stopped" : "running";
+
+		strcpy(pc, "-");
+		strcpy(sp, "-");
+		where[0] = '\0';
+
+#ifdef PX_REG_PC
+		if (t->list[i].have_regs) {
+			snprintf(pc, sizeof(pc), "%#llx",
+				(unsigned long long) PX_REG_PC(t->list[i].regs));
+			snprintf(sp, sizeof(sp), "%#llx",
+				(unsigned long long) PX_REG_SP(t->list[i].regs));
+
+			if (ENV(symbols).tables) {
+				px_sym_format(PX_REG_PC(t->list[i].regs), where, sizeof(where));
+			}
+		}
+#endif
+		printf("%-8d %-10s %-16s %-18s %-18s %s\n", t->list[i].tid, state,
+			comm ? comm : "?", pc, sp, where);
+
+		px_safe_free(comm);
+	}
+	printf("[+] %zu threads, %zu stopped\n", t->n, t->stopped);
+	px_threads_show_latency();
+}
+
+/**
+ * Prints the timings of the last px_threads_stop()
+ */
+void px_threads_show_latency(void)
+{
+	const px_threads *t = &ENV(threads);
+
+	printf("[+] %zu threads stopped in %.0fus (interrupts sent in %.0fus), "
+		"registers read in %.0fus\n", t->n, t->stop_ns / 1e3,
+		t->interrupt_ns / 1e3, t->regs_ns / 1e3);
+}
+
+/**
+ * Prints the general registers saved for a thread (0 for the main one)
+ */
+void px_threads_show_regs(pid_t tid)
+{
+	const px_threads *t = &ENV(threads);
+	const unsigned long long *regs;
+	ssize_t i;
+	size_t j;
+
+	if ((i = px_threads_find(t, tid ? tid : ENV(pid))) == -1) {
+		px_error("No attached thread %d", tid);
+		return;
+	}
+	if (!t->list[i].have_regs) {
+		px_error("No registers saved for thread %d", t->list[i].tid);
 		return;
 	}
+#ifdef PX_REG_PC
+	regs = (const unsigned long long *) &t->list[i].regs;
 
-	ENV(pid) = 0;
+	for (j = 0; j < sizeof(g_reg_names) / sizeof(*g_reg_names); ++j) {
+		printf("%-9s 0x%016llx%s", g_reg_names[j], regs[j],
+			j % 3 == 2 ? "\n" : "   ");
+	}
+	if (j % 3) {
+		printf("\n");
+	}
+#else
+	(void) regs;
+	(void) j;
+	px_error("regs is not supported on this architecture");
+#endif
 }
 
 /**
  * Sends a signal to the attached child process
  */
 void px_send_signal(int signum) {
+	pid_t tid = 0;
 	int stat;
 
 	printf("[+] Sending signal %d to attached process\n", signum);
 
+	/* The target may run while handling the signal */
+	px_cache_invalidate();
+
 	if (kill(ENV(pid), signum) == -1) {
 		px_error("%s", strerror(errno));
 		return;
 	}
 
-	waitpid(ENV(pid), &stat, WNOHANG);
+	/* The threads are stopped: only SIGKILL acts before detach. The
+	 * leader is reported last, once the other threads were reaped. */
+	stat = 0;
+
+	if (signum == SIGKILL) {
+		while ((tid = waitpid(-1, &stat, __WALL)) != -1 && tid != ENV(pid));
+	} else {
+		tid = waitpid(ENV(pid), &stat, __WALL | WNOHANG);
+	}
+
+	if (tid == ENV(pid) && (WIFEXITED(stat) || WIFSIGNALED(stat))) {
+		if (WIFEXITED(stat)) {
+			printf("Child status: %d (Exited with status: %d)\n",
+				stat, WEXITSTATUS(stat));
+		} else {
+			printf("Child status: %d (Killed by signal %d)\n",
+				stat, WTERMSIG(stat));
+		}
 
-	if (WIFEXITED(stat)) {
-		printf("Child status: %d (Exited with status: %d)\n",
-			stat, WEXITSTATUS(stat));
+		px_threads_clear(&ENV(threads));
+		ptrace_reset();
 
 		ENV(pid) = 0;
+		ENV(parent) = 0;
 	} else {
 		printf("Child status: %d\n", stat);
 	}
@@ -27,8 +27,76 @@
 #ifndef PX_TRACE
 #define PX_TRACE
 
+#include <sys/types.h>
+#include <sys/ptrace.h>
+#include <sys/user.h>
+#include <stdint.h>
+
+/**
+ * ptrace options of every seized thread
+ */
+#define PX_PTRACE_OPTIONS PTRACE_O_TRACECLONE
+
+/**
+ * Registers of a struct user_regs_struct used across the tree
+ */
+#if defined(__x86_64__)
+# define PX_REG_PC(r) (r).rip
+# define PX_REG_SP(r) (r).rsp
+# define PX_REG_FP(r) (r).rbp
+# define PX_REG_LR(r) 0
+#elif defined(__aarch64__)
+# define PX_REG_PC(r) (r).pc
+# define PX_REG_SP(r) (r).sp
+# define PX_REG_FP(r) (r).regs[29]
+# define PX_REG_LR(r) (r).regs[30]
+#endif
+
+/**
+ * A thread of the target seized with PTRACE_SEIZE
+ */
+typedef struct _px_thread {
+	pid_t tid;
+	uint8_t interrupted;  /* PTRACE_INTERRUPT sent, its stop not seen yet */
+	uint8_t starting;     /* new thread, its first stop not seen yet */
+	uint8_t stopped;      /* in PTRACE_EVENT_STOP */
+	uint8_t group_stop;   /* stopped by SIGSTOP & co, resume with LISTEN */
+	uint8_t have_regs;    /* regs holds the registers of the current stop */
+	uint64_t since;       /* when it was interrupted (CLOCK_MONOTONIC ns) */
+	struct user_regs_struct regs;
+} px_thread;
+
+/**
+ * The seized threads, one table per session (ENV(threads))
+ */
+typedef struct _px_threads {
+	px_thread *list;
+	size_t n;
+	size_t size;
+	size_t interrupted;   /* threads with interrupted set */
+	size_t stopped;       /* threads with stopped set */
+	uint64_t stop_ns;     /* last px_threads_stop(): first interrupt to last stop */
+	uint64_t interrupt_ns; /* ... spent sending the interrupts */
+	uint64_t regs_ns;     /* ... spent reading the registers */
+} px_threads;
+
 void px_attach_pid();
 void px_detach_pid();
 void px_send_signal(int);
+void px_fork_pid(void);
+ssize_t px_threads_find(const px_threads*, pid_t);
+int px_threads_seize(px_threads*);
+void px_threads_interrupt(px_threads*);
+ssize_t px_threads_event(px_threads*, pid_t, int);
+ssize_t px_threads_wait(px_threads*);
+void px_threads_resume(px_threads*, size_t);
+void px_threads_resume_all(px_threads*);
+uint64_t px_threads_stop(px_threads*);
+void px_threads_detach(px_threads*);
+void px_threads_clear(px_threads*);
+void px_threads_show(void);
+void px_threads_show_latency(void);
+void px_threads_show_regs(pid_t);
+uint64_t px_clock_ns(void);
 
 #endif /* PX_TRACE */
@@ -0,0 +1,419 @@
+/**
+ * Copyright (c) 2012, Felipe Pena
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *   Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <time.h>
+#include "common.h"
+#include "cmd.h"
+#include "ptrace.h"
+#include "pagemap.h"
+#include "pool.h"
+#include "track.h"
+
+/**
+ * Pagemap entries read at once, one buffer per worker (256 MiB of address
+ * space with 4 KiB pages)
+ */
+#define PX_TRACK_BATCH 65536
+
+/**
+ * Bytes copied to the dump file at once; longer runs are split into
+ * records of this size
+ */
+#define PX_TRACK_DUMP_CHUNK (1 << 20)
+
+/**
+ * Four pagemap entries tested at once; GCC lowers it to SSE2/AVX2
+ */
+typedef uint64_t px_track_vec __attribute__((vector_size(32)));
+
+#define PX_TRACK_LANES (sizeof(px_track_vec) / sizeof(uint64_t))
+
+/**
+ * A run of written pages
+ */
+typedef struct _px_track_span {
+	uintptr_t addr;
+	size_t npages;
+} px_track_span;
+
+/**
+ * What was found in a batch of pages
+ */
+typedef struct _px_track_item {
+	size_t dirty;
+	px_track_span *spans; /* only with --dump */
+	size_t nspans;
+} px_track_item;
+
+typedef struct _px_track_run {
+	const px_pagemap_item *batches;
+	px_track_item *items; /* one per batch */
+	int spans;
+	int failed;
+} px_track_run;
+
+typedef struct _px_track_region {
+	size_t region;
+	size_t npages;
+	size_t dirty;
+} px_track_region;
+
+/**
+ * Process whose soft-dirty bits px cleared and when
+ */
+static struct {
+	pid_t pid;
+	struct timespec started;
+} g_track;
+
+/**
+ * Counts the entries with the soft-dirty bit set
+ */
+static size_t _px_track_count(const uint64_t *pm, size_t n)
+{
+	const px_track_vec bit = { PX_PM_SOFT_DIRTY, PX_PM_SOFT_DIRTY,
+		PX_PM_SOFT_DIRTY, PX_PM_SOFT_DIRTY };
+	px_track_vec words, sum = { 0, 0, 0, 0 };
+	size_t i, count;
+
+	for (i = 0; i + PX_TRACK_LANES <= n; i += PX_TRACK_LANES) {
+		memcpy(&words, pm + i, sizeof(words));
+		sum -= (px_track_vec) ((words & bit) != 0);
+	}
+	count = sum[0] + sum[1] + sum[2] + sum[3];
+
+	for (; i < n; ++i) {
+		count += (pm[i] & PX_PM_SOFT_DIRTY) != 0;
+	}
+	return count;
+}
+
+/**
+ * Collects the runs of written pages of an item
+ */
+static int _px_track_spans(px_track_item *item, uintptr_t addr,
+	const uint64_t *pm, size_t n, size_t page)
+{
+	px_track_span *tmp;
+	size_t i, size = 0, start;
+
+	for (i = 0; i < n; ++i) {
+		if (!(pm[i] & PX_PM_SOFT_DIRTY)) {
+			continue;
+		}
+		for (start = i; i < n && (pm[i] & PX_PM_SOFT_DIRTY); ++i);
+
+		if (item->nspans == size) {
+			size = size ? size * 2 : 16;
+
+			if ((tmp = realloc(item->spans, sizeof(*tmp) * size)) == NULL) {
+				return -1;
+			}
+			item->spans = tmp;
+		}
+		item->spans[item->nspans].addr = addr + start * page;
+		item->spans[item->nspans].npages = i - start;
+		++item->nspans;
+	}
+	return 0;
+}
+
+/**
+ * Reads the pagemap entries of a batch (run on the worker threads)
+ */
+static void _px_track_batch(size_t i, unsigned worker, const uint64_t *pm,
+	ssize_t n, void *arg)
+{
+	px_track_run *run = arg;
+	px_track_item *item = &run->items[i];
+
+	if (n <= 0) {
+		return;
+	}
+
+	item->dirty = _px_track_count(pm, n);
+
+	if (run->spans && item->dirty && _px_track_spans(item, run->batches[i].addr,
+			pm, n, getpagesize()) == -1) {
+		__atomic_store_n(&run->failed, 1, __ATOMIC_RELAXED);
+	}
+}
+
+static int _px_track_region_cmp(const void *a, const void *b)
+{
+	const px_track_region *ra = a, *rb = b;
+
+	return ra->dirty < rb->dirty ? 1 : ra->dirty > rb->dirty ? -1
+		: (ra->region > rb->region) - (ra->region < rb->region);
+}
+
+/**
+ * Writes the written pages as records of address, length (both 64-bit)
+ * and the bytes
+ */
+static int _px_track_dump(const char *file, const px_track_item *items,
+	size_t n, size_t page, size_t *dumped)
+{
+	unsigned char *buf;
+	uint64_t header[2];
+	FILE *fp;
+	uintptr_t addr, end;
+	size_t i, k, len;
+	int ret = 0;
+
+	if ((fp = fopen(file, "wb")) == NULL) {
+		px_error("Failed to open %s (%s)", file, strerror(errno));
+		return -1;
+	}
+	if ((buf = malloc(PX_TRACK_DUMP_CHUNK)) == NULL) {
+		px_error("Failed to alloc!");
+		fclose(fp);
+		return -1;
+	}
+
+	for (i = 0; i < n; ++i) {
+		for (k = 0; k < items[i].nspans; ++k) {
+			addr = items[i].spans[k].addr;
+			end = addr + items[i].spans[k].npages * page;
+
+			for (; addr < end; addr += len) {
+				len = end - addr < PX_TRACK_DUMP_CHUNK ? end - addr
+					: PX_TRACK_DUMP_CHUNK;
+
+				/* Pages px cannot read (e.g. PROT_NONE now) are left out */
+				if (ptrace_read_direct(addr, buf, len) != (ssize_t) len) {
+					continue;
+				}
+				header[0] = addr;
+				header[1] = len;
+
+				if (fwrite(header, sizeof(header), 1, fp) != 1
+					|| fwrite(buf, len, 1, fp) != 1) {
+					px_error("Failed to write %s (%s)", file, strerror(errno));
+					ret = -1;
+					goto out;
+				}
+				*dumped += len;
+			}
+		}
+	}
+out:
+	free(buf);
+
+	if (fclose(fp) == EOF && ret == 0) {
+		px_error("Failed to write %s (%s)", file, strerror(errno));
+		ret = -1;
+	}
+	return ret;
+}
+
+/**
+ * Checks whether the kernel keeps soft-dirty bits, if the stack of the
+ * target (written all the time) has any. Returns -1 when it cannot tell.
+ */
+static int _px_track_supported(void)
+{
+	const size_t page = getpagesize();
+	uint64_t *pm;
+	size_t i, npages;
+	ssize_t n = -1;
+	int fd, found = -1;
+
+	for (i = 0; ENV(maps) && i < ENV(nregions); ++i) {
+		if (strcmp(PX_MAPS_NAME(i), "[stack]") == 0) {
+			break;
+		}
+	}
+	if (ENV(maps) == NULL || i == ENV(nregions)) {
+		return -1;
+	}
+
+	npages = (ENV(maps)[i].end - PX_MAPS_START(i)) / page;
+
+	if ((pm = malloc(npages * sizeof(*pm))) != NULL
+		&& (fd = px_pagemap_open()) != -1) {
+		n = px_pagemap_read(fd, PX_MAPS_START(i), npages, pm);
+		close(fd);
+	}
+	if (n > 0) {
+		found = _px_track_count(pm, n) != 0;
+	}
+	px_safe_free(pm);
+
+	return found;
+}
+
+/**
+ * Clears the soft-dirty bits of the target's pages
+ * track start
+ */
+void px_track_start(void)
+{
+	char fname[PATH_MAX];
+	int fd;
+
+	if (_px_track_supported() == 0) {
+		printf("[!] No page of the stack is soft-dirty, the kernel may not "
+			"track writes (CONFIG_MEM_SOFT_DIRTY)\n");
+	}
+
+	snprintf(fname, sizeof(fname), "/proc/%d/clear_refs", ENV(pid));
+
+	if ((fd = open(fname, O_WRONLY | O_CLOEXEC)) == -1) {
+		px_error("Failed to open %s (%s)", fname, strerror(errno));
+		return;
+	}
+	if (write(fd, "4", 1) != 1) {
+		px_error("Failed to clear the soft-dirty bits (%s)", strerror(errno));
+		close(fd);
+		return;
+	}
+	close(fd);
+
+	g_track.pid = ENV(pid);
+	clock_gettime(CLOCK_MONOTONIC, &g_track.started);
+
+	printf("[+] Tracking the pages pid %d writes\n", ENV(pid));
+}
+
+/**
+ * Reports the pages each region wrote since track start, from the
+ * soft-dirty bits of /proc/<pid>/pagemap read by the worker threads
+ * track diff [--dump file]
+ */
+void px_track_diff(const char *params)
+{
+	const size_t page = getpagesize();
+	const unsigned jobs = px_pool_jobs();
+	px_track_run run;
+	px_pagemap_item *batches = NULL;
+	px_track_item *items = NULL;
+	px_track_region *regions = NULL;
+	const char *dump = NULL;
+	struct timespec t0, t1;
+	size_t i, k, nregions = 0, dirty = 0, pages = 0, dumped = 0;
+	ssize_t n = 0;
+	int pagemap;
+
+	if (params && strncmp(params, "--dump ", 7) == 0) {
+		dump = params + 7;
+	} else if (params && *params) {
+		px_error("Unknown option %s", params);
+		return;
+	}
+
+	if (g_track.pid != ENV(pid)) {
+		px_error("Run track start first");
+		return;
+	}
+	if (ENV(maps) == NULL) {
+		px_error("No regions, run maps first");
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	memset(&run, 0, sizeof(run));
+	run.spans = dump != NULL;
+
+	if ((pagemap = px_pagemap_open()) == -1) {
+		px_error("Failed to open the pagemap (%s)", strerror(errno));
+		return;
+	}
+
+	if ((n = px_pagemap_items(PX_TRACK_BATCH, NULL, NULL, &batches)) == -1) {
+		n = 0;
+		goto out;
+	}
+
+	if ((items = calloc(n ? n : 1, sizeof(*items))) == NULL
+		|| (regions = calloc(ENV(nregions), sizeof(*regions))) == NULL) {
+		px_error("Failed to alloc!");
+		goto out;
+	}
+
+	run.batches = batches;
+	run.items = items;
+
+	if (px_pagemap_scan(pagemap, batches, n, PX_TRACK_BATCH, jobs,
+			_px_track_batch, &run) == -1) {
+		goto out;
+	}
+
+	if (run.failed) {
+		px_error("Failed to alloc!");
+		goto out;
+	}
+
+	/* Batches are in region order */
+	for (i = 0; i < (size_t) n; ++i) {
+		if (nregions == 0 || regions[nregions - 1].region != batches[i].region) {
+			regions[nregions++].region = batches[i].region;
+		}
+		regions[nregions - 1].npages += batches[i].npages;
+		regions[nregions - 1].dirty += items[i].dirty;
+		pages += batches[i].npages;
+		dirty += items[i].dirty;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	qsort(regions, nregions, sizeof(*regions), _px_track_region_cmp);
+
+	for (k = 0; k < nregions && regions[k].dirty; ++k) {
+		i = regions[k].region;
+
+		printf("%" PRIxPTR "-%" PRIxPTR " %s %-40s %8zu pages %10zu KiB (%.1f%%)\n",
+			PX_MAPS_START(i), ENV(maps)[i].end, ENV(maps)[i].perms,
+			PX_MAPS_NAME(i), regions[k].dirty, regions[k].dirty * page >> 10,
+			100.0 * regions[k].dirty / regions[k].npages);
+	}
+
+	printf("[+] %zu of %zu pages (%zu KiB) written in %zu regions in the last "
+		"%.1fs, pagemap read in %.3fs\n", dirty, pages, dirty * page >> 10, k,
+		(t1.tv_sec - g_track.started.tv_sec)
+			+ (t1.tv_nsec - g_track.started.tv_nsec) / 1e9,
+		(t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+
+	if (dump && _px_track_dump(dump, items, n, page, &dumped) == 0) {
+		printf("[+] %zu KiB written to %s\n", dumped >> 10, dump);
+	}
+out:
+	for (i = 0; items && i < (size_t) n; ++i) {
+		px_safe_free(items[i].spans);
+	}
+	px_safe_free(items);
+	px_safe_free(batches);
+	px_safe_free(regions);
+	close(pagemap);
+}
@@ -0,0 +1,931 @@
+/**
+ * Copyright (c) 2012, Felipe Pena
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *   Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <elf.h>
+#include <link.h>
+#include "common.h"
+#include "cmd.h"
+#include "maps.h"
+#include "elffile.h"
+#include "ptrace.h"
+#include "unwind.h"
+
+/**
+ * Compiled rules kept, direct mapped by PC
+ */
+#define PX_UNWIND_CACHE (1 << 16)
+
+/**
+ * The stack window grows in steps of this size
+ */
+#define PX_UNWIND_STEP (8 << 10)
+
+/**
+ * DWARF numbers of the registers the unwinder follows
+ */
+#if defined(__x86_64__)
+# define PX_DW_FP 6
+# define PX_DW_SP 7
+# define PX_DW_RA 16
+#elif defined(__aarch64__)
+# define PX_DW_FP 29
+# define PX_DW_RA 30
+# define PX_DW_SP 31
+#else
+# define PX_DW_FP 0
+# define PX_DW_RA 0
+# define PX_DW_SP 0
+#endif
+
+#define PX_DW_NREGS 32
+#define PX_DW_STATES 8
+
+/**
+ * DW_EH_PE pointer encodings (see the LSB, .eh_frame_hdr)
+ */
+#define PX_PE_OMIT    0xff
+#define PX_PE_ABSPTR  0x00
+#define PX_PE_ULEB128 0x01
+#define PX_PE_UDATA2  0x02
+#define PX_PE_UDATA4  0x03
+#define PX_PE_UDATA8  0x04
+#define PX_PE_SLEB128 0x09
+#define PX_PE_SDATA2  0x0a
+#define PX_PE_SDATA4  0x0b
+#define PX_PE_SDATA8  0x0c
+#define PX_PE_PCREL   0x10
+#define PX_PE_DATAREL 0x30
+#define PX_PE_INDIRECT 0x80
+
+/**
+ * Register rules
+ */
+enum {
+	PX_RULE_SAME,           /* unchanged (callee-saved, not saved yet) */
+	PX_RULE_OFFSET,         /* saved at CFA + off */
+	PX_RULE_UNDEFINED,      /* outermost frame */
+	PX_RULE_BAD             /* expressions and such, not handled */
+};
+
+/**
+ * The rule to step out of the frame of one PC
+ * cfa_reg is PX_DW_SP or PX_DW_FP; a rule px cannot follow has
+ * cfa_reg == PX_RULE_NONE and the frame pointer is used instead.
+ */
+#define PX_RULE_NONE 0xff
+
+typedef struct _px_unwind_rule {
+	uintptr_t pc;
+	int32_t cfa_off;
+	int32_t ra_off;
+	int32_t fp_off;
+	uint8_t cfa_reg;
+	uint8_t ra;
+	uint8_t fp;
+} px_unwind_rule;
+
+/**
+ * A mapped object and its .eh_frame_hdr search table
+ */
+typedef struct _px_unwind_obj {
+	uint32_t filename;      /* region name, in the maps string pool */
+	px_elf_file file;
+	uintptr_t bias;         /* load bias */
+	uintptr_t delta;        /* vaddr - file offset of the eh_frame segment */
+	uintptr_t hdr_vaddr;
+	const int32_t *table;   /* (initial location, FDE) pairs, datarel */
+	size_t nfdes;
+} px_unwind_obj;
+
+/**
+ * Row of the CFA table being computed
+ */
+typedef struct _px_cfa_row {
+	uint64_t cfa_reg;
+	int64_t cfa_off;
+	int cfa_bad;
+	uint8_t how[PX_DW_NREGS];
+	int64_t off[PX_DW_NREGS];
+} px_cfa_row;
+
+/**
+ * Parsed CIE fields an FDE needs
+ */
+typedef struct _px_cie {
+	uint64_t code_align;
+	int64_t data_align;
+	uint64_t ra_reg;
+	uint8_t fde_enc;
+	int has_aug;
+	const uint8_t *ins;
+	const uint8_t *end;
+} px_cie;
+
+static struct {
+	pid_t pid;
+	px_unwind_obj *objs;
+	size_t nobjs;
+	size_t size;
+	px_unwind_rule *cache;
+	px_unwind_stats stats;
+} g_unwind;
+
+static int _px_uleb(const uint8_t **p, const uint8_t *end, uint64_t *out)
+{
+	uint64_t value = 0;
+	unsigned shift = 0;
+	uint8_t b;
+
+	do {
+		if (*p >= end || shift > 63) {
+			return -1;
+		}
+		b = *(*p)++;
+		value |= (uint64_t) (b & 0x7f) << shift;
+		shift += 7;
+	} while (b & 0x80);
+
+	*out = value;
+	return 0;
+}
+
+static int _px_sleb(const uint8_t **p, const uint8_t *end, int64_t *out)
+{
+	uint64_t value = 0;
+	unsigned shift = 0;
+	uint8_t b;
+
+	do {
+		if (*p >= end || shift > 63) {
+			return -1;
+		}
+		b = *(*p)++;
+		value |= (uint64_t) (b & 0x7f) << shift;
+		shift += 7;
+	} while (b & 0x80);
+
+	if (shift < 64 && (b & 0x40)) {
+		value |= ~0ULL << shift;
+	}
+	*out = (int64_t) value;
+	return 0;
+}
+
+/**
+ * Reads a fixed size little endian field
+ */
+static int _px_fixed(const uint8_t **p, const uint8_t *end, size_t len,
+	uint64_t *out)
+{
+	uint64_t value = 0;
+
+	if ((size_t) (end - *p) < len) {
+		return -1;
+	}
+	memcpy(&value, *p, len);
+	*p += len;
+	*out = value;
+	return 0;
+}
+
+/**
+ * Decodes a DW_EH_PE encoded pointer into a link time address
+ * Fields are in the mapped file; delta turns their offsets into addresses.
+ */
+static int _px_unwind_ptr(const px_unwind_obj *obj, const uint8_t **p,
+	const uint8_t *end, uint8_t enc, uint64_t *out)
+{
+	const uintptr_t field = (uintptr_t) (*p - obj->file.data) + obj->delta;
+	uint64_t value;
+	int64_t svalue;
+	int ret;
+
+	if (enc == PX_PE_OMIT || (enc & PX_PE_INDIRECT)) {
+		return -1;
+	}
+
+	switch (enc & 0x0f) {
+		case PX_PE_ABSPTR:  ret = _px_fixed(p, end, sizeof(uintptr_t), &value); break;
+		case PX_PE_UDATA2:  ret = _px_fixed(p, end, 2, &value); break;
+		case PX_PE_UDATA4:  ret = _px_fixed(p, end, 4, &value); break;
+		case PX_PE_UDATA8:  ret = _px_fixed(p, end, 8, &value); break;
+		case PX_PE_ULEB128: ret = _px_uleb(p, end, &value); break;
+		case PX_PE_SLEB128:
+			ret = _px_sleb(p, end, &svalue);
+			value = svalue;
+			break;
+		case PX_PE_SDATA2:
+			ret = _px_fixed(p, end, 2, &value);
+			value = (int16_t) value;
+			break;
+		case PX_PE_SDATA4:
+			ret = _px_fixed(p, end, 4, &value);
+			value = (int32_t) value;
+			break;
+		case PX_PE_SDATA8:  ret = _px_fixed(p, end, 8, &value); break;
+		default:
+			return -1;
+	}
+	if (ret == -1) {
+		return -1;
+	}
+
+	switch (enc & 0x70) {
+		case 0:
+			break;
+		case PX_PE_PCREL:
+			value += field;
+			break;
+		case PX_PE_DATAREL:
+			value += obj->hdr_vaddr;
+			break;
+		default:
+			return -1;
+	}
+	*out = value;
+	return 0;
+}
+
+/**
+ * Loads the search table of the object mapped at a region
+ * Returns 0, or -1 when the object has no usable .eh_frame_hdr.
+ */
+static int _px_unwind_obj_open(px_unwind_obj *obj, size_t region)
+{
+	const ElfW(Phdr) *ph, *hdr = NULL, *load = NULL;
+	const uint8_t *p, *end;
+	uint64_t value, nfdes, align;
+	size_t i;
+
+	if (px_elf_file_open_addr(&obj->file, PX_MAPS_START(region)) == -1
+		|| obj->file.phdrs == NULL) {
+		return -1;
+	}
+
+	for (i = 0; i < obj->file.ehdr->e_phnum; ++i) {
+		ph = &obj->file.phdrs[i];
+		/* 0 and 1 both mean no alignment */
+		align = ph->p_align ? ph->p_align : 1;
+
+		if (ph->p_type == PT_GNU_EH_FRAME) {
+			hdr = ph;
+		} else if (ph->p_type == PT_LOAD
+			&& (ph->p_offset & ~(align - 1)) <= ENV(maps)[region].offset
+			&& ENV(maps)[region].offset < ph->p_offset + ph->p_filesz) {
+			load = ph;
+		}
+	}
+
+	if (hdr == NULL || load == NULL
+		|| hdr->p_offset + hdr->p_filesz > obj->file.size || hdr->p_filesz < 4) {
+		return -1;
+	}
+
+	obj->bias = PX_MAPS_START(region) - ENV(maps)[region].offset
+		- (load->p_vaddr - load->p_offset);
+	obj->delta = hdr->p_vaddr - hdr->p_offset;
+	obj->hdr_vaddr = hdr->p_vaddr;
+
+	/* version, eh_frame_ptr_enc, fde_count_enc, table_enc */
+	p = obj->file.data + hdr->p_offset;
+	end = p + hdr->p_filesz;
+
+	if (p[0] != 1 || p[3] != (PX_PE_DATAREL | PX_PE_SDATA4)) {
+		return -1;
+	}
+	p += 4;
+
+	if (_px_unwind_ptr(obj, &p, end, obj->file.data[hdr->p_offset + 1], &value) == -1
+		|| _px_unwind_ptr(obj, &p, end, obj->file.data[hdr->p_offset + 2], &nfdes) == -1
+		|| nfdes > (size_t) (end - p) / (2 * sizeof(int32_t))) {
+		return -1;
+	}
+
+	/* FDE addresses become file offsets through delta, which only holds
+	 * when .eh_frame is loaded by a segment with the same one */
+	for (i = 0; i < obj->file.ehdr->e_phnum; ++i) {
+		ph = &obj->file.phdrs[i];
+
+		if (ph->p_type == PT_LOAD && ph->p_vaddr <= value
+			&& value < ph->p_vaddr + ph->p_filesz) {
+			break;
+		}
+	}
+	if (i == obj->file.ehdr->e_phnum || ph->p_vaddr - ph->p_offset != obj->delta) {
+		return -1;
+	}
+	obj->table = (const int32_t*) p;
+	obj->nfdes = nfdes;
+
+	return 0;
+}
+
+/**
+ * Finds the object mapped at pc, opening it the first time
+ */
+static px_unwind_obj *_px_unwind_obj(uintptr_t pc)
+{
+	px_unwind_obj *objs;
+	ssize_t region;
+	size_t i;
+
+	if ((region = px_maps_lookup(pc)) == -1) {
+		return NULL;
+	}
+
+	for (i = 0; i < g_unwind.nobjs; ++i) {
+		if (g_unwind.objs[i].filename == ENV(maps)[region].filename) {
+			return g_unwind.objs[i].table ? &g_unwind.objs[i] : NULL;
+		}
+	}
+
+	if (g_unwind.nobjs == g_unwind.size) {
+		g_unwind.size = g_unwind.size ? g_unwind.size * 2 : 32;
+
+		if ((objs = realloc(g_unwind.objs, sizeof(*objs) * g_unwind.size)) == NULL) {
+			return NULL;
+		}
+		g_unwind.objs = objs;
+	}
+
+	/* Objects without a table are kept too, so they are tried once */
+	objs = &g_unwind.objs[g_unwind.nobjs++];
+	memset(objs, 0, sizeof(*objs));
+	objs->filename = ENV(maps)[region].filename;
+
+	if (_px_unwind_obj_open(objs, region) == -1) {
+		px_elf_file_close(&objs->file);
+		objs->table = NULL;
+		return NULL;
+	}
+	return objs;
+}
+
+/**
+ * Parses the CIE an FDE points to
+ */
+static int _px_unwind_cie(const px_unwind_obj *obj, const uint8_t *p,
+	px_cie *cie)
+{
+	const uint8_t *end = obj->file.data + obj->file.size, *aug, *aug_end;
+	uint64_t len, id, value;
+	uint8_t version, enc;
+
+	if (_px_fixed(&p, end, 4, &len) == -1 || len == 0 || len == 0xffffffff
+		|| len > (size_t) (end - p)) {
+		return -1;
+	}
+	end = p + len;
+
+	if (_px_fixed(&p, end, 4, &id) == -1 || id != 0 || p >= end) {
+		return -1;
+	}
+	version = *p++;
+	aug = p;
+
+	while (p < end && *p) {
+		++p;
+	}
+	if (p++ >= end || (version != 1 && version != 3 && version != 4)) {
+		return -1;
+	}
+	if (version == 4) {
+		/* address_size, segment_size */
+		p += 2;
+	}
+	if (_px_uleb(&p, end, &cie->code_align) == -1
+		|| _px_sleb(&p, end, &cie->data_align) == -1) {
+		return -1;
+	}
+	if (version == 1) {
+		if (p >= end) {
+			return -1;
+		}
+		cie->ra_reg = *p++;
+	} else if (_px_uleb(&p, end, &cie->ra_reg) == -1) {
+		return -1;
+	}
+
+	cie->fde_enc = PX_PE_ABSPTR;
+	cie->has_aug = *aug == 'z';
+
+	if (cie->has_aug) {
+		if (_px_uleb(&p, end, &len) == -1 || len > (size_t) (end - p)) {
+			return -1;
+		}
+		aug_end = p + len;
+
+		for (++aug; *aug; ++aug) {
+			switch (*aug) {
+				case 'R':
+					if (p >= aug_end) {
+						return -1;
+					}
+					cie->fde_enc = *p++;
+					break;
+				case 'L':
+					++p;
+					break;
+				case 'P':
+					if (p >= aug_end) {
+						return -1;
+					}
+					enc = *p++;
+					/* Only skipped, an indirect pointer has the same size */
+					if (_px_unwind_ptr(obj, &p, aug_end, enc & ~PX_PE_INDIRECT,
+						&value) == -1) {
+						return -1;
+					}
+					break;
+				case 'S':
+				case 'B':
+					break;
+				default:
+					return -1;
+			}
+		}
+		p = aug_end;
+	} else if (*aug) {
+		/* Old augmentations ("eh") are not worth handling */
+		return -1;
+	}
+
+	cie->ins = p;
+	cie->end = end;
+
+	return 0;
+}
+
+static inline void _px_cfa_set(px_cfa_row *row, uint64_t reg, uint8_t how,
+	int64_t off)
+{
+	if (reg < PX_DW_NREGS) {
+		row->how[reg] = how;
+		row->off[reg] = off;
+	}
+}
+
+/**
+ * Runs CFA instructions until the row for pc is complete
+ * loc is the address of the first instruction's row; init is the row
+ * after the CIE instructions, for DW_CFA_restore.
+ */
+static int _px_cfa_run(const px_unwind_obj *obj, const px_cie *cie,
+	const uint8_t *p, const uint8_t *end, uint64_t loc, uint64_t pc,
+	px_cfa_row *row, const px_cfa_row *init)
+{
+	px_cfa_row states[PX_DW_STATES];
+	size_t nstates = 0;
+	uint64_t reg, value, delta;
+	int64_t svalue;
+	uint8_t op;
+
+	while (p < end) {
+		op = *p++;
+
+		switch (op >> 6) {
+			case 1: /* DW_CFA_advance_loc */
+				if ((loc += (op & 0x3f) * cie->code_align) > pc) {
+					return 0;
+				}
+				continue;
+			case 2: /* DW_CFA_offset */
+				if (_px_uleb(&p, end, &value) == -1) {
+					return -1;
+				}
+				_px_cfa_set(row, op & 0x3f, PX_RULE_OFFSET,
+					(int64_t) value * cie->data_align);
+				continue;
+			case 3: /* DW_CFA_restore */
+				reg = op & 0x3f;
+				_px_cfa_set(row, reg, init ? init->how[reg] : PX_RULE_SAME,
+					init ? init->off[reg] : 0);
+				continue;
+		}
+
+		switch (op) {
+			case 0x00: /* DW_CFA_nop */
+				break;
+			case 0x01: /* DW_CFA_set_loc */
+				if (_px_unwind_ptr(obj, &p, end, cie->fde_enc, &loc) == -1) {
+					return -1;
+				}
+				if (loc > pc) {
+					return 0;
+				}
+				break;
+			case 0x02: /* DW_CFA_advance_loc1 */
+			case 0x03: /* DW_CFA_advance_loc2 */
+			case 0x04: /* DW_CFA_advance_loc4 */
+				if (_px_fixed(&p, end, op == 0x02 ? 1 : op == 0x03 ? 2 : 4,
+					&delta) == -1) {
+					return -1;
+				}
+				if ((loc += delta * cie->code_align) > pc) {
+					return 0;
+				}
+				break;
+			case 0x05: /* DW_CFA_offset_extended */
+				if (_px_uleb(&p, end, &reg) == -1 || _px_uleb(&p, end, &value) == -1) {
+					return -1;
+				}
+				_px_cfa_set(row, reg, PX_RULE_OFFSET, (int64_t) value * cie->data_align);
+				break;
+			case 0x06: /* DW_CFA_restore_extended */
+				if (_px_uleb(&p, end, &reg) == -1) {
+					return -1;
+				}
+				if (reg < PX_DW_NREGS) {
+					_px_cfa_set(row, reg, init ? init->how[reg] : PX_RULE_SAME,
+						init ? init->off[reg] : 0);
+				}
+				break;
+			case 0x07: /* DW_CFA_undefined */
+			case 0x08: /* DW_CFA_same_value */
+				if (_px_uleb(&p, end, &reg) == -1) {
+					return -1;
+				}
+				_px_cfa_set(row, reg, op == 0x07 ? PX_RULE_UNDEFINED : PX_RULE_SAME, 0);
+				break;
+			case 0x09: /* DW_CFA_register */
+				if (_px_uleb(&p, end, &reg) == -1 || _px_uleb(&p, end, &value) == -1) {
+					return -1;
+				}
+				_px_cfa_set(row, reg, PX_RULE_BAD, 0);
+				break;
+			case 0x0a: /* DW_CFA_remember_state */
+				if (nstates == PX_DW_STATES) {
+					return -1;
+				}
+				states[nstates++] = *row;
+				break;
+			case 0x0b: /* DW_CFA_restore_state */
+				if (nstates == 0) {
+					return -1;
+				}
+				/* Like libgcc, the CFA rule is part of the state */
+				*row = states[--nstates];
+				break;
+			case 0x0c: /* DW_CFA_def_cfa */
+				if (_px_uleb(&p, end, &row->cfa_reg) == -1
+					|| _px_uleb(&p, end, &value) == -1) {
+					return -1;
+				}
+				row->cfa_off = value;
+				row->cfa_bad = 0;
+				break;
+			case 0x0d: /* DW_CFA_def_cfa_register */
+				if (_px_uleb(&p, end, &row->cfa_reg) == -1) {
+					return -1;
+				}
+				row->cfa_bad = 0;
+				break;
+			case 0x0e: /* DW_CFA_def_cfa_offset */
+				if (_px_uleb(&p, end, &value) == -1) {
+					return -1;
+				}
+				row->cfa_off = value;
+				break;
+			case 0x0f: /* DW_CFA_def_cfa_expression */
+				if (_px_uleb(&p, end, &value) == -1 || value > (size_t) (end - p)) {
+					return -1;
+				}
+				p += value;
+				row->cfa_bad = 1;
+				break;
+			case 0x10: /* DW_CFA_expression */
+			case 0x16: /* DW_CFA_val_expression */
+				if (_px_uleb(&p, end, &reg) == -1 || _px_uleb(&p, end, &value) == -1
+					|| value > (size_t) (end - p)) {
+					return -1;
+				}
+				p += value;
+				_px_cfa_set(row, reg, PX_RULE_BAD, 0);
+				break;
+			case 0x11: /* DW_CFA_offset_extended_sf */
+				if (_px_uleb(&p, end, &reg) == -1 || _px_sleb(&p, end, &svalue) == -1) {
+					return -1;
+				}
+				_px_cfa_set(row, reg, PX_RULE_OFFSET, svalue * cie->data_align);
+				break;
+			case 0x12: /* DW_CFA_def_cfa_sf */
+				if (_px_uleb(&p, end, &row->cfa_reg) == -1
+					|| _px_sleb(&p, end, &svalue) == -1) {
+					return -1;
+				}
+				row->cfa_off = svalue * cie->data_align;
+				row->cfa_bad = 0;
+				break;
+			case 0x13: /* DW_CFA_def_cfa_offset_sf */
+				if (_px_sleb(&p, end, &svalue) == -1) {
+					return -1;
+				}
+				row->cfa_off = svalue * cie->data_align;
+				break;
+			case 0x14: /* DW_CFA_val_offset */
+			case 0x15: /* DW_CFA_val_offset_sf */
+				if (_px_uleb(&p, end, &reg) == -1) {
+					return -1;
+				}
+				if (op == 0x14 ? _px_uleb(&p, end, &value) : _px_sleb(&p, end, &svalue)) {
+					return -1;
+				}
+				_px_cfa_set(row, reg, PX_RULE_BAD, 0);
+				break;
+			case 0x2d: /* DW_CFA_GNU_window_save, AArch64 negate_ra_state */
+				break;
+			case 0x2e: /* DW_CFA_GNU_args_size */
+				if (_px_uleb(&p, end, &value) == -1) {
+					return -1;
+				}
+				break;
+			case 0x2f: /* DW_CFA_GNU_negative_offset_extended */
+				if (_px_uleb(&p, end, &reg) == -1 || _px_uleb(&p, end, &value) == -1) {
+					return -1;
+				}
+				_px_cfa_set(row, reg, PX_RULE_OFFSET, -(int64_t) value * cie->data_align);
+				break;
+			default:
+				return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Computes the rule for pc from the object's .eh_frame
+ */
+static void _px_unwind_compile(uintptr_t pc, px_unwind_rule *rule)
+{
+	const px_unwind_obj *obj;
+	const uint8_t *p, *end, *data_end;
+	px_cfa_row row, init;
+	px_cie cie;
+	uint64_t len, cie_off, start, range, aug;
+	uintptr_t rel;
+	size_t lo, hi, half;
+	int32_t loc;
+
+	rule->pc = pc;
+	rule->cfa_reg = PX_RULE_NONE;
+
+	if ((obj = _px_unwind_obj(pc)) == NULL || obj->nfdes == 0) {
+		return;
+	}
+
+	/* Last FDE starting at or below pc, locations are relative to the hdr */
+	rel = pc - obj->bias - obj->hdr_vaddr;
+
+	for (lo = 0, hi = obj->nfdes; hi > lo;) {
+		half = (hi - lo) / 2;
+		memcpy(&loc, &obj->table[(lo + half) * 2], sizeof(loc));
+
+		if ((intptr_t) loc <= (intptr_t) rel) {
+			lo += half + 1;
+		} else {
+			hi = lo + half;
+		}
+	}
+	if (lo == 0) {
+		return;
+	}
+	memcpy(&loc, &obj->table[(lo - 1) * 2 + 1], sizeof(loc));
+
+	data_end = obj->file.data + obj->file.size;
+
+	if (obj->hdr_vaddr + loc - obj->delta >= obj->file.size) {
+		return;
+	}
+	p = obj->file.data + (obj->hdr_vaddr + loc - obj->delta);
+
+	if (_px_fixed(&p, data_end, 4, &len) == -1 || len == 0 || len == 0xffffffff
+		|| len > (size_t) (data_end - p)) {
+		return;
+	}
+	end = p + len;
+
+	/* The CIE pointer counts back from its own field */
+	if (_px_fixed(&p, end, 4, &cie_off) == -1 || cie_off == 0
+		|| cie_off > (size_t) (p - 4 - obj->file.data)
+		|| _px_unwind_cie(obj, p - 4 - cie_off, &cie) == -1
+		|| _px_unwind_ptr(obj, &p, end, cie.fde_enc, &start) == -1
+		|| _px_unwind_ptr(obj, &p, end, cie.fde_enc & 0x0f, &range) == -1) {
+		return;
+	}
+	if (pc - obj->bias < start || pc - obj->bias >= start + range) {
+		return;
+	}
+	if (cie.has_aug) {
+		if (_px_uleb(&p, end, &aug) == -1 || aug > (size_t) (end - p)) {
+			return;
+		}
+		p += aug;
+	}
+
+	memset(&row, 0, sizeof(row));
+
+	if (_px_cfa_run(obj, &cie, cie.ins, cie.end, 0, UINT64_MAX, &row, NULL) == -1) {
+		return;
+	}
+	init = row;
+
+	if (_px_cfa_run(obj, &cie, p, end, start, pc - obj->bias, &row, &init) == -1
+		|| row.cfa_bad || (row.cfa_reg != PX_DW_SP && row.cfa_reg != PX_DW_FP)
+		|| cie.ra_reg >= PX_DW_NREGS) {
+		return;
+	}
+	if (row.how[cie.ra_reg] == PX_RULE_BAD || row.how[PX_DW_FP] == PX_RULE_BAD
+		|| row.cfa_off != (int32_t) row.cfa_off) {
+		return;
+	}
+
+	rule->cfa_reg = row.cfa_reg;
+	rule->cfa_off = row.cfa_off;
+	rule->ra = row.how[cie.ra_reg];
+	rule->ra_off = row.off[cie.ra_reg];
+	rule->fp = row.how[PX_DW_FP];
+	rule->fp_off = row.off[PX_DW_FP];
+}
+
+/**
+ * Returns the rule of a PC, compiling it on a cache miss
+ */
+static const px_unwind_rule *_px_unwind_rule(uintptr_t pc)
+{
+	px_unwind_rule *rule;
+
+	if (g_unwind.pid != ENV(pid)) {
+		px_unwind_clear();
+		g_unwind.pid = ENV(pid);
+	}
+	if (g_unwind.cache == NULL
+		&& (g_unwind.cache = calloc(PX_UNWIND_CACHE, sizeof(*rule))) == NULL) {
+		return NULL;
+	}
+
+	rule = &g_unwind.cache[((pc >> 1) ^ (pc >> 17)) & (PX_UNWIND_CACHE - 1)];
+
+	if (rule->pc == pc) {
+		++g_unwind.stats.hits;
+		return rule;
+	}
+	++g_unwind.stats.misses;
+
+	_px_unwind_compile(pc, rule);
+
+	return rule;
+}
+
+/**
+ * Reads a word of the stack, growing the window as needed
+ */
+static int _px_unwind_read(px_unwind_stack *stack, uintptr_t addr,
+	uintptr_t *out)
+{
+	size_t want;
+	ssize_t got;
+
+	if (addr < stack->base) {
+		return -1;
+	}
+	if (addr + sizeof(*out) > stack->base + stack->len) {
+		want = addr + sizeof(*out) - stack->base;
+		want = (want + PX_UNWIND_STEP - 1) & ~(size_t) (PX_UNWIND_STEP - 1);
+
+		if (want > stack->size) {
+			want = stack->size;
+		}
+		if (want <= stack->len || (got = ptrace_read_direct(stack->base
+				+ stack->len, stack->buf + stack->len, want - stack->len)) <= 0) {
+			return -1;
+		}
+		stack->len += got;
+
+		if (addr + sizeof(*out) > stack->base + stack->len) {
+			return -1;
+		}
+	}
+	memcpy(out, stack->buf + (addr - stack->base), sizeof(*out));
+	return 0;
+}
+
+/**
+ * Unwinds a stopped thread: each frame uses the .eh_frame rule of its PC
+ * (compiled once and cached) and falls back to the frame pointer when
+ * there is no rule. The stack is read through the window in stack, whose
+ * base must be the thread's stack pointer. Returns the number of PCs
+ * stored, leaf first.
+ */
+size_t px_unwind(const px_unwind_regs *regs, px_unwind_stack *stack,
+	uintptr_t *pcs, size_t max)
+{
+	const px_unwind_rule *rule;
+	uintptr_t pc = regs->pc, sp = regs->sp, fp = regs->fp, cfa, ra, next;
+	size_t n = 0;
+
+	while (n < max && pc) {
+		pcs[n++] = pc;
+
+		/* Callers are looked up inside their call instruction */
+		rule = PX_DW_RA ? _px_unwind_rule(n == 1 ? pc : pc - 1) : NULL;
+
+		if (rule && rule->cfa_reg != PX_RULE_NONE) {
+			if (rule->ra == PX_RULE_UNDEFINED) {
+				break;
+			}
+			cfa = (rule->cfa_reg == PX_DW_SP ? sp : fp) + rule->cfa_off;
+
+			if (rule->ra == PX_RULE_OFFSET) {
+				if (_px_unwind_read(stack, cfa + rule->ra_off, &ra) == -1) {
+					break;
+				}
+			} else if (n == 1 && regs->lr) {
+				/* Leaf function that keeps the return address in LR */
+				ra = regs->lr;
+			} else {
+				break;
+			}
+			if (rule->fp == PX_RULE_OFFSET
+				&& _px_unwind_read(stack, cfa + rule->fp_off, &fp) == -1) {
+				break;
+			}
+			/* Stacks grow down, each CFA is above the last */
+			if (cfa <= sp) {
+				break;
+			}
+			sp = cfa;
+			pc = ra;
+			++g_unwind.stats.cfi;
+			continue;
+		}
+
+		/* Frame pointer chain: saved fp, then the return address */
+		if (fp < sp || (fp & (sizeof(uintptr_t) - 1))
+			|| _px_unwind_read(stack, fp, &next) == -1
+			|| _px_unwind_read(stack, fp + sizeof(uintptr_t), &ra) == -1) {
+			break;
+		}
+		sp = fp + 2 * sizeof(uintptr_t);
+		pc = ra;
+		++g_unwind.stats.fp;
+
+		if (next <= fp) {
+			/* Still record this frame's caller */
+			if (n < max && pc) {
+				pcs[n++] = pc;
+			}
+			break;
+		}
+		fp = next;
+	}
+	return n;
+}
+
+/**
+ * Copies the counters of the unwinder
+ */
+void px_unwind_stats_get(px_unwind_stats *stats)
+{
+	*stats = g_unwind.stats;
+}
+
+/**
+ * Drops the cached rules and objects (the mappings changed)
+ */
+void px_unwind_clear(void)
+{
+	size_t i;
+
+	for (i = 0; i < g_unwind.nobjs; ++i) {
+		px_elf_file_close(&g_unwind.objs[i].file);
+	}
+	px_safe_free(g_unwind.objs);
+	px_safe_free(g_unwind.cache);
+	memset(&g_unwind, 0, sizeof(g_unwind));
+}
@@ -0,0 +1,67 @@
+/**
+ * Copyright (c) 2012, Felipe Pena
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *   Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PX_UNWIND
+#define PX_UNWIND
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * Registers the unwinder works with
+ */
+typedef struct _px_unwind_regs {
+	uintptr_t pc;
+	uintptr_t sp;
+	uintptr_t fp;
+	uintptr_t lr;           /* link register, 0 where there is none */
+} px_unwind_regs;
+
+/**
+ * Window of the stack read so far, from base (the stack pointer) upwards
+ */
+typedef struct _px_unwind_stack {
+	unsigned char *buf;
+	size_t size;
+	uintptr_t base;
+	size_t len;
+} px_unwind_stack;
+
+/**
+ * How the frames were unwound, and how often the rule cache helped
+ */
+typedef struct _px_unwind_stats {
+	uint64_t cfi;           /* frames unwound through .eh_frame */
+	uint64_t fp;            /* frames unwound through the frame pointer */
+	uint64_t hits;          /* rule cache */
+	uint64_t misses;
+} px_unwind_stats;
+
+size_t px_unwind(const px_unwind_regs*, px_unwind_stack*, uintptr_t*, size_t);
+void px_unwind_stats_get(px_unwind_stats*);
+void px_unwind_clear(void);
+
+#endif /* PX_UNWIND */